@@ -0,0 +1,153 @@
+#ifndef KEYSTORE_CONNECTION_H
+#define KEYSTORE_CONNECTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+// Hands connections to the reactor that owns them: a worker that leaves a
+// backlog posts the connection and the reactor, woken through the eventfd,
+// sends the rest once the socket takes it.
+typedef struct connection_mailbox {
+    pthread_mutex_t mutex;
+    struct client_connection *head;  /* posted, not taken yet */
+    int fd;                 /* eventfd the reactor waits on */
+} connection_mailbox;
+
+// Client connection structure. Shared between the event loop that reads
+// requests and the workers answering them: every in-flight job holds a
+// reference, so the fd is only closed once the last response is done.
+//
+// No thread waits for a socket. What one cannot send at once (or while
+// another holds the send lock) goes to the connection's backlog; the next
+// thread to take the send lock sends the backlog before anything else, and
+// the reactor sends it itself once the socket is writable. Short responses
+// are copied into the backlog; the large values of a response whose sender
+// lends them (connection_send_lend()) stay where they are until sent.
+typedef struct client_connection {
+    int fd;
+    struct sockaddr_in addr;
+    char client_ip[INET_ADDRSTRLEN];
+    int port;
+    enum wire_format wire;  /* decided by the first byte received */
+    char *rbuf;             /* received bytes not yet parsed into requests */
+    size_t rbuf_len;
+    size_t rbuf_cap;
+    size_t rbuf_need;       /* size of the partial frame at the front, once known */
+    struct job_request *upload;  /* PUT whose value is being streamed in */
+    size_t upload_left;     /* value bytes of `upload` still to arrive */
+    int upload_ready;       /* a worker has reserved the space of `upload` */
+    int refcount;           /* event loop + in-flight jobs */
+    int closed;             /* client gone; further responses are dropped */
+    pthread_mutex_t send_mutex;  /* keeps whole responses from interleaving */
+    pthread_mutex_t wbuf_mutex;  /* the backlog, which reactors add to without send_mutex */
+    struct connection_segment *wbuf_head;  /* backlog: response bytes waiting for the socket */
+    struct connection_segment *wbuf_tail;
+    struct connection_segment *lent;  /* last segment lent by the send lock holder */
+    int lending;            /* the send lock holder lends its large buffers */
+    size_t backlog;         /* bytes in the backlog, read without the lock */
+    connection_mailbox *mailbox;  /* of the reactor reading from it */
+    int mailed;             /* posted to the mailbox, not taken yet */
+    struct client_connection *next_mail;
+    int pending;            /* on the reactor's list of connections with a backlog */
+    int read_paused;        /* reactor stopped reading until the backlog shrinks */
+    int recv_armed;         /* io_uring: a receive is in flight */
+    int writable_armed;     /* io_uring: a POLLOUT is in flight */
+    struct client_connection *next_pending;
+} client_connection_t;
+
+client_connection_t * connection_create(int fd, const struct sockaddr_in *addr);
+void connection_get(client_connection_t *conn);
+void connection_put(client_connection_t *conn);
+// Connections alive (until their last reference is dropped) and accepted
+// since start
+void connection_counts(uint64_t *open, uint64_t *accepted);
+// Marks the connection closed and drops its backlog, giving lent buffers
+// back to their owners
+void connection_shutdown(client_connection_t *conn);
+// Marks the calling thread as a reactor: it never waits for a send lock
+// and watches the connections it leaves a backlog on itself
+void connection_thread_nonblocking(void);
+// Sends the whole iovec as one response. Returns 0 on success.
+int connection_send(client_connection_t *conn, struct iovec *iov, int iovcnt);
+// A response sent in several parts keeps other responses out between
+// connection_send_begin() and connection_send_end(). On a reactor it
+// returns -1 instead of waiting for the lock; the responses then go to
+// connection_send_later().
+int connection_send_begin(client_connection_t *conn);
+// connection_send_begin() unless another thread holds the lock: returns -1
+int connection_send_try_begin(client_connection_t *conn);
+int connection_send_part(client_connection_t *conn, struct iovec *iov, int iovcnt);
+void connection_send_end(client_connection_t *conn);
+// Between connection_send_begin() and connection_send_end_lent(), the
+// iovecs of at least CONNECTION_LEND_MIN bytes the socket does not take are
+// kept by reference instead of copied. connection_send_end_lent() returns 1
+// when the backlog still refers to them: `release(arg)` then runs once they
+// are sent or the connection is shut down. With 0 the caller frees them.
+#define CONNECTION_LEND_MIN 4096
+void connection_send_lend(client_connection_t *conn);
+int connection_send_end_lent(client_connection_t *conn, void (*release)(void *), void *arg);
+// Adds whole responses to the backlog without the send lock (reactors).
+// The parts between connection_send_later_begin() and
+// connection_send_later_end() go out together.
+int connection_send_later(client_connection_t *conn, struct iovec *iov, int iovcnt);
+void connection_send_later_begin(client_connection_t *conn);
+int connection_send_later_part(client_connection_t *conn, struct iovec *iov, int iovcnt);
+void connection_send_later_end(client_connection_t *conn);
+// Sends what the backlog holds without waiting (reactors, once the socket
+// is writable). Returns 1 while some is left, 0 once it is empty and -1 if
+// the connection failed.
+int connection_flush(client_connection_t *conn);
+
+static inline size_t connection_backlog(client_connection_t *conn){
+    return __atomic_load_n(&conn->backlog, __ATOMIC_ACQUIRE);
+}
+
+int connection_mailbox_init(connection_mailbox *box);
+void connection_mailbox_free(connection_mailbox *box);
+// Makes the reactor waiting on the mailbox's eventfd look at it
+void connection_mailbox_wake(connection_mailbox *box);
+// Takes the connections posted so far. Each comes with a reference for the
+// caller; connection_mailbox_next() walks the list and lets a connection
+// be posted again.
+client_connection_t * connection_mailbox_take(connection_mailbox *box);
+client_connection_t * connection_mailbox_next(client_connection_t *conn);
+// Hands the connection to the reactor reading from it, which watches its
+// backlog and resumes reading from it if it may
+void connection_mailbox_post(client_connection_t *conn);
+
+// Sends to several connections at once. With the io_uring backend each
+// round goes to the kernel in one system call from a ring owned by the
+// sending thread; otherwise every send is a plain sendmsg(). The caller
+// holds the send lock of every connection added. What the sockets do not
+// take goes to their backlogs.
+#define CONNECTION_SEND_SET 16
+
+typedef struct connection_send_op {
+    client_connection_t *conn;
+    struct msghdr msg;
+    size_t left;            /* iovecs not yet sent completely */
+    int full;               /* the socket took no more; the rest goes to the backlog */
+    int failed;
+} connection_send_op;
+
+typedef struct connection_send_set {
+    int count;
+    connection_send_op sends[CONNECTION_SEND_SET];
+} connection_send_set;
+
+// Selects the send path for every thread; call before any sends happen
+void connection_use_uring(int enable);
+// Returns the slot of the send, or -1 when the set is full
+int connection_send_set_add(connection_send_set *set, client_connection_t *conn,
+                            struct iovec *iov, int iovcnt);
+// Sends everything added; `failed` tells which sends did not complete
+void connection_send_set_run(connection_send_set *set);
+
+#endif
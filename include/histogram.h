@@ -0,0 +1,84 @@
+#ifndef KEYSTORE_HISTOGRAM_H
+#define KEYSTORE_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Log-linear latency histogram in the manner of HdrHistogram. Values below
+// 128 get a bucket each; above that every power of two is split into 64
+// buckets, so a recorded value is off by less than 1/64 (1.6%). Values are
+// usually nanoseconds and anything at or above 2^40 (about 18 minutes)
+// lands in the last bucket.
+//
+// One thread records into a histogram. Counters are written with relaxed
+// atomic stores, so another thread may read or merge it at any time and
+// sees every counter torn-free, if not all from the same instant.
+
+#define HISTOGRAM_SUB_BITS   7
+#define HISTOGRAM_HALF       (1u << (HISTOGRAM_SUB_BITS - 1))
+#define HISTOGRAM_MAX_BITS   40
+#define HISTOGRAM_BUCKETS    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_HALF)
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram;
+
+static inline unsigned histogram_bucket(uint64_t value){
+    if (value < 2 * HISTOGRAM_HALF) return (unsigned)value;
+    if (value >> HISTOGRAM_MAX_BITS) return HISTOGRAM_BUCKETS - 1;
+    unsigned shift = (unsigned)(63 - __builtin_clzll(value)) - (HISTOGRAM_SUB_BITS - 1);
+    return shift * HISTOGRAM_HALF + (unsigned)(value >> shift);
+}
+
+// Highest value that falls into `bucket`
+static inline uint64_t histogram_bucket_value(unsigned bucket){
+    if (bucket < 2 * HISTOGRAM_HALF) return bucket;
+    unsigned shift = bucket / HISTOGRAM_HALF - 1;
+    return (((uint64_t)(bucket - shift * HISTOGRAM_HALF) + 1) << shift) - 1;
+}
+
+static inline void histogram_record(histogram *h, uint64_t value){
+    uint64_t *b = &h->buckets[histogram_bucket(value)];
+    __atomic_store_n(b, *b + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if (value > h->max) __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+static inline void histogram_reset(histogram *h){
+    memset(h, 0, sizeof(*h));
+}
+
+// Adds `from` to `into`; `from` may be recorded into concurrently
+static inline void histogram_merge(histogram *into, const histogram *from){
+    into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max) into->max = max;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Value at or below which `pct` percent of the recorded values lie
+static inline uint64_t histogram_percentile(const histogram *h, double pct){
+    uint64_t total = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) total += h->buckets[i];
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)total + 0.5);
+    if (rank == 0) rank = 1;
+    if (rank > total) rank = total;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen < rank) continue;
+        uint64_t value = histogram_bucket_value(i);
+        return value < h->max ? value : h->max;
+    }
+    return h->max;
+}
+
+#endif
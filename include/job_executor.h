@@ -5,41 +5,42 @@
 #include <signal.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <errno.h>
-#define MAX_KEY_LENGTH 128
-#define MAX_VALUE_LENGTH 1024
-#define JOB_WORKER_THREAD_COUNT 16
 
-enum job_type{
-    INVALID_TYPE = -1,
-    PUT = 1,
-    GET = 2,
-    DELETE = 3,
-    
-};
-
-enum job_error_code{
-    INVALID_KEY,
-    STORAGE_FULL,
-    NO_ERROR
-};
-
-enum job_status{
-    NOT_STARTED,
-    SUBMITTED,
-    PROCESSING,
-    COMPLETED,
-    FAILED
-};
+#include "protocol.h"
+#include "kv_engine.h"
+#include "kv_shards.h"
+#include "connection.h"
+#include "wal.h"
+#include "obj_pool.h"
+#include "metrics.h"
+
+#define JOB_WORKER_THREAD_COUNT 16
+#define JOB_OUTBOX_SIZE 64      /* completed jobs a worker gathers before flushing */
+#define JOB_RING_SIZE 1024      /* slots per worker ring, a power of two */
+#define JOB_SPIN_MAX 512        /* empty polls before an idle worker parks */
+#define JOB_CACHE_LINE 64
+#define JOB_REQUEST_POOL_BYTES 2048  /* requests up to this size come from the request pool */
+#define JOB_REACTOR_MAX_GET (64u * 1024u)   /* larger GET values are sent by a worker, not a reactor */
+#define JOB_SEND_IOV 128                    /* iovecs gathered per connection before a send */
 
+// In-memory request: key and value live inline in `data`
 typedef struct job_request{
     enum job_type type;
-    char key[MAX_KEY_LENGTH];
-    char value[MAX_VALUE_LENGTH];
+    uint32_t request_id;
+    uint8_t flags;          /* KV_FLAG_* from the request opcode */
+    uint8_t pooled;         /* allocated from the request pool */
+    size_t key_len;
+    size_t value_len;
+    char *key;              /* points into data */
+    char *value;            /* points into data, right after the key */
+    kv_put_stream *stream;  /* PUT whose value was streamed into the engine instead */
+    char data[];
 } job_request;
 
 typedef struct job_response{
@@ -47,33 +48,89 @@ typedef struct job_response{
     enum job_status status;
     enum job_error_code error;
     int data_len;
-    char *data;
+    char *data;             /* malloc'd response bytes, or */
+    kv_pinned_value value;  /* a GET value sent straight from the image */
 } job_response;
 
 typedef struct job{
-    int client_fd;
+    client_connection_t *client;  /* holds a reference until job_free() */
+    kv_shards *shards;            /* keys are routed to their shard's engine */
     job_request *request;
     job_response *response;
-    struct job *next_job;
+    struct wal *commit_wal;       /* log of the shard the job last updated */
+    uint64_t commit_lsn;          /* record of commit_wal that must be durable before replying (0 == none) */
+    uint8_t on_reactor;           /* run inline: large GETs and PUTs finding no free block are deferred */
+    uint8_t deferred;             /* gave up inline, to be queued */
+    uint8_t starts_upload;        /* only reserves the space of the client's upload; no response */
+    uint64_t recv_ns;             /* metrics_now() when the request was complete, ... */
+    uint64_t start_ns;            /* ... when it started executing ... */
+    uint64_t done_ns;             /* ... and when it finished */
+    struct job *next_job;         /* overflow list of the queue, a reactor's parked replies, then the send batch */
 } job;
 
+// Completed jobs held by one worker until their responses are flushed
+typedef struct job_outbox{
+    job *jobs[JOB_OUTBOX_SIZE];
+    int count;
+} job_outbox;
+
+// Bounded multi-producer/multi-consumer ring (one per worker). Every cell
+// carries a sequence number telling producers and consumers whose turn it
+// is, so push and pop are a single CAS on the ring position.
+typedef struct job_ring_cell{
+    size_t seq;
+    job *job;
+} job_ring_cell;
+
+typedef struct job_ring{
+    size_t enqueue_pos;
+    char pad0[JOB_CACHE_LINE - sizeof(size_t)];
+    size_t dequeue_pos;
+    char pad1[JOB_CACHE_LINE - sizeof(size_t)];
+    job_ring_cell cells[JOB_RING_SIZE];
+} job_ring;
+
+// Scheduler: job_push() spreads jobs over the workers' rings; a worker pops
+// from its own ring, steals from the others when it runs dry, spins for a
+// while and finally parks on p_cond.
 typedef struct job_queue{
-    job *head, *tail;
-    pthread_mutex_t p_mutex;
+    job_ring *rings;        /* one per worker, set up by job_worker_pool_init() */
+    int ring_count;
+    unsigned next_ring;     /* round-robin push cursor */
+    job *head, *tail;       /* overflow list, used when every ring is full */
+    int overflow;           /* jobs on the overflow list */
+    pthread_mutex_t p_mutex;/* overflow list and parking */
     pthread_cond_t p_cond;
+    int sleepers;           /* workers parked on p_cond */
+    int workers;            /* worker threads still running */
+    int next_worker;        /* ring index handed to the next worker thread */
+    int stopping;           /* set by job_queue_free(); job_pop() returns NULL once empty */
 } job_queue;
 
-job_request * job_request_init(enum job_type type,char *key, char *value);
+job_request * job_request_init(enum job_type type, const char *key, size_t key_len,
+                               const char *value, size_t value_len);
 void job_request_free(job_request *req);
 
 job_queue * job_queue_init(void);
+// Sets up `count` worker rings; job_worker_pool_init() does this before
+// starting the workers
+int job_queue_rings_init(job_queue *q, int count);
+// Gives the calling thread the next ring to pop from first, as every
+// worker thread does when it starts
+void job_queue_attach_worker(job_queue *q);
+// Jobs waiting in the rings and the overflow list; a snapshot that may be
+// off by the pushes and pops under way
+size_t job_queue_depth(job_queue *q);
 void job_queue_free(job_queue *q);
 
-void job_init(job_request *job_req);
+// Job with a fresh response, both from the object pools
+job * job_alloc(job_request *req);
 void job_free(job *j);
+void job_pool_log_stats(void);
 
 void job_push(job_queue *q, job *j);
 job * job_pop(job_queue *q);
+job * job_try_pop(job_queue *q);
 
 job_response * job_response_init(enum job_type type);
 void job_response_free(job_response *res);
@@ -83,4 +140,7 @@ void * job_worker_thread(void *arg);
 int job_worker_pool_init(job_queue *queue, int num_threads);
 
 void update_job_status(job *work_job,enum job_status);
-void notify_job_status(job *work_job);
\ No newline at end of file
+void notify_job_status(job *work_job);
+
+void job_outbox_add(job_outbox *box, job *done_job);
+void job_outbox_flush(job_outbox *box);
\ No newline at end of file
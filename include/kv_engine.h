@@ -0,0 +1,220 @@
+#ifndef KEYSTORE_KV_ENGINE_H
+#define KEYSTORE_KV_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "storage.h"
+#include "kv_page.h"
+
+#define DEFAULT_HASH_BUCKETS 512u   /* initial buckets; a multiple of KV_LOCK_STRIPES */
+#define KV_LOCK_STRIPES      64u
+
+// Linear hashing: one bucket splits at a time once the average chain grows
+// past KV_SPLIT_LOAD. Bucket heads live in directory segments of
+// KV_DIR_SEGMENT_BLOCKS contiguous blocks, found through a root block.
+#define KV_SPLIT_LOAD         2u
+#define KV_SPLITS_PER_CHECK   8u     /* splits done by one single-key insert at most */
+#define KV_DIR_SEGMENT_BLOCKS 16u
+
+// Free-space maps that could not be restored from the index snapshot are
+// refilled in the background by this many threads walking the buckets
+#define KV_REBUILD_THREADS    4u
+
+enum kv_result{
+    KV_OK = 0,
+    KV_ERROR = -1,
+    KV_NOT_FOUND = -2,
+    KV_NO_SPACE = -3,
+    KV_TOO_LARGE = -4,
+    KV_INVALID_KEY = -5
+};
+
+// On-disk record layout: this header followed by `key_len` key bytes and
+// `value_len` value bytes. Small records are packed into slotted pages
+// (kv_page.h), larger ones take a block of their own. Records hash to a
+// bucket and are chained through `next_block`.
+typedef struct kv_record_header {
+    uint32_t next_block;    /* next record in the chain: block or packed reference (0 == end) */
+    uint32_t hash;          /* full key hash, compared before the key bytes */
+    uint32_t key_len;       /* key bytes following the header */
+    uint32_t value_len;     /* value bytes following the key */
+} kv_record_header_t;
+
+// Values too large to share a block with their header and key are stored in
+// extents, runs of contiguous blocks holding the value bytes in order. The
+// record then carries an extent table after the key in place of the value;
+// value_len is still the full value length. The table is not aligned
+// within the record.
+#define KV_EXTENT_BLOCKS 256u       /* blocks per extent at most */
+#define KV_SYNC_MIN_VALUE (64u * 1024u)  /* values from this size on are synced in place, not logged */
+
+typedef struct kv_extent {
+    uint32_t first_block;
+    uint32_t block_count;
+} kv_extent;
+
+typedef struct kv_extent_table {
+    uint32_t count;
+    uint32_t reserved;
+    kv_extent extents[];
+} kv_extent_table;
+
+// Records per lock stripe, changed under the stripe's write lock
+typedef struct kv_stripe_count {
+    int64_t records;
+    char pad[64 - sizeof(int64_t)];
+} kv_stripe_count;
+
+// Zero-copy reads pin the block holding the record: its own block, or the
+// page of a packed record. A pinned block is not freed and a pinned page is
+// not compacted; whatever its records release meanwhile (the block itself,
+// the extents of their values) is freed when the last pin goes.
+typedef struct kv_pin_entry {
+    uint32_t block;
+    uint32_t count;             /* pins held */
+    uint32_t deferred_count;
+    uint32_t deferred_cap;
+    kv_extent *deferred;        /* runs to free once unpinned */
+    struct kv_pin_entry *next;
+} kv_pin_entry;
+
+typedef struct kv_pin_stripe {
+    pthread_mutex_t mutex;      /* taken inside the stripe lock, or alone */
+    kv_pin_entry *active;
+    kv_pin_entry *spare;        /* retired entries kept for reuse */
+} kv_pin_stripe;
+
+struct kv_engine;
+
+typedef struct kv_rebuild_worker {
+    struct kv_engine *engine;
+    uint32_t first_stripe;      /* walks first_stripe, + KV_REBUILD_THREADS, ... */
+    int started;
+    pthread_t thread;
+} kv_rebuild_worker;
+
+// Every table size is a multiple of KV_LOCK_STRIPES, so a key's stripe is
+// hash % KV_LOCK_STRIPES whatever the split state, and a bucket shares its
+// stripe with the bucket it splits into.
+typedef struct kv_engine {
+    storage_state_t *storage;
+    uint32_t *dir;              /* directory root: first block of each segment */
+    uint32_t **segments;        /* bucket heads of each segment inside the mapping */
+    uint32_t segment_count;     /* root capacity */
+    uint32_t segment_buckets;   /* heads per segment */
+    uint32_t base_buckets;      /* table size at level 0 */
+    uint64_t lh_state;          /* level << 32 | split; changes under the split bucket's lock */
+    pthread_mutex_t split_mutex;/* one split at a time */
+    pthread_rwlock_t locks[KV_LOCK_STRIPES];
+    kv_stripe_count counts[KV_LOCK_STRIPES];
+    kv_page_map pages[KV_LOCK_STRIPES];    /* pages with room, per stripe */
+    kv_pin_stripe pins[KV_LOCK_STRIPES];
+    size_t pack_limit;          /* largest record packed into a page, 0 == packing off */
+    int rebuild_due;            /* no usable snapshot: recount, refill the free-space maps */
+    int rebuild_stop;
+    kv_rebuild_worker rebuilders[KV_REBUILD_THREADS];
+} kv_engine_t;
+
+// Engine lifecycle. Creates the hash directory on a freshly formatted image,
+// converts the single-block bucket array of older images and finishes a
+// split that was interrupted by a crash. Record counts and free-space maps
+// come from the index snapshot when it matches the image; they are saved
+// again after every checkpoint and on close.
+int kv_engine_open(kv_engine_t *engine, storage_state_t *storage);
+// Starts the background recount of the records and rebuild of the
+// free-space maps if the snapshot was missing or stale (after daemonize(), like the log threads)
+int kv_engine_start(kv_engine_t *engine);
+void kv_engine_close(kv_engine_t *engine);
+
+uint32_t kv_engine_hash(const char *key, size_t key_len);
+// Largest key + value kept inline in a record; larger values use extents
+size_t kv_engine_max_record(const kv_engine_t *engine);
+// Records stored, summed over the stripes without locking
+uint64_t kv_engine_record_count(kv_engine_t *engine);
+
+// Copies the value for `key` into a malloc'd buffer owned by the caller.
+int kv_engine_lookup(kv_engine_t *engine, const char *key, size_t key_len,
+                     char **out_value, size_t *out_value_len);
+// Inserts `key` or replaces its current value.
+int kv_engine_insert(kv_engine_t *engine, const char *key, size_t key_len,
+                     const char *value, size_t value_len);
+int kv_engine_remove(kv_engine_t *engine, const char *key, size_t key_len);
+
+// A value left in place in the image for a zero-copy send. The pieces point
+// into the mapping and stay valid until kv_engine_unpin().
+typedef struct kv_pinned_value {
+    kv_engine_t *engine;
+    uint32_t stripe;
+    uint32_t block;             /* pinned block, 0 == nothing pinned */
+    size_t len;                 /* value bytes */
+    uint32_t piece_count;
+    struct iovec *pieces;       /* the value in order: one piece, or one per extent */
+    struct iovec piece;         /* storage for a value in a single piece */
+    char *copy;                 /* the value, when the buffer pool could not hold it */
+} kv_pinned_value;
+
+// Finds `key` and pins its value without copying it. The stripe lock is
+// only held for the lookup itself. Every pinned value must be unpinned.
+// With the buffer pool its chunks stay in memory until then; once pinned
+// values take their share of the pool, further ones are copied instead.
+int kv_engine_lookup_pinned(kv_engine_t *engine, const char *key, size_t key_len,
+                            kv_pinned_value *out);
+void kv_engine_unpin(kv_pinned_value *value);
+
+// A value written piece by piece before its record is published, so large
+// values never have to be held in memory. Every stream that was begun is
+// finished by exactly one commit or abort. `key` must stay valid until then.
+typedef struct kv_put_stream {
+    kv_engine_t *engine;
+    const char *key;
+    size_t key_len;
+    uint32_t hash;
+    int status;             /* first failure; later calls just report it */
+    size_t value_len;
+    size_t written;         /* value bytes stored so far */
+    char *buffer;           /* inline-sized values are gathered here */
+    kv_extent_table *table; /* extents of a large value */
+    uint32_t table_cap;
+    char *window;           /* last kv_engine_put_window(), held in the buffer pool */
+    size_t window_len;
+} kv_put_stream;
+
+// Reserves the space for a `value_len`-byte value
+int kv_engine_put_begin(kv_engine_t *engine, const char *key, size_t key_len,
+                        size_t value_len, kv_put_stream *out);
+// Where the next value bytes go: up to *out_len bytes may be written there
+// before kv_engine_put_advance(). NULL once the value is complete or failed,
+// or when the buffer pool has no room to hold the window; the bytes are
+// then passed to kv_engine_put_write(). A window waiting for bytes keeps
+// one chunk of the pool.
+char * kv_engine_put_window(kv_put_stream *stream, size_t *out_len);
+void kv_engine_put_advance(kv_put_stream *stream, size_t len);
+int kv_engine_put_write(kv_put_stream *stream, const char *data, size_t len);
+// Publishes the value once all of it was written, replacing the key's
+// current value
+int kv_engine_put_commit(kv_put_stream *stream);
+void kv_engine_put_abort(kv_put_stream *stream);
+
+// One key of a multi-key operation. `result` receives the kv_result for
+// this key; lookups fill out_value (malloc'd, owned by the caller).
+typedef struct kv_batch_item {
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+    int result;
+    char *out_value;
+    size_t out_value_len;
+} kv_batch_item;
+
+// Multi-key variants: keys are grouped by lock stripe and every stripe is
+// locked once; inserts take all their blocks from the allocator in one go.
+// Return KV_OK once the batch ran (see the per-item results) or KV_ERROR.
+int kv_engine_multi_lookup(kv_engine_t *engine, kv_batch_item *items, size_t count);
+int kv_engine_multi_insert(kv_engine_t *engine, kv_batch_item *items, size_t count);
+int kv_engine_multi_remove(kv_engine_t *engine, kv_batch_item *items, size_t count);
+
+#endif
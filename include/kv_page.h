@@ -0,0 +1,84 @@
+#ifndef KEYSTORE_KV_PAGE_H
+#define KEYSTORE_KV_PAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "storage.h"
+
+// Slotted pages: small records share a block. The slot directory grows up
+// from the page header and the records grow down from the end of the block;
+// a record keeps its slot number for life, so chains refer to it by
+// (page, slot) while deletes compact the page underneath.
+//
+// Every record in a page belongs to the same engine lock stripe, recorded in
+// the page header. Holding that stripe's lock therefore covers the whole
+// page, including records moved by compaction.
+
+#define KV_PAGE_MAGIC       0x4B565047u /* 'KVPG' */
+#define KV_PAGE_MAX_SLOTS   255u
+#define KV_PAGE_MAX_RECORD  1024u       /* larger records get a block of their own */
+#define KV_PAGE_MAX_PAGES   (1u << 23)  /* page numbers that fit in a reference */
+
+// Record references in chains and bucket heads: a plain block index, or a
+// packed (page, slot) pair when the top bit is set
+#define KV_REF_PACKED       0x80000000u
+#define KV_REF_SLOT_BITS    8
+
+// Free-space map: per stripe, recently touched pages bucketed by free bytes
+#define KV_PAGE_CLASSES     8
+#define KV_PAGE_MAP_DEPTH   16
+
+typedef struct kv_page_header {
+    uint32_t magic;         /* KV_PAGE_MAGIC */
+    uint16_t stripe;        /* lock stripe of every record in the page */
+    uint16_t slot_count;    /* entries in the slot directory */
+    uint16_t data_start;    /* records occupy [data_start, block_size) */
+    uint16_t live;          /* slots in use */
+} kv_page_header_t;
+
+typedef struct kv_page_slot {
+    uint16_t offset;        /* record offset in the page, 0 == free slot */
+    uint16_t length;        /* record bytes */
+} kv_page_slot_t;
+
+typedef struct kv_page_map {
+    uint32_t pages[KV_PAGE_CLASSES][KV_PAGE_MAP_DEPTH];
+    uint8_t count[KV_PAGE_CLASSES];
+} kv_page_map;
+
+static inline int kv_ref_is_packed(uint32_t ref){
+    return (ref & KV_REF_PACKED) != 0;
+}
+
+static inline uint32_t kv_ref_pack(uint32_t page, uint32_t slot){
+    return KV_REF_PACKED | page << KV_REF_SLOT_BITS | slot;
+}
+
+static inline uint32_t kv_ref_page(uint32_t ref){
+    return (ref & ~KV_REF_PACKED) >> KV_REF_SLOT_BITS;
+}
+
+static inline uint32_t kv_ref_slot(uint32_t ref){
+    return ref & ((1u << KV_REF_SLOT_BITS) - 1);
+}
+
+// All page functions expect the caller to hold the page's stripe lock.
+void kv_page_format(storage_state_t *st, uint32_t page, uint32_t stripe);
+// Address of a packed record, NULL if the reference is stale
+void * kv_page_record(storage_state_t *st, uint32_t ref);
+// Places a record of `len` bytes and returns its reference, or 0 if the
+// page is full. The record bytes are left to the caller to fill and log.
+uint32_t kv_page_insert(storage_state_t *st, uint32_t page, size_t len);
+// Removes a record and, if `compact` is set, compacts the page. Records of a
+// pinned page must stay put, so its holes wait for a later compaction.
+// Returns the records left.
+uint32_t kv_page_delete(storage_state_t *st, uint32_t ref, int compact);
+
+// Free-space map of one stripe
+void kv_page_map_note(kv_page_map *map, storage_state_t *st, uint32_t page);
+void kv_page_map_forget(kv_page_map *map, uint32_t page);
+// A mapped page with room for a `len`-byte record, or 0
+uint32_t kv_page_map_pick(kv_page_map *map, storage_state_t *st, size_t len);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef KEYSTORE_KV_SHARDS_H
+#define KEYSTORE_KV_SHARDS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "storage.h"
+#include "kv_engine.h"
+#include "wal.h"
+#include "metrics.h"
+
+// Hash-sharded storage: every shard is a separate image with its own
+// allocator, index and write-ahead log, so shards share no locks and may
+// sit on different devices. Keys are routed by hash; the routing depends
+// on the number and order of the shards, which every image records in its
+// superblock and checks when it is opened.
+
+#define KV_MAX_SHARDS 16
+
+typedef struct kv_shard {
+    char image_path[WAL_PATH_MAX];
+    char wal_path[WAL_PATH_MAX];    /* <image minus .img>.wal */
+    uint32_t index;
+    int rc;                         /* result of opening the shard */
+    storage_state_t storage;
+    kv_engine_t engine;
+} kv_shard;
+
+typedef struct kv_shards {
+    uint32_t count;
+    kv_shard *shards;
+} kv_shards;
+
+// Opens or creates every image, replays its log and attaches its index,
+// one thread per shard. Fails if any shard fails; the others are closed.
+// A non-zero pool_bytes serves the images from buffer pools instead of
+// mappings, each shard getting an equal share.
+int kv_shards_open(kv_shards *set, const char *const *image_paths, uint32_t count,
+                   const wal_options *opts, size_t pool_bytes);
+// Launches every shard's log threads and any index rebuild, and applies
+// the memory options to every image, each getting an equal share of the
+// memory target (after daemonize())
+int kv_shards_start(kv_shards *set, const storage_memory_options *memory);
+void kv_shards_close(kv_shards *set);
+// Appends the per-shard gauges and counters (blocks, records, cache, log
+// and checkpoint syncs) to a metrics dump
+void kv_shards_metrics(kv_shards *set, metrics_buffer *buf);
+
+// Shard of a key hash. Taken from the high bits of a multiplicative mix so
+// it does not correlate with the low bits the engine uses for buckets and
+// lock stripes.
+static inline uint32_t kv_shards_index(const kv_shards *set, uint32_t hash){
+    return (uint32_t)(((uint64_t)(hash * 0x9E3779B1u) * set->count) >> 32);
+}
+
+static inline kv_engine_t * kv_shards_route(kv_shards *set, const char *key, size_t key_len){
+    return &set->shards[kv_shards_index(set, kv_engine_hash(key, key_len))].engine;
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef KEYSTORE_METRICS_H
+#define KEYSTORE_METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "histogram.h"
+
+// Runtime metrics in the Prometheus text format. Every thread counts the
+// requests it answers and records their latency in histograms of its own,
+// so the request path takes no lock and shares no cache line with other
+// threads. A reader merges the threads' histograms when the metrics are
+// asked for, and only then reads process-wide values (queue depth, free
+// blocks, log syncs, connections) from the source registered with
+// metrics_set_source().
+//
+// The latency of a request is split into stages:
+//
+//   queue    request received until it started executing
+//   execute  running it against the engine
+//   send     executed until its response was handed to the socket
+//   total    request received until its response was handed to the socket
+
+#define METRICS_OPCODES      8      /* job_type values, STATS included */
+#define METRICS_THREAD_NAME  16
+#define METRICS_SOCKET_PATH  "/tmp/keystored.metrics"
+#define METRICS_SEND_TIMEOUT_MS 1000    /* a scraper that stops reading is dropped */
+
+enum metrics_stage{
+    METRICS_STAGE_QUEUE,
+    METRICS_STAGE_EXECUTE,
+    METRICS_STAGE_SEND,
+    METRICS_STAGE_TOTAL,
+    METRICS_STAGES
+};
+
+// Counters of one thread, written only by that thread. Histograms are
+// allocated the first time the thread answers a request of that opcode.
+typedef struct metrics_thread {
+    char name[METRICS_THREAD_NAME];
+    uint64_t requests[METRICS_OPCODES];
+    uint64_t errors[METRICS_OPCODES];
+    histogram *latency[METRICS_OPCODES][METRICS_STAGES];
+    struct metrics_thread *next;
+} metrics_thread;
+
+// Text being rendered. A failed allocation sets `failed`; later output is
+// dropped.
+typedef struct metrics_buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+} metrics_buffer;
+
+// Clock of the stage timestamps
+static inline uint64_t metrics_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Names the calling thread in the per-thread counters (reactor-0,
+// worker-3, ...). Threads that never call it are listed as "other".
+void metrics_thread_init(const char *name);
+// A request this thread answered, with the metrics_now() stamps of its
+// stages; a zero stamp leaves out the stages it bounds
+void metrics_record(int opcode, int failed, uint64_t recv_ns, uint64_t start_ns,
+                    uint64_t done_ns, uint64_t sent_ns);
+
+void metrics_printf(metrics_buffer *buf, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+// Appends every metric: the request counters and histograms, then what
+// the source adds
+void metrics_render(metrics_buffer *buf);
+void metrics_set_source(void (*source)(metrics_buffer *buf));
+
+// Serves the rendered metrics on a Unix socket: every connection receives
+// one dump and is closed. The socket is replaced if it exists.
+int metrics_serve_start(const char *path);
+void metrics_serve_stop(void);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef KEYSTORE_OBJ_POOL_H
+#define KEYSTORE_OBJ_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Fixed-size object pool. Every thread allocates from and frees into its own
+// cache without locking. Objects freed on another thread than the one that
+// allocated them are handed back through a shared depot a whole batch at a
+// time, so a reactor allocating and a worker freeing take the depot lock
+// once per OBJ_POOL_BATCH objects. The depot is capped, so bursts are
+// returned to malloc and the resident size stays flat.
+
+#define OBJ_POOL_BATCH        32      /* objects moved between a cache and the depot at once */
+#define OBJ_POOL_CACHE_MAX    (2 * OBJ_POOL_BATCH)
+#define OBJ_POOL_DEPOT_MAX    64      /* batches kept in the depot */
+
+typedef struct obj_pool{
+    const char *name;
+    size_t obj_size;
+    pthread_key_t cache_key;    /* per-thread obj_pool_cache */
+    pthread_mutex_t mutex;      /* depot */
+    void *depot;                /* batches chained through their first object */
+    size_t depot_batches;
+    uint64_t hits;              /* served from a cache or the depot */
+    uint64_t misses;            /* fell through to malloc */
+} obj_pool;
+
+int obj_pool_init(obj_pool *pool, const char *name, size_t obj_size);
+void obj_pool_destroy(obj_pool *pool);
+
+void * obj_pool_alloc(obj_pool *pool);
+void obj_pool_free(obj_pool *pool, void *obj);
+
+void obj_pool_stats(const obj_pool *pool, uint64_t *hits, uint64_t *misses);
+
+#endif
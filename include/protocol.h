@@ -0,0 +1,135 @@
+#ifndef KEYSTORE_PROTOCOL_H
+#define KEYSTORE_PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Sizes of the legacy fixed-layout request
+#define MAX_KEY_LENGTH 128
+#define MAX_VALUE_LENGTH 1024
+
+// Framed protocol. Every message starts with a 12-byte header in network
+// byte order followed by the key and value bytes:
+//
+//   request:  magic u8 | opcode u8 | key_len u16 | value_len u32 | request_id u32
+//   response: magic u8 | opcode u8 | status u8 | error u8 | value_len u32 | request_id u32
+//
+// The first byte of a legacy `legacy_job_request` is the low byte of its
+// job_type (1..3), so a connection's format is decided by its first byte.
+#define KV_FRAME_MAGIC        0xB5
+#define KV_FRAME_HEADER_SIZE  12
+#define KV_MAX_VALUE_LENGTH   (64u * 1024u * 1024u)
+
+// Request opcode byte: the low bits carry the job_type, the high bits are
+// request flags. Without KV_FLAG_PROGRESS only the final COMPLETED/FAILED
+// response is sent.
+#define KV_OPCODE_MASK        0x3F
+#define KV_FLAG_PROGRESS      0x80  /* also send SUBMITTED/PROCESSING notifications */
+
+// Multi-key opcodes carry their keys in the value section of one frame
+// (key_len 0) and are answered by one response with a status per key:
+//
+//   request value:  count u32 | count x (key_len u16 | value_len u32 | key | value)
+//   response value: count u32 | count x (error u8 | value_len u32 | value)
+//
+// value_len is 0 in MGET/MDELETE entries and in responses other than MGET
+// hits. The response status is COMPLETED once the batch ran; per-key
+// failures are reported in the entries.
+#define KV_BATCH_COUNT_SIZE       4
+#define KV_BATCH_REQ_ENTRY_SIZE   6
+#define KV_BATCH_RES_ENTRY_SIZE   5
+#define KV_BATCH_MAX_KEYS         65536
+
+enum job_type{
+    INVALID_TYPE = -1,
+    PUT = 1,
+    GET = 2,
+    DELETE = 3,
+    MGET = 4,
+    MPUT = 5,
+    MDELETE = 6,
+    STATS = 7,      /* no key or value; answered with the metrics text */
+};
+
+enum job_error_code{
+    INVALID_KEY,
+    STORAGE_FULL,
+    NO_ERROR,
+    KEY_NOT_FOUND,
+    VALUE_TOO_LARGE,
+    INTERNAL_ERROR
+};
+
+enum job_status{
+    NOT_STARTED,
+    SUBMITTED,
+    PROCESSING,
+    COMPLETED,
+    FAILED
+};
+
+enum wire_format{
+    WIRE_UNKNOWN,
+    WIRE_FRAMED,
+    WIRE_LEGACY
+};
+
+typedef struct kv_request_header{
+    uint8_t  opcode;        /* enum job_type | KV_FLAG_* */
+    uint16_t key_len;
+    uint32_t value_len;
+    uint32_t request_id;
+} kv_request_header;
+
+typedef struct kv_response_header{
+    uint8_t  opcode;        /* enum job_type */
+    uint8_t  status;        /* enum job_status */
+    uint8_t  error;         /* enum job_error_code */
+    uint32_t value_len;
+    uint32_t request_id;
+} kv_response_header;
+
+// Compatibility mode: whole structs on the wire, as sent by older clients
+typedef struct legacy_job_request{
+    enum job_type type;
+    char key[MAX_KEY_LENGTH];
+    char value[MAX_VALUE_LENGTH];
+} legacy_job_request;
+
+typedef struct legacy_job_response{
+    enum job_type type;
+    enum job_status status;
+    enum job_error_code error;
+    int data_len;
+    char *data;             /* always NULL on the wire; value bytes follow */
+} legacy_job_response;
+
+typedef struct kv_batch_entry{
+    const char *key;
+    uint16_t key_len;
+    const char *value;
+    uint32_t value_len;
+} kv_batch_entry;
+
+static inline int kv_is_batch_type(int type){
+    return type == MGET || type == MPUT || type == MDELETE;
+}
+
+void kv_encode_request_header(uint8_t *buf, const kv_request_header *hdr);
+// Returns 0 on success, -1 if the magic byte does not match
+int kv_decode_request_header(const uint8_t *buf, kv_request_header *hdr);
+void kv_encode_response_header(uint8_t *buf, const kv_response_header *hdr);
+int kv_decode_response_header(const uint8_t *buf, kv_response_header *hdr);
+
+void kv_encode_batch_count(uint8_t *buf, uint32_t count);
+uint32_t kv_decode_batch_count(const uint8_t *buf);
+// Writes a request entry header (KV_BATCH_REQ_ENTRY_SIZE bytes)
+void kv_encode_batch_entry(uint8_t *buf, uint16_t key_len, uint32_t value_len);
+// Reads the request entry at `*off` and advances it. Returns 0 on success,
+// -1 if the entry runs past `len`.
+int kv_decode_batch_entry(const uint8_t *buf, size_t len, size_t *off, kv_batch_entry *out);
+// Writes a response entry header (KV_BATCH_RES_ENTRY_SIZE bytes)
+void kv_encode_batch_result(uint8_t *buf, uint8_t error, uint32_t value_len);
+void kv_decode_batch_result(const uint8_t *buf, uint8_t *error, uint32_t *value_len);
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef KEYSTORE_STORAGE_H
+#define KEYSTORE_STORAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Persistent block storage configuration
+#define KEYSTORE_MAGIC 0x4B455953 /* 'KEYS' */
+#define KEYSTORE_VERSION 2   /* 2: allocation bitmap replaced the free list */
+#define DEFAULT_BLOCK_SIZE 4096U
+#define DEFAULT_NUM_BLOCKS 16384U /* 64 MiB total */
+#define DEFAULT_MAX_BLOCKS 4194304U /* growth limit: 16 GiB */
+
+// Online growth: the image is extended by its current size, within these
+// bounds, whenever the allocator runs out of blocks
+#define STORAGE_GROW_MIN_BLOCKS 16384U
+#define STORAGE_GROW_MAX_BLOCKS 262144U /* 1 GiB */
+
+// Per-thread block cache: refilled and spilled STORAGE_CACHE_BATCH at a time
+#define STORAGE_CACHE_BLOCKS 32U
+#define STORAGE_CACHE_BATCH  16U
+
+// High-water mark: the allocator only scans the bitmap below the mark and
+// raises it this many blocks at a time once everything below is taken
+#define STORAGE_HWM_STEP 1024U
+
+// Memory target for the image (storage_memory_start()): a clock sweeps
+// chunks of STORAGE_CHUNK_BLOCKS blocks, one dirty-bitmap word each, every
+// STORAGE_EVICT_INTERVAL_MS and drops cold clean ones until the resident
+// size is back under STORAGE_EVICT_LOW_PCT percent of the target
+#define STORAGE_CHUNK_BLOCKS      64U
+#define STORAGE_EVICT_INTERVAL_MS 250U
+#define STORAGE_EVICT_LOW_PCT     90U
+
+// The address space reserved for an image starts on this boundary so
+// transparent huge pages can back it
+#define STORAGE_MAP_ALIGN (2u * 1024u * 1024u)
+
+// Buffer pool backend (pool_bytes given to storage_open_or_create()): the
+// chunks above are the pool's frames. Readers and uploads may keep up to
+// STORAGE_POOL_HELD_PCT percent of them pinned between operations, and the
+// evictor keeps STORAGE_POOL_FREE_PCT percent free.
+#define STORAGE_POOL_MIN_BYTES (64u * 1024u * 1024u)
+#define STORAGE_POOL_HELD_PCT  25U
+#define STORAGE_POOL_FREE_PCT  5U
+#define STORAGE_POOL_WAIT_MS   10U
+
+// Index snapshot kept next to the image (<image minus .img>.snap)
+#define STORAGE_SNAPSHOT_MAGIC   0x4B534E50u /* 'KSNP' */
+#define STORAGE_SNAPSHOT_VERSION 1u
+#define STORAGE_PATH_MAX         256
+
+typedef struct keystore_super_block {
+    uint32_t magic;         /* KEYSTORE_MAGIC */
+    uint32_t version;       /* structure version */
+    uint64_t total_size;    /* total file size in bytes */
+    uint32_t block_size;    /* bytes per block */
+    uint32_t num_blocks;    /* number of blocks including superblock */
+    uint32_t bitmap_block;         /* first block of the allocation bitmap */
+    uint32_t free_block_count;     /* free blocks, recounted from the bitmap at open */
+    uint32_t hash_bucket_count;    /* hash buckets at level 0 */
+    uint32_t hash_buckets_block;   /* single-block bucket array of older images (0 once converted) */
+    uint64_t checkpoint_lsn;       /* last WAL record contained in the image */
+    uint64_t wal_segment;          /* first WAL segment to replay */
+    uint32_t bitmap_blocks;        /* blocks holding the bitmap, one bit per block */
+    uint32_t max_blocks;           /* growth limit; the bitmap covers this many blocks */
+    uint64_t hash_records;         /* records in the index, as of the last split or close */
+    uint32_t hash_dir_block;       /* root block of the hash directory */
+    uint32_t hash_level;           /* linear hashing: table size is hash_bucket_count << level ... */
+    uint32_t hash_split;           /* ... plus the buckets below the split pointer */
+    uint32_t shard_index;          /* position of the image in its shard set ... */
+    uint32_t shard_count;          /* ... of this many images (0 == not stamped yet) */
+    uint32_t alloc_hwm;            /* blocks at or above this were never allocated, so
+                                      their bitmap bits are zero without being read */
+} keystore_super_block_t;
+
+// Snapshot file header, followed by `len` payload bytes
+typedef struct storage_snapshot_header {
+    uint32_t magic;         /* STORAGE_SNAPSHOT_MAGIC */
+    uint32_t version;       /* STORAGE_SNAPSHOT_VERSION */
+    uint64_t lsn;           /* last WAL record the payload reflects */
+    uint32_t num_blocks;    /* image size when it was taken */
+    uint32_t len;           /* payload bytes */
+    uint32_t crc;           /* crc32 of the payload */
+    uint32_t reserved;
+} storage_snapshot_header_t;
+
+// How the image's mapping is treated once the daemon runs
+typedef struct storage_memory_options {
+    size_t cache_target;    /* resident bytes the evictor sweeps down to, 0 == none */
+    int prefault;           /* fault the metadata in at startup */
+    int huge_pages;         /* MADV_HUGEPAGE on the whole image */
+    int random_access;      /* MADV_RANDOM on the data blocks: no readahead */
+    int lock_metadata;      /* mlock() the metadata */
+} storage_memory_options;
+
+struct wal;
+
+typedef struct storage_state {
+    int fd;
+    void *mapped_ptr;
+    size_t mapped_size;     /* bytes of the file mapped; grows online */
+    size_t reserved_size;   /* address space reserved at mapped_ptr for growth */
+    keystore_super_block_t super;
+    pthread_mutex_t alloc_mutex;    /* claimed bitmap, cursor and alloc_hwm */
+    pthread_mutex_t grow_mutex;     /* one image extension at a time */
+    uint64_t *claimed;      /* in-memory bitmap: allocated or held by a thread cache,
+                               sized for max_blocks */
+    size_t bitmap_words;    /* words covering num_blocks */
+    size_t alloc_cursor;    /* word where the next refill scan starts */
+    pthread_key_t cache_key;/* per-thread storage_block_cache */
+    struct wal *wal;        /* redo log, NULL when not attached */
+    int created;            /* image was created by this open */
+    char snapshot_path[STORAGE_PATH_MAX];
+    pthread_mutex_t hook_mutex;     /* checkpoint_hook and its running call */
+    void (*checkpoint_hook)(void *arg);
+    void *checkpoint_arg;
+    uint64_t *dirty;        /* blocks changed since the last checkpoint, sized for max_blocks */
+    uint8_t *chunk_flags;   /* STORAGE_CHUNK_* per chunk, sized for max_blocks */
+    size_t cache_target;    /* resident bytes the evictor sweeps down to, 0 == none */
+    storage_memory_options memory;
+    size_t cache_resident;  /* resident bytes at the last sweep */
+    uint64_t cache_evicted; /* bytes dropped by the evictor */
+    size_t clock_hand;      /* next chunk the evictor looks at */
+    unsigned char *residency;   /* mincore() vector */
+    size_t residency_len;
+    pthread_mutex_t evict_mutex;
+    pthread_cond_t evict_cond;
+    int evicting;
+    pthread_t evictor;
+    size_t pool_frames;     /* buffer pool backend: chunks resident at most, 0 == mmap backend */
+    size_t pool_used;       /* chunks resident or being read, under pool_mutex */
+    size_t pool_held;       /* chunks with pins kept between operations */
+    size_t pool_pinned;     /* chunks of metadata */
+    uint32_t *chunk_users;  /* pins on each resident chunk, or STORAGE_CHUNK_ABSENT/BUSY */
+    uint32_t *chunk_held;   /* of those, pins kept between operations */
+    int pool_waiters;       /* threads waiting on pool_cond */
+    pthread_mutex_t pool_mutex;     /* frame accounting and the clock hand */
+    pthread_cond_t pool_cond;       /* a chunk was read, dropped or unpinned */
+    pthread_rwlock_t pool_write_lock;   /* early write-backs, drained before a checkpoint syncs */
+} storage_state_t;
+
+#define STORAGE_CHUNK_REFERENCED 0x01u  /* handed out since the clock last passed */
+#define STORAGE_CHUNK_PINNED     0x02u  /* never evicted */
+
+#define STORAGE_CHUNK_ABSENT 0xFFFFFFFFu    /* not in the pool */
+#define STORAGE_CHUNK_BUSY   0xFFFFFFFEu    /* being read or dropped */
+
+// Storage lifecycle. The whole growth range is reserved as address space up
+// front, so block pointers stay valid while the image grows.
+//
+// With pool_bytes 0 the image file is mapped MAP_SHARED and the kernel
+// pages it. Otherwise the range is anonymous memory serving as a buffer
+// pool of at most pool_bytes: chunks are read from the file with O_DIRECT
+// when a block of theirs is asked for and written back by the checkpoint,
+// or earlier, after a log flush, when a frame is needed and only changed
+// chunks are left to evict. A chunk is pinned while an operation uses it
+// (storage_op_begin()), so eviction never pulls memory from under a reader.
+int storage_open_or_create(const char *path,
+                           uint32_t default_block_size,
+                           uint32_t default_num_blocks,
+                           uint32_t default_max_blocks,
+                           size_t pool_bytes,
+                           storage_state_t *out_state);
+void storage_close(storage_state_t *state);
+void storage_print_superblock_ascii(const storage_state_t *state);
+
+// Logs the current contents of [ptr, ptr+len) inside the mapping to the WAL,
+// if one is attached. Call after modifying the bytes, holding their lock.
+void storage_log_write(storage_state_t *state, const void *ptr, size_t len);
+// For bytes nothing refers to yet, such as the blocks of a large value
+// before its record is linked: syncs [ptr, ptr+len) to the image file and
+// logs only that it was, not the bytes. Returns -1 if the sync failed.
+int storage_log_synced(storage_state_t *state, const void *ptr, size_t len);
+// Marks [ptr, ptr+len) changed without logging it yet, so it stays in
+// memory until it is logged and checkpointed or synced in place
+void storage_note_write(storage_state_t *state, const void *ptr, size_t len);
+uint32_t storage_crc32(uint32_t crc, const void *data, size_t len);
+
+// Returns a pointer to the beginning of the block within the mmap, or NULL on error.
+// With the buffer pool the block's chunk is read in if needed and stays
+// until the calling thread's operation ends; the rest of the chunk, up to
+// STORAGE_CHUNK_BLOCKS-aligned boundaries, may be used as well.
+uint8_t * storage_block_ptr(storage_state_t *state, uint32_t block_index);
+
+// Operations bracket the use of pointers from storage_block_ptr() on the
+// calling thread and may nest. The buffer pool releases their chunks once
+// the outermost one ends, or back to a mark taken inside it, for walks that
+// touch more chunks than they hold on to.
+void storage_op_begin(void);
+void storage_op_end(void);
+size_t storage_op_mark(void);
+void storage_op_release(size_t mark);
+// Keeps every chunk of [ptr, ptr+len) in memory until storage_unpin(), for
+// ranges past one chunk or kept beyond the operation. `held` pins outlive
+// it (zero-copy sends, upload windows) and fail with -1 once they would
+// take more than STORAGE_POOL_HELD_PCT of the pool. Without the pool both
+// only check the range.
+int storage_pin(storage_state_t *state, const void *ptr, size_t len, int held);
+void storage_unpin(storage_state_t *state, const void *ptr, size_t len, int held);
+
+// Block allocation. The bitmap in the image records allocated blocks; each
+// thread keeps a small cache of claimed blocks so single-block alloc/free
+// only take alloc_mutex once per STORAGE_CACHE_BATCH operations. Blocks
+// above the high-water mark are free by definition, so a new image touches
+// only its superblock and first bitmap block and stays sparse. When no
+// block is left the image is extended up to max_blocks.
+int bitmap_format(storage_state_t *state);
+// Rebuilds the in-memory allocator state from the on-disk bitmap (after open or WAL replay)
+int storage_alloc_rescan(storage_state_t *state);
+int storage_block_alloc(storage_state_t *state, uint32_t *out_block_index);
+int storage_block_free(storage_state_t *state, uint32_t block_index);
+// Up to `count` single blocks with at most one trip to alloc_mutex;
+// returns how many were allocated
+uint32_t storage_block_alloc_many(storage_state_t *state, uint32_t *out_blocks, uint32_t count);
+void storage_block_free_many(storage_state_t *state, const uint32_t *blocks, uint32_t count);
+// Contiguous runs of `count` blocks, bypassing the thread caches
+int storage_block_alloc_run(storage_state_t *state, uint32_t count, uint32_t *out_first_block);
+int storage_block_free_run(storage_state_t *state, uint32_t first_block, uint32_t count);
+// Marks the calling thread as one that never grows the image, which takes
+// an fallocate() and an fsync(): its allocations fail once no block is free
+void storage_thread_nonblocking(void);
+
+// Applies `opts` to the mapping; call after daemonize(), since page tables
+// and memory locks do not survive fork().
+//
+// Memory target: every change to the image already passes through
+// storage_log_write(), which marks its blocks dirty until the next
+// checkpoint; storage_block_ptr() marks chunks referenced. Once the image
+// has more than cache_target bytes in memory, an evictor thread drops chunks
+// that were neither referenced since its last pass nor changed since the
+// last checkpoint, both from the mapping and from the page cache, and asks
+// for an early checkpoint when only dirty chunks are left. It is a soft
+// target, not a cap: page faults take memory between passes, and dirty
+// chunks stay until the checkpoint.
+//
+// The metadata (superblock, bitmap and pinned blocks) is prefaulted and
+// locked in chunks as the options ask, now and whenever more is pinned.
+int storage_memory_start(storage_state_t *state, const storage_memory_options *opts);
+// Marks blocks as metadata: never evicted, and prefaulted and locked like
+// the rest of it. For structures reached through cached pointers rather
+// than storage_block_ptr().
+void storage_cache_pin(storage_state_t *state, uint32_t first_block, uint32_t count);
+// Forgets the dirty blocks and writes them to the image file: every block
+// changed before the call is on disk once it returns 0
+int storage_sync_image(storage_state_t *state);
+// Writes the blocks under [ptr, ptr+len) to the image file and waits for them
+int storage_sync_range(storage_state_t *state, const void *ptr, size_t len);
+
+// Index snapshot: in-memory state of the layers above, saved on a clean
+// shutdown and after checkpoints so a restart need not rebuild it. Saving
+// replaces the file atomically. Loading reads it in one go and fails unless
+// it describes the image exactly as recovered, i.e. it was taken at the
+// checkpoint LSN; a fresh image discards any old snapshot.
+int storage_snapshot_save(storage_state_t *state, uint64_t lsn, const void *data, size_t len);
+int storage_snapshot_load(storage_state_t *state, void *data, size_t len);
+// Runs `hook` after every checkpoint. Passing NULL removes it and waits for
+// a call in progress.
+void storage_set_checkpoint_hook(storage_state_t *state, void (*hook)(void *arg), void *arg);
+void storage_run_checkpoint_hook(storage_state_t *state);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef KEYSTORE_URING_H
+#define KEYSTORE_URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring access through the raw system calls, so the daemon
+// needs no liburing. One thread owns a ring: nothing here is locked.
+//
+// The network backend relies on multishot accept and recv with provided
+// buffer rings, which arrived with Linux 6.0; uring_init() refuses older
+// kernels so callers can fall back to epoll.
+
+typedef struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail;      /* SQEs handed out; published to *sq_tail on submit */
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} uring;
+
+// Buffers the kernel picks from for IOSQE_BUFFER_SELECT receives. A
+// completion names its buffer, which goes back with uring_buf_ring_recycle()
+// once the data was consumed.
+typedef struct uring_buf_ring {
+    struct io_uring_buf_ring *ring;
+    char *buffers;
+    unsigned count;         /* a power of two */
+    unsigned size;          /* bytes per buffer */
+    uint16_t group;
+    uint16_t tail;
+} uring_buf_ring;
+
+// `cq_entries` 0 keeps the kernel's default of twice the submission queue.
+// Returns 0, or -1 with errno set (ENOTSUP: kernel too old).
+int uring_init(uring *ring, unsigned entries, unsigned cq_entries);
+void uring_free(uring *ring);
+// Whether this kernel runs the network backend at all
+int uring_supported(void);
+
+// A zeroed SQE to fill in; queued SQEs are submitted first if the queue is
+// full. NULL only if that submission fails.
+struct io_uring_sqe * uring_get_sqe(uring *ring);
+// Submits every queued SQE and waits until `wait_nr` completions are
+// ready or `timeout_ms` passed (-1: no limit). Returns the SQEs submitted,
+// or -errno; -ETIME and -EINTR only mean nothing arrived in time.
+int uring_submit_and_wait(uring *ring, unsigned wait_nr, int timeout_ms);
+// Next completion or NULL; uring_cqe_seen() releases it
+struct io_uring_cqe * uring_peek_cqe(uring *ring);
+void uring_cqe_seen(uring *ring);
+
+int uring_buf_ring_init(uring *ring, uring_buf_ring *bufs, uint16_t group, unsigned count, unsigned size);
+void uring_buf_ring_free(uring *ring, uring_buf_ring *bufs);
+static inline char * uring_buf_ring_buffer(const uring_buf_ring *bufs, uint16_t bid){
+    return bufs->buffers + (size_t)bid * bufs->size;
+}
+void uring_buf_ring_recycle(uring_buf_ring *bufs, uint16_t bid);
+
+#endif
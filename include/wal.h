@@ -0,0 +1,136 @@
+#ifndef KEYSTORE_WAL_H
+#define KEYSTORE_WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "storage.h"
+
+// Write-ahead log of physical redo records. Every change to the mapped
+// image is appended as an after-image of the modified byte range while the
+// lock guarding those bytes is held, so LSN order matches the order in which
+// overlapping ranges were written. A flusher thread writes and fsyncs the
+// log (group commit) and a checkpointer periodically syncs the image and
+// starts a new segment file, after which older segments are dropped.
+//
+// The image stays MAP_SHARED, so the kernel may write a dirty page back
+// before the record describing it is durable. Acknowledged operations are
+// always recovered; an operation that was never acknowledged can leave
+// partial changes if power is lost inside that window. The buffer pool
+// backend only writes a changed chunk before the checkpoint after a
+// wal_flush(), so there the window is limited to the superblock.
+//
+// Large values are not copied into the log: their blocks are synced in
+// place and a WAL_RECORD_SYNCED record notes the range. Replay then leaves
+// those bytes as they are on disk, skipping earlier records that wrote to
+// the same blocks before they were freed and reused.
+
+#define WAL_RECORD_MAGIC          0x57414C52u /* 'WALR' */
+#define WAL_RECORD_SYNCED         0x1u        /* payload is the u64 length of a range synced in place */
+#define WAL_PATH_MAX              256
+#define WAL_DEFAULT_GROUP_US      200u
+#define WAL_ASYNC_FLUSH_MS        10u
+#define WAL_CHECKPOINT_INTERVAL_MS 5000u
+#define WAL_CHECKPOINT_BYTES      (64u * 1024u * 1024u)
+#define WAL_MAX_BUFFER            (16u * 1024u * 1024u)
+#define WAL_MAX_NOTIFY            64  /* threads woken by wal_durable_notify(), one per reactor */
+
+enum durability_level{
+    DURABILITY_SYNC,    /* fsync before every acknowledgement */
+    DURABILITY_GROUP,   /* acknowledgements share one fsync, gathered for up to group_commit_us */
+    DURABILITY_ASYNC    /* acknowledge at once; the log is flushed every WAL_ASYNC_FLUSH_MS */
+};
+
+typedef struct wal_options{
+    enum durability_level level;
+    uint32_t group_commit_us;
+    uint32_t checkpoint_interval_ms;
+    size_t checkpoint_bytes;    /* checkpoint early once a segment grows past this */
+} wal_options;
+
+// On-disk record header, followed by `len` bytes to copy to `offset`
+typedef struct wal_record_header{
+    uint32_t magic;         /* WAL_RECORD_MAGIC */
+    uint32_t len;           /* payload bytes */
+    uint64_t lsn;           /* log sequence number, strictly increasing */
+    uint64_t offset;        /* byte offset in the image */
+    uint32_t crc;           /* crc32 of the header (crc = 0) and payload */
+    uint32_t flags;         /* WAL_RECORD_* */
+} wal_record_header_t;
+
+typedef struct wal{
+    storage_state_t *storage;
+    wal_options opts;
+    char base_path[WAL_PATH_MAX];
+    int fd;                     /* current segment */
+    uint64_t segment;           /* current segment number */
+    size_t segment_bytes;
+    pthread_mutex_t mutex;      /* buffer and LSN counters */
+    pthread_mutex_t io_mutex;   /* one writer of the segment file at a time */
+    pthread_cond_t work_cond;   /* wakes the flusher */
+    pthread_cond_t durable_cond;/* durable_lsn advanced */
+    pthread_cond_t ckpt_cond;   /* wakes the checkpointer */
+    char *buf;                  /* records not yet written */
+    size_t buf_len, buf_cap;
+    char *spare;                /* buffer being written by the flusher */
+    size_t spare_cap;
+    uint64_t next_lsn;
+    uint64_t durable_lsn;
+    int waiters;                /* commits waiting on the flusher */
+    struct {
+        int fd;                 /* eventfd written to once lsn is durable */
+        uint64_t lsn;           /* 0 == nothing to report */
+    } notify[WAL_MAX_NOTIFY];
+    int notify_count;
+    int notify_pending;         /* entries with an lsn to report */
+    int failed;                 /* a write or fsync failed; commits report errors */
+    uint64_t fsync_count;       /* log syncs and their total time, for the metrics */
+    uint64_t fsync_ns;
+    uint64_t msync_count;       /* checkpoint syncs of the image */
+    uint64_t msync_ns;
+    int running;
+    int started;
+    pthread_t flusher, checkpointer;
+} wal_t;
+
+// Replays the log into the image and attaches it to `storage`. On a freshly
+// created image any leftover segments are discarded. Records are buffered
+// until wal_start() launches the flusher and checkpointer, which must happen
+// after daemonize() since threads do not survive fork().
+int wal_open(storage_state_t *storage, const char *base_path, const wal_options *opts);
+int wal_start(wal_t *w);
+// Stops the background threads, checkpoints and detaches the log.
+void wal_close(storage_state_t *storage);
+
+// Appends the current contents of [ptr, ptr+len) inside the mapping.
+uint64_t wal_append(wal_t *w, const void *ptr, size_t len);
+// Appends that [ptr, ptr+len) was synced to the image instead of its contents
+uint64_t wal_append_synced(wal_t *w, const void *ptr, size_t len);
+// LSN of the last record appended by any thread
+uint64_t wal_last_lsn(wal_t *w);
+// Writes and syncs every record appended so far
+int wal_flush(wal_t *w);
+// Waits until `lsn` is durable according to the durability level.
+int wal_wait_durable(wal_t *w, uint64_t lsn);
+// wal_wait_durable() for threads that must not wait: returns 1 once `lsn`
+// is durable and -1 if it never will be. Otherwise returns 0, has the
+// flusher sync the log (at once in sync mode) and writes to the eventfd
+// `fd` once `lsn` is durable or the log failed.
+int wal_durable_notify(wal_t *w, uint64_t lsn, int fd);
+// Whether the buffer is at WAL_MAX_BUFFER, where wal_append() waits
+int wal_full(wal_t *w);
+int wal_checkpoint(wal_t *w);
+// Wakes the checkpointer now rather than at its next interval
+void wal_request_checkpoint(wal_t *w);
+
+// LSN of the last record appended by the calling thread
+uint64_t wal_thread_lsn(void);
+// Marks the calling thread as one that never waits for the flusher in
+// wal_append(); its records may take the buffer past WAL_MAX_BUFFER, so it
+// should check wal_full() before changing anything.
+void wal_thread_nonblocking(void);
+
+int wal_parse_durability(const char *name, enum durability_level *out);
+
+#endif
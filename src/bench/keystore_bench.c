@@ -0,0 +1,761 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "histogram.h"
+
+// Closed-loop load generator: every thread drives its share of the
+// connections with poll(), keeping `pipeline` framed requests in flight on
+// each. Latency is measured from the moment a request is queued for sending
+// until its response is parsed, and only responses that arrive between the
+// end of the warmup and the end of the run are counted.
+
+#define DEFAULT_THREADS     4
+#define DEFAULT_PIPELINE    16
+#define DEFAULT_DURATION    10.0
+#define DEFAULT_WARMUP      1.0
+#define DEFAULT_KEYS        100000
+#define DEFAULT_KEY_SIZE    16
+#define DEFAULT_VALUE_SIZE  100
+#define DEFAULT_READ_RATIO  0.9
+#define DEFAULT_ZIPF_THETA  0.99
+#define MAX_PIPELINE        4096
+#define MAX_CONNECTIONS     4096
+#define DRAIN_TIMEOUT_NS    (5ull * 1000000000ull)  /* wait this long for the last responses */
+#define POLL_INTERVAL_MS    100
+#define RECV_CHUNK          (64 * 1024)
+
+enum bench_op{
+    BENCH_GET,
+    BENCH_PUT,
+    BENCH_OPS
+};
+
+static const char *const bench_op_names[BENCH_OPS] = { "GET", "PUT" };
+
+static struct option long_options[] = {
+    {"connect", required_argument, 0, 'c'},
+    {"threads", required_argument, 0, 't'},
+    {"connections", required_argument, 0, 'n'},
+    {"pipeline", required_argument, 0, 'p'},
+    {"duration", required_argument, 0, 'd'},
+    {"warmup", required_argument, 0, 'w'},
+    {"keys", required_argument, 0, 'k'},
+    {"key-size", required_argument, 0, 'K'},
+    {"value-size", required_argument, 0, 'V'},
+    {"read-ratio", required_argument, 0, 'r'},
+    {"distribution", required_argument, 0, 'D'},
+    {"zipf-theta", required_argument, 0, 'z'},
+    {"preload", no_argument, 0, 'P'},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+};
+
+void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [OPTIONS]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --connect <IP Address>:<port>  Server to load\n");
+    fprintf(stderr, "  --threads <n>                 Client threads (default %d)\n", DEFAULT_THREADS);
+    fprintf(stderr, "  --connections <n>             Connections, spread over the threads (default: one per thread)\n");
+    fprintf(stderr, "  --pipeline <depth>            Requests in flight per connection (default %d)\n", DEFAULT_PIPELINE);
+    fprintf(stderr, "  --duration <seconds>          Length of the measured run (default %.0f)\n", DEFAULT_DURATION);
+    fprintf(stderr, "  --warmup <seconds>            Unmeasured load before the run (default %.0f)\n", DEFAULT_WARMUP);
+    fprintf(stderr, "  --keys <n>                    Size of the key space (default %d)\n", DEFAULT_KEYS);
+    fprintf(stderr, "  --key-size <n>|<min>-<max>    Key length in bytes, fixed or uniform (default %d)\n", DEFAULT_KEY_SIZE);
+    fprintf(stderr, "  --value-size <n>|<min>-<max>  PUT value length in bytes, fixed or uniform (default %d)\n", DEFAULT_VALUE_SIZE);
+    fprintf(stderr, "  --read-ratio <0..1>           Fraction of requests that are GETs (default %.2f)\n", DEFAULT_READ_RATIO);
+    fprintf(stderr, "  --distribution uniform|zipfian  Key popularity (default uniform)\n");
+    fprintf(stderr, "  --zipf-theta <0..1>           Skew of the zipfian distribution (default %.2f)\n", DEFAULT_ZIPF_THETA);
+    fprintf(stderr, "  --preload                     PUT every key once before the run\n");
+    fprintf(stderr, "  --help                        Show this help message\n");
+    fprintf(stderr, "\nExample:\n");
+    fprintf(stderr, "  %s --connect 127.0.0.1:5000 --threads 4 --connections 32 --pipeline 16 --preload\n", program_name);
+    fprintf(stderr, "  %s --connect 127.0.0.1:5000 --read-ratio 0.5 --value-size 64-4096 --distribution zipfian\n", program_name);
+}
+
+typedef struct size_range {
+    uint32_t min;
+    uint32_t max;
+} size_range;
+
+typedef struct bench_options {
+    char *server_ip;
+    int server_port;
+    int threads;
+    int connections;
+    int pipeline;
+    double duration;
+    double warmup;
+    uint64_t keys;
+    size_range key_size;
+    size_range value_size;
+    double read_ratio;
+    int zipfian;
+    double zipf_theta;
+    int preload;
+} bench_options;
+
+// Zipfian generator of Gray et al. ("Quickly generating billion-record
+// synthetic databases"), as used by YCSB: rank 0 is the most popular key
+typedef struct zipf_state {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} zipf_state;
+
+// A request waiting for its response
+typedef struct bench_slot {
+    uint32_t request_id;    /* 0 while the slot is free */
+    uint8_t op;             /* enum bench_op */
+    uint64_t sent_ns;
+} bench_slot;
+
+typedef struct bench_conn {
+    int fd;
+    char *out;              /* frames not yet written */
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    uint8_t *in;            /* bytes received but not yet parsed */
+    size_t in_len;
+    size_t in_cap;
+    bench_slot *slots;
+    uint32_t *free_slots;
+    int free_count;
+    int in_flight;
+    uint16_t seq;
+} bench_conn;
+
+typedef struct bench_thread {
+    pthread_t thread;
+    int index;
+    const bench_options *opts;
+    const zipf_state *zipf;
+    uint64_t rng;
+    bench_conn *conns;
+    int conn_count;
+    int preload;            /* this pass PUTs keys [next_key, end_key) once */
+    uint64_t next_key;
+    uint64_t end_key;
+    histogram hist[BENCH_OPS];
+    uint64_t misses;
+    uint64_t errors;
+    int rc;
+} bench_thread;
+
+static const char *g_value_pattern;
+static uint64_t g_measure_start;
+static uint64_t g_measure_end;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*: cheap and good enough to pick keys and sizes
+static uint64_t rng_next(uint64_t *state){
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+static double rng_unit(uint64_t *state){
+    return (double)(rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint32_t size_pick(const size_range *range, uint64_t r){
+    return range->min + (uint32_t)(r % ((uint64_t)range->max - range->min + 1));
+}
+
+static void zipf_init(zipf_state *z, uint64_t n, double theta){
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1.0 / (1.0 - theta);
+    double zeta2 = 1.0 + pow(0.5, theta);
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; i++) z->zetan += 1.0 / pow((double)i, theta);
+    z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static uint64_t zipf_next(const zipf_state *z, uint64_t *rng){
+    double u = rng_unit(rng);
+    double uz = u * z->zetan;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow(0.5, z->theta)) return 1;
+    uint64_t rank = (uint64_t)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
+
+static int digits(uint64_t v){
+    int d = 1;
+    while (v >= 10) {
+        v /= 10;
+        d++;
+    }
+    return d;
+}
+
+// Key i always has the same length, so a GET finds what the PUT stored
+static size_t format_key(const bench_options *opts, uint64_t index, char *out){
+    uint64_t h = index * 0x9E3779B97F4A7C15ull;
+    size_t len = size_pick(&opts->key_size, h >> 32);
+    snprintf(out, len + 1, "k%0*llu", (int)len - 1, (unsigned long long)index);
+    return len;
+}
+
+static int parse_size_range(const char *arg, size_range *out, uint32_t limit){
+    char *end;
+    errno = 0;
+    unsigned long min = strtoul(arg, &end, 10);
+    unsigned long max = min;
+    if (*end == '-') max = strtoul(end + 1, &end, 10);
+    if (errno || *end != '\0' || end == arg || min > max || max > limit) return -1;
+    out->min = (uint32_t)min;
+    out->max = (uint32_t)max;
+    return 0;
+}
+
+static int parse_count(const char *arg, long min, long max, long *out){
+    char *end;
+    errno = 0;
+    long v = strtol(arg, &end, 10);
+    if (errno || *end != '\0' || end == arg || v < min || v > max) return -1;
+    *out = v;
+    return 0;
+}
+
+static int parse_fraction(const char *arg, double min, double max, double *out){
+    char *end;
+    errno = 0;
+    double v = strtod(arg, &end);
+    if (errno || *end != '\0' || end == arg || !(v >= min && v <= max)) return -1;
+    *out = v;
+    return 0;
+}
+
+// Returns 0 to run, 1 on an invalid command line and -1 after --help
+int parse_and_validate(int argc, char **argv, bench_options *opts) {
+    int opt;
+    long n;
+    while ((opt = getopt_long(argc, argv, "c:t:n:p:d:w:k:K:V:r:D:z:Ph", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'c': {
+                char *colon = strrchr(optarg, ':');
+                if (!colon) {
+                    fprintf(stderr, "Error: --connect expects <IP Address>:<port>\n");
+                    return 1;
+                }
+                *colon = '\0';
+                opts->server_ip = optarg;
+                if (parse_count(colon + 1, 1, 65535, &n) != 0) {
+                    fprintf(stderr, "Error: invalid port %s\n", colon + 1);
+                    return 1;
+                }
+                opts->server_port = (int)n;
+                break;
+            }
+            case 't':
+                if (parse_count(optarg, 1, 1024, &n) != 0) {
+                    fprintf(stderr, "Error: --threads must be between 1 and 1024\n");
+                    return 1;
+                }
+                opts->threads = (int)n;
+                break;
+            case 'n':
+                if (parse_count(optarg, 1, MAX_CONNECTIONS, &n) != 0) {
+                    fprintf(stderr, "Error: --connections must be between 1 and %d\n", MAX_CONNECTIONS);
+                    return 1;
+                }
+                opts->connections = (int)n;
+                break;
+            case 'p':
+                if (parse_count(optarg, 1, MAX_PIPELINE, &n) != 0) {
+                    fprintf(stderr, "Error: --pipeline must be between 1 and %d\n", MAX_PIPELINE);
+                    return 1;
+                }
+                opts->pipeline = (int)n;
+                break;
+            case 'd':
+                if (parse_fraction(optarg, 0.001, 86400, &opts->duration) != 0) {
+                    fprintf(stderr, "Error: invalid --duration %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                if (parse_fraction(optarg, 0, 86400, &opts->warmup) != 0) {
+                    fprintf(stderr, "Error: invalid --warmup %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'k':
+                if (parse_count(optarg, 2, 1000000000L, &n) != 0) {
+                    fprintf(stderr, "Error: --keys must be between 2 and 1000000000\n");
+                    return 1;
+                }
+                opts->keys = (uint64_t)n;
+                break;
+            case 'K':
+                if (parse_size_range(optarg, &opts->key_size, UINT16_MAX) != 0) {
+                    fprintf(stderr, "Error: invalid --key-size %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'V':
+                if (parse_size_range(optarg, &opts->value_size, KV_MAX_VALUE_LENGTH) != 0) {
+                    fprintf(stderr, "Error: invalid --value-size %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (parse_fraction(optarg, 0, 1, &opts->read_ratio) != 0) {
+                    fprintf(stderr, "Error: --read-ratio must be between 0 and 1\n");
+                    return 1;
+                }
+                break;
+            case 'D':
+                if (strcmp(optarg, "uniform") == 0) {
+                    opts->zipfian = 0;
+                } else if (strcmp(optarg, "zipfian") == 0) {
+                    opts->zipfian = 1;
+                } else {
+                    fprintf(stderr, "Error: --distribution must be uniform or zipfian\n");
+                    return 1;
+                }
+                break;
+            case 'z':
+                if (parse_fraction(optarg, 0.01, 0.9999, &opts->zipf_theta) != 0) {
+                    fprintf(stderr, "Error: --zipf-theta must be between 0.01 and 0.9999\n");
+                    return 1;
+                }
+                break;
+            case 'P':
+                opts->preload = 1;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return -1;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        fprintf(stderr, "Error: unexpected argument %s\n", argv[optind]);
+        return 1;
+    }
+    if (!opts->server_ip) {
+        fprintf(stderr, "Error: --connect is required\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (opts->connections == 0) opts->connections = opts->threads;
+    if (opts->connections < opts->threads) {
+        fprintf(stderr, "Error: need at least one connection per thread\n");
+        return 1;
+    }
+    // Every key must fit "k" and its zero-padded index
+    if (opts->key_size.min < (uint32_t)digits(opts->keys - 1) + 1) {
+        fprintf(stderr, "Error: --key-size must be at least %d for %llu keys\n",
+                digits(opts->keys - 1) + 1, (unsigned long long)opts->keys);
+        return 1;
+    }
+    return 0;
+}
+
+static int connect_to_server(const char *server_ip, int server_port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &addr.sin_addr) <= 0) {
+        perror("inet_pton");
+        close(sock);
+        return -1;
+    }
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+static int conn_init(bench_conn *c, const bench_options *opts){
+    memset(c, 0, sizeof(*c));
+    c->fd = connect_to_server(opts->server_ip, opts->server_port);
+    if (c->fd < 0) return -1;
+    c->slots = calloc((size_t)opts->pipeline, sizeof(bench_slot));
+    c->free_slots = calloc((size_t)opts->pipeline, sizeof(uint32_t));
+    if (!c->slots || !c->free_slots) return -1;
+    for (int i = 0; i < opts->pipeline; i++) c->free_slots[i] = (uint32_t)(opts->pipeline - 1 - i);
+    c->free_count = opts->pipeline;
+    return 0;
+}
+
+static void conn_free(bench_conn *c){
+    if (c->fd >= 0) close(c->fd);
+    free(c->out);
+    free(c->in);
+    free(c->slots);
+    free(c->free_slots);
+}
+
+static int buffer_reserve(void **buf, size_t *cap, size_t need){
+    if (need <= *cap) return 0;
+    size_t cap2 = *cap ? *cap : RECV_CHUNK;
+    while (cap2 < need) cap2 *= 2;
+    void *p = realloc(*buf, cap2);
+    if (!p) return -1;
+    *buf = p;
+    *cap = cap2;
+    return 0;
+}
+
+// Appends one request to the connection's output. The request id carries
+// the slot in its low 16 bits and a sequence number above them.
+static int conn_queue(bench_thread *t, bench_conn *c, enum bench_op op, uint64_t key_index){
+    const bench_options *opts = t->opts;
+    char key[UINT16_MAX + 1];
+    size_t key_len = format_key(opts, key_index, key);
+    uint32_t value_len = op == BENCH_PUT ? size_pick(&opts->value_size, rng_next(&t->rng)) : 0;
+
+    // Compact once everything before out_off is written
+    if (c->out_off == c->out_len) c->out_off = c->out_len = 0;
+    size_t frame = KV_FRAME_HEADER_SIZE + key_len + value_len;
+    if (buffer_reserve((void **)&c->out, &c->out_cap, c->out_len + frame) != 0) return -1;
+
+    uint32_t slot = c->free_slots[--c->free_count];
+    if (++c->seq == 0) c->seq = 1;
+    bench_slot *s = &c->slots[slot];
+    s->request_id = ((uint32_t)c->seq << 16) | slot;
+    s->op = (uint8_t)op;
+
+    kv_request_header hdr;
+    hdr.opcode = op == BENCH_PUT ? PUT : GET;
+    hdr.key_len = (uint16_t)key_len;
+    hdr.value_len = value_len;
+    hdr.request_id = s->request_id;
+    char *p = c->out + c->out_len;
+    kv_encode_request_header((uint8_t *)p, &hdr);
+    memcpy(p + KV_FRAME_HEADER_SIZE, key, key_len);
+    memcpy(p + KV_FRAME_HEADER_SIZE + key_len, g_value_pattern, value_len);
+    c->out_len += frame;
+    c->in_flight++;
+    s->sent_ns = now_ns();
+    return 0;
+}
+
+// Tops the pipeline up; returns the requests queued or -1
+static int conn_fill(bench_thread *t, bench_conn *c){
+    const bench_options *opts = t->opts;
+    int queued = 0;
+    while (c->free_count > 0) {
+        enum bench_op op;
+        uint64_t key;
+        if (t->preload) {
+            if (t->next_key >= t->end_key) break;
+            op = BENCH_PUT;
+            key = t->next_key++;
+        } else {
+            op = rng_unit(&t->rng) < opts->read_ratio ? BENCH_GET : BENCH_PUT;
+            key = opts->zipfian ? zipf_next(t->zipf, &t->rng) : rng_next(&t->rng) % opts->keys;
+        }
+        if (conn_queue(t, c, op, key) != 0) return -1;
+        queued++;
+    }
+    return queued;
+}
+
+static int conn_flush(bench_conn *c){
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror("send");
+            return -1;
+        }
+        c->out_off += (size_t)n;
+    }
+    return 0;
+}
+
+static void complete(bench_thread *t, bench_conn *c, const kv_response_header *hdr, uint64_t now){
+    uint32_t slot = hdr->request_id & 0xFFFF;
+    if (slot >= (uint32_t)t->opts->pipeline || c->slots[slot].request_id != hdr->request_id) {
+        t->errors++;
+        return;
+    }
+    bench_slot *s = &c->slots[slot];
+    if (hdr->status == FAILED && hdr->error == KEY_NOT_FOUND && s->op == BENCH_GET) {
+        t->misses++;
+    } else if (hdr->status != COMPLETED) {
+        t->errors++;
+    }
+    if (!t->preload && now >= g_measure_start && now < g_measure_end) {
+        histogram_record(&t->hist[s->op], now - s->sent_ns);
+    }
+    s->request_id = 0;
+    c->free_slots[c->free_count++] = slot;
+    c->in_flight--;
+}
+
+// Reads what is available and completes every whole response in it
+static int conn_receive(bench_thread *t, bench_conn *c){
+    for (;;) {
+        if (buffer_reserve((void **)&c->in, &c->in_cap, c->in_len + RECV_CHUNK) != 0) return -1;
+        ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            perror("recv");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Error: server closed connection\n");
+            return -1;
+        }
+        c->in_len += (size_t)n;
+        if ((size_t)n < RECV_CHUNK) break;
+    }
+
+    uint64_t now = now_ns();
+    size_t off = 0;
+    while (c->in_len - off >= KV_FRAME_HEADER_SIZE) {
+        kv_response_header hdr;
+        if (kv_decode_response_header(c->in + off, &hdr) != 0) {
+            fprintf(stderr, "Error: malformed response from server\n");
+            return -1;
+        }
+        if (c->in_len - off < KV_FRAME_HEADER_SIZE + (size_t)hdr.value_len) break;
+        off += KV_FRAME_HEADER_SIZE + hdr.value_len;
+        if (hdr.status == COMPLETED || hdr.status == FAILED) complete(t, c, &hdr, now);
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return 0;
+}
+
+// Runs until the measured window closed (or the preload range is done) and
+// every request sent got its response
+static int thread_loop(bench_thread *t){
+    struct pollfd fds[MAX_CONNECTIONS];
+    for (;;) {
+        uint64_t now = now_ns();
+        int stopping = !t->preload && now >= g_measure_end;
+        int in_flight = 0;
+        for (int i = 0; i < t->conn_count; i++) {
+            bench_conn *c = &t->conns[i];
+            if (!stopping && conn_fill(t, c) < 0) return -1;
+            if (conn_flush(c) != 0) return -1;
+            in_flight += c->in_flight;
+            fds[i].fd = c->fd;
+            fds[i].events = POLLIN | (c->out_off < c->out_len ? POLLOUT : 0);
+            fds[i].revents = 0;
+        }
+        if (in_flight == 0 && (stopping || t->preload)) return 0;
+        if (stopping && now >= g_measure_end + DRAIN_TIMEOUT_NS) {
+            fprintf(stderr, "Error: %d requests got no response\n", in_flight);
+            return -1;
+        }
+
+        int ready = poll(fds, (nfds_t)t->conn_count, POLL_INTERVAL_MS);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return -1;
+        }
+        for (int i = 0; i < t->conn_count && ready > 0; i++) {
+            if (!fds[i].revents) continue;
+            ready--;
+            if ((fds[i].revents & (POLLIN | POLLERR | POLLHUP)) && conn_receive(t, &t->conns[i]) != 0) {
+                return -1;
+            }
+        }
+    }
+}
+
+static void * bench_thread_main(void *arg){
+    bench_thread *t = (bench_thread *)arg;
+    t->rc = thread_loop(t);
+    return NULL;
+}
+
+// Starts every thread on the current pass and waits for them
+static int run_threads(bench_thread *threads, int count){
+    int rc = 0;
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&threads[i].thread, NULL, bench_thread_main, &threads[i]) != 0) {
+            perror("pthread_create");
+            threads[i].rc = -1;
+            threads[i].thread = pthread_self();
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (!pthread_equal(threads[i].thread, pthread_self())) pthread_join(threads[i].thread, NULL);
+        if (threads[i].rc != 0) rc = -1;
+    }
+    return rc;
+}
+
+static void print_row(const char *name, const histogram *h, double seconds){
+    printf("%-6s %12llu %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+           (unsigned long long)h->count, (double)h->count / seconds,
+           h->count ? (double)h->sum / (double)h->count / 1000.0 : 0.0,
+           (double)histogram_percentile(h, 50.0) / 1000.0,
+           (double)histogram_percentile(h, 99.0) / 1000.0,
+           (double)histogram_percentile(h, 99.9) / 1000.0,
+           (double)h->max / 1000.0);
+}
+
+static void print_range(const char *name, const size_range *range){
+    if (range->min == range->max) printf("%s %u B", name, range->min);
+    else printf("%s %u-%u B", name, range->min, range->max);
+}
+
+int main(int argc, char **argv) {
+    bench_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.threads = DEFAULT_THREADS;
+    opts.pipeline = DEFAULT_PIPELINE;
+    opts.duration = DEFAULT_DURATION;
+    opts.warmup = DEFAULT_WARMUP;
+    opts.keys = DEFAULT_KEYS;
+    opts.key_size.min = opts.key_size.max = DEFAULT_KEY_SIZE;
+    opts.value_size.min = opts.value_size.max = DEFAULT_VALUE_SIZE;
+    opts.read_ratio = DEFAULT_READ_RATIO;
+    opts.zipf_theta = DEFAULT_ZIPF_THETA;
+
+    int parse_result = parse_and_validate(argc, argv, &opts);
+    if (parse_result != 0) return parse_result > 0 ? 1 : 0;
+
+    char *pattern = malloc(opts.value_size.max ? opts.value_size.max : 1);
+    if (!pattern) {
+        perror("malloc");
+        return 1;
+    }
+    for (uint32_t i = 0; i < opts.value_size.max; i++) pattern[i] = (char)('a' + i % 26);
+    g_value_pattern = pattern;
+
+    zipf_state zipf;
+    if (opts.zipfian) zipf_init(&zipf, opts.keys, opts.zipf_theta);
+
+    bench_thread *threads = calloc((size_t)opts.threads, sizeof(bench_thread));
+    bench_conn *conns = calloc((size_t)opts.connections, sizeof(bench_conn));
+    if (!threads || !conns) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < opts.connections; i++) conns[i].fd = -1;
+
+    int rc = 0;
+    int conn = 0;
+    uint64_t seed = (uint64_t)now_ns() | 1;
+    for (int i = 0; i < opts.threads && rc == 0; i++) {
+        bench_thread *t = &threads[i];
+        t->index = i;
+        t->opts = &opts;
+        t->zipf = &zipf;
+        t->rng = seed * (uint64_t)(2 * i + 1) + 0x9E3779B97F4A7C15ull;
+        t->conns = &conns[conn];
+        t->conn_count = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+        for (int k = 0; k < t->conn_count && rc == 0; k++) rc = conn_init(&t->conns[k], &opts);
+        conn += t->conn_count;
+    }
+    if (rc != 0) goto out;
+
+    printf("keystore-bench: %s:%d, %d threads, %d connections, pipeline %d\n", opts.server_ip,
+           opts.server_port, opts.threads, opts.connections, opts.pipeline);
+    printf("workload: %llu keys (", (unsigned long long)opts.keys);
+    if (opts.zipfian) printf("zipfian %.2f", opts.zipf_theta);
+    else printf("uniform");
+    printf("), ");
+    print_range("keys", &opts.key_size);
+    printf(", ");
+    print_range("values", &opts.value_size);
+    printf(", %.0f%% GET, %.1f s after %.1f s warmup\n", opts.read_ratio * 100.0, opts.duration, opts.warmup);
+
+    if (opts.preload) {
+        uint64_t start = now_ns();
+        for (int i = 0; i < opts.threads; i++) {
+            threads[i].preload = 1;
+            threads[i].next_key = opts.keys * (uint64_t)i / (uint64_t)opts.threads;
+            threads[i].end_key = opts.keys * (uint64_t)(i + 1) / (uint64_t)opts.threads;
+        }
+        rc = run_threads(threads, opts.threads);
+        if (rc != 0) goto out;
+        double seconds = (double)(now_ns() - start) / 1e9;
+        uint64_t errors = 0;
+        for (int i = 0; i < opts.threads; i++) {
+            errors += threads[i].errors;
+            threads[i].errors = 0;
+            threads[i].misses = 0;
+            threads[i].preload = 0;
+        }
+        printf("preload: %llu keys in %.2f s (%.0f ops/s), %llu errors\n", (unsigned long long)opts.keys,
+               seconds, (double)opts.keys / seconds, (unsigned long long)errors);
+    }
+
+    g_measure_start = now_ns() + (uint64_t)(opts.warmup * 1e9);
+    g_measure_end = g_measure_start + (uint64_t)(opts.duration * 1e9);
+    rc = run_threads(threads, opts.threads);
+    if (rc != 0) goto out;
+
+    histogram *total = calloc(BENCH_OPS + 1, sizeof(histogram));
+    if (!total) {
+        perror("calloc");
+        rc = -1;
+        goto out;
+    }
+    uint64_t misses = 0, errors = 0;
+    for (int i = 0; i < opts.threads; i++) {
+        for (int op = 0; op < BENCH_OPS; op++) {
+            histogram_merge(&total[op], &threads[i].hist[op]);
+            histogram_merge(&total[BENCH_OPS], &threads[i].hist[op]);
+        }
+        misses += threads[i].misses;
+        errors += threads[i].errors;
+    }
+    printf("\n%-6s %12s %12s %10s %10s %10s %10s %10s\n", "op", "count", "ops/s", "avg(us)",
+           "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (int op = 0; op < BENCH_OPS; op++) {
+        if (total[op].count) print_row(bench_op_names[op], &total[op], opts.duration);
+    }
+    print_row("total", &total[BENCH_OPS], opts.duration);
+    printf("\nGET misses: %llu, errors: %llu\n", (unsigned long long)misses, (unsigned long long)errors);
+    if (errors) rc = -1;
+    free(total);
+
+out:
+    for (int i = 0; i < opts.connections; i++) conn_free(&conns[i]);
+    free(conns);
+    free(threads);
+    free(pattern);
+    return rc == 0 ? 0 : 1;
+}
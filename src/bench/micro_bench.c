@@ -0,0 +1,533 @@
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "kv_engine.h"
+#include "job_executor.h"
+#include "histogram.h"
+
+// In-process microbenchmarks of the hot paths, without any networking:
+//
+//   alloc_free   storage_block_alloc() and then storage_block_free() of
+//                `param` blocks per round. Past STORAGE_CACHE_BLOCKS every
+//                round spills to and refills from the shared bitmap.
+//   queue        job_push() to job_pop() handoff from `threads` producers
+//                to as many consumers, with push-to-pop latency
+//   lookup_hit   kv_engine_lookup() of a present and of an absent key in an
+//   lookup_miss  index of `param` records; load_factor is records per
+//                bucket, the average chain length
+//
+// Every benchmark runs at 1, 2, 4, ... up to --threads threads. ns_per_op
+// is the wall time per operation of one thread, ops_per_sec the total
+// throughput.
+
+#define MICRO_DEFAULT_OPS       1000000ull
+#define MICRO_DEFAULT_KEYS      1000000ull
+#define MICRO_MAX_THREADS       256
+#define MICRO_ALLOC_SMALL       1       /* blocks held per round: served by the thread cache */
+#define MICRO_ALLOC_LARGE       64      /* twice the thread cache: bitmap traffic every round */
+#define MICRO_QUEUE_WINDOW      1024    /* jobs a producer has in flight at most */
+#define MICRO_FIRST_KEYS        1000ull
+#define MICRO_VALUE_SIZE        64
+#define MICRO_DEFAULT_IMAGE     "/tmp/keystore-microbench.img"
+
+enum micro_bench{
+    MICRO_ALLOC = 0x1,
+    MICRO_QUEUE = 0x2,
+    MICRO_LOOKUP = 0x4,
+    MICRO_ALL = 0x7
+};
+
+enum micro_format{
+    MICRO_CSV,
+    MICRO_JSON
+};
+
+static struct option long_options[] = {
+    {"threads", required_argument, 0, 't'},
+    {"ops", required_argument, 0, 'o'},
+    {"keys", required_argument, 0, 'k'},
+    {"bench", required_argument, 0, 'b'},
+    {"format", required_argument, 0, 'f'},
+    {"image", required_argument, 0, 'i'},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+};
+
+void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [OPTIONS]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --threads <n>                 Highest thread count of the sweep (default: online CPUs)\n");
+    fprintf(stderr, "  --ops <n>                     Operations per thread and run (default %llu)\n", MICRO_DEFAULT_OPS);
+    fprintf(stderr, "  --keys <n>                    Largest index for the lookups, grown from %llu tenfold (default %llu)\n",
+            MICRO_FIRST_KEYS, MICRO_DEFAULT_KEYS);
+    fprintf(stderr, "  --bench <list>                Comma-separated subset of alloc,queue,lookup (default all)\n");
+    fprintf(stderr, "  --format csv|json             Output format (default csv)\n");
+    fprintf(stderr, "  --image <path>                Scratch image, removed afterwards (default %s)\n", MICRO_DEFAULT_IMAGE);
+    fprintf(stderr, "  --help                        Show this help message\n");
+    fprintf(stderr, "\nExample:\n");
+    fprintf(stderr, "  %s --threads 8 --bench alloc,queue --format json > before.json\n", program_name);
+}
+
+typedef struct micro_options {
+    int max_threads;
+    uint64_t ops;
+    uint64_t max_keys;
+    unsigned benches;       /* enum micro_bench bits */
+    enum micro_format format;
+    const char *image_path;
+} micro_options;
+
+// Queued by the queue benchmark. The job comes first, so what job_pop()
+// returns can be cast back.
+typedef struct micro_job {
+    job job;
+    uint64_t pushed_ns;
+    int done;               /* popped: its producer may push it again */
+    int stop;               /* sentinel telling a consumer to exit */
+} micro_job;
+
+typedef struct micro_worker micro_worker;
+
+// One measured run: its workers are released together by `start`
+typedef struct micro_run {
+    const micro_options *opts;
+    void (*body)(micro_worker *w);
+    pthread_barrier_t start;
+    int threads;
+    uint64_t param;
+    storage_state_t *storage;
+    kv_engine_t *engine;
+    int hit;                /* lookup: present keys */
+    job_queue *queue;
+    micro_job *jobs;        /* queue: MICRO_QUEUE_WINDOW per producer, then the sentinels */
+    uint64_t consumed;      /* queue: jobs popped so far */
+    uint64_t total;         /* queue: jobs pushed in all */
+} micro_run;
+
+struct micro_worker {
+    pthread_t thread;
+    int index;
+    micro_run *run;
+    uint64_t rng;
+    histogram latency;      /* queue consumers only */
+    int rc;
+};
+
+static int g_first_row = 1;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t rng_next(uint64_t *state){
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+// 1, 2, 4, ... and finally `max`; 0 once `max` was run
+static int next_threads(int threads, int max){
+    if (threads >= max) return 0;
+    return threads * 2 < max ? threads * 2 : max;
+}
+
+static void print_result(const micro_options *opts, const char *bench, int threads, uint64_t param,
+                         double load_factor, uint64_t ops, double seconds, const histogram *latency){
+    double ns_per_op = ops ? seconds * 1e9 * threads / (double)ops : 0.0;
+    double ops_per_sec = seconds > 0 ? (double)ops / seconds : 0.0;
+    unsigned long long p50 = latency ? histogram_percentile(latency, 50.0) : 0;
+    unsigned long long p99 = latency ? histogram_percentile(latency, 99.0) : 0;
+    unsigned long long p999 = latency ? histogram_percentile(latency, 99.9) : 0;
+    if (opts->format == MICRO_CSV) {
+        if (g_first_row) printf("bench,threads,param,load_factor,ops,ns_per_op,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+        printf("%s,%d,%llu,%.3f,%llu,%.2f,%.0f,%llu,%llu,%llu\n", bench, threads,
+               (unsigned long long)param, load_factor, (unsigned long long)ops, ns_per_op, ops_per_sec,
+               p50, p99, p999);
+    } else {
+        printf("%s  {\"bench\": \"%s\", \"threads\": %d, \"param\": %llu, \"load_factor\": %.3f, "
+               "\"ops\": %llu, \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f, "
+               "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}",
+               g_first_row ? "[\n" : ",\n", bench, threads, (unsigned long long)param, load_factor,
+               (unsigned long long)ops, ns_per_op, ops_per_sec, p50, p99, p999);
+    }
+    g_first_row = 0;
+    fflush(stdout);
+}
+
+static void * worker_main(void *arg){
+    micro_worker *w = (micro_worker *)arg;
+    pthread_barrier_wait(&w->run->start);
+    w->run->body(w);
+    return NULL;
+}
+
+// Runs the body on `count` workers and returns the seconds from their
+// common start until the last one finished, or -1 if one of them failed
+static double run_workers(micro_run *run, micro_worker *workers, int count){
+    pthread_barrier_init(&run->start, NULL, (unsigned)count + 1);
+    uint64_t seed = now_ns() | 1;
+    for (int i = 0; i < count; i++) {
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].index = i;
+        workers[i].run = run;
+        workers[i].rng = seed * (uint64_t)(2 * i + 1) + 0x9E3779B97F4A7C15ull;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&run->start);
+    uint64_t start = now_ns();
+    int rc = 0;
+    for (int i = 0; i < count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].rc != 0) rc = -1;
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&run->start);
+    return rc == 0 ? seconds : -1.0;
+}
+
+static void alloc_body(micro_worker *w){
+    micro_run *run = w->run;
+    uint32_t held[MICRO_ALLOC_LARGE];
+    uint32_t batch = (uint32_t)run->param;
+    for (uint64_t done = 0; done < run->opts->ops; done += batch) {
+        for (uint32_t k = 0; k < batch; k++) {
+            if (storage_block_alloc(run->storage, &held[k]) != 0) {
+                storage_block_free_many(run->storage, held, k);
+                w->rc = -1;
+                return;
+            }
+        }
+        for (uint32_t k = 0; k < batch; k++) storage_block_free(run->storage, held[k]);
+    }
+}
+
+static int bench_alloc(const micro_options *opts, storage_state_t *storage, micro_worker *workers){
+    static const uint32_t batches[] = { MICRO_ALLOC_SMALL, MICRO_ALLOC_LARGE };
+    for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        for (int t = 1; t; t = next_threads(t, opts->max_threads)) {
+            micro_run run;
+            memset(&run, 0, sizeof(run));
+            run.opts = opts;
+            run.body = alloc_body;
+            run.threads = t;
+            run.param = batches[b];
+            run.storage = storage;
+            double seconds = run_workers(&run, workers, t);
+            if (seconds < 0) {
+                fprintf(stderr, "Error: block allocation failed\n");
+                return -1;
+            }
+            uint64_t rounds = (opts->ops + batches[b] - 1) / batches[b];
+            print_result(opts, "alloc_free", t, batches[b], 0.0, rounds * batches[b] * (uint64_t)t, seconds, NULL);
+        }
+    }
+    return 0;
+}
+
+// Producers are workers [0, threads), consumers the rest. The consumer
+// that pops the last job releases the others with one sentinel each.
+static void queue_body(micro_worker *w){
+    micro_run *run = w->run;
+    if (w->index < run->threads) {
+        micro_job *window = &run->jobs[(size_t)w->index * MICRO_QUEUE_WINDOW];
+        for (uint64_t i = 0; i < run->opts->ops; i++) {
+            micro_job *mj = &window[i % MICRO_QUEUE_WINDOW];
+            while (!__atomic_load_n(&mj->done, __ATOMIC_ACQUIRE)) sched_yield();
+            mj->done = 0;
+            mj->pushed_ns = now_ns();
+            job_push(run->queue, &mj->job);
+        }
+        return;
+    }
+    job_queue_attach_worker(run->queue);
+    for (;;) {
+        micro_job *mj = (micro_job *)job_pop(run->queue);
+        if (!mj || mj->stop) return;
+        histogram_record(&w->latency, now_ns() - mj->pushed_ns);
+        __atomic_store_n(&mj->done, 1, __ATOMIC_RELEASE);
+        if (__atomic_add_fetch(&run->consumed, 1, __ATOMIC_ACQ_REL) != run->total) continue;
+        micro_job *stops = &run->jobs[(size_t)run->threads * MICRO_QUEUE_WINDOW];
+        for (int i = 0; i < run->threads - 1; i++) job_push(run->queue, &stops[i].job);
+        return;
+    }
+}
+
+static micro_job * queue_jobs_alloc(size_t count){
+    micro_job *jobs = calloc(count, sizeof(micro_job));
+    if (!jobs) return NULL;
+    for (size_t i = 0; i < count; i++) {
+        jobs[i].job.request = calloc(1, sizeof(job_request));
+        jobs[i].job.response = calloc(1, sizeof(job_response));
+        if (!jobs[i].job.request || !jobs[i].job.response) return NULL;
+        jobs[i].job.request->type = GET;
+        jobs[i].job.response->type = GET;
+        jobs[i].done = 1;
+    }
+    return jobs;
+}
+
+static void queue_jobs_free(micro_job *jobs, size_t count){
+    if (!jobs) return;
+    for (size_t i = 0; i < count; i++) {
+        free(jobs[i].job.request);
+        free(jobs[i].job.response);
+    }
+    free(jobs);
+}
+
+static int bench_queue(const micro_options *opts, micro_worker *workers){
+    histogram *latency = malloc(sizeof(histogram));
+    if (!latency) return -1;
+    for (int t = 1; t; t = next_threads(t, opts->max_threads)) {
+        micro_run run;
+        memset(&run, 0, sizeof(run));
+        run.opts = opts;
+        run.body = queue_body;
+        run.threads = t;
+        run.total = opts->ops * (uint64_t)t;
+        size_t job_count = (size_t)t * MICRO_QUEUE_WINDOW + (size_t)t;
+        run.jobs = queue_jobs_alloc(job_count);
+        run.queue = job_queue_init();
+        if (!run.jobs || !run.queue || job_queue_rings_init(run.queue, t) != 0) {
+            fprintf(stderr, "Error: out of memory\n");
+            queue_jobs_free(run.jobs, job_count);
+            free(latency);
+            return -1;
+        }
+        for (int i = 0; i < t; i++) run.jobs[(size_t)t * MICRO_QUEUE_WINDOW + (size_t)i].stop = 1;
+
+        double seconds = run_workers(&run, workers, 2 * t);
+        histogram_reset(latency);
+        for (int i = t; i < 2 * t; i++) histogram_merge(latency, &workers[i].latency);
+        print_result(opts, "queue", t, 0, 0.0, run.total, seconds, latency);
+        job_queue_free(run.queue);
+        queue_jobs_free(run.jobs, job_count);
+    }
+    free(latency);
+    return 0;
+}
+
+static size_t format_key(char *out, size_t size, int hit, uint64_t index){
+    return (size_t)snprintf(out, size, "%s%llu", hit ? "key:" : "miss:", (unsigned long long)index);
+}
+
+static void lookup_body(micro_worker *w){
+    micro_run *run = w->run;
+    char key[32];
+    for (uint64_t i = 0; i < run->opts->ops; i++) {
+        size_t key_len = format_key(key, sizeof(key), run->hit, rng_next(&w->rng) % run->param);
+        char *value = NULL;
+        size_t value_len = 0;
+        int rc = kv_engine_lookup(run->engine, key, key_len, &value, &value_len);
+        if (rc != (run->hit ? KV_OK : KV_NOT_FOUND)) {
+            free(value);
+            w->rc = -1;
+            return;
+        }
+        free(value);
+    }
+}
+
+// Records per bucket of the linear hash table
+static double index_load(const kv_engine_t *engine){
+    int64_t records = 0;
+    for (uint32_t s = 0; s < KV_LOCK_STRIPES; s++) records += engine->counts[s].records;
+    uint64_t lh = __atomic_load_n(&engine->lh_state, __ATOMIC_RELAXED);
+    uint64_t buckets = ((uint64_t)engine->base_buckets << (lh >> 32)) + (uint32_t)lh;
+    return (double)records / (double)buckets;
+}
+
+static int bench_lookup(const micro_options *opts, storage_state_t *storage, micro_worker *workers){
+    kv_engine_t *engine = calloc(1, sizeof(kv_engine_t));
+    if (!engine || kv_engine_open(engine, storage) != KV_OK) {
+        fprintf(stderr, "Error: failed to open the index\n");
+        free(engine);
+        return -1;
+    }
+    char value[MICRO_VALUE_SIZE];
+    memset(value, 'v', sizeof(value));
+    uint64_t inserted = 0;
+    int rc = 0;
+    for (uint64_t keys = MICRO_FIRST_KEYS; rc == 0 && keys; ) {
+        if (keys > opts->max_keys) keys = opts->max_keys;
+        for (; inserted < keys; inserted++) {
+            char key[32];
+            size_t key_len = format_key(key, sizeof(key), 1, inserted);
+            if (kv_engine_insert(engine, key, key_len, value, sizeof(value)) != KV_OK) {
+                fprintf(stderr, "Error: insert of %s failed\n", key);
+                rc = -1;
+                break;
+            }
+        }
+        double load = index_load(engine);
+        for (int hit = 1; rc == 0 && hit >= 0; hit--) {
+            for (int t = 1; t; t = next_threads(t, opts->max_threads)) {
+                micro_run run;
+                memset(&run, 0, sizeof(run));
+                run.opts = opts;
+                run.body = lookup_body;
+                run.threads = t;
+                run.param = keys;
+                run.engine = engine;
+                run.hit = hit;
+                double seconds = run_workers(&run, workers, t);
+                if (seconds < 0) {
+                    fprintf(stderr, "Error: lookup returned the wrong result\n");
+                    rc = -1;
+                    break;
+                }
+                print_result(opts, hit ? "lookup_hit" : "lookup_miss", t, keys, load,
+                             opts->ops * (uint64_t)t, seconds, NULL);
+            }
+        }
+        keys = keys < opts->max_keys ? keys * 10 : 0;
+    }
+    kv_engine_close(engine);
+    free(engine);
+    return rc;
+}
+
+static int parse_benches(char *arg, unsigned *out){
+    *out = 0;
+    for (char *name = strtok(arg, ","); name; name = strtok(NULL, ",")) {
+        if (strcmp(name, "alloc") == 0) *out |= MICRO_ALLOC;
+        else if (strcmp(name, "queue") == 0) *out |= MICRO_QUEUE;
+        else if (strcmp(name, "lookup") == 0) *out |= MICRO_LOOKUP;
+        else return -1;
+    }
+    return *out ? 0 : -1;
+}
+
+static int parse_count(const char *arg, unsigned long long min, unsigned long long max,
+                       unsigned long long *out){
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (errno || *end != '\0' || end == arg || v < min || v > max) return -1;
+    *out = v;
+    return 0;
+}
+
+// Returns 0 to run, 1 on an invalid command line and -1 after --help
+int parse_and_validate(int argc, char **argv, micro_options *opts) {
+    int opt;
+    unsigned long long n;
+    while ((opt = getopt_long(argc, argv, "t:o:k:b:f:i:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                if (parse_count(optarg, 1, MICRO_MAX_THREADS, &n) != 0) {
+                    fprintf(stderr, "Error: --threads must be between 1 and %d\n", MICRO_MAX_THREADS);
+                    return 1;
+                }
+                opts->max_threads = (int)n;
+                break;
+            case 'o':
+                if (parse_count(optarg, 1, 1ull << 40, &n) != 0) {
+                    fprintf(stderr, "Error: invalid --ops %s\n", optarg);
+                    return 1;
+                }
+                opts->ops = n;
+                break;
+            case 'k':
+                if (parse_count(optarg, MICRO_FIRST_KEYS, 100000000ull, &n) != 0) {
+                    fprintf(stderr, "Error: --keys must be between %llu and 100000000\n", MICRO_FIRST_KEYS);
+                    return 1;
+                }
+                opts->max_keys = n;
+                break;
+            case 'b':
+                if (parse_benches(optarg, &opts->benches) != 0) {
+                    fprintf(stderr, "Error: --bench takes a list of alloc, queue and lookup\n");
+                    return 1;
+                }
+                break;
+            case 'f':
+                if (strcmp(optarg, "csv") == 0) {
+                    opts->format = MICRO_CSV;
+                } else if (strcmp(optarg, "json") == 0) {
+                    opts->format = MICRO_JSON;
+                } else {
+                    fprintf(stderr, "Error: --format must be csv or json\n");
+                    return 1;
+                }
+                break;
+            case 'i':
+                opts->image_path = optarg;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return -1;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        fprintf(stderr, "Error: unexpected argument %s\n", argv[optind]);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    micro_options opts;
+    memset(&opts, 0, sizeof(opts));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts.max_threads = cpus < 1 ? 1 : cpus > MICRO_MAX_THREADS ? MICRO_MAX_THREADS : (int)cpus;
+    opts.ops = MICRO_DEFAULT_OPS;
+    opts.max_keys = MICRO_DEFAULT_KEYS;
+    opts.benches = MICRO_ALL;
+    opts.format = MICRO_CSV;
+    opts.image_path = MICRO_DEFAULT_IMAGE;
+
+    int parse_result = parse_and_validate(argc, argv, &opts);
+    if (parse_result != 0) return parse_result > 0 ? 1 : 0;
+
+    // The queue benchmark runs a consumer per producer
+    micro_worker *workers = calloc(2 * (size_t)opts.max_threads, sizeof(micro_worker));
+    storage_state_t *storage = calloc(1, sizeof(storage_state_t));
+    if (!workers || !storage) {
+        perror("calloc");
+        return 1;
+    }
+
+    // Always start from an empty image
+    unlink(opts.image_path);
+    if (storage_open_or_create(opts.image_path, DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS,
+                               DEFAULT_MAX_BLOCKS, 0, storage) != 0) {
+        fprintf(stderr, "Error: cannot create %s\n", opts.image_path);
+        return 1;
+    }
+    char snapshot[STORAGE_PATH_MAX];
+    snprintf(snapshot, sizeof(snapshot), "%s", storage->snapshot_path);
+    unlink(snapshot);
+
+    int rc = 0;
+    if (rc == 0 && (opts.benches & MICRO_ALLOC)) rc = bench_alloc(&opts, storage, workers);
+    if (rc == 0 && (opts.benches & MICRO_QUEUE)) rc = bench_queue(&opts, workers);
+    if (rc == 0 && (opts.benches & MICRO_LOOKUP)) rc = bench_lookup(&opts, storage, workers);
+    if (opts.format == MICRO_JSON && !g_first_row) printf("\n]\n");
+
+    storage_close(storage);
+    unlink(opts.image_path);
+    unlink(snapshot);
+    free(storage);
+    free(workers);
+    return rc == 0 ? 0 : 1;
+}
@@ -7,17 +7,28 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
-#include <time.h>
 
-#include "job_executor.h"
+#include "protocol.h"
+
+#define DEFAULT_PIPELINE_DEPTH 32
+#define STREAM_CHUNK (64 * 1024)   /* bytes per read/write when streaming a value from or to a file */
 
 static struct option long_options[] = {
     {"connect", required_argument, 0, 'c'},
     {"put", required_argument, 0, 'p'},
+    {"put-file", required_argument, 0, 'f'},
+    {"output", required_argument, 0, 'o'},
     {"get", required_argument, 0, 'g'},
     {"delete", required_argument, 0, 'd'},
+    {"legacy", no_argument, 0, 'l'},
+    {"batch", no_argument, 0, 'b'},
+    {"pipeline", required_argument, 0, 'n'},
+    {"progress", no_argument, 0, 's'},
+    {"stats", no_argument, 0, 't'},
     {"help", no_argument, 0, 'h'},
     {0, 0, 0, 0}
 };
@@ -27,25 +38,65 @@ void print_usage(const char *program_name) {
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  --connect <IP Address>:<port>  Connect to server\n");
     fprintf(stderr, "  --put <key> <value>           Put key-value pair\n");
+    fprintf(stderr, "  --put-file <key> <path>       Put the contents of a file, streamed in chunks\n");
     fprintf(stderr, "  --get <key>                   Get value for key\n");
     fprintf(stderr, "  --delete <key>                Delete key\n");
+    fprintf(stderr, "  --output <path>               Write the value of --get to a file as it arrives\n");
+    fprintf(stderr, "  --legacy                      Use the fixed-size legacy request format\n");
+    fprintf(stderr, "  --batch                       Read commands from stdin (put <key> <value> | get <key> | delete <key>)\n");
+    fprintf(stderr, "                                and multi-key frames (mput <k> <v> [<k> <v>...] | mget <k>... | mdelete <k>...)\n");
+    fprintf(stderr, "  --pipeline <depth>            Requests kept in flight in batch mode (default %d)\n", DEFAULT_PIPELINE_DEPTH);
+    fprintf(stderr, "  --progress                    Also receive SUBMITTED/PROCESSING notifications\n");
+    fprintf(stderr, "  --stats                       Print the server's metrics (Prometheus text format)\n");
     fprintf(stderr, "  --help                        Show this help message\n");
     fprintf(stderr, "\nExample:\n");
     fprintf(stderr, "  %s --connect 127.0.0.1:8080 --put mykey myvalue\n", program_name);
     fprintf(stderr, "  %s --connect 127.0.0.1:8080 --get mykey\n", program_name);
+    fprintf(stderr, "  %s --connect 127.0.0.1:8080 --batch --pipeline 64 < commands.txt\n", program_name);
 }
 
-int parse_and_validate(int argc, char **argv, char **server_ip, int *server_port, enum job_type *type, char **key, char **value) {
+// Decoded response, independent of the wire format
+typedef struct client_response {
+    int type;
+    int status;
+    int error;
+    uint32_t request_id;
+    uint32_t data_len;
+    char *data;
+} client_response;
+
+typedef struct client_options {
+    char *server_ip;
+    int server_port;
+    enum job_type type;
+    char *key;
+    char *value;
+    char *value_file;       /* --put-file: value streamed from this file */
+    char *output;           /* --output: GET value streamed to this file */
+    enum wire_format wire;
+    int batch;
+    int pipeline_depth;
+    uint8_t flags;          /* KV_FLAG_* sent with every request */
+} client_options;
+
+// A batch request waiting for its final response
+typedef struct pending_request {
+    uint32_t request_id;    /* 0 == slot free */
+    enum job_type type;
+    char *key;              /* the keys of a multi-key request, space separated */
+} pending_request;
+
+int parse_and_validate(int argc, char **argv, client_options *opts) {
     int option_index = 0;
     int c;
-    while ((c = getopt_long(argc, argv, "c:p:g:d:h", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "c:p:f:o:g:d:lbn:sth", long_options, &option_index)) != -1) {
         switch (c) {
             case 'c': // --connect
-                *server_ip = strtok(optarg, ":");
-                if (*server_ip) {
+                opts->server_ip = strtok(optarg, ":");
+                if (opts->server_ip) {
                     char *port_str = strtok(NULL, ":");
                     if (port_str) {
-                        *server_port = atoi(port_str);
+                        opts->server_port = atoi(port_str);
                     } else {
                         fprintf(stderr, "Error: Invalid format for --connect. Use IP:PORT\n");
                         return 1;
@@ -57,10 +108,10 @@ int parse_and_validate(int argc, char **argv, char **server_ip, int *server_port
                 break;
 
             case 'p': // --put
-                *type = PUT;
-                *key = optarg;
+                opts->type = PUT;
+                opts->key = optarg;
                 if (optind < argc) {
-                    *value = argv[optind];
+                    opts->value = argv[optind];
                     optind++; // Move to next argument
                 } else {
                     fprintf(stderr, "Error: --put requires both key and value\n");
@@ -68,14 +119,55 @@ int parse_and_validate(int argc, char **argv, char **server_ip, int *server_port
                 }
                 break;
 
+            case 'f': // --put-file
+                opts->type = PUT;
+                opts->key = optarg;
+                if (optind < argc) {
+                    opts->value_file = argv[optind];
+                    optind++;
+                } else {
+                    fprintf(stderr, "Error: --put-file requires both key and path\n");
+                    return 1;
+                }
+                break;
+
+            case 'o': // --output
+                opts->output = optarg;
+                break;
+
             case 'g': // --get
-                *type = GET;
-                *key = optarg;
+                opts->type = GET;
+                opts->key = optarg;
                 break;
 
             case 'd': // --delete
-                *type = DELETE;
-                *key = optarg;
+                opts->type = DELETE;
+                opts->key = optarg;
+                break;
+
+            case 'l': // --legacy
+                opts->wire = WIRE_LEGACY;
+                break;
+
+            case 'b': // --batch
+                opts->batch = 1;
+                break;
+
+            case 'n': // --pipeline
+                opts->pipeline_depth = atoi(optarg);
+                if (opts->pipeline_depth <= 0) {
+                    fprintf(stderr, "Error: --pipeline requires a positive depth\n");
+                    return 1;
+                }
+                break;
+
+            case 's': // --progress
+                opts->flags |= KV_FLAG_PROGRESS;
+                break;
+
+            case 't': // --stats
+                opts->type = STATS;
+                opts->key = "";
                 break;
 
             case 'h': // --help
@@ -91,27 +183,67 @@ int parse_and_validate(int argc, char **argv, char **server_ip, int *server_port
         }
     }
 
+    if (opts->batch) {
+        if (!opts->server_ip || !opts->server_port) {
+            fprintf(stderr, "Error: Missing required options\n");
+            fprintf(stderr, "Use --help for usage information\n");
+            return 1;
+        }
+        if (opts->wire == WIRE_LEGACY) {
+            fprintf(stderr, "Error: --batch needs request ids and cannot be used with --legacy\n");
+            return 1;
+        }
+        return 0;
+    }
+
     // Check if required options are provided
-    if (!*server_ip || !*server_port || *type == INVALID_TYPE || !*key) {
+    if (!opts->server_ip || !opts->server_port || opts->type == INVALID_TYPE || !opts->key) {
         fprintf(stderr, "Error: Missing required options\n");
         fprintf(stderr, "Use --help for usage information\n");
         return 1;
     }
 
     // Validate key length
-    if (*key && strlen(*key) > 128) {
-        fprintf(stderr, "Error: Key length exceeds 128 characters\n");
+    size_t max_key = (opts->wire == WIRE_LEGACY) ? MAX_KEY_LENGTH : UINT16_MAX;
+    if (strlen(opts->key) > max_key) {
+        fprintf(stderr, "Error: Key length exceeds %zu characters\n", max_key);
         return 1;
     }
 
+    if ((opts->value_file || opts->output) && opts->wire == WIRE_LEGACY) {
+        fprintf(stderr, "Error: --put-file and --output cannot be used with --legacy\n");
+        return 1;
+    }
+    if (opts->type == STATS && opts->wire == WIRE_LEGACY) {
+        fprintf(stderr, "Error: --stats cannot be used with --legacy\n");
+        return 1;
+    }
+    if (opts->output && opts->type != GET) {
+        fprintf(stderr, "Error: --output only applies to --get\n");
+        return 1;
+    }
+    if (opts->value_file) {
+        struct stat st;
+        if (stat(opts->value_file, &st) != 0) {
+            perror(opts->value_file);
+            return 1;
+        }
+        if ((uint64_t)st.st_size > KV_MAX_VALUE_LENGTH) {
+            fprintf(stderr, "Error: Value length exceeds %u bytes\n", KV_MAX_VALUE_LENGTH);
+            return 1;
+        }
+        return 0;
+    }
+
     // Additional check for PUT operation
-    if (*type == PUT) {
-        if (!*value) {
+    if (opts->type == PUT) {
+        if (!opts->value) {
             fprintf(stderr, "Error: --put requires both key and value\n");
             return 1;
         }
-        if (strlen(*value) > 1024) {
-            fprintf(stderr, "Error: Value length exceeds 1024 characters\n");
+        size_t max_value = (opts->wire == WIRE_LEGACY) ? MAX_VALUE_LENGTH : KV_MAX_VALUE_LENGTH;
+        if (strlen(opts->value) > max_value) {
+            fprintf(stderr, "Error: Value length exceeds %zu characters\n", max_value);
             return 1;
         }
     }
@@ -142,30 +274,421 @@ int connect_to_server(const char *server_ip, int server_port) {
     return sock;
 }
 
-void print_job_response(const job_response *res) {
+// Reads exactly `len` bytes; returns the number read (short only on EOF/error)
+ssize_t recv_all(int sock, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = recv(sock, (char *)buf + got, len - got, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        got += (size_t)n;
+    }
+    return (ssize_t)got;
+}
+
+// Sends one framed request
+int send_frame(int sock, enum job_type type, const char *key, size_t key_len,
+               const char *value, size_t value_len, uint32_t request_id, uint8_t flags) {
+    uint8_t frame[KV_FRAME_HEADER_SIZE];
+    kv_request_header hdr;
+    hdr.opcode = (uint8_t)type | flags;
+    hdr.key_len = (uint16_t)key_len;
+    hdr.value_len = (uint32_t)value_len;
+    hdr.request_id = request_id;
+    kv_encode_request_header(frame, &hdr);
+
+    struct iovec iov[3] = {
+        { frame, sizeof(frame) },
+        { (void *)key, key_len },
+        { (void *)value, value_len },
+    };
+    ssize_t total = (ssize_t)(sizeof(frame) + key_len + value_len);
+    return writev(sock, iov, value_len ? 3 : 2) == total ? 0 : -1;
+}
+
+// Sends a PUT whose value is the contents of `path`, read and sent one
+// chunk at a time
+int send_file_frame(int sock, const char *key, const char *path, uint32_t request_id, uint8_t flags) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0) {
+        fclose(fp);
+        return -1;
+    }
+    uint8_t frame[KV_FRAME_HEADER_SIZE];
+    kv_request_header hdr;
+    hdr.opcode = (uint8_t)PUT | flags;
+    hdr.key_len = (uint16_t)strlen(key);
+    hdr.value_len = (uint32_t)st.st_size;
+    hdr.request_id = request_id;
+    kv_encode_request_header(frame, &hdr);
+
+    struct iovec iov[2] = {
+        { frame, sizeof(frame) },
+        { (void *)key, hdr.key_len },
+    };
+    int rc = writev(sock, iov, 2) == (ssize_t)(sizeof(frame) + hdr.key_len) ? 0 : -1;
+    char *chunk = malloc(STREAM_CHUNK);
+    size_t left = hdr.value_len;
+    while (rc == 0 && left > 0) {
+        size_t n = fread(chunk, 1, left < STREAM_CHUNK ? left : STREAM_CHUNK, fp);
+        if (n == 0) {
+            // The server is waiting for the announced length
+            fprintf(stderr, "Error: %s changed while sending\n", path);
+            rc = -1;
+            break;
+        }
+        for (size_t off = 0; rc == 0 && off < n; ) {
+            ssize_t sent = send(sock, chunk + off, n - off, 0);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0) rc = -1;
+            else off += (size_t)sent;
+        }
+        left -= n;
+    }
+    free(chunk);
+    fclose(fp);
+    return rc;
+}
+
+// Sends one request in the connection's wire format
+int send_request(int sock, enum wire_format wire, enum job_type type, const char *key, const char *value,
+                 uint32_t request_id, uint8_t flags) {
+    size_t key_len = strlen(key);
+    size_t value_len = value ? strlen(value) : 0;
+
+    if (wire == WIRE_LEGACY) {
+        legacy_job_request legacy;
+        memset(&legacy, 0, sizeof(legacy));
+        legacy.type = type;
+        snprintf(legacy.key, sizeof(legacy.key), "%s", key);
+        snprintf(legacy.value, sizeof(legacy.value), "%s", value ? value : "");
+        return send(sock, &legacy, sizeof(legacy), 0) == (ssize_t)sizeof(legacy) ? 0 : -1;
+    }
+    return send_frame(sock, type, key, key_len, value, value_len, request_id, flags);
+}
+
+// Encodes the space separated arguments of an mput/mget/mdelete line into a
+// batch payload. Returns a malloc'd buffer, or NULL if the arguments do not
+// form whole entries.
+uint8_t * encode_batch_payload(enum job_type type, const char *args, size_t *out_len) {
+    char *copy = strdup(args);
+    // Every argument costs at most one entry header plus its bytes
+    size_t cap = KV_BATCH_COUNT_SIZE + strlen(args) * (KV_BATCH_REQ_ENTRY_SIZE + 1);
+    uint8_t *buf = malloc(cap);
+    if (!copy || !buf) {
+        free(copy);
+        free(buf);
+        return NULL;
+    }
+    size_t off = KV_BATCH_COUNT_SIZE;
+    uint32_t count = 0;
+    char *save = NULL;
+    for (char *key = strtok_r(copy, " ", &save); key; key = strtok_r(NULL, " ", &save)) {
+        const char *value = NULL;
+        if (type == MPUT && !(value = strtok_r(NULL, " ", &save))) {
+            count = 0;
+            break;
+        }
+        size_t key_len = strlen(key), value_len = value ? strlen(value) : 0;
+        kv_encode_batch_entry(buf + off, (uint16_t)key_len, (uint32_t)value_len);
+        off += KV_BATCH_REQ_ENTRY_SIZE;
+        memcpy(buf + off, key, key_len);
+        off += key_len;
+        if (value_len) memcpy(buf + off, value, value_len);
+        off += value_len;
+        count++;
+    }
+    free(copy);
+    if (count == 0) {
+        free(buf);
+        return NULL;
+    }
+    kv_encode_batch_count(buf, count);
+    *out_len = off;
+    return buf;
+}
+
+// Receives one response. The value is stored in res->data, or written to
+// `out` as it arrives when one is given. Returns 1 on success, 0 if the
+// server closed the connection and -1 on error.
+int recv_response(int sock, enum wire_format wire, client_response *res, FILE *out) {
+    memset(res, 0, sizeof(*res));
+    ssize_t n;
+    if (wire == WIRE_LEGACY) {
+        legacy_job_response legacy;
+        n = recv_all(sock, &legacy, sizeof(legacy));
+        if (n < 0) return -1;
+        if (n < (ssize_t)sizeof(legacy)) return 0;
+        res->type = legacy.type;
+        res->status = legacy.status;
+        res->error = legacy.error;
+        res->data_len = legacy.data_len > 0 ? (uint32_t)legacy.data_len : 0;
+    } else {
+        uint8_t frame[KV_FRAME_HEADER_SIZE];
+        kv_response_header hdr;
+        n = recv_all(sock, frame, sizeof(frame));
+        if (n < 0) return -1;
+        if (n < (ssize_t)sizeof(frame)) return 0;
+        if (kv_decode_response_header(frame, &hdr) != 0) {
+            fprintf(stderr, "Error: malformed response from server\n");
+            return -1;
+        }
+        res->type = hdr.opcode;
+        res->status = hdr.status;
+        res->error = hdr.error;
+        res->request_id = hdr.request_id;
+        res->data_len = hdr.value_len;
+    }
+
+    // Value bytes follow the response header
+    if (res->data_len > 0 && out) {
+        char *chunk = malloc(STREAM_CHUNK);
+        if (!chunk) return -1;
+        uint32_t left = res->data_len;
+        while (left > 0) {
+            size_t want = left < STREAM_CHUNK ? left : STREAM_CHUNK;
+            ssize_t got = recv_all(sock, chunk, want);
+            if (got > 0 && fwrite(chunk, 1, (size_t)got, out) != (size_t)got) got = -1;
+            if (got != (ssize_t)want) {
+                free(chunk);
+                return got < 0 ? -1 : 0;
+            }
+            left -= (uint32_t)want;
+        }
+        free(chunk);
+    } else if (res->data_len > 0) {
+        res->data = malloc(res->data_len);
+        if (!res->data) return -1;
+        if (recv_all(sock, res->data, res->data_len) != (ssize_t)res->data_len) {
+            free(res->data);
+            res->data = NULL;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void print_job_response(const client_response *res) {
     printf("Job Response:\n");
     printf("  Type: %d\n", res->type);
     printf("  Status: %d\n", res->status);
     printf("  Error: %d\n", res->error);
-    printf("  Data Length: %d\n", res->data_len);
+    printf("  Request ID: %u\n", res->request_id);
+    printf("  Data Length: %u\n", res->data_len);
     if (res->data && res->data_len > 0) {
-        printf("  Data: %.*s\n", res->data_len, res->data);
+        printf("  Data: %.*s\n", (int)res->data_len, res->data);
     }
     printf("\n");
 }
 
+static const char * job_type_name(int type) {
+    switch (type) {
+        case PUT:    return "put";
+        case GET:    return "get";
+        case DELETE: return "delete";
+        case MGET:    return "mget";
+        case MPUT:    return "mput";
+        case MDELETE: return "mdelete";
+        case STATS:   return "stats";
+        default:     return "?";
+    }
+}
+
+// Splits "put <key> <value>", "get <key>" or "delete <key>". The value is
+// the rest of the line and may contain spaces. For mput/mget/mdelete the
+// whole argument list is returned in `key`. Returns 0 on success.
+int parse_batch_line(char *line, enum job_type *type, char **key, char **value) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char *op = strtok(line, " ");
+    char *args = strtok(NULL, "");
+    if (!op || !args) return -1;
+    *value = NULL;
+    if (strcmp(op, "mget") == 0 || strcmp(op, "mput") == 0 || strcmp(op, "mdelete") == 0) {
+        *type = op[1] == 'g' ? MGET : (op[1] == 'p' ? MPUT : MDELETE);
+        *key = args;
+        return 0;
+    }
+    *key = strtok(args, " ");
+    *value = strtok(NULL, "");
+    if (!*key) return -1;
+    if (strcmp(op, "put") == 0) {
+        *type = PUT;
+        return *value ? 0 : -1;
+    }
+    if (strcmp(op, "get") == 0) *type = GET;
+    else if (strcmp(op, "delete") == 0) *type = DELETE;
+    else return -1;
+    *value = NULL;
+    return 0;
+}
+
+// Prints one line per key of a multi-key response. Returns the number of
+// keys that failed.
+int print_batch_response(const pending_request *req, const client_response *res) {
+    const uint8_t *p = (const uint8_t *)res->data;
+    if (!p || res->data_len < KV_BATCH_COUNT_SIZE) return 1;
+    uint32_t count = kv_decode_batch_count(p);
+    size_t off = KV_BATCH_COUNT_SIZE;
+    char *copy = strdup(req->key);
+    char *save = NULL;
+    char *key = copy ? strtok_r(copy, " ", &save) : NULL;
+    int failures = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t error;
+        uint32_t value_len;
+        if (res->data_len - off < KV_BATCH_RES_ENTRY_SIZE) break;
+        kv_decode_batch_result(p + off, &error, &value_len);
+        off += KV_BATCH_RES_ENTRY_SIZE;
+        if (res->data_len - off < value_len) break;
+        if (error == NO_ERROR) {
+            printf("  %s OK", key ? key : "?");
+            if (req->type == MGET) printf(" %.*s", (int)value_len, (const char *)p + off);
+            printf("\n");
+        } else {
+            printf("  %s FAILED (error %d)\n", key ? key : "?", error);
+            failures++;
+        }
+        off += value_len;
+        if (key) key = strtok_r(NULL, " ", &save);
+        // mput arguments alternate keys and values
+        if (key && req->type == MPUT) key = strtok_r(NULL, " ", &save);
+    }
+    free(copy);
+    return failures;
+}
+
+// Reads commands from stdin and keeps up to `depth` of them in flight.
+// Responses may arrive in any order and are matched by request id.
+// Returns the number of failed requests, or -1 on a connection error.
+int run_batch(int sock, int depth, uint8_t flags) {
+    pending_request *pending = calloc((size_t)depth, sizeof(pending_request));
+    if (!pending) return -1;
+    char *line = NULL;
+    size_t line_cap = 0;
+    uint32_t next_id = 1;
+    int in_flight = 0, eof = 0, failures = 0, rc = 0;
+
+    while (!eof || in_flight > 0) {
+        // Fill the pipeline
+        while (!eof && in_flight < depth) {
+            enum job_type type;
+            char *key, *value;
+            if (getline(&line, &line_cap, stdin) < 0) {
+                eof = 1;
+                break;
+            }
+            if (parse_batch_line(line, &type, &key, &value) != 0) {
+                if (line[0] != '\0') fprintf(stderr, "Skipping invalid command: %s\n", line);
+                continue;
+            }
+            int slot = 0;
+            while (pending[slot].request_id != 0) slot++;
+            int sent;
+            if (kv_is_batch_type(type)) {
+                size_t payload_len = 0;
+                uint8_t *payload = encode_batch_payload(type, key, &payload_len);
+                if (!payload) {
+                    fprintf(stderr, "Skipping invalid %s arguments: %s\n", job_type_name(type), key);
+                    continue;
+                }
+                sent = send_frame(sock, type, "", 0, (const char *)payload, payload_len, next_id, flags);
+                free(payload);
+            } else {
+                sent = send_request(sock, WIRE_FRAMED, type, key, value, next_id, flags);
+            }
+            if (sent < 0) {
+                perror("send");
+                rc = -1;
+                goto out;
+            }
+            pending[slot].request_id = next_id++;
+            pending[slot].type = type;
+            pending[slot].key = strdup(key);
+            in_flight++;
+        }
+        if (in_flight == 0) break;
+
+        // Collect responses; progress notifications are skipped
+        client_response res;
+        int n = recv_response(sock, WIRE_FRAMED, &res, NULL);
+        if (n <= 0) {
+            if (n < 0) perror("recv");
+            else printf("Server closed connection\n");
+            rc = -1;
+            goto out;
+        }
+        if (res.status == COMPLETED || res.status == FAILED) {
+            for (int i = 0; i < depth; i++) {
+                if (pending[i].request_id != res.request_id) continue;
+                if (res.status == COMPLETED && kv_is_batch_type(pending[i].type)) {
+                    printf("%u %s OK\n", res.request_id, job_type_name(pending[i].type));
+                    failures += print_batch_response(&pending[i], &res);
+                } else if (res.status == COMPLETED) {
+                    printf("%u %s %s OK", res.request_id, job_type_name(pending[i].type), pending[i].key);
+                    if (res.data) printf(" %.*s", (int)res.data_len, res.data);
+                    printf("\n");
+                } else {
+                    printf("%u %s %s FAILED (error %d)\n", res.request_id,
+                           job_type_name(pending[i].type), pending[i].key, res.error);
+                    failures++;
+                }
+                free(pending[i].key);
+                pending[i].key = NULL;
+                pending[i].request_id = 0;
+                in_flight--;
+                break;
+            }
+        }
+        free(res.data);
+    }
+
+out:
+    for (int i = 0; i < depth; i++) free(pending[i].key);
+    free(pending);
+    free(line);
+    return rc < 0 ? rc : failures;
+}
+
+// Sends STATS and copies the metrics text to stdout. Returns 0 on success.
+static int run_stats(int sock, uint32_t request_id) {
+    if (send_request(sock, WIRE_FRAMED, STATS, "", NULL, request_id, 0) < 0) {
+        perror("send");
+        return -1;
+    }
+    client_response res;
+    int rc = recv_response(sock, WIRE_FRAMED, &res, NULL);
+    if (rc <= 0) {
+        if (rc < 0) perror("recv");
+        else fprintf(stderr, "Server closed connection\n");
+        return -1;
+    }
+    if (res.status != COMPLETED) {
+        fprintf(stderr, "Error: stats request failed (error %d)\n", res.error);
+        free(res.data);
+        return -1;
+    }
+    fwrite(res.data, 1, res.data_len, stdout);
+    free(res.data);
+    return 0;
+}
+
 int main(int argc, char **argv) {
-    char *server_ip = NULL;
-    int server_port = 0;
-    enum job_type type = INVALID_TYPE;
-    char *key = NULL;
-    char *value = NULL;
-    job_request *req = NULL;
-    struct timespec delay;
-    delay.tv_sec = 0; // Seconds
-    delay.tv_nsec = 100000000; //100ms
-
-    int parse_result = parse_and_validate(argc, argv, &server_ip, &server_port, &type, &key, &value);
+    client_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.type = INVALID_TYPE;
+    opts.wire = WIRE_FRAMED;
+    opts.pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+    const uint32_t request_id = 1;
+
+    int parse_result = parse_and_validate(argc, argv, &opts);
     if (parse_result != 0) {
         if (parse_result > 0) {
             return 1; // error
@@ -173,78 +696,82 @@ int main(int argc, char **argv) {
         return 0; // help printed
     }
 
-    req = job_request_init(type, key, value);
-    if (!req) return 1;
-    
-    int sock = connect_to_server(server_ip, server_port);
+    int sock = connect_to_server(opts.server_ip, opts.server_port);
     if (sock < 0) {
-        job_request_free(req);
         return 1;
     }
+
+    if (opts.batch) {
+        int failures = run_batch(sock, opts.pipeline_depth, opts.flags);
+        close(sock);
+        return failures == 0 ? 0 : 1;
+    }
+    if (opts.type == STATS) {
+        int failed = run_stats(sock, request_id);
+        close(sock);
+        return failed ? 1 : 0;
+    }
     
-    // Send request
-    if (send(sock, req, sizeof(job_request), 0) < 0) {
-        perror("send");
+    FILE *out = NULL;
+    if (opts.output && !(out = fopen(opts.output, "wb"))) {
+        perror(opts.output);
         close(sock);
-        job_request_free(req);
         return 1;
     }
 
-    // Read multiple responses until job is completed or failed
-    job_response *res = job_response_init(type);
-    if (!res) {
-        perror("Failed to allocate response");
+    // Send request
+    int sent = opts.value_file ? send_file_frame(sock, opts.key, opts.value_file, request_id, opts.flags)
+                               : send_request(sock, opts.wire, opts.type, opts.key, opts.value, request_id, opts.flags);
+    if (sent < 0) {
+        perror("send");
+        if (out) fclose(out);
         close(sock);
-        job_request_free(req);
         return 1;
     }
-    
-    ssize_t n;
+
+    // Read responses until the job is completed or failed
+    client_response res;
     int response_count = 0;
     
     printf("Waiting for job responses...\n");
     
     while (1) {
-        // Clear the response structure for each new response
-        memset(res, 0, sizeof(job_response));
-        res->type = type;
-        
-        n = recv(sock, res, sizeof(job_response), 0);
-        if (n < 0) {
+        int rc = recv_response(sock, opts.wire, &res, out);
+        if (rc < 0) {
             perror("recv");
             break;
         }
-        if (n == 0) {
+        if (rc == 0) {
             printf("Server closed connection\n");
             break;
         }
         
         response_count++;
         printf("Received response %d:\n", response_count);
-        print_job_response(res);
+        print_job_response(&res);
+        if (out && res.status == COMPLETED && res.data_len > 0) {
+            printf("Value written to %s\n", opts.output);
+        }
+        free(res.data);
         
         // Check if job is completed or failed
-        if (res->status == COMPLETED) {
+        if (res.status == COMPLETED) {
             printf("Job completed successfully!\n");
             break;
-        } else if (res->status == FAILED) {
+        } else if (res.status == FAILED) {
             printf("Job failed!\n");
             break;
-        } else if (res->status == PROCESSING) {
+        } else if (res.status == PROCESSING) {
             printf("Job is still processing...\n");
-        } else if (res->status == SUBMITTED) {
+        } else if (res.status == SUBMITTED) {
             printf("Job has been submitted...\n");
         }
-        
-        // Small delay to avoid busy waiting
-        nanosleep(&delay, NULL); // 100ms
     }
     
     printf("Total responses received: %d\n", response_count);
     
     // Cleanup
-    job_response_free(res);
-    job_request_free(req);
+    if (out) fclose(out);
     close(sock);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,54 +1,9 @@
+#define _GNU_SOURCE
 #include "keystored.h"
 
 static job_queue *g_job_queue = NULL;
 int keep_running = 1;
-storage_state_t g_storage;
-
-// Safe pointer to the start of the superblock memory (block 0)
-static inline uint8_t * sb_block_ptr(storage_state_t *st) { 
-    return st ? (uint8_t*)st->mapped_ptr : NULL; 
-}
-
-// Forward declarations
-static inline uint8_t * block_ptr(storage_state_t *state, uint32_t block_index);
-static int hash_buckets_block_init(storage_state_t *st, uint32_t bucket_count);
-
-// Forward declaration of functions
-// Initialize bucket block on first create
-static int hash_buckets_block_init(storage_state_t *st, uint32_t bucket_count) {
-    if (!st) return -1;
-    // allocate a block to hold buckets
-    uint32_t blk = 0;
-    if (storage_block_alloc(st, &blk) != 0) return -1;
-    uint32_t *arr = (uint32_t*)block_ptr(st, blk);
-    if (!arr) { storage_block_free(st, blk); return -1; }
-    size_t need = (size_t)bucket_count * sizeof(uint32_t);
-    if (need > st->super.block_size) { storage_block_free(st, blk); return -1; }
-    memset(arr, 0, need);
-    msync(arr, need, MS_SYNC);
-    // record in superblock
-    keystore_super_block_t *sb = (keystore_super_block_t*)sb_block_ptr(st);
-    sb->hash_bucket_count = bucket_count;
-    sb->hash_buckets_block = blk;
-    msync(sb, sizeof(*sb), MS_SYNC);
-    st->super.hash_bucket_count = bucket_count;
-    st->super.hash_buckets_block = blk;
-    return 0;
-}
-
-// ---------------- Free-list management ----------------
-//   - Block 0 is the superblock (never on free list)
-//   - For each FREE block i (i >= 1), the first 4 bytes store `next_free_block_index` (uint32_t)
-//   - The superblock stores the head of the free list and the free block count
-
-// Returns a pointer to the beginning of the block within the mmap, or NULL on error.
-static uint8_t * block_ptr(storage_state_t *state, uint32_t block_index){
-    if (!state || !state->mapped_ptr) return NULL;
-    if (block_index >= state->super.num_blocks) return NULL;
-    size_t offset = (size_t)block_index * (size_t)state->super.block_size;
-    if (offset + sizeof(uint32_t) > state->mapped_size) return NULL;
-    return (uint8_t*)state->mapped_ptr + offset;
-}
+kv_shards g_shards;
 
 void handle_signal(int sig) {
     if (sig == SIGTERM || sig == SIGINT) {
@@ -65,6 +20,12 @@ int create_socket(const char *bind_ip, int port) {
     }
     int one = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // Every reactor binds its own listener to the same port
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        syslog(LOG_ERR, "keystored::failed to set SO_REUSEPORT");
+        close(sockfd);
+        return -1;
+    }
 
     struct sockaddr_in addr;
     memset(&addr,0,sizeof(addr));
@@ -94,330 +55,800 @@ int create_epoll(void) {
     return epollfd;
 }
 
-int storage_open_or_create(const char *path,
-                           uint32_t default_block_size,
-                           uint32_t default_num_blocks,
-                           storage_state_t *out_state) {
-    if (!out_state) return -1;
-    memset(out_state, 0, sizeof(*out_state));
+void add_epoll_fd(int epfd, int fd, void *ptr, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = ptr;
+    ev.events = events;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        syslog(LOG_ERR, "keystored::failed to add fd to epoll");
+    }
+}
 
-    int fd = open(path, O_RDWR | O_CLOEXEC);
-    if (fd < 0 && errno == ENOENT) {
-        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
-        if (fd < 0) {
-            syslog(LOG_ERR, "keystored::storage create failed: %m");
-            return -1;
-        }
-        // Compute total size and resize
-        uint64_t total_size = (uint64_t)default_block_size * (uint64_t)default_num_blocks;
-        if (ftruncate(fd, (off_t)total_size) != 0) {
-            syslog(LOG_ERR, "keystored::ftruncate failed: %m");
-            close(fd);
-            return -1;
+void remove_epoll_fd(int epfd, int fd) {
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        syslog(LOG_ERR, "keystored::failed to remove fd from epoll");
+    }
+}
+
+// Accept new client connection
+int accept_client(int listen_socket, client_connection_t **client) {
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    
+    // Non-blocking: the reactor never waits for a client's socket
+    int client_fd = accept4(listen_socket, (struct sockaddr*)&client_addr, &addr_len,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0; // No pending connections
         }
+        syslog(LOG_ERR, "keystored::failed to accept client connection");
+        return -1;
+    }
+    
+    // Allocate client connection structure
+    *client = connection_create(client_fd, &client_addr);
+    if (!*client) {
+        syslog(LOG_ERR, "keystored::failed to allocate client connection");
+        close(client_fd);
+        return -1;
+    }
+    
+    syslog(LOG_DEBUG, "keystored::accepted client connection from %s:%d", 
+           (*client)->client_ip, (*client)->port);
+    
+    return 1;
+}
+
+// Starts streaming the value of a large PUT into the engine. Only the frame
+// header and key are consumed here. A worker reserves the space, since that
+// may grow the image; the value bytes are then fed to the upload as they
+// arrive and the request is submitted once the last one is in.
+static job_request * upload_begin(client_connection_t *client, const kv_request_header *hdr, const char *key) {
+    job_request *req = job_request_init(PUT, key, hdr->key_len, NULL, 0);
+    if (!req) return NULL;
+    // Zeroed, it can be aborted before it was begun
+    req->stream = calloc(1, sizeof(kv_put_stream));
+    job *begin = req->stream ? job_alloc(req) : NULL;
+    if (!begin) {
+        job_request_free(req);
+        return NULL;
+    }
+    req->request_id = hdr->request_id;
+    req->flags = hdr->opcode & ~KV_OPCODE_MASK;
+    req->value_len = hdr->value_len;
+    client->upload = req;
+    client->upload_left = hdr->value_len;
+    client->upload_ready = 0;
+    connection_get(client);
+    begin->client = client;
+    begin->shards = &g_shards;
+    begin->starts_upload = 1;
+    job_push(g_job_queue, begin);
+    return req;
+}
+
+// Whether the client's upload still waits for a worker to reserve its space
+static int upload_waiting(client_connection_t *client) {
+    return client->upload && !__atomic_load_n(&client->upload_ready, __ATOMIC_ACQUIRE);
+}
+
+// Parses one request out of `buf`. Returns 1 and sets `consumed` when a
+// whole request was decoded, 0 if more bytes are needed and -1 on a
+// malformed frame. A started upload is consumed without a request.
+static int parse_request(client_connection_t *client, const uint8_t *buf, size_t avail,
+                         size_t *consumed, job_request **out_req) {
+    // The first byte of a connection decides framed vs legacy format
+    if (client->wire == WIRE_UNKNOWN) {
+        client->wire = (buf[0] == KV_FRAME_MAGIC) ? WIRE_FRAMED : WIRE_LEGACY;
+    }
 
-        // Map and write superblock
-        void *map = mmap(NULL, (size_t)total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        if (map == MAP_FAILED) {
-            syslog(LOG_ERR, "keystored::mmap failed: %m");
-            close(fd);
+    job_request *req = NULL;
+    if (client->wire == WIRE_LEGACY) {
+        // Compatibility mode: one whole legacy struct per request
+        if (avail < sizeof(legacy_job_request)) return 0;
+        legacy_job_request legacy;
+        memcpy(&legacy, buf, sizeof(legacy));
+        req = job_request_init(legacy.type,
+                               legacy.key, strnlen(legacy.key, MAX_KEY_LENGTH),
+                               legacy.value, strnlen(legacy.value, MAX_VALUE_LENGTH));
+        // Legacy clients keep receiving every status change
+        if (req) req->flags = KV_FLAG_PROGRESS;
+        *consumed = sizeof(legacy);
+    } else {
+        if (avail < KV_FRAME_HEADER_SIZE) return 0;
+        kv_request_header hdr;
+        if (kv_decode_request_header(buf, &hdr) != 0 || hdr.value_len > KV_MAX_VALUE_LENGTH) {
+            syslog(LOG_WARNING, "keystored::malformed frame from client %s:%d", 
+                   client->client_ip, client->port);
             return -1;
         }
-        keystore_super_block_t *sb = (keystore_super_block_t *)map;
-        memset(sb, 0, sizeof(*sb));
-        sb->magic = KEYSTORE_MAGIC;
-        sb->version = KEYSTORE_VERSION;
-        sb->total_size = total_size;
-        sb->block_size = default_block_size;
-        sb->num_blocks = default_num_blocks;
-        sb->free_list_head_block = 0;
-        sb->free_block_count = 0;
-        msync(map, sizeof(*sb), MS_SYNC);
-
-        out_state->fd = fd;
-        out_state->mapped_ptr = map;
-        out_state->mapped_size = (size_t)total_size;
-        out_state->super = *sb;
-        pthread_mutex_init(&out_state->freelist_mutex, NULL);
-        // Format the free list now that the file exists
-        freelist_format(out_state);
-        return 0;
-    } else if (fd < 0) {
-        syslog(LOG_ERR, "keystored::storage open failed: %m");
+        const char *key = (const char *)buf + KV_FRAME_HEADER_SIZE;
+        if ((hdr.opcode & KV_OPCODE_MASK) == PUT && hdr.value_len > REACTOR_STREAM_MIN_VALUE) {
+            size_t head_len = KV_FRAME_HEADER_SIZE + (size_t)hdr.key_len;
+            if (avail < head_len) {
+                client->rbuf_need = head_len;
+                return 0;
+            }
+            if (!upload_begin(client, &hdr, key)) {
+                syslog(LOG_ERR, "keystored::failed to allocate job request");
+                return -1;
+            }
+            *consumed = head_len;
+            *out_req = NULL;
+            return 1;
+        }
+        size_t frame_len = KV_FRAME_HEADER_SIZE + (size_t)hdr.key_len + (size_t)hdr.value_len;
+        if (avail < frame_len) {
+            client->rbuf_need = frame_len;
+            return 0;
+        }
+        req = job_request_init((enum job_type)(hdr.opcode & KV_OPCODE_MASK), key, hdr.key_len,
+                               key + hdr.key_len, hdr.value_len);
+        if (req) {
+            req->request_id = hdr.request_id;
+            req->flags = hdr.opcode & ~KV_OPCODE_MASK;
+        }
+        *consumed = frame_len;
+    }
+    if (!req) {
+        syslog(LOG_ERR, "keystored::failed to allocate job request");
         return -1;
     }
+    *out_req = req;
+    return 1;
+}
 
-    // Existing file: map and validate superblock
-    struct stat st;
-    if (fstat(fd, &st) != 0) {
-        syslog(LOG_ERR, "keystored::fstat failed: %m");
-        close(fd);
-        return -1;
+// Requests that only touch one small record are cheaper to run here than
+// to hand to another thread. Progress notifications need the queue, and
+// multi-key requests touch many buckets, so they go to the workers, as does
+// STATS, which merges every thread's histograms. So do updates while their
+// shard's log buffer is full, which only a worker may wait on.
+static void reactor_flush_outbox(reactor_t *reactor);
+static void reactor_watch(reactor_t *reactor, client_connection_t *client);
+static void reactor_pause(reactor_t *reactor, client_connection_t *client);
+
+static int runs_inline(const job_request *req) {
+    if (req->value_len > REACTOR_INLINE_MAX_VALUE || (req->flags & KV_FLAG_PROGRESS) ||
+        kv_is_batch_type(req->type) || req->type == STATS) {
+        return 0;
     }
-    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (map == MAP_FAILED) {
-        syslog(LOG_ERR, "keystored::mmap failed: %m");
-        close(fd);
+    if (req->type == GET) return 1;
+    kv_engine_t *engine = kv_shards_route(&g_shards, req->key, req->key_len);
+    return !wal_full(engine->storage->wal);
+}
+
+// Wraps a decoded request into a job and either runs it on the reactor or
+// submits it to the queue
+static int submit_request(reactor_t *reactor, client_connection_t *client, job_request *req) {
+    // Create job and response from request
+    job *new_job = job_alloc(req);
+    if (!new_job) {
+        syslog(LOG_ERR, "keystored::failed to allocate job");
+        job_request_free(req);
         return -1;
     }
-    keystore_super_block_t *sb = (keystore_super_block_t *)map;
-    if (sb->magic != KEYSTORE_MAGIC || sb->version != KEYSTORE_VERSION) {
-        syslog(LOG_ERR, "keystored::invalid superblock (magic=%u version=%u)", sb->magic, sb->version);
-        munmap(map, (size_t)st.st_size);
-        close(fd);
-        return -1;
+    
+    connection_get(client);
+    new_job->client = client;
+    new_job->shards = &g_shards;
+    new_job->recv_ns = metrics_now();
+    if (runs_inline(req)) {
+        // Replied to when the reactor flushes its outbox
+        update_job_status(new_job, PROCESSING);
+        new_job->on_reactor = 1;
+        process_job(new_job);
+        new_job->on_reactor = 0;
+        if (!new_job->deferred) {
+            // Flushed here rather than by job_outbox_add(), which would not
+            // watch the clients left with a backlog
+            if (reactor->outbox.count == JOB_OUTBOX_SIZE - 1) reactor_flush_outbox(reactor);
+            job_outbox_add(&reactor->outbox, new_job);
+            return 0;
+        }
+        // Turned out to need a worker (a large GET value, or a PUT that
+        // found no free block)
+        new_job->deferred = 0;
     }
-    out_state->fd = fd;
-    out_state->mapped_ptr = map;
-    out_state->mapped_size = (size_t)st.st_size;
-    out_state->super = *sb;
-    pthread_mutex_init(&out_state->freelist_mutex, NULL);
+    // Submit job to queue; a progress notification may not fit the socket
+    job_push(g_job_queue, new_job);
+    reactor_watch(reactor, client);
     return 0;
 }
 
-void storage_close(storage_state_t *state){
-    if (!state) return;
-    if (state->mapped_ptr && state->mapped_size) {
-        msync(state->mapped_ptr, state->mapped_size, MS_SYNC);
-        munmap(state->mapped_ptr, state->mapped_size);
-    }
-    if (state->fd > 0) close(state->fd);
-    pthread_mutex_destroy(&state->freelist_mutex);
-    memset(state, 0, sizeof(*state));
+// Value bytes of the current upload have arrived; submits the PUT once the
+// value is complete
+static int upload_received(reactor_t *reactor, client_connection_t *client, size_t len) {
+    client->upload_left -= len;
+    if (client->upload_left > 0) return 0;
+    job_request *req = client->upload;
+    client->upload = NULL;
+    return submit_request(reactor, client, req);
 }
 
-void storage_print_superblock_ascii(const storage_state_t *state){
-    if (!state) return;
-    const keystore_super_block_t *sb = &state->super;
-    printf("+----------------------+------------------------------+\n");
-    printf("| %-20s | %-28s |\n", "Field", "Value");
-    printf("+----------------------+------------------------------+\n");
-    printf("| %-20s | 0x%08X                   |\n", "magic", sb->magic);
-    printf("| %-20s | %10u                    |\n", "version", sb->version);
-    printf("| %-20s | %10llu bytes          |\n", "total_size", (unsigned long long)sb->total_size);
-    printf("| %-20s | %10u bytes/block     |\n", "block_size", sb->block_size);
-    printf("| %-20s | %10u blocks          |\n", "num_blocks", sb->num_blocks);
-    printf("| %-20s | %10u (block index)  |\n", "free_head", sb->free_list_head_block);
-    printf("| %-20s | %10u blocks          |\n", "free_count", sb->free_block_count);
-    printf("+----------------------+------------------------------+\n");
+// Dispatches every complete request in the read buffer and keeps the
+// trailing partial one at the front of the buffer.
+static int dispatch_buffered_requests(reactor_t *reactor, client_connection_t *client) {
+    size_t off = 0;
+    while (off < client->rbuf_len && !client->read_paused) {
+        if (client->upload) {
+            size_t len = client->rbuf_len - off;
+            if (len > client->upload_left) len = client->upload_left;
+            kv_engine_put_write(client->upload->stream, client->rbuf + off, len);
+            off += len;
+            if (upload_received(reactor, client, len) < 0) return -1;
+            continue;
+        }
+        size_t consumed = 0;
+        job_request *req = NULL;
+        int rc = parse_request(client, (const uint8_t *)client->rbuf + off,
+                               client->rbuf_len - off, &consumed, &req);
+        if (rc < 0) return -1;
+        if (rc == 0) break;
+        off += consumed;
+        client->rbuf_need = 0;
+        if (req && submit_request(reactor, client, req) < 0) return -1;
+        // An upload just began: its value waits until a worker made room
+        if (!req && client->upload) reactor_pause(reactor, client);
+    }
+    if (off > 0) {
+        memmove(client->rbuf, client->rbuf + off, client->rbuf_len - off);
+        client->rbuf_len -= off;
+    }
+    return 0;
 }
 
+// Makes room for at least CLIENT_READ_CHUNK more bytes, or for the whole
+// pending frame when its size is already known.
+static int reserve_read_buffer(client_connection_t *client) {
+    size_t want = client->rbuf_len + CLIENT_READ_CHUNK;
+    if (client->rbuf_need > want) want = client->rbuf_need;
+    if (want <= client->rbuf_cap) return 0;
 
+    size_t cap = client->rbuf_cap ? client->rbuf_cap : CLIENT_READ_CHUNK;
+    while (cap < want) cap *= 2;
+    char *buf = realloc(client->rbuf, cap);
+    if (!buf) {
+        syslog(LOG_ERR, "keystored::failed to grow read buffer for client %s:%d", 
+               client->client_ip, client->port);
+        return -1;
+    }
+    client->rbuf = buf;
+    client->rbuf_cap = cap;
+    return 0;
+}
 
-// Small helpers to read/write the `next` pointer inside a block
-static inline int freelist_read_next(storage_state_t *state, uint32_t block_index, uint32_t *out_next){
-    void *ptr = block_ptr(state, block_index);
-    if (!ptr || !out_next) return -1;
-    memcpy(out_next, ptr, sizeof(uint32_t));
+// Handle client job requests. The socket is edge-triggered, so it is read
+// until EAGAIN and every complete request is dispatched as it arrives.
+// While a large value is streamed in, it is received straight into its
+// place in the image.
+int handle_client_request(reactor_t *reactor, client_connection_t *client) {
+    while (!client->read_paused) {
+        size_t room = 0;
+        char *direct = (client->upload && client->rbuf_len == 0)
+                       ? kv_engine_put_window(client->upload->stream, &room) : NULL;
+        char *dst = direct;
+        if (direct) {
+            if (room > client->upload_left) room = client->upload_left;
+        } else {
+            if (reserve_read_buffer(client) < 0) return -1;
+            dst = client->rbuf + client->rbuf_len;
+            room = client->rbuf_cap - client->rbuf_len;
+        }
+        ssize_t bytes_received = recv(client->fd, dst, room, MSG_DONTWAIT);
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0; // Drained
+            }
+            syslog(LOG_ERR, "keystored::failed to receive from client %s:%d", 
+                   client->client_ip, client->port);
+            return -1;
+        }
+        if (bytes_received == 0) {
+            syslog(LOG_DEBUG, "keystored::client %s:%d disconnected", 
+                   client->client_ip, client->port);
+            return -1;
+        }
+        if (direct) {
+            kv_engine_put_advance(client->upload->stream, (size_t)bytes_received);
+            if (upload_received(reactor, client, (size_t)bytes_received) < 0) return -1;
+            continue;
+        }
+        client->rbuf_len += (size_t)bytes_received;
+        if (dispatch_buffered_requests(reactor, client) < 0) return -1;
+    }
     return 0;
 }
 
-static inline int freelist_write_next(storage_state_t *state, uint32_t block_index, uint32_t next_index){
-    void *ptr = block_ptr(state, block_index);
-    if (!ptr) return -1;
-    memcpy(ptr, &next_index, sizeof(uint32_t));
+// Bytes the io_uring backend received for `client` into one of its
+// buffers: value bytes of an upload go straight into the engine, anything
+// else through the read buffer.
+static int handle_client_data(reactor_t *reactor, client_connection_t *client, const char *data, size_t len) {
+    while (len > 0) {
+        // A paused client's bytes wait in the read buffer
+        if (client->upload && client->rbuf_len == 0 && !client->read_paused) {
+            size_t n = len < client->upload_left ? len : client->upload_left;
+            kv_engine_put_write(client->upload->stream, data, n);
+            data += n;
+            len -= n;
+            if (upload_received(reactor, client, n) < 0) return -1;
+            continue;
+        }
+        // A receive never exceeds CLIENT_READ_CHUNK, which this always fits
+        if (reserve_read_buffer(client) < 0) return -1;
+        memcpy(client->rbuf + client->rbuf_len, data, len);
+        client->rbuf_len += len;
+        return dispatch_buffered_requests(reactor, client);
+    }
     return 0;
 }
 
-// Formats the free list over data blocks [1 .. num_blocks-1].
-// This is called when creating a brand new storage image.
-int freelist_format(storage_state_t *state){
-    if (!state || !state->mapped_ptr) return -1;
-    const uint32_t first_data = 1;
-    const uint32_t last_data = (state->super.num_blocks == 0) ? 0 : (state->super.num_blocks - 1);
+// Clean up client connection
+void cleanup_client(client_connection_t *client) {
+    if (client) {
+        // An unfinished upload gives its extents back
+        job_request_free(client->upload);
+        client->upload = NULL;
+        // Jobs still in flight keep the connection alive until they finish
+        connection_shutdown(client);
+        connection_put(client);
+    }
+}
 
-    // Make a simple chain: i -> i+1, last -> 0 (end)
-    for (uint32_t i = first_data; i <= last_data; i++) {
-        uint32_t next = (i < last_data) ? (i + 1) : 0;
-        if (freelist_write_next(state, i, next) != 0) return -1;
+int reactor_init(reactor_t *reactor, int id, int cpu, enum io_backend backend,
+                 const char *bind_ip, int port) {
+    memset(reactor, 0, sizeof(*reactor));
+    reactor->id = id;
+    reactor->cpu = cpu;
+    reactor->backend = backend;
+    reactor->epoll_fd = -1;
+    reactor->ring.fd = -1;
+    reactor->listen_fd = create_socket(bind_ip, port);
+    if (reactor->listen_fd < 0) return -1;
+    if (connection_mailbox_init(&reactor->mailbox) != 0) {
+        syslog(LOG_ERR, "keystored::failed to create reactor mailbox: %m");
+        close(reactor->listen_fd);
+        return -1;
+    }
+    if (backend == IO_BACKEND_URING) {
+        // The ring waits for connections itself; a non-blocking listener
+        // would only have it retry
+        fcntl(reactor->listen_fd, F_SETFL, fcntl(reactor->listen_fd, F_GETFL) & ~O_NONBLOCK);
+        if (uring_init(&reactor->ring, URING_SQ_ENTRIES, URING_CQ_ENTRIES) != 0) {
+            syslog(LOG_ERR, "keystored::failed to create io_uring: %m");
+            connection_mailbox_free(&reactor->mailbox);
+            close(reactor->listen_fd);
+            return -1;
+        }
+        if (uring_buf_ring_init(&reactor->ring, &reactor->bufs, URING_BUF_GROUP, URING_BUF_COUNT,
+                                CLIENT_READ_CHUNK) != 0) {
+            syslog(LOG_ERR, "keystored::failed to register receive buffers: %m");
+            uring_free(&reactor->ring);
+            connection_mailbox_free(&reactor->mailbox);
+            close(reactor->listen_fd);
+            return -1;
+        }
+        return 0;
     }
+    reactor->epoll_fd = create_epoll();
+    if (reactor->epoll_fd < 0) {
+        connection_mailbox_free(&reactor->mailbox);
+        close(reactor->listen_fd);
+        return -1;
+    }
+    add_epoll_fd(reactor->epoll_fd, reactor->listen_fd, NULL, EPOLLIN);
+    add_epoll_fd(reactor->epoll_fd, reactor->mailbox.fd, &reactor->mailbox, EPOLLIN);
+    return 0;
+}
 
-    keystore_super_block_t *live_sb = (keystore_super_block_t*)state->mapped_ptr;
-    if (state->super.num_blocks > 1) {
-        live_sb->free_list_head_block = first_data;
-        live_sb->free_block_count = state->super.num_blocks - 1;
+void reactor_close(reactor_t *reactor) {
+    if (reactor->backend == IO_BACKEND_URING) {
+        uring_buf_ring_free(&reactor->ring, &reactor->bufs);
+        uring_free(&reactor->ring);
     } else {
-        live_sb->free_list_head_block = 0;
-        live_sb->free_block_count = 0;
+        close(reactor->epoll_fd);
     }
-    msync(live_sb, sizeof(*live_sb), MS_SYNC);
-    state->super.free_list_head_block = live_sb->free_list_head_block;
-    state->super.free_block_count = live_sb->free_block_count;
-    return 0;
+    close(reactor->listen_fd);
 }
 
-// Pops a block from the free list. Returns 0 on success and writes the block index.
-int storage_block_alloc(storage_state_t *state, uint32_t *out_block_index){
-    if (!state || !out_block_index) return -1;
-    pthread_mutex_lock(&state->freelist_mutex);
+static void uring_arm_accept(reactor_t *reactor) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&reactor->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = reactor->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT_TAG;
+}
 
-    keystore_super_block_t *live_sb = (keystore_super_block_t*)state->mapped_ptr;
-    const uint32_t head = live_sb->free_list_head_block;
-    if (head == 0 || live_sb->free_block_count == 0) {
-        pthread_mutex_unlock(&state->freelist_mutex);
-        return -1; // No free blocks
+// Receives into the reactor's buffer ring until the client goes away or
+// the ring runs dry
+static void uring_arm_recv(reactor_t *reactor, client_connection_t *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&reactor->ring);
+    if (!sqe) {
+        cleanup_client(client);
+        return;
     }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = reactor->bufs.group;
+    sqe->user_data = (uint64_t)(uintptr_t)client;
+    client->recv_armed = 1;
+}
 
-    uint32_t next = 0;
-    if (freelist_read_next(state, head, &next) != 0) {
-        pthread_mutex_unlock(&state->freelist_mutex);
-        return -1;
-    }
+// Wakes the reactor when its mailbox's eventfd is written to
+static void uring_arm_wake(reactor_t *reactor) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&reactor->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = reactor->mailbox.fd;
+    sqe->addr = (uint64_t)(uintptr_t)&reactor->wake_count;
+    sqe->len = sizeof(reactor->wake_count);
+    sqe->user_data = URING_WAKE_TAG;
+}
 
-    live_sb->free_list_head_block = next;
-    live_sb->free_block_count -= 1;
-    msync(live_sb, sizeof(*live_sb), MS_SYNC);
-    state->super.free_list_head_block = live_sb->free_list_head_block;
-    state->super.free_block_count = live_sb->free_block_count;
-    pthread_mutex_unlock(&state->freelist_mutex);
-    *out_block_index = head;
-    return 0;
+// Stops receiving for a paused client; the receive completes with
+// -ECANCELED
+static void uring_cancel_recv(reactor_t *reactor, client_connection_t *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&reactor->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)client;
+    sqe->user_data = URING_CANCEL_TAG;
 }
 
-// Pushes a block back onto the free list (LIFO). Returns 0 on success.
-int storage_block_free(storage_state_t *state, uint32_t block_index){
-    if (!state) return -1;
-    if (block_index == 0 || block_index >= state->super.num_blocks) return -1; 
+// Wakes the reactor once the client's socket takes more of its backlog.
+// The poll holds a reference of its own.
+static void uring_arm_writable(reactor_t *reactor, client_connection_t *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&reactor->ring);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uint64_t)(uintptr_t)client | URING_WRITABLE_BIT;
+    connection_get(client);
+    client->writable_armed = 1;
+}
 
-    pthread_mutex_lock(&state->freelist_mutex);
-    keystore_super_block_t *live_sb = (keystore_super_block_t*)state->mapped_ptr;
+static void uring_accepted(reactor_t *reactor, int client_fd) {
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    memset(&client_addr, 0, sizeof(client_addr));
+    // A multishot accept shares one address buffer between connections
+    getpeername(client_fd, (struct sockaddr *)&client_addr, &addr_len);
+    client_connection_t *client = connection_create(client_fd, &client_addr);
+    if (!client) {
+        syslog(LOG_ERR, "keystored::failed to allocate client connection");
+        close(client_fd);
+        return;
+    }
+    client->mailbox = &reactor->mailbox;
+    syslog(LOG_DEBUG, "keystored::accepted client connection from %s:%d",
+           client->client_ip, client->port);
+    uring_arm_recv(reactor, client);
+}
 
-    // The freed block points to the current head
-    if (freelist_write_next(state, block_index, live_sb->free_list_head_block) != 0) {
-        pthread_mutex_unlock(&state->freelist_mutex);
-        return -1;
+static void uring_received(reactor_t *reactor, client_connection_t *client, const struct io_uring_cqe *cqe) {
+    if (cqe->res > 0) {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        int rc = client->closed ? 0
+               : handle_client_data(reactor, client, uring_buf_ring_buffer(&reactor->bufs, bid), (size_t)cqe->res);
+        uring_buf_ring_recycle(&reactor->bufs, bid);
+        if (rc < 0) connection_shutdown(client);
+    } else if (cqe->res == 0) {
+        syslog(LOG_DEBUG, "keystored::client %s:%d disconnected", client->client_ip, client->port);
+        connection_shutdown(client);
+    } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        if (!client->closed) {
+            syslog(LOG_ERR, "keystored::failed to receive from client %s:%d",
+                   client->client_ip, client->port);
+        }
+        connection_shutdown(client);
     }
-    // Update head and count
-    live_sb->free_list_head_block = block_index;
-    live_sb->free_block_count += 1;
-    msync(live_sb, sizeof(*live_sb), MS_SYNC);
-    state->super.free_list_head_block = live_sb->free_list_head_block;
-    state->super.free_block_count = live_sb->free_block_count;
-    pthread_mutex_unlock(&state->freelist_mutex);
-    return 0;
+    if (cqe->flags & IORING_CQE_F_MORE) return;
+    client->recv_armed = 0;
+    // A paused client is resumed or cleaned up by reactor_send_pending(),
+    // or by reactor_take_mail() once its upload has room.
+    // Otherwise the receive ended for good once the client is gone, or
+    // because the buffers ran out, which the reactor just refilled.
+    if (client->read_paused) return;
+    if (client->closed) cleanup_client(client);
+    else uring_arm_recv(reactor, client);
 }
 
-void add_epoll_fd(int epfd, int fd, void *ptr, uint32_t events) {
-    struct epoll_event ev;
-    memset(&ev, 0, sizeof(ev));
-    ev.data.ptr = ptr;
-    ev.events = events;
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-        syslog(LOG_ERR, "keystored::failed to add fd to epoll");
+// Lists a client whose responses did not all fit its socket, so they are
+// sent once it is writable, and stops reading from it while too many wait
+static void reactor_watch(reactor_t *reactor, client_connection_t *client) {
+    size_t backlog = connection_backlog(client);
+    if (backlog == 0 || client->closed) return;
+    if (!client->pending) {
+        connection_get(client);
+        client->pending = 1;
+        client->next_pending = reactor->pending;
+        reactor->pending = client;
+        if (reactor->backend == IO_BACKEND_URING) uring_arm_writable(reactor, client);
     }
+    if (backlog >= REACTOR_BACKLOG_PAUSE) reactor_pause(reactor, client);
 }
 
-void remove_epoll_fd(int epfd, int fd) {
-    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
-        syslog(LOG_ERR, "keystored::failed to remove fd from epoll");
+// Stops reading from a client until reactor_resume()
+static void reactor_pause(reactor_t *reactor, client_connection_t *client) {
+    if (client->read_paused) return;
+    client->read_paused = 1;
+    if (reactor->backend == IO_BACKEND_URING && client->recv_armed) uring_cancel_recv(reactor, client);
+}
+
+static void reactor_resume(reactor_t *reactor, client_connection_t *client);
+
+// Whether a paused client may be read from again
+static int reactor_may_resume(client_connection_t *client) {
+    return connection_backlog(client) < REACTOR_BACKLOG_PAUSE && !upload_waiting(client);
+}
+
+// Watches the clients whose backlogs workers left, and resumes those whose
+// uploads a worker made room for
+static void reactor_take_mail(reactor_t *reactor) {
+    client_connection_t *client = connection_mailbox_take(&reactor->mailbox);
+    while (client) {
+        client_connection_t *next = connection_mailbox_next(client);
+        reactor_watch(reactor, client);
+        if (client->read_paused && reactor_may_resume(client)) reactor_resume(reactor, client);
+        connection_put(client);
+        client = next;
     }
 }
 
-// Accept new client connection
-int accept_client(int listen_socket, client_connection_t **client) {
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    
-    int client_fd = accept(listen_socket, (struct sockaddr*)&client_addr, &addr_len);
-    if (client_fd < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            return 0; // No pending connections
+// Sets aside the inline updates whose log records are not durable yet; the
+// log writes to the mailbox's eventfd once they are
+static void reactor_park_commits(reactor_t *reactor) {
+    job_outbox *box = &reactor->outbox;
+    int kept = 0;
+    for (int i = 0; i < box->count; i++) {
+        job *j = box->jobs[i];
+        if (j->commit_lsn && wal_durable_notify(j->commit_wal, j->commit_lsn, reactor->mailbox.fd) == 0) {
+            j->next_job = reactor->parked;
+            reactor->parked = j;
+            continue;
         }
-        syslog(LOG_ERR, "keystored::failed to accept client connection");
-        return -1;
+        // A failed log fails the job when it is flushed
+        box->jobs[kept++] = j;
     }
-    
-    // Allocate client connection structure
-    *client = malloc(sizeof(client_connection_t));
-    if (!*client) {
-        syslog(LOG_ERR, "keystored::failed to allocate client connection");
-        close(client_fd);
-        return -1;
+    box->count = kept;
+}
+
+// Replies to the parked updates that became durable and parks the rest again
+static void reactor_unpark(reactor_t *reactor) {
+    job *j = reactor->parked;
+    reactor->parked = NULL;
+    while (j) {
+        job *next = j->next_job;
+        if (reactor->outbox.count == JOB_OUTBOX_SIZE) reactor_flush_outbox(reactor);
+        reactor->outbox.jobs[reactor->outbox.count++] = j;
+        j = next;
     }
-    
-    // Initialize client connection
-    (*client)->fd = client_fd;
-    (*client)->addr = client_addr;
-    inet_ntop(AF_INET, &client_addr.sin_addr, (*client)->client_ip, INET_ADDRSTRLEN);
-    (*client)->port = ntohs(client_addr.sin_port);
-    
-    syslog(LOG_INFO, "keystored::accepted client connection from %s:%d", 
-           (*client)->client_ip, (*client)->port);
-    
-    return 1;
+    if (reactor->outbox.count) reactor_flush_outbox(reactor);
 }
 
-// Handle client job request
-int handle_client_request(client_connection_t *client) {
-    job_request req;
-    ssize_t bytes_received = recv(client->fd, &req, sizeof(job_request), MSG_DONTWAIT);
-    
-    if (bytes_received < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            return 0; // No data available
-        }
-        syslog(LOG_ERR, "keystored::failed to receive from client %s:%d", 
-               client->client_ip, client->port);
-        return -1;
+// Replies to every inline job in the outbox whose changes are durable and
+// watches the clients whose sockets did not take all of it
+static void reactor_flush_outbox(reactor_t *reactor) {
+    reactor_park_commits(reactor);
+    if (reactor->outbox.count == 0) return;
+    client_connection_t *clients[JOB_OUTBOX_SIZE];
+    int count = 0;
+    for (int i = 0; i < reactor->outbox.count; i++) {
+        client_connection_t *client = reactor->outbox.jobs[i]->client;
+        int k = 0;
+        while (k < count && clients[k] != client) k++;
+        if (k < count) continue;
+        // The jobs' references go with them
+        connection_get(client);
+        clients[count++] = client;
     }
-    
-    if (bytes_received == 0) {
-        syslog(LOG_INFO, "keystored::client %s:%d disconnected", 
-               client->client_ip, client->port);
-        return -1;
+    job_outbox_flush(&reactor->outbox);
+    for (int k = 0; k < count; k++) {
+        reactor_watch(reactor, clients[k]);
+        connection_put(clients[k]);
     }
-    
-    if (bytes_received != sizeof(job_request)) {
-        syslog(LOG_WARNING, "keystored::incomplete job request from client %s:%d (expected %zu, got %zd)", 
-               client->client_ip, client->port, sizeof(job_request), bytes_received);
-        return 0;
+}
+
+// Reads from a paused client again, or cleans it up once it is gone
+static void reactor_resume(reactor_t *reactor, client_connection_t *client) {
+    client->read_paused = 0;
+    if (!client->closed && dispatch_buffered_requests(reactor, client) == 0) {
+        if (client->read_paused) return;
+        if (reactor->backend == IO_BACKEND_URING) {
+            if (!client->recv_armed) uring_arm_recv(reactor, client);
+            return;
+        }
+        // Edges that arrived while paused were not read
+        if (handle_client_request(reactor, client) == 0) return;
     }
-    
-    // Create job from request
-    job *new_job = malloc(sizeof(job));
-    if (!new_job) {
-        syslog(LOG_ERR, "keystored::failed to allocate job");
-        return -1;
+    if (reactor->backend == IO_BACKEND_URING) {
+        // An armed receive cleans up when it completes
+        connection_shutdown(client);
+        if (!client->recv_armed) cleanup_client(client);
+        return;
     }
-    
-    // Initialize job
-    new_job->request = malloc(sizeof(job_request));
-    if (!new_job->request) {
-        syslog(LOG_ERR, "keystored::failed to allocate job request");
-        free(new_job);
-        return -1;
+    remove_epoll_fd(reactor->epoll_fd, client->fd);
+    cleanup_client(client);
+}
+
+// Sends what the listed clients' sockets take of their backlogs, resumes
+// reading from those that caught up and drops those that failed
+static void reactor_send_pending(reactor_t *reactor) {
+    // Resumed clients may be listed again while the list is walked
+    client_connection_t *client = reactor->pending;
+    reactor->pending = NULL;
+    while (client) {
+        client_connection_t *next = client->next_pending;
+        int rc = client->closed ? -1 : connection_flush(client);
+        if (rc < 0) connection_shutdown(client);
+        int listed = rc > 0;
+        // Unlisted first: a resumed client may be listed again
+        if (!listed) client->pending = 0;
+        if (client->read_paused && !upload_waiting(client) &&
+            (rc < 0 || connection_backlog(client) < REACTOR_BACKLOG_PAUSE)) {
+            reactor_resume(reactor, client);
+        }
+        if (listed && !client->closed) {
+            if (reactor->backend == IO_BACKEND_URING && !client->writable_armed) {
+                uring_arm_writable(reactor, client);
+            }
+            client->next_pending = reactor->pending;
+            reactor->pending = client;
+        } else {
+            if (listed) client->pending = 0;
+            connection_put(client);
+        }
+        client = next;
     }
-    
-    // Copy request data
-    memcpy(new_job->request, &req, sizeof(job_request));
-    
-    // Create response
-    new_job->response = job_response_init(req.type);
-    if (!new_job->response) {
-        syslog(LOG_ERR, "keystored::failed to create job response");
-        free(new_job->request);
-        free(new_job);
-        return -1;
+    // Replies to what the resumed clients had buffered
+    if (reactor->outbox.count) reactor_flush_outbox(reactor);
+}
+
+static void reactor_uring_loop(reactor_t *reactor) {
+    uring *ring = &reactor->ring;
+    uring_arm_accept(reactor);
+    uring_arm_wake(reactor);
+    while (keep_running) {
+        int rc = uring_submit_and_wait(ring, 1, 250);
+        if (rc < 0 && rc != -ETIME && rc != -EINTR) {
+            syslog(LOG_ERR, "keystored::io_uring_enter failed: %s", strerror(-rc));
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(ring)) != NULL) {
+            if (cqe->user_data == URING_ACCEPT_TAG) {
+                if (cqe->res >= 0) {
+                    uring_accepted(reactor, cqe->res);
+                } else {
+                    syslog(LOG_ERR, "keystored::failed to accept client connection: %s", strerror(-cqe->res));
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE)) uring_arm_accept(reactor);
+            } else if (cqe->user_data == URING_CANCEL_TAG) {
+                // The cancelled receive reports on its own
+            } else if (cqe->user_data == URING_WAKE_TAG) {
+                reactor_take_mail(reactor);
+                reactor_unpark(reactor);
+                uring_arm_wake(reactor);
+            } else if (cqe->user_data & URING_WRITABLE_BIT) {
+                // Sent from by reactor_send_pending() below
+                client_connection_t *client =
+                    (client_connection_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_WRITABLE_BIT);
+                client->writable_armed = 0;
+                connection_put(client);
+            } else {
+                uring_received(reactor, (client_connection_t *)(uintptr_t)cqe->user_data, cqe);
+            }
+            uring_cqe_seen(ring);
+        }
+        if (reactor->outbox.count) reactor_flush_outbox(reactor);
+        if (reactor->pending) reactor_send_pending(reactor);
     }
-    
-    new_job->next_job = NULL;
-    new_job->client_fd = client->fd;
-    // Submit job to queue
-    job_push(g_job_queue, new_job);
-    syslog(LOG_INFO, "keystored::submitted job (type: %d, key: %s) from client %s:%d to queue", 
-           req.type, req.key, client->client_ip, client->port);
-    
-    return 0;
 }
 
-// Clean up client connection
-void cleanup_client(client_connection_t *client) {
-    if (client) {
-        close(client->fd);
-        free(client);
+static void reactor_epoll_loop(reactor_t *reactor) {
+    struct epoll_event events[MAX_EVENT];
+    while (keep_running) {
+        int nfds = epoll_wait(reactor->epoll_fd, events, MAX_EVENT, 250);
+        if (nfds < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "keystored::epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            if (events[i].data.ptr == &reactor->mailbox) {
+                // Drained by the read; posts from here on write it again
+                if (read(reactor->mailbox.fd, &reactor->wake_count, sizeof(reactor->wake_count)) < 0 &&
+                    errno != EAGAIN) {
+                    syslog(LOG_ERR, "keystored::failed to read reactor mailbox: %m");
+                }
+                reactor_take_mail(reactor);
+                reactor_unpark(reactor);
+            } else if (events[i].data.ptr == NULL) {
+                // Listen socket event - accept every pending connection
+                for (;;) {
+                    client_connection_t *new_client = NULL;
+                    int accept_result = accept_client(reactor->listen_fd, &new_client);
+                    if (accept_result > 0 && new_client) {
+                        new_client->mailbox = &reactor->mailbox;
+                        // Writable edges let the reactor send a backlog
+                        add_epoll_fd(reactor->epoll_fd, new_client->fd, new_client,
+                                     EPOLLIN | EPOLLOUT | EPOLLET);
+                        continue;
+                    }
+                    if (accept_result < 0 && new_client) {
+                        cleanup_client(new_client);
+                    }
+                    break;
+                }
+            } else {
+                // Client socket event - run or queue its requests
+                client_connection_t *client = (client_connection_t*)events[i].data.ptr;
+                // Writable edges are for reactor_send_pending(), which also
+                // reads from a paused client once it catches up
+                if (client->read_paused || !(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) continue;
+                int handle_result = handle_client_request(reactor, client);
+
+                if (handle_result < 0) {
+                    // Client error or disconnect - remove from epoll and cleanup
+                    remove_epoll_fd(reactor->epoll_fd, client->fd);
+                    cleanup_client(client);
+                }
+            }
+        }
+        // Replies to everything run inline in this wakeup; updates whose
+        // log records are not durable yet are answered on a later one
+        if (reactor->outbox.count) reactor_flush_outbox(reactor);
+        if (reactor->pending) reactor_send_pending(reactor);
     }
 }
 
+void * reactor_thread(void *arg) {
+    reactor_t *reactor = (reactor_t *)arg;
+    char name[24]; // "reactor-" and any int
+    snprintf(name, sizeof(name), "reactor-%d", reactor->id);
+    metrics_thread_init(name);
+    connection_thread_nonblocking();
+    wal_thread_nonblocking();
+    storage_thread_nonblocking();
+    if (reactor->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(reactor->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            syslog(LOG_WARNING, "keystored::failed to pin reactor %d to cpu %d", reactor->id, reactor->cpu);
+        }
+    }
+    if (reactor->backend == IO_BACKEND_URING) reactor_uring_loop(reactor);
+    else reactor_epoll_loop(reactor);
+    // Nothing else needs the reactor now, so parked replies wait for the log
+    while (reactor->parked) {
+        job *j = reactor->parked;
+        reactor->parked = j->next_job;
+        job_outbox_add(&reactor->outbox, j);
+    }
+    if (reactor->outbox.count) job_outbox_flush(&reactor->outbox);
+    return NULL;
+}
+
+// Page faults of the daemon so far (counted from the fork in daemonize());
+// major faults are pages read from the image on first touch
+static void log_page_faults(const char *when) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return;
+    syslog(LOG_INFO, "keystored::page faults %s: %ld major, %ld minor", when, ru.ru_majflt, ru.ru_minflt);
+}
+
 int daemonize(void) {
     pid_t process_id, session_id;
     int rc = 0;
@@ -429,7 +860,7 @@ int daemonize(void) {
 
     //Exit Parent process
     if (process_id > 0)
-        return 0;
+        exit(EXIT_SUCCESS);
     
     //Set new session
     session_id = setsid();
@@ -449,134 +880,286 @@ int daemonize(void) {
     return 0;
 }
 
-int main(){
+// Process-wide values added to every metrics dump
+static void render_metrics(metrics_buffer *buf) {
+    uint64_t open, accepted;
+    connection_counts(&open, &accepted);
+    metrics_printf(buf, "# HELP keystored_job_queue_depth Jobs waiting for a worker\n"
+                        "# TYPE keystored_job_queue_depth gauge\n"
+                        "keystored_job_queue_depth %zu\n", job_queue_depth(g_job_queue));
+    metrics_printf(buf, "# HELP keystored_connections Client connections open\n"
+                        "# TYPE keystored_connections gauge\n"
+                        "keystored_connections %llu\n", (unsigned long long)open);
+    metrics_printf(buf, "# HELP keystored_connections_accepted_total Client connections accepted\n"
+                        "# TYPE keystored_connections_accepted_total counter\n"
+                        "keystored_connections_accepted_total %llu\n", (unsigned long long)accepted);
+    kv_shards_metrics(&g_shards, buf);
+}
+
+static struct option long_options[] = {
+    {"durability", required_argument, 0, 'D'},
+    {"group-commit-us", required_argument, 0, 'G'},
+    {"reactors", required_argument, 0, 'r'},
+    {"pin-cpus", no_argument, 0, 'P'},
+    {"shard", required_argument, 0, 'S'},
+    {"io-backend", required_argument, 0, 'I'},
+    {"cache-target-mb", required_argument, 0, 'C'},
+    {"buffer-pool-mb", required_argument, 0, 'B'},
+    {"prefault", no_argument, 0, 'F'},
+    {"huge-pages", no_argument, 0, 'H'},
+    {"random-access", no_argument, 0, 'R'},
+    {"mlock-metadata", no_argument, 0, 'L'},
+    {"metrics-socket", required_argument, 0, 'M'},
+    {"verbose", no_argument, 0, 'v'},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+};
+
+static void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [OPTIONS]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --durability <sync|group|async>  When updates are acknowledged (default group)\n");
+    fprintf(stderr, "  --group-commit-us <usec>         Group commit window (default %u)\n", WAL_DEFAULT_GROUP_US);
+    fprintf(stderr, "  --reactors <n>                   Event loop threads (default: online CPUs)\n");
+    fprintf(stderr, "  --pin-cpus                       Pin reactor i to CPU i\n");
+    fprintf(stderr, "  --shard <image>                  Add a shard image; repeat for up to %d shards,\n", KV_MAX_SHARDS);
+    fprintf(stderr, "                                   always in the same order (default %s)\n", KEYSTORE_IMG_PATH);
+    fprintf(stderr, "  --io-backend <epoll|io_uring>    How reactors wait for sockets (default epoll;\n");
+    fprintf(stderr, "                                   io_uring needs Linux 6.0)\n");
+    fprintf(stderr, "  --cache-target-mb <MiB>          Soft target for the images' resident memory,\n");
+    fprintf(stderr, "                                   shared by all shards; not a hard cap (default: none)\n");
+    fprintf(stderr, "  --buffer-pool-mb <MiB>           Serve the images from an O_DIRECT buffer pool capped at\n");
+    fprintf(stderr, "                                   this size, shared by all shards, at least %u each\n",
+            STORAGE_POOL_MIN_BYTES >> 20);
+    fprintf(stderr, "  --prefault                       Fault the index and metadata in at startup\n");
+    fprintf(stderr, "  --huge-pages                     Ask for transparent huge pages for the images\n");
+    fprintf(stderr, "  --random-access                  No readahead on data blocks (MADV_RANDOM)\n");
+    fprintf(stderr, "  --mlock-metadata                 Lock the index and metadata in memory\n");
+    fprintf(stderr, "  --metrics-socket <path>          Unix socket serving the metrics (default %s;\n", METRICS_SOCKET_PATH);
+    fprintf(stderr, "                                   'none' disables it)\n");
+    fprintf(stderr, "  --verbose                        Also log every connection and disconnection\n");
+    fprintf(stderr, "  --help                           Show this help message\n");
+}
+
+int main(int argc, char *argv[]){
     int rc;
     const char *bind_ip = "127.0.0.1";
     int port = 5000;
-    
+    wal_options wal_opts = {
+        .level = DURABILITY_GROUP,
+        .group_commit_us = WAL_DEFAULT_GROUP_US,
+        .checkpoint_interval_ms = WAL_CHECKPOINT_INTERVAL_MS,
+        .checkpoint_bytes = WAL_CHECKPOINT_BYTES,
+    };
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    int num_reactors = ncpu < MAX_REACTORS ? ncpu : MAX_REACTORS;
+    int pin_cpus = 0;
+    const char *shard_paths[KV_MAX_SHARDS] = { KEYSTORE_IMG_PATH };
+    uint32_t shard_count = 0;
+    enum io_backend backend = IO_BACKEND_EPOLL;
+    storage_memory_options memory;
+    memset(&memory, 0, sizeof(memory));
+    size_t pool_bytes = 0;
+    const char *metrics_path = METRICS_SOCKET_PATH;
+    int verbose = 0;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "D:G:r:PS:I:C:B:FHRLM:vh", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'D': // --durability
+                if (wal_parse_durability(optarg, &wal_opts.level) != 0) {
+                    fprintf(stderr, "Error: unknown durability level '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'G': // --group-commit-us
+                wal_opts.group_commit_us = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'r': // --reactors
+                num_reactors = atoi(optarg);
+                if (num_reactors <= 0 || num_reactors > MAX_REACTORS) {
+                    fprintf(stderr, "Error: reactors must be between 1 and %d\n", MAX_REACTORS);
+                    return 1;
+                }
+                break;
+            case 'P': // --pin-cpus
+                pin_cpus = 1;
+                break;
+            case 'S': // --shard
+                if (shard_count == KV_MAX_SHARDS) {
+                    fprintf(stderr, "Error: at most %d shards\n", KV_MAX_SHARDS);
+                    return 1;
+                }
+                shard_paths[shard_count++] = optarg;
+                break;
+            case 'I': // --io-backend
+                if (strcmp(optarg, "epoll") == 0) {
+                    backend = IO_BACKEND_EPOLL;
+                } else if (strcmp(optarg, "io_uring") == 0) {
+                    backend = IO_BACKEND_URING;
+                } else {
+                    fprintf(stderr, "Error: unknown io backend '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'C': { // --cache-target-mb
+                char *end = NULL;
+                unsigned long mb = strtoul(optarg, &end, 10);
+                if (!end || *end != '\0' || mb == 0 || mb > SIZE_MAX >> 20) {
+                    fprintf(stderr, "Error: invalid memory target '%s'\n", optarg);
+                    return 1;
+                }
+                memory.cache_target = (size_t)mb << 20;
+                break;
+            }
+            case 'B': { // --buffer-pool-mb
+                char *end = NULL;
+                unsigned long mb = strtoul(optarg, &end, 10);
+                if (!end || *end != '\0' || mb == 0 || mb > SIZE_MAX >> 20) {
+                    fprintf(stderr, "Error: invalid buffer pool size '%s'\n", optarg);
+                    return 1;
+                }
+                pool_bytes = (size_t)mb << 20;
+                break;
+            }
+            case 'F': // --prefault
+                memory.prefault = 1;
+                break;
+            case 'H': // --huge-pages
+                memory.huge_pages = 1;
+                break;
+            case 'R': // --random-access
+                memory.random_access = 1;
+                break;
+            case 'L': // --mlock-metadata
+                memory.lock_metadata = 1;
+                break;
+            case 'M': // --metrics-socket
+                metrics_path = strcmp(optarg, "none") == 0 ? NULL : optarg;
+                break;
+            case 'v': // --verbose
+                verbose = 1;
+                break;
+            case 'h': // --help
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (shard_count == 0) shard_count = 1;
+    if (pool_bytes && memory.cache_target) {
+        fprintf(stderr, "Error: --cache-target-mb is for the mapped images; the buffer pool has its own cap\n");
+        return 1;
+    }
+    if (pool_bytes && pool_bytes / shard_count < STORAGE_POOL_MIN_BYTES) {
+        fprintf(stderr, "Error: the buffer pool needs at least %u MiB per shard\n", STORAGE_POOL_MIN_BYTES >> 20);
+        return 1;
+    }
+
     //setup logs
     openlog(DAEMON_NAME, LOG_PID|LOG_CONS, LOG_DAEMON);
+    // Masked priorities return from syslog() before any formatting
+    setlogmask(LOG_UPTO(verbose ? LOG_DEBUG : LOG_INFO));
+
+    if (backend == IO_BACKEND_URING && !uring_supported()) {
+        syslog(LOG_WARNING, "keystored::io_uring unavailable (%m), using epoll");
+        backend = IO_BACKEND_EPOLL;
+    }
+    // Workers send through io_uring too
+    connection_use_uring(backend == IO_BACKEND_URING);
 
-    // Initialize storage BEFORE daemonizing so errors are visible in foreground
-    rc = storage_open_or_create(KEYSTORE_IMG_PATH, DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, &g_storage);
-    if (rc != 0) {
+    // Initialize storage BEFORE daemonizing so errors are visible in foreground.
+    // Every shard replays its own log and attaches its index, in parallel.
+    if (kv_shards_open(&g_shards, shard_paths, shard_count, &wal_opts, pool_bytes) != 0) {
         syslog(LOG_ERR, "keystored::storage initialization failed");
         return 1;
     }
-    // Initialize hash bucket block on first create; if already set, skip
-    if (g_storage.super.hash_buckets_block == 0){
-        if (hash_buckets_block_init(&g_storage, DEFAULT_HASH_BUCKETS) != 0){
-            syslog(LOG_ERR, "keystored::failed to init hash bucket block");
-            return 1;
-        }
-    }
-    
+
     //Daemonize the process
     rc = daemonize();
     if (rc < 0) {
         syslog(LOG_ERR, "keystored::failed to daemonize");
         return 1;
     }
-
-    //Create socket
-    int listen_socket = create_socket(bind_ip, port);
-    if (listen_socket < 0) {
-        syslog(LOG_ERR, "keystored::failed to create socket");
+    if (kv_shards_start(&g_shards, &memory) != 0) {
+        syslog(LOG_ERR, "keystored::failed to start WAL threads");
         return 1;
     }
-    
-    //Create epoll
-    int epoll_fd = create_epoll();
-    if (epoll_fd < 0) {
-        syslog(LOG_ERR, "keystored::failed to create epoll");
-        close(listen_socket);
-        return 1;
-    }
-    
-    //Add listen socket to epoll
-    add_epoll_fd(epoll_fd, listen_socket, NULL, EPOLLIN);
-    
-    syslog(LOG_INFO, "keystored::started on %s:%d", bind_ip, port);
 
     g_job_queue = job_queue_init();
     if (!g_job_queue) {
         syslog(LOG_ERR, "keystored::failed to initialize job queue");
-        close(listen_socket);
-        close(epoll_fd);
         return 1;
     }
+    metrics_set_source(render_metrics);
 
     rc = job_worker_pool_init(g_job_queue, NUM_THREADS);
-    if(rc){
+    if(rc <= 0){
         syslog(LOG_ERR, "keystored::failed to create thead pool");
         job_queue_free(g_job_queue);
-        close(listen_socket);
-        close(epoll_fd);
         return 1;
     }
-    
-    // Handle signals 
+
+    // Handle signals
     signal(SIGTERM, handle_signal);
     signal(SIGINT, handle_signal);
 
-    // Main event loop
-    struct epoll_event events[MAX_EVENT]; 
-    
-    while (keep_running) {
-        int nfds = epoll_wait(epoll_fd, events, MAX_EVENT, 250); 
-        if (nfds < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            syslog(LOG_ERR, "keystored::epoll_wait failed");
+    //Create one listener and epoll per reactor
+    static reactor_t reactors[MAX_REACTORS];
+    int started = 0;
+    for (int i = 0; i < num_reactors; i++) {
+        if (reactor_init(&reactors[i], i, pin_cpus ? i % ncpu : -1, backend, bind_ip, port) != 0) {
+            syslog(LOG_ERR, "keystored::failed to create socket");
             break;
         }
-        
-        for (int i = 0; i < nfds; i++) {
-            if (events[i].data.ptr == NULL) {
-                // Listen socket event - accept new connections
-                client_connection_t *new_client = NULL;
-                int accept_result = accept_client(listen_socket, &new_client);
-                
-                if (accept_result > 0 && new_client) {
-                    // Add new client to epoll for read events
-                    add_epoll_fd(epoll_fd, new_client->fd, new_client, EPOLLIN | EPOLLET);
-                } else if (accept_result < 0) {
-                    // Error accepting client
-                    if (new_client) {
-                        cleanup_client(new_client);
-                    }
-                }
-            } else {
-                // Client socket event - handle job request
-                client_connection_t *client = (client_connection_t*)events[i].data.ptr;
-                int handle_result = handle_client_request(client);
-                
-                if (handle_result < 0) {
-                    // Client error or disconnect - remove from epoll and cleanup
-                    remove_epoll_fd(epoll_fd, client->fd);
-                    cleanup_client(client);
-                }
-            }
+        if (pthread_create(&reactors[i].thread, NULL, reactor_thread, &reactors[i]) != 0) {
+            syslog(LOG_ERR, "keystored::failed to start reactor %d", i);
+            reactor_close(&reactors[i]);
+            connection_mailbox_free(&reactors[i].mailbox);
+            break;
         }
+        started++;
     }
-    
+    if (started == 0) {
+        job_queue_free(g_job_queue);
+        return 1;
+    }
+    // The daemon runs without it if the socket cannot be bound; STATS still works
+    if (metrics_path && metrics_serve_start(metrics_path) != 0) {
+        syslog(LOG_WARNING, "keystored::metrics socket %s unavailable", metrics_path);
+    }
+    log_page_faults("at startup");
+    syslog(LOG_INFO, "keystored::started on %s:%d with %d %s reactors and %u shards", bind_ip, port, started,
+           backend == IO_BACKEND_URING ? "io_uring" : "epoll", g_shards.count);
+
+    // Reactors return once keep_running is cleared
+    for (int i = 0; i < started; i++) {
+        pthread_join(reactors[i].thread, NULL);
+        reactor_close(&reactors[i]);
+    }
+
     // Cleanup
     syslog(LOG_INFO, "keystored::cleaning up");
-    
-    // Close epoll
-    close(epoll_fd);
-    
-    // Close listen socket
-    close(listen_socket);
-    
+    metrics_serve_stop();
+
     // Free job queue
     if (g_job_queue) {
         job_queue_free(g_job_queue);
     }
+    // Workers post to the reactors' mailboxes until they are gone
+    for (int i = 0; i < started; i++) {
+        connection_mailbox_free(&reactors[i].mailbox);
+    }
     
-    // Close storage mapping/file
-    storage_close(&g_storage);
+    job_pool_log_stats();
+    log_page_faults("while running");
+
+    // Close storage mappings/files
+    kv_shards_close(&g_shards);
     closelog();
     return 0;
 }
\ No newline at end of file
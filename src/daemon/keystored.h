@@ -7,54 +7,75 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <getopt.h>
 
 #include "job_executor.h"
+#include "connection.h"
+#include "storage.h"
+#include "kv_engine.h"
+#include "kv_shards.h"
+#include "wal.h"
+#include "uring.h"
 
 #define DAEMON_NAME "keyvalued"
 #define NUM_THREADS     16
 #define MAX_EVENT       16
-// Persistent block storage configuration
+#define CLIENT_READ_CHUNK 16384
+#define MAX_REACTORS    64
+// Requests carrying more value bytes than this go to the worker pool
+#define REACTOR_INLINE_MAX_VALUE 16384
+// PUT values larger than this are streamed into the engine as they arrive
+#define REACTOR_STREAM_MIN_VALUE (64u * 1024u)
+// A client is not read from while more response bytes than this wait for
+// its socket
+#define REACTOR_BACKLOG_PAUSE (256u * 1024u)
+// Persistent block storage configuration: the image used when no --shard is
+// given. Each image's log segments are written as <image minus .img>.wal.<sequence>
 #define KEYSTORE_IMG_PATH "/tmp/keystored.img"
-#define KEYSTORE_MAGIC 0x4B455953 /* 'KEYS' */
-#define KEYSTORE_VERSION 1
-#define DEFAULT_BLOCK_SIZE 4096U
-#define DEFAULT_NUM_BLOCKS 16384U /* 64 MiB total */
-#define DEFAULT_HASH_BUCKETS 512u
+// io_uring backend: receive buffers the kernel picks from, per reactor
+#define URING_BUF_GROUP     1
+#define URING_BUF_COUNT     128
+#define URING_SQ_ENTRIES    256
+#define URING_CQ_ENTRIES    4096
+#define URING_ACCEPT_TAG    1   /* user_data of the accept; clients are pointers */
+#define URING_CANCEL_TAG    2   /* user_data of a receive's cancellation */
+#define URING_WRITABLE_BIT  1   /* set in a client pointer: its POLLOUT */
+#define URING_WAKE_TAG      3   /* user_data of the mailbox eventfd's read */
 
-typedef struct keystore_super_block {
-    uint32_t magic;         /* KEYSTORE_MAGIC */
-    uint32_t version;       /* structure version */
-    uint64_t total_size;    /* total file size in bytes */
-    uint32_t block_size;    /* bytes per block */
-    uint32_t num_blocks;    /* number of blocks including superblock */
-    uint32_t free_list_head_block; /* head block index of free list (0 == none) */
-    uint32_t free_block_count;     /* number of free blocks available */
-    uint32_t hash_bucket_count;    /* number of hash buckets */
-    uint32_t hash_buckets_block;   /* block index holding the hash bucket array */
-    uint8_t  reserved[32];  /* future use */
-} keystore_super_block_t;
+// How reactors wait for sockets. io_uring accepts and receives without a
+// system call per connection or read; it needs Linux 6.0 and falls back
+// to epoll elsewhere.
+enum io_backend {
+    IO_BACKEND_EPOLL,
+    IO_BACKEND_URING,
+};
 
-typedef struct storage_state {
-    int fd;
-    void *mapped_ptr;
-    size_t mapped_size;
-    keystore_super_block_t super;
-    pthread_mutex_t freelist_mutex;
-} storage_state_t;
-
-// Client connection structure
-typedef struct client_connection {
-    int fd;
-    struct sockaddr_in addr;
-    char client_ip[INET_ADDRSTRLEN];
-    int port;
-} client_connection_t;
+// One event loop per thread, each with its own SO_REUSEPORT listener so the
+// kernel spreads new connections across them. Small requests run to
+// completion on the reactor; large ones are queued for the worker pool.
+typedef struct reactor{
+    int id;
+    int cpu;                /* CPU to pin to, -1 == not pinned */
+    int listen_fd;
+    int epoll_fd;
+    enum io_backend backend;
+    uring ring;             /* io_uring backend only */
+    uring_buf_ring bufs;
+    pthread_t thread;
+    job_outbox outbox;      /* inline jobs completed during one wakeup */
+    client_connection_t *pending;  /* clients whose responses wait for their socket */
+    connection_mailbox mailbox;    /* clients whose backlog a worker left; also woken by the logs */
+    uint64_t wake_count;    /* io_uring: the mailbox's eventfd is read into */
+    job *parked;            /* inline updates waiting for their log records, by next_job */
+} reactor_t;
 
 void handle_signal(int sig);
 int daemonize(void);
@@ -63,18 +84,9 @@ int create_epoll(void);
 void add_epoll_fd(int epfd, int fd, void *ptr, uint32_t events);
 void remove_epoll_fd(int epfd, int fd);
 int accept_client(int listen_socket, client_connection_t **client);
-int handle_client_request(client_connection_t *client);
+int handle_client_request(reactor_t *reactor, client_connection_t *client);
+int reactor_init(reactor_t *reactor, int id, int cpu, enum io_backend backend,
+                 const char *bind_ip, int port);
+void reactor_close(reactor_t *reactor);
+void * reactor_thread(void *arg);
 void cleanup_client(client_connection_t *client);
-
-// Storage lifecycle
-int storage_open_or_create(const char *path,
-                           uint32_t default_block_size,
-                           uint32_t default_num_blocks,
-                           storage_state_t *out_state);
-void storage_close(storage_state_t *state);
-void storage_print_superblock_ascii(const storage_state_t *state);
-
-// Free-list management (persistent on-disk singly-linked list of free blocks)
-int freelist_format(storage_state_t *state);
-int storage_block_alloc(storage_state_t *state, uint32_t *out_block_index);
-int storage_block_free(storage_state_t *state, uint32_t block_index);
\ No newline at end of file
@@ -1,5 +1,29 @@
 #include "job_executor.h"
 
+// Per-request objects: allocated on the reactor, freed on whichever thread
+// sends the reply
+static obj_pool g_job_pool;
+static obj_pool g_request_pool;
+static obj_pool g_response_pool;
+static pthread_once_t g_pools_once = PTHREAD_ONCE_INIT;
+
+static void job_pools_init(void){
+    obj_pool_init(&g_job_pool, "job", sizeof(job));
+    obj_pool_init(&g_request_pool, "job_request", JOB_REQUEST_POOL_BYTES);
+    obj_pool_init(&g_response_pool, "job_response", sizeof(job_response));
+}
+
+void job_pool_log_stats(void){
+    pthread_once(&g_pools_once, job_pools_init);
+    const obj_pool *pools[] = { &g_job_pool, &g_request_pool, &g_response_pool };
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        uint64_t hits = 0, misses = 0;
+        obj_pool_stats(pools[i], &hits, &misses);
+        syslog(LOG_INFO, "keystored::%s pool: %llu hits, %llu misses", pools[i]->name,
+               (unsigned long long)hits, (unsigned long long)misses);
+    }
+}
+
 
 job_queue * job_queue_init(void){
     job_queue *q = (job_queue *)calloc(1,sizeof(job_queue));
@@ -9,65 +33,237 @@ job_queue * job_queue_init(void){
     return q;
 }
 
+static int ring_push(job_ring *r, job *j){
+    size_t pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        job_ring_cell *cell = &r->cells[pos & (JOB_RING_SIZE - 1)];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->job = j;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1; // Full
+        } else {
+            pos = __atomic_load_n(&r->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static job * ring_pop(job_ring *r){
+    size_t pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        job_ring_cell *cell = &r->cells[pos & (JOB_RING_SIZE - 1)];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                job *j = cell->job;
+                __atomic_store_n(&cell->seq, pos + JOB_RING_SIZE, __ATOMIC_RELEASE);
+                return j;
+            }
+        } else if (diff < 0) {
+            return NULL; // Empty
+        } else {
+            pos = __atomic_load_n(&r->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int job_queue_rings_init(job_queue *q, int count){
+    void *mem = NULL;
+    if (posix_memalign(&mem, JOB_CACHE_LINE, (size_t)count * sizeof(job_ring)) != 0) return -1;
+    job_ring *rings = (job_ring *)mem;
+    memset(rings, 0, (size_t)count * sizeof(job_ring));
+    for (int r = 0; r < count; r++) {
+        for (size_t i = 0; i < JOB_RING_SIZE; i++) rings[r].cells[i].seq = i;
+    }
+    q->rings = rings;
+    q->ring_count = count;
+    return 0;
+}
+
+// Ring owned by the calling worker thread (-1 outside the pool)
+static __thread int t_worker_ring = -1;
+
+void job_queue_attach_worker(job_queue *q){
+    t_worker_ring = __atomic_fetch_add(&q->next_worker, 1, __ATOMIC_RELAXED) % q->ring_count;
+}
+
+size_t job_queue_depth(job_queue *q){
+    size_t depth = (size_t)__atomic_load_n(&q->overflow, __ATOMIC_RELAXED);
+    for (int r = 0; r < q->ring_count; r++) {
+        size_t enq = __atomic_load_n(&q->rings[r].enqueue_pos, __ATOMIC_RELAXED);
+        size_t deq = __atomic_load_n(&q->rings[r].dequeue_pos, __ATOMIC_RELAXED);
+        if (enq > deq) depth += enq - deq;
+    }
+    return depth;
+}
+
+// Own ring first, then steal from the others in order
+static job * rings_take(job_queue *q){
+    int n = q->ring_count;
+    int self = t_worker_ring >= 0 ? t_worker_ring : 0;
+    for (int i = 0; i < n; i++) {
+        job *j = ring_pop(&q->rings[(self + i) % n]);
+        if (j) return j;
+    }
+    return NULL;
+}
+
+// Caller holds p_mutex
+static job * overflow_take(job_queue *q){
+    job *j = q->head;
+    if (j) {
+        q->head = j->next_job;
+        if (!q->head) q->tail = NULL;
+        __atomic_sub_fetch(&q->overflow, 1, __ATOMIC_RELEASE);
+    }
+    return j;
+}
+
+static job * queue_take(job_queue *q){
+    job *j = rings_take(q);
+    if (j || __atomic_load_n(&q->overflow, __ATOMIC_ACQUIRE) == 0) return j;
+    pthread_mutex_lock(&q->p_mutex);
+    j = overflow_take(q);
+    pthread_mutex_unlock(&q->p_mutex);
+    return j;
+}
+
 void job_queue_free(job_queue *q){
     if(!q) return;
     pthread_mutex_lock(&q->p_mutex);
-    while (q->head) {
-        job * j = q->head->next_job;
-        job_free(q->head);
-        q->head = j;
+    // Let idle workers exit so their outboxes are flushed before teardown
+    q->stopping = 1;
+    pthread_cond_broadcast(&q->p_cond);
+    while (q->workers > 0) {
+        pthread_cond_wait(&q->p_cond, &q->p_mutex);
     }
     pthread_mutex_unlock(&q->p_mutex);
+    job *j;
+    while ((j = queue_take(q)) != NULL) {
+        job_free(j);
+    }
     pthread_mutex_destroy(&q->p_mutex);
     pthread_cond_destroy(&q->p_cond);
+    free(q->rings);
+    free(q);
 }
 
-void job_init(job_request *req){
-    if(!req) return;
-    job *j = (job *)calloc(1,sizeof(j));
-    if(!j) return;
+job * job_alloc(job_request *req){
+    pthread_once(&g_pools_once, job_pools_init);
+    job *j = (job *)obj_pool_alloc(&g_job_pool);
+    if (!j) return NULL;
+    memset(j, 0, sizeof(*j));
     j->request = req;
     j->response = job_response_init(req->type);
-    j->next_job = NULL;
+    if (!j->response) {
+        obj_pool_free(&g_job_pool, j);
+        return NULL;
+    }
+    return j;
 }
 
 void job_free(job *j){
     if(!j) return;
-    if(j->request) free(j->request);
-    if(j->response) free(j->response);
-    free(j);
+    if(j->request) job_request_free(j->request);
+    if(j->response) job_response_free(j->response);
+    if(j->client) connection_put(j->client);
+    obj_pool_free(&g_job_pool, j);
     j=NULL;
 }
 
 void job_push(job_queue *q,job *j){
-    j->next_job = NULL;
-    pthread_mutex_lock(&q->p_mutex);
-    if (q->tail) q->tail->next_job = j; else q->head = j;
-    q->tail = j;
-    pthread_cond_signal(&q->p_cond);
-    pthread_mutex_unlock(&q->p_mutex);
+    // Notify before queueing: once queued a worker may finish and free the job
     update_job_status(j,SUBMITTED);
     notify_job_status(j);
+    j->next_job = NULL;
+
+    int queued = 0;
+    int n = q->ring_count;
+    unsigned first = __atomic_fetch_add(&q->next_ring, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < n && !queued; i++) {
+        queued = ring_push(&q->rings[(first + (unsigned)i) % (unsigned)n], j) == 0;
+    }
+    if (!queued) {
+        pthread_mutex_lock(&q->p_mutex);
+        if (q->tail) q->tail->next_job = j; else q->head = j;
+        q->tail = j;
+        __atomic_add_fetch(&q->overflow, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&q->p_mutex);
+    }
+
+    // Pairs with the fence in job_pop(): either a parking worker sees the
+    // job or we see it parked and wake it
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->sleepers, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&q->p_mutex);
+        pthread_cond_signal(&q->p_cond);
+        pthread_mutex_unlock(&q->p_mutex);
+    }
 }
 
 job * job_pop(job_queue *q){
-    pthread_mutex_lock(&q->p_mutex);
-    while (!q->head) {
-        pthread_cond_wait(&q->p_cond, &q->p_mutex);
-    }
-    job *j = q->head;
-    if (j) {
-        q->head = j->next_job;
-        if (!q->head) q->tail = NULL;
+    // Adaptive spinning: grows while spinning finds work, shrinks on parking
+    static __thread int spin_limit = JOB_SPIN_MAX / 4;
+    job *j = NULL;
+    for (;;) {
+        for (int spin = 0; spin <= spin_limit; spin++) {
+            j = queue_take(q);
+            if (j) {
+                if (spin > 0 && spin_limit < JOB_SPIN_MAX) spin_limit *= 2;
+                goto found;
+            }
+            if (__atomic_load_n(&q->stopping, __ATOMIC_RELAXED)) break;
+            if (spin & 15) continue;
+            sched_yield();
+        }
+
+        pthread_mutex_lock(&q->p_mutex);
+        __atomic_add_fetch(&q->sleepers, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        // Recheck after announcing ourselves; job_push() may have missed us
+        j = rings_take(q);
+        if (!j) j = overflow_take(q);
+        if (!j && !q->stopping) {
+            pthread_cond_wait(&q->p_cond, &q->p_mutex);
+        }
+        __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_RELAXED);
+        int stopping = q->stopping;
+        pthread_mutex_unlock(&q->p_mutex);
+        if (spin_limit > 1) spin_limit /= 2;
+        if (j) goto found;
+        if (stopping) {
+            j = queue_take(q);
+            if (!j) return NULL;
+            goto found;
+        }
     }
-    pthread_mutex_unlock(&q->p_mutex);
+found:
     update_job_status(j,PROCESSING);
     notify_job_status(j);
     return j;
 }
 
+// Non-blocking pop; returns NULL when the queue is empty
+job * job_try_pop(job_queue *q){
+    job *j = queue_take(q);
+    if (j) {
+        update_job_status(j,PROCESSING);
+        notify_job_status(j);
+    }
+    return j;
+}
+
 job_response * job_response_init(enum job_type type){
-    job_response *res = (job_response *) calloc(1,sizeof(job_response));
+    pthread_once(&g_pools_once, job_pools_init);
+    job_response *res = (job_response *)obj_pool_alloc(&g_response_pool);
     if(!res) return NULL;
 
     res->type =  type;
@@ -75,67 +271,314 @@ job_response * job_response_init(enum job_type type){
     res->error = NO_ERROR;
     res->data_len = 0;
     res->data = NULL;
+    memset(&res->value, 0, sizeof(res->value));
 
     return res;
 }
 
 void job_response_free(job_response *res){
-    free(res);
+    if(!res) return;
+    free(res->data);
+    kv_engine_unpin(&res->value);
+    obj_pool_free(&g_response_pool, res);
     res = NULL;
 }
 
-job_request * job_request_init(enum job_type type,char *key, char *value){
-    job_request * req = (job_request *)calloc(1,sizeof(job_request));
+job_request * job_request_init(enum job_type type, const char *key, size_t key_len,
+                               const char *value, size_t value_len){
+    // One allocation: header, key, value and a trailing NUL for logging
+    pthread_once(&g_pools_once, job_pools_init);
+    size_t size = sizeof(job_request) + key_len + value_len + 1;
+    int pooled = size <= JOB_REQUEST_POOL_BYTES;
+    job_request * req = (job_request *)(pooled ? obj_pool_alloc(&g_request_pool) : malloc(size));
     if (!req) return NULL;
+    req->pooled = (uint8_t)pooled;
     req->type = type;
-    snprintf(req->key, strlen(key), "%s", key);
-    snprintf(req->value, strlen(value), "%s", value);
+    req->request_id = 0;
+    req->flags = 0;
+    req->key_len = key_len;
+    req->value_len = value_len;
+    req->key = req->data;
+    req->value = req->data + key_len;
+    req->stream = NULL;
+    if (key && key_len) memcpy(req->key, key, key_len);
+    if (value && value_len) memcpy(req->value, value, value_len);
+    req->data[key_len + value_len] = '\0';
     return req;
 }
 
 void job_request_free(job_request *req){
-    free(req);
+    if (!req) return;
+    if (req->stream) {
+        kv_engine_put_abort(req->stream);
+        free(req->stream);
+    }
+    if (req->pooled) obj_pool_free(&g_request_pool, req);
+    else free(req);
     req=NULL;
 }
 
+static enum job_error_code job_error_from_kv(int rc){
+    switch (rc) {
+        case KV_OK:          return NO_ERROR;
+        case KV_NOT_FOUND:   return KEY_NOT_FOUND;
+        case KV_NO_SPACE:    return STORAGE_FULL;
+        case KV_TOO_LARGE:   return VALUE_TOO_LARGE;
+        case KV_INVALID_KEY: return INVALID_KEY;
+        default:             return INTERNAL_ERROR;
+    }
+}
+
+static int batch_run(kv_engine_t *engine, enum job_type type, kv_batch_item *items, size_t count){
+    if (type == MGET) return kv_engine_multi_lookup(engine, items, count);
+    if (type == MPUT) return kv_engine_multi_insert(engine, items, count);
+    return kv_engine_multi_remove(engine, items, count);
+}
+
+// Runs a batch as one engine call per shard it touches. Updates that did
+// go through must be durable before the reply, but a job carries a single
+// commit point: the logs of all but the last shard updated are waited for
+// here.
+static int batch_run_sharded(job *work_job, kv_batch_item *items, uint32_t count){
+    kv_shards *set = work_job->shards;
+    enum job_type type = work_job->request->type;
+    kv_batch_item *part = items;
+    uint32_t *origin = NULL;
+    if (set->count > 1) {
+        part = malloc((count ? count : 1) * sizeof(kv_batch_item));
+        origin = malloc((count ? count : 1) * sizeof(uint32_t));
+        if (!part || !origin) {
+            free(part);
+            free(origin);
+            return KV_ERROR;
+        }
+    }
+
+    int rc = KV_OK;
+    for (uint32_t s = 0; s < set->count && rc == KV_OK; s++) {
+        uint32_t n = count;
+        if (origin) {
+            n = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                if (kv_shards_index(set, kv_engine_hash(items[i].key, items[i].key_len)) != s) continue;
+                origin[n] = i;
+                part[n++] = items[i];
+            }
+            if (n == 0) continue;
+        }
+        kv_engine_t *engine = &set->shards[s].engine;
+        rc = batch_run(engine, type, part, n);
+        int updated = 0;
+        for (uint32_t k = 0; k < n; k++) {
+            if (origin) items[origin[k]] = part[k];
+            if (part[k].result == KV_OK && type != MGET) updated = 1;
+        }
+        if (!updated) continue;
+        if (work_job->commit_lsn &&
+            wal_wait_durable(work_job->commit_wal, work_job->commit_lsn) != 0 && rc == KV_OK) {
+            rc = KV_ERROR;
+        }
+        work_job->commit_wal = engine->storage->wal;
+        work_job->commit_lsn = wal_thread_lsn();
+    }
+    if (origin) {
+        free(part);
+        free(origin);
+    }
+    return rc;
+}
+
+// Runs an MGET/MPUT/MDELETE frame and encodes the per-key results into
+// res->data. Returns KV_OK once the batch ran.
+static int process_batch(job *work_job){
+    job_request *req = work_job->request;
+    job_response *res = work_job->response;
+    const uint8_t *payload = (const uint8_t *)req->value;
+    if (req->value_len < KV_BATCH_COUNT_SIZE) return KV_INVALID_KEY;
+    uint32_t count = kv_decode_batch_count(payload);
+    if (count > KV_BATCH_MAX_KEYS) return KV_INVALID_KEY;
+
+    kv_batch_item *items = calloc(count ? count : 1, sizeof(kv_batch_item));
+    if (!items) return KV_ERROR;
+    size_t off = KV_BATCH_COUNT_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+        kv_batch_entry entry;
+        if (kv_decode_batch_entry(payload, req->value_len, &off, &entry) != 0) {
+            free(items);
+            return KV_INVALID_KEY;
+        }
+        items[i].key = entry.key;
+        items[i].key_len = entry.key_len;
+        items[i].value = entry.value;
+        items[i].value_len = entry.value_len;
+    }
+
+    int rc = batch_run_sharded(work_job, items, count);
+
+    size_t size = KV_BATCH_COUNT_SIZE + (size_t)count * KV_BATCH_RES_ENTRY_SIZE;
+    for (uint32_t i = 0; rc == KV_OK && i < count; i++) {
+        size += items[i].out_value_len;
+    }
+    uint8_t *out = (rc == KV_OK && size <= KV_MAX_VALUE_LENGTH) ? malloc(size) : NULL;
+    if (rc == KV_OK && !out) rc = (size > KV_MAX_VALUE_LENGTH) ? KV_TOO_LARGE : KV_ERROR;
+    if (out) {
+        uint8_t *p = out;
+        kv_encode_batch_count(p, count);
+        p += KV_BATCH_COUNT_SIZE;
+        for (uint32_t i = 0; i < count; i++) {
+            kv_encode_batch_result(p, (uint8_t)job_error_from_kv(items[i].result), (uint32_t)items[i].out_value_len);
+            p += KV_BATCH_RES_ENTRY_SIZE;
+            if (items[i].out_value_len) memcpy(p, items[i].out_value, items[i].out_value_len);
+            p += items[i].out_value_len;
+        }
+        res->data = (char *)out;
+        res->data_len = (int)size;
+    }
+    for (uint32_t i = 0; i < count; i++) free(items[i].out_value);
+    free(items);
+    return rc;
+}
+
+// Renders the metrics into the response value
+static int process_stats(job *work_job){
+    metrics_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    metrics_render(&buf);
+    if (buf.failed || buf.len > KV_MAX_VALUE_LENGTH) {
+        free(buf.data);
+        return KV_ERROR;
+    }
+    work_job->response->data = buf.data;
+    work_job->response->data_len = (int)buf.len;
+    return KV_OK;
+}
+
+// The value is pinned in the image and sent from there once the job is
+// flushed, so it is never copied. A reactor hands large values to the
+// workers: it must not block on one client for a long send.
+static int process_get(job *work_job){
+    job_request *req = work_job->request;
+    job_response *res = work_job->response;
+    kv_engine_t *engine = kv_shards_route(work_job->shards, req->key, req->key_len);
+    int rc = kv_engine_lookup_pinned(engine, req->key, req->key_len, &res->value);
+    if (rc != KV_OK) return rc;
+    if (work_job->on_reactor && res->value.len > JOB_REACTOR_MAX_GET) {
+        kv_engine_unpin(&res->value);
+        work_job->deferred = 1;
+        return rc;
+    }
+    res->data_len = (int)res->value.len;
+    return rc;
+}
+
 void process_job(job *work_job){
     int rc = 0;
     if (!work_job || !work_job->response || !work_job->request) {
         return;
     }
-    // Mark as processing
-    update_job_status(work_job,PROCESSING);
-    notify_job_status(work_job);
-
-    // For now, we simply mark the job as completed immediately.
-    switch (work_job->request->type) {
+    // job_pop() already marked it PROCESSING
+    work_job->start_ns = metrics_now();
+    job_request *req = work_job->request;
+    job_response *res = work_job->response;
+    kv_engine_t *engine = kv_shards_route(work_job->shards, req->key, req->key_len);
+    switch (req->type) {
         case PUT:
-        case DELETE:
+            if (req->stream) {
+                // The value already sits in the engine; publish it
+                rc = kv_engine_put_commit(req->stream);
+                free(req->stream);
+                req->stream = NULL;
+                break;
+            }
+            rc = kv_engine_insert(engine, req->key, req->key_len,
+                                  req->value, req->value_len);
+            if (rc == KV_NO_SPACE && work_job->on_reactor) {
+                // A worker may grow the image, which a reactor does not
+                work_job->deferred = 1;
+                return;
+            }
+            break;
         case GET:
+            rc = process_get(work_job);
+            if (work_job->deferred) return;
+            break;
+        case DELETE:
+            rc = kv_engine_remove(engine, req->key, req->key_len);
+            break;
+        case MGET:
+        case MPUT:
+        case MDELETE:
+            rc = process_batch(work_job);
+            break;
+        case STATS:
+            rc = process_stats(work_job);
+            break;
         default:
-            rc = 0;
+            rc = KV_INVALID_KEY;
             break;
     }
+    res->error = job_error_from_kv(rc);
+    if (rc == KV_OK && req->type != GET && req->type != STATS && !kv_is_batch_type(req->type)) {
+        work_job->commit_wal = engine->storage->wal;
+        work_job->commit_lsn = wal_thread_lsn();
+    }
+    work_job->done_ns = metrics_now();
+    // The final response is sent by the worker's outbox
     rc == 0 ? update_job_status(work_job,COMPLETED): update_job_status(work_job,FAILED);
-    notify_job_status(work_job);
 }
 
+// Reserves the space of a streamed PUT, which may grow the image, and hands
+// the upload back to the reactor receiving its value. A failed reservation
+// is reported once the value has been drained.
+static void start_upload(job *work_job){
+    job_request *req = work_job->request;
+    client_connection_t *client = work_job->client;
+    kv_engine_put_begin(kv_shards_route(work_job->shards, req->key, req->key_len), req->key, req->key_len,
+                        req->value_len, req->stream);
+    // The request stays the client's upload
+    work_job->request = NULL;
+    __atomic_store_n(&client->upload_ready, 1, __ATOMIC_RELEASE);
+    connection_mailbox_post(client);
+    job_free(work_job);
+}
+
+// Completed jobs collect in the outbox while more work is queued; it is
+// flushed when the queue runs dry or the outbox fills up.
 void * job_worker_thread(void *arg){
     job_queue *queue = (job_queue *)arg;
+    job_outbox outbox;
+    outbox.count = 0;
+    job_queue_attach_worker(queue);
+    char name[24]; // "worker-" and any int
+    snprintf(name, sizeof(name), "worker-%d", t_worker_ring);
+    metrics_thread_init(name);
     for(;;){
-        job *work_job = job_pop(queue);
+        int blocking = outbox.count == 0;
+        job *work_job = blocking ? job_pop(queue) : job_try_pop(queue);
         if (!work_job) {
+            job_outbox_flush(&outbox);
+            // job_pop() only comes back empty once the queue is stopping
+            if (blocking) break;
+            continue;
+        }
+        if (work_job->starts_upload) {
+            start_upload(work_job);
             continue;
         }
         process_job(work_job);
-        job_free(work_job);
+        job_outbox_add(&outbox, work_job);
     }
+    pthread_mutex_lock(&queue->p_mutex);
+    queue->workers--;
+    pthread_cond_broadcast(&queue->p_cond);
+    pthread_mutex_unlock(&queue->p_mutex);
     return NULL;
 }
 
 int job_worker_pool_init(job_queue *queue, int num_threads){
     if (!queue) return 0;
     if (num_threads <= 0) num_threads = JOB_WORKER_THREAD_COUNT;
+    if (!queue->rings && job_queue_rings_init(queue, num_threads) != 0) return 0;
 
     pthread_attr_t attr;
     pthread_attr_init(&attr);
@@ -144,10 +587,16 @@ int job_worker_pool_init(job_queue *queue, int num_threads){
     int started = 0;
     for (int i = 0; i < num_threads; i++) {
         pthread_t tid;
+        pthread_mutex_lock(&queue->p_mutex);
+        queue->workers++;
+        pthread_mutex_unlock(&queue->p_mutex);
         int rc = pthread_create(&tid, &attr, job_worker_thread, (void *)queue);
         if (rc == 0) {
             started++;
         } else {
+            pthread_mutex_lock(&queue->p_mutex);
+            queue->workers--;
+            pthread_mutex_unlock(&queue->p_mutex);
             // Stop attempting further threads on failure
             break;
         }
@@ -162,10 +611,227 @@ void update_job_status(job *work_job,enum job_status status){
     work_job->response->status = status;
 }
 
+// Encodes the response header for the connection's wire format into `buf`
+// (at least sizeof(legacy_job_response) bytes) and returns its length.
+static size_t encode_response(const job *work_job, void *buf, size_t data_len){
+    const job_response *res = work_job->response;
+    if (work_job->client->wire == WIRE_LEGACY) {
+        legacy_job_response legacy;
+        memset(&legacy, 0, sizeof(legacy));
+        legacy.type = res->type;
+        legacy.status = res->status;
+        legacy.error = res->error;
+        legacy.data_len = (int)data_len;
+        memcpy(buf, &legacy, sizeof(legacy));
+        return sizeof(legacy);
+    }
+    kv_response_header hdr;
+    hdr.opcode = (uint8_t)res->type;
+    hdr.status = (uint8_t)res->status;
+    hdr.error = (uint8_t)res->error;
+    hdr.value_len = (uint32_t)data_len;
+    hdr.request_id = work_job->request ? work_job->request->request_id : 0;
+    kv_encode_response_header(buf, &hdr);
+    return KV_FRAME_HEADER_SIZE;
+}
+
+// A completed GET or batch is followed by `data_len` value bytes
+static size_t response_data_len(const job_response *res){
+    if (res->status != COMPLETED || (!res->data && !res->value.pieces)) return 0;
+    return (size_t)res->data_len;
+}
+
+// Sends a progress notification right away. Only requests that asked for
+// them with KV_FLAG_PROGRESS get SUBMITTED/PROCESSING updates.
 void notify_job_status(job *work_job){
     if(!work_job) return;
-    if (send(work_job->client_fd, work_job->response, sizeof(job_response), 0) < 0) {
+    // The PUT that follows a reservation reports on the upload
+    if (work_job->starts_upload) return;
+    if (!(work_job->request->flags & KV_FLAG_PROGRESS) &&
+        work_job->response->status != COMPLETED && work_job->response->status != FAILED) {
+        return;
+    }
+    job_response *res = work_job->response;
+    // Pinned values only go out with the final response, from the outbox
+    size_t data_len = res->data ? response_data_len(res) : 0;
+    uint8_t head[sizeof(legacy_job_response)];
+    struct iovec iov[2];
+    iov[0].iov_base = head;
+    iov[0].iov_len = encode_response(work_job, head, data_len);
+    iov[1].iov_base = res->data;
+    iov[1].iov_len = data_len;
+
+    if (connection_send(work_job->client, iov, data_len ? 2 : 1) < 0) {
         syslog(LOG_ERR, "keystored::failed to send response to client %d", 
             work_job->response->status);
     }
-}
\ No newline at end of file
+}
+
+void job_outbox_add(job_outbox *box, job *done_job){
+    box->jobs[box->count++] = done_job;
+    if (box->count == JOB_OUTBOX_SIZE) job_outbox_flush(box);
+}
+
+// Responses gathered for one connection, sent under its send lock. A
+// reactor that cannot have the lock adds them to the backlog instead.
+typedef struct send_batch {
+    client_connection_t *client;
+    struct iovec iov[JOB_SEND_IOV];
+    int iovcnt;
+    int locked;
+    int failed;
+    job *jobs;              /* whose responses these are, linked by next_job */
+} send_batch;
+
+// Frees the jobs of a batch whose values the backlog borrowed
+static void jobs_release(void *arg){
+    job *j = arg;
+    while (j) {
+        job *next = j->next_job;
+        job_free(j);
+        j = next;
+    }
+}
+
+static void batch_flush(send_batch *b){
+    if (b->iovcnt > 0 && !b->failed) {
+        int rc = b->locked ? connection_send_part(b->client, b->iov, b->iovcnt)
+                           : connection_send_later_part(b->client, b->iov, b->iovcnt);
+        if (rc < 0) b->failed = 1;
+    }
+    b->iovcnt = 0;
+}
+
+static void batch_add(send_batch *b, void *base, size_t len){
+    if (b->iovcnt == JOB_SEND_IOV) batch_flush(b);
+    b->iov[b->iovcnt].iov_base = base;
+    b->iov[b->iovcnt].iov_len = len;
+    b->iovcnt++;
+}
+
+// Value bytes of a response: its buffer, or the pinned pieces of a GET,
+// which sendmsg() copies straight out of the mapping. sendfile() is no use
+// here: the socket keeps referencing the page cache after it returns, and
+// the blocks may be reused as soon as the job is freed.
+static void batch_add_value(send_batch *b, job *j, size_t data_len){
+    job_response *res = j->response;
+    if (res->data) {
+        batch_add(b, res->data, data_len);
+        return;
+    }
+    for (uint32_t p = 0; p < res->value.piece_count; p++) {
+        batch_add(b, res->value.pieces[p].iov_base, res->value.pieces[p].iov_len);
+    }
+}
+
+// Sends what the batches still hold, all connections in one go, releases
+// their send locks and frees the jobs. Values the sockets did not take are
+// lent to the backlogs under the lock, and their jobs freed once sent.
+static void send_batches(send_batch *batches, int count){
+    connection_send_set set;
+    int slot[CONNECTION_SEND_SET];
+    set.count = 0;
+    for (int i = 0; i < count; i++) {
+        send_batch *b = &batches[i];
+        slot[i] = -1;
+        if (!b->locked) batch_flush(b);
+        else if (b->iovcnt > 0 && !b->failed) slot[i] = connection_send_set_add(&set, b->client, b->iov, b->iovcnt);
+    }
+    connection_send_set_run(&set);
+    uint64_t sent_ns = metrics_now();
+    for (int i = 0; i < count; i++) {
+        send_batch *b = &batches[i];
+        if (slot[i] >= 0 && set.sends[slot[i]].failed) b->failed = 1;
+        for (job *j = b->jobs; j; j = j->next_job) {
+            metrics_record(j->request ? j->request->type : 0,
+                           j->response->status != COMPLETED && j->response->error != KEY_NOT_FOUND,
+                           j->recv_ns, j->start_ns, j->done_ns, sent_ns);
+        }
+        // The jobs may be freed before the client is done with
+        client_connection_t *client = b->client;
+        connection_get(client);
+        int lent = 0;
+        if (b->locked) lent = connection_send_end_lent(client, jobs_release, b->jobs);
+        else connection_send_later_end(client);
+        if (!lent) jobs_release(b->jobs);
+        if (b->failed) {
+            // A response cut short leaves the client mid-frame
+            syslog(LOG_ERR, "keystored::failed to send responses to client %s:%d",
+                client->client_ip, client->port);
+            connection_shutdown(client);
+        }
+        connection_put(client);
+    }
+}
+
+// Sends every gathered final response, the responses of each connection
+// together and in completion order, and frees the jobs (or lends their
+// values to the backlog until the socket takes them).
+void job_outbox_flush(job_outbox *box){
+    uint8_t heads[JOB_OUTBOX_SIZE][sizeof(legacy_job_response)];
+    send_batch batches[CONNECTION_SEND_SET];
+    int sent[JOB_OUTBOX_SIZE] = {0};
+    int waited[JOB_OUTBOX_SIZE] = {0};
+
+    // One durability wait per shard log covers every update in the outbox
+    for (int i = 0; i < box->count; i++) {
+        struct wal *wal = box->jobs[i]->commit_wal;
+        if (!box->jobs[i]->commit_lsn || waited[i]) continue;
+        uint64_t commit_lsn = 0;
+        for (int k = i; k < box->count; k++) {
+            if (box->jobs[k]->commit_wal == wal && box->jobs[k]->commit_lsn > commit_lsn) {
+                commit_lsn = box->jobs[k]->commit_lsn;
+            }
+        }
+        int failed = wal_wait_durable(wal, commit_lsn) != 0;
+        for (int k = i; k < box->count; k++) {
+            job *j = box->jobs[k];
+            if (!j->commit_lsn || j->commit_wal != wal) continue;
+            waited[k] = 1;
+            if (failed && j->response->status == COMPLETED) {
+                j->response->status = FAILED;
+                j->response->error = INTERNAL_ERROR;
+            }
+        }
+    }
+
+    int open = 0;
+    for (int i = 0; i < box->count; i++) {
+        if (sent[i]) continue;
+        client_connection_t *client = box->jobs[i]->client;
+        // Never block on a send lock while holding others: two workers
+        // could be waiting for each other's connections
+        int locked = 1;
+        if (open > 0 && connection_send_try_begin(client) != 0) {
+            send_batches(batches, open);
+            open = 0;
+        }
+        if (open == 0) locked = connection_send_begin(client) == 0;
+        if (locked) connection_send_lend(client);
+        else connection_send_later_begin(client);
+        send_batch *batch = &batches[open++];
+        batch->client = client;
+        batch->iovcnt = 0;
+        batch->locked = locked;
+        batch->failed = 0;
+        batch->jobs = NULL;
+        job **tail = &batch->jobs;
+        for (int k = i; k < box->count; k++) {
+            job *j = box->jobs[k];
+            if (sent[k] || j->client != client) continue;
+            sent[k] = 1;
+            j->next_job = NULL;
+            *tail = j;
+            tail = &j->next_job;
+            size_t data_len = response_data_len(j->response);
+            batch_add(batch, heads[k], encode_response(j, heads[k], data_len));
+            if (data_len) batch_add_value(batch, j, data_len);
+        }
+        if (open == CONNECTION_SEND_SET) {
+            send_batches(batches, open);
+            open = 0;
+        }
+    }
+    send_batches(batches, open);
+    box->count = 0;
+}
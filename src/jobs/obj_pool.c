@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "obj_pool.h"
+
+// A free object links to the next one in its list; the first object of a
+// depot batch also links to the next batch.
+typedef struct pool_obj{
+    struct pool_obj *next;
+    struct pool_obj *next_batch;
+} pool_obj;
+
+typedef struct obj_pool_cache{
+    obj_pool *pool;
+    pool_obj *head;
+    int count;
+    uint64_t hits, misses;      /* folded into the pool on every depot visit */
+} obj_pool_cache;
+
+static void cache_fold_stats(obj_pool_cache *cache){
+    if (cache->hits) __atomic_add_fetch(&cache->pool->hits, cache->hits, __ATOMIC_RELAXED);
+    if (cache->misses) __atomic_add_fetch(&cache->pool->misses, cache->misses, __ATOMIC_RELAXED);
+    cache->hits = cache->misses = 0;
+}
+
+// Moves one batch from the head of the cache to the depot, or back to
+// malloc when the depot is full
+static void cache_spill(obj_pool_cache *cache){
+    obj_pool *pool = cache->pool;
+    pool_obj *batch = cache->head;
+    pool_obj *last = batch;
+    int n = 1;
+    while (n < OBJ_POOL_BATCH && last->next) {
+        last = last->next;
+        n++;
+    }
+    cache->head = last->next;
+    cache->count -= n;
+    last->next = NULL;
+
+    int kept = 0;
+    if (n == OBJ_POOL_BATCH) {
+        pthread_mutex_lock(&pool->mutex);
+        if (pool->depot_batches < OBJ_POOL_DEPOT_MAX) {
+            batch->next_batch = (pool_obj *)pool->depot;
+            pool->depot = batch;
+            pool->depot_batches++;
+            kept = 1;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    if (!kept) {
+        while (batch) {
+            pool_obj *next = batch->next;
+            free(batch);
+            batch = next;
+        }
+    }
+    cache_fold_stats(cache);
+}
+
+// Thread exit: hand everything cached back
+static void cache_release(void *ptr){
+    obj_pool_cache *cache = (obj_pool_cache *)ptr;
+    while (cache->head) cache_spill(cache);
+    cache_fold_stats(cache);
+    free(cache);
+}
+
+static obj_pool_cache * thread_cache(obj_pool *pool){
+    obj_pool_cache *cache = pthread_getspecific(pool->cache_key);
+    if (cache) return cache;
+    cache = calloc(1, sizeof(*cache));
+    if (!cache) return NULL;
+    cache->pool = pool;
+    if (pthread_setspecific(pool->cache_key, cache) != 0) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+int obj_pool_init(obj_pool *pool, const char *name, size_t obj_size){
+    if (!pool) return -1;
+    memset(pool, 0, sizeof(*pool));
+    pool->name = name;
+    pool->obj_size = obj_size < sizeof(pool_obj) ? sizeof(pool_obj) : obj_size;
+    if (pthread_key_create(&pool->cache_key, cache_release) != 0) {
+        syslog(LOG_ERR, "keystored::failed to create %s pool", name);
+        return -1;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    return 0;
+}
+
+void obj_pool_destroy(obj_pool *pool){
+    if (!pool || !pool->obj_size) return;
+    // Objects still cached by live threads are left to process exit
+    pthread_key_delete(pool->cache_key);
+    pool_obj *batch = (pool_obj *)pool->depot;
+    while (batch) {
+        pool_obj *next_batch = batch->next_batch;
+        while (batch) {
+            pool_obj *next = batch->next;
+            free(batch);
+            batch = next;
+        }
+        batch = next_batch;
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    memset(pool, 0, sizeof(*pool));
+}
+
+void * obj_pool_alloc(obj_pool *pool){
+    obj_pool_cache *cache = thread_cache(pool);
+    if (!cache) return malloc(pool->obj_size);
+
+    if (!cache->head) {
+        pthread_mutex_lock(&pool->mutex);
+        pool_obj *batch = (pool_obj *)pool->depot;
+        if (batch) {
+            pool->depot = batch->next_batch;
+            pool->depot_batches--;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+        if (batch) {
+            cache->head = batch;
+            cache->count = OBJ_POOL_BATCH;
+        }
+        cache_fold_stats(cache);
+    }
+    if (cache->head) {
+        pool_obj *obj = cache->head;
+        cache->head = obj->next;
+        cache->count--;
+        cache->hits++;
+        return obj;
+    }
+    cache->misses++;
+    return malloc(pool->obj_size);
+}
+
+void obj_pool_free(obj_pool *pool, void *obj){
+    if (!obj) return;
+    obj_pool_cache *cache = thread_cache(pool);
+    if (!cache) {
+        free(obj);
+        return;
+    }
+    pool_obj *po = (pool_obj *)obj;
+    po->next = cache->head;
+    cache->head = po;
+    if (++cache->count >= OBJ_POOL_CACHE_MAX) cache_spill(cache);
+}
+
+void obj_pool_stats(const obj_pool *pool, uint64_t *hits, uint64_t *misses){
+    if (hits) *hits = __atomic_load_n(&pool->hits, __ATOMIC_RELAXED);
+    if (misses) *misses = __atomic_load_n(&pool->misses, __ATOMIC_RELAXED);
+}
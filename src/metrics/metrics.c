@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+#define METRICS_BUFFER_MIN    16384
+#define METRICS_POLL_MS       200     /* how soon the server notices metrics_serve_stop() */
+
+static const char *const g_op_names[METRICS_OPCODES] = {
+    "OTHER", "PUT", "GET", "DELETE", "MGET", "MPUT", "MDELETE", "STATS"
+};
+
+static const char *const g_stage_names[METRICS_STAGES] = { "queue", "execute", "send", "total" };
+
+// Upper bounds of the exported histogram buckets, in nanoseconds. The
+// recorded histograms are much finer; a bucket is counted below a bound
+// when its highest value is.
+static const uint64_t g_bounds_ns[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+    1000000000, 2500000000ull, 5000000000ull, 10000000000ull
+};
+
+// Threads are only ever added: their counters outlive them
+static pthread_mutex_t g_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_thread *g_threads;
+static __thread metrics_thread *t_metrics;
+static void (*g_source)(metrics_buffer *buf);
+
+static int g_serve_fd = -1;
+static int g_serve_stop;
+static pthread_t g_serve_thread;
+static char g_serve_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static metrics_thread * thread_metrics(void){
+    if (t_metrics) return t_metrics;
+    metrics_thread *m = calloc(1, sizeof(metrics_thread));
+    if (!m) return NULL;
+    snprintf(m->name, sizeof(m->name), "other");
+    pthread_mutex_lock(&g_threads_mutex);
+    m->next = g_threads;
+    g_threads = m;
+    pthread_mutex_unlock(&g_threads_mutex);
+    t_metrics = m;
+    return m;
+}
+
+void metrics_thread_init(const char *name){
+    metrics_thread *m = thread_metrics();
+    if (!m) return;
+    pthread_mutex_lock(&g_threads_mutex);
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    pthread_mutex_unlock(&g_threads_mutex);
+}
+
+static void stage_record(metrics_thread *m, int op, int stage, uint64_t from, uint64_t to){
+    if (!from || !to || to < from) return;
+    histogram *h = m->latency[op][stage];
+    if (!h) {
+        h = calloc(1, sizeof(histogram));
+        if (!h) return;
+        __atomic_store_n(&m->latency[op][stage], h, __ATOMIC_RELEASE);
+    }
+    histogram_record(h, to - from);
+}
+
+void metrics_record(int opcode, int failed, uint64_t recv_ns, uint64_t start_ns,
+                    uint64_t done_ns, uint64_t sent_ns){
+    metrics_thread *m = thread_metrics();
+    if (!m) return;
+    int op = opcode > 0 && opcode < METRICS_OPCODES ? opcode : 0;
+    __atomic_store_n(&m->requests[op], m->requests[op] + 1, __ATOMIC_RELAXED);
+    if (failed) __atomic_store_n(&m->errors[op], m->errors[op] + 1, __ATOMIC_RELAXED);
+    stage_record(m, op, METRICS_STAGE_QUEUE, recv_ns, start_ns);
+    stage_record(m, op, METRICS_STAGE_EXECUTE, start_ns, done_ns);
+    stage_record(m, op, METRICS_STAGE_SEND, done_ns, sent_ns);
+    stage_record(m, op, METRICS_STAGE_TOTAL, recv_ns, sent_ns);
+}
+
+void metrics_printf(metrics_buffer *buf, const char *fmt, ...){
+    if (buf->failed) return;
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        size_t room = buf->cap - buf->len;
+        int n = vsnprintf(buf->data ? buf->data + buf->len : NULL, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            buf->failed = 1;
+            return;
+        }
+        if ((size_t)n < room) {
+            buf->len += (size_t)n;
+            return;
+        }
+        size_t cap = buf->cap ? buf->cap : METRICS_BUFFER_MIN;
+        while (cap - buf->len <= (size_t)n) cap *= 2;
+        char *data = realloc(buf->data, cap);
+        if (!data) {
+            buf->failed = 1;
+            return;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+}
+
+static void render_histogram(metrics_buffer *buf, const char *op, const char *stage, const histogram *h){
+    uint64_t below = 0;
+    unsigned i = 0;
+    for (size_t b = 0; b < sizeof(g_bounds_ns) / sizeof(g_bounds_ns[0]); b++) {
+        for (; i < HISTOGRAM_BUCKETS && histogram_bucket_value(i) <= g_bounds_ns[b]; i++) below += h->buckets[i];
+        metrics_printf(buf, "keystored_request_duration_seconds_bucket{op=\"%s\",stage=\"%s\",le=\"%g\"} %llu\n",
+                       op, stage, (double)g_bounds_ns[b] / 1e9, (unsigned long long)below);
+    }
+    for (; i < HISTOGRAM_BUCKETS; i++) below += h->buckets[i];
+    metrics_printf(buf, "keystored_request_duration_seconds_bucket{op=\"%s\",stage=\"%s\",le=\"+Inf\"} %llu\n",
+                   op, stage, (unsigned long long)below);
+    metrics_printf(buf, "keystored_request_duration_seconds_sum{op=\"%s\",stage=\"%s\"} %.9f\n",
+                   op, stage, (double)h->sum / 1e9);
+    metrics_printf(buf, "keystored_request_duration_seconds_count{op=\"%s\",stage=\"%s\"} %llu\n",
+                   op, stage, (unsigned long long)below);
+}
+
+static void render_threads(metrics_buffer *buf){
+    uint64_t requests[METRICS_OPCODES] = {0};
+    uint64_t errors[METRICS_OPCODES] = {0};
+    pthread_mutex_lock(&g_threads_mutex);
+    metrics_thread *threads = g_threads;
+    metrics_printf(buf, "# HELP keystored_thread_requests_total Requests answered by each thread.\n");
+    metrics_printf(buf, "# TYPE keystored_thread_requests_total counter\n");
+    for (metrics_thread *m = threads; m; m = m->next) {
+        uint64_t total = 0;
+        for (int op = 0; op < METRICS_OPCODES; op++) {
+            uint64_t n = __atomic_load_n(&m->requests[op], __ATOMIC_RELAXED);
+            requests[op] += n;
+            errors[op] += __atomic_load_n(&m->errors[op], __ATOMIC_RELAXED);
+            total += n;
+        }
+        metrics_printf(buf, "keystored_thread_requests_total{thread=\"%s\"} %llu\n", m->name,
+                       (unsigned long long)total);
+    }
+    pthread_mutex_unlock(&g_threads_mutex);
+
+    metrics_printf(buf, "# HELP keystored_requests_total Requests answered, by opcode.\n");
+    metrics_printf(buf, "# TYPE keystored_requests_total counter\n");
+    for (int op = 1; op < METRICS_OPCODES; op++) {
+        metrics_printf(buf, "keystored_requests_total{op=\"%s\"} %llu\n", g_op_names[op],
+                       (unsigned long long)requests[op]);
+    }
+    metrics_printf(buf, "# HELP keystored_request_errors_total Requests that failed, not counting missing keys, by opcode.\n");
+    metrics_printf(buf, "# TYPE keystored_request_errors_total counter\n");
+    for (int op = 1; op < METRICS_OPCODES; op++) {
+        metrics_printf(buf, "keystored_request_errors_total{op=\"%s\"} %llu\n", g_op_names[op],
+                       (unsigned long long)errors[op]);
+    }
+
+    // The list only grows at its head, so it can be walked without the
+    // lock from the head read above
+    histogram *merged = malloc(sizeof(histogram));
+    if (!merged) {
+        buf->failed = 1;
+        return;
+    }
+    static const double quantiles[] = { 50.0, 99.0, 99.9 };
+    metrics_printf(buf, "# HELP keystored_request_duration_seconds Request latency, by opcode and stage.\n");
+    metrics_printf(buf, "# TYPE keystored_request_duration_seconds histogram\n");
+    metrics_buffer summary;
+    memset(&summary, 0, sizeof(summary));
+    metrics_printf(&summary, "# HELP keystored_request_duration_quantile_seconds Request latency percentiles, by opcode and stage.\n");
+    metrics_printf(&summary, "# TYPE keystored_request_duration_quantile_seconds gauge\n");
+    for (int op = 0; op < METRICS_OPCODES; op++) {
+        for (int stage = 0; stage < METRICS_STAGES; stage++) {
+            histogram_reset(merged);
+            for (metrics_thread *m = threads; m; m = m->next) {
+                const histogram *h = __atomic_load_n(&m->latency[op][stage], __ATOMIC_ACQUIRE);
+                if (h) histogram_merge(merged, h);
+            }
+            if (merged->count == 0) continue;
+            render_histogram(buf, g_op_names[op], g_stage_names[stage], merged);
+            for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                metrics_printf(&summary, "keystored_request_duration_quantile_seconds{op=\"%s\",stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                               g_op_names[op], g_stage_names[stage], quantiles[q] / 100.0,
+                               (double)histogram_percentile(merged, quantiles[q]) / 1e9);
+            }
+        }
+    }
+    free(merged);
+    if (summary.failed) buf->failed = 1;
+    else if (summary.len) metrics_printf(buf, "%.*s", (int)summary.len, summary.data);
+    free(summary.data);
+}
+
+void metrics_render(metrics_buffer *buf){
+    render_threads(buf);
+    void (*source)(metrics_buffer *) = __atomic_load_n(&g_source, __ATOMIC_ACQUIRE);
+    if (source) source(buf);
+}
+
+void metrics_set_source(void (*source)(metrics_buffer *buf)){
+    __atomic_store_n(&g_source, source, __ATOMIC_RELEASE);
+}
+
+static void serve_client(int fd){
+    struct timeval timeout = { METRICS_SEND_TIMEOUT_MS / 1000, (METRICS_SEND_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    metrics_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    metrics_render(&buf);
+    if (buf.failed) {
+        syslog(LOG_ERR, "keystored::out of memory rendering metrics");
+    } else {
+        size_t off = 0;
+        while (off < buf.len) {
+            ssize_t n = send(fd, buf.data + off, buf.len - off, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            off += (size_t)n;
+        }
+    }
+    free(buf.data);
+    close(fd);
+}
+
+static void * serve_thread(void *arg){
+    (void)arg;
+    metrics_thread_init("metrics");
+    struct pollfd pfd = { g_serve_fd, POLLIN, 0 };
+    while (!__atomic_load_n(&g_serve_stop, __ATOMIC_ACQUIRE)) {
+        int ready = poll(&pfd, 1, METRICS_POLL_MS);
+        if (ready <= 0) continue;
+        int fd = accept(g_serve_fd, NULL, NULL);
+        if (fd >= 0) serve_client(fd);
+    }
+    return NULL;
+}
+
+int metrics_serve_start(const char *path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "keystored::metrics socket path too long: %s", path);
+        return -1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "keystored::metrics socket failed: %m");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        syslog(LOG_ERR, "keystored::cannot listen on metrics socket %s: %m", path);
+        close(fd);
+        return -1;
+    }
+    // Only the daemon's user and group may read the metrics
+    chmod(path, 0660);
+    g_serve_fd = fd;
+    g_serve_stop = 0;
+    snprintf(g_serve_path, sizeof(g_serve_path), "%s", path);
+    if (pthread_create(&g_serve_thread, NULL, serve_thread, NULL) != 0) {
+        syslog(LOG_ERR, "keystored::failed to start metrics thread");
+        close(fd);
+        unlink(path);
+        g_serve_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_serve_stop(void){
+    if (g_serve_fd < 0) return;
+    __atomic_store_n(&g_serve_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(g_serve_thread, NULL);
+    close(g_serve_fd);
+    unlink(g_serve_path);
+    g_serve_fd = -1;
+}
@@ -0,0 +1,583 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+
+#include "connection.h"
+#include "uring.h"
+
+#define CONNECTION_IOV_MAX 1024     /* iovecs one sendmsg takes on Linux */
+#define CONNECTION_BACKLOG_IOV 64   /* backlog iovecs gathered per sendmsg */
+#define CONNECTION_RING_ENTRIES 32  /* send ring of a thread, >= CONNECTION_SEND_SET */
+#define CONNECTION_WBUF_MIN 16384   /* smallest backlog segment of copied bytes */
+
+// A run of backlog bytes. Copied bytes live in `data`; the iovecs of a
+// lent segment point at the sender's buffers (and into `data` for short
+// ones), which release(arg) gives back once the segment is done with.
+typedef struct connection_segment {
+    struct connection_segment *next;
+    struct iovec *iov;      /* first iovec not sent completely */
+    size_t iovcnt;
+    size_t cap;             /* room in `data` for copied bytes, 0 == lent */
+    void (*release)(void *arg);
+    void *arg;
+    struct iovec copied;    /* the one iovec of copied bytes */
+    char data[];
+} connection_segment;
+
+static int g_use_uring;
+static pthread_key_t g_ring_key;
+static pthread_once_t g_ring_once = PTHREAD_ONCE_INIT;
+static uint64_t g_accepted;
+static uint64_t g_open;
+static __thread int t_nonblocking;  /* reactor thread: never waits for a send lock */
+
+client_connection_t * connection_create(int fd, const struct sockaddr_in *addr){
+    client_connection_t *conn = calloc(1, sizeof(client_connection_t));
+    if (!conn) return NULL;
+    conn->fd = fd;
+    conn->addr = *addr;
+    inet_ntop(AF_INET, &addr->sin_addr, conn->client_ip, INET_ADDRSTRLEN);
+    conn->port = ntohs(addr->sin_port);
+    conn->wire = WIRE_UNKNOWN;
+    conn->refcount = 1;
+    pthread_mutex_init(&conn->send_mutex, NULL);
+    pthread_mutex_init(&conn->wbuf_mutex, NULL);
+    __atomic_add_fetch(&g_accepted, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_open, 1, __ATOMIC_RELAXED);
+    return conn;
+}
+
+void connection_get(client_connection_t *conn){
+    __atomic_add_fetch(&conn->refcount, 1, __ATOMIC_RELAXED);
+}
+
+// Frees a list of segments, giving lent buffers back first
+static void segments_free(connection_segment *seg){
+    while (seg) {
+        connection_segment *next = seg->next;
+        if (seg->release) seg->release(seg->arg);
+        free(seg);
+        seg = next;
+    }
+}
+
+void connection_put(client_connection_t *conn){
+    if (!conn) return;
+    if (__atomic_sub_fetch(&conn->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->send_mutex);
+    pthread_mutex_destroy(&conn->wbuf_mutex);
+    // Lent segments hold references of their own, so only copies are left
+    segments_free(conn->wbuf_head);
+    free(conn->rbuf);
+    free(conn);
+    __atomic_sub_fetch(&g_open, 1, __ATOMIC_RELAXED);
+}
+
+void connection_counts(uint64_t *open, uint64_t *accepted){
+    *open = __atomic_load_n(&g_open, __ATOMIC_RELAXED);
+    *accepted = __atomic_load_n(&g_accepted, __ATOMIC_RELAXED);
+}
+
+void connection_shutdown(client_connection_t *conn){
+    __atomic_store_n(&conn->closed, 1, __ATOMIC_RELEASE);
+    shutdown(conn->fd, SHUT_RDWR);
+    // Nothing is added to the backlog once closed is seen under wbuf_mutex
+    pthread_mutex_lock(&conn->wbuf_mutex);
+    connection_segment *segs = conn->wbuf_head;
+    conn->wbuf_head = conn->wbuf_tail = conn->lent = NULL;
+    __atomic_store_n(&conn->backlog, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&conn->wbuf_mutex);
+    segments_free(segs);
+}
+
+// Moves `msg` past `sent` bytes; returns the iovecs left
+static size_t msg_advance(struct msghdr *msg, size_t left, size_t sent){
+    while (left > 0 && sent >= msg->msg_iov->iov_len) {
+        sent -= msg->msg_iov->iov_len;
+        msg->msg_iov++;
+        left--;
+    }
+    if (left > 0) {
+        msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + sent;
+        msg->msg_iov->iov_len -= sent;
+    }
+    return left;
+}
+
+void connection_thread_nonblocking(void){
+    t_nonblocking = 1;
+}
+
+int connection_mailbox_init(connection_mailbox *box){
+    box->head = NULL;
+    box->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (box->fd < 0) return -1;
+    pthread_mutex_init(&box->mutex, NULL);
+    return 0;
+}
+
+void connection_mailbox_free(connection_mailbox *box){
+    client_connection_t *conn = connection_mailbox_take(box);
+    while (conn) {
+        client_connection_t *next = connection_mailbox_next(conn);
+        connection_put(conn);
+        conn = next;
+    }
+    close(box->fd);
+    pthread_mutex_destroy(&box->mutex);
+}
+
+void connection_mailbox_wake(connection_mailbox *box){
+    uint64_t one = 1;
+    // A full counter already wakes the reader
+    ssize_t rc = write(box->fd, &one, sizeof(one));
+    (void)rc;
+}
+
+void connection_mailbox_post(client_connection_t *conn){
+    connection_mailbox *box = conn->mailbox;
+    if (!box) return;
+    pthread_mutex_lock(&box->mutex);
+    int posted = conn->mailed;
+    if (!posted) {
+        connection_get(conn);
+        conn->mailed = 1;
+        conn->next_mail = box->head;
+        box->head = conn;
+    }
+    pthread_mutex_unlock(&box->mutex);
+    if (!posted) connection_mailbox_wake(box);
+}
+
+client_connection_t * connection_mailbox_take(connection_mailbox *box){
+    pthread_mutex_lock(&box->mutex);
+    client_connection_t *head = box->head;
+    box->head = NULL;
+    pthread_mutex_unlock(&box->mutex);
+    return head;
+}
+
+client_connection_t * connection_mailbox_next(client_connection_t *conn){
+    connection_mailbox *box = conn->mailbox;
+    pthread_mutex_lock(&box->mutex);
+    client_connection_t *next = conn->next_mail;
+    conn->mailed = 0;
+    pthread_mutex_unlock(&box->mutex);
+    return next;
+}
+
+// Sends the `left` iovecs of `msg` until the socket is full. Returns the
+// iovecs not sent completely, or -1 on failure.
+static ssize_t send_msg(client_connection_t *conn, struct msghdr *msg, size_t left){
+    while (left > 0) {
+        if (__atomic_load_n(&conn->closed, __ATOMIC_ACQUIRE)) return -1;
+        msg->msg_iovlen = left < CONNECTION_IOV_MAX ? left : CONNECTION_IOV_MAX;
+        ssize_t sent = sendmsg(conn->fd, msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        // Skip what went out and retry with the remainder
+        left = msg_advance(msg, left, (size_t)sent);
+    }
+    return (ssize_t)left;
+}
+
+// Links a segment at the end of the backlog, or with `front` at its
+// start. Caller holds wbuf_mutex.
+static void backlog_link(client_connection_t *conn, connection_segment *seg, size_t len, int front){
+    if (front) {
+        seg->next = conn->wbuf_head;
+        conn->wbuf_head = seg;
+        if (!conn->wbuf_tail) conn->wbuf_tail = seg;
+    } else {
+        seg->next = NULL;
+        if (conn->wbuf_tail) conn->wbuf_tail->next = seg;
+        else conn->wbuf_head = seg;
+        conn->wbuf_tail = seg;
+    }
+    __atomic_store_n(&conn->backlog, conn->backlog + len, __ATOMIC_RELEASE);
+}
+
+// Copies iovecs to the end of the backlog, filling the last segment of
+// copied bytes first. Caller holds wbuf_mutex.
+static int backlog_copy(client_connection_t *conn, const struct iovec *iov, size_t iovcnt, size_t len){
+    connection_segment *tail = conn->wbuf_tail;
+    size_t room = 0;
+    if (tail && tail->cap > 0) {
+        room = tail->cap - (size_t)((char *)tail->copied.iov_base + tail->copied.iov_len - tail->data);
+    }
+    connection_segment *seg = NULL;
+    if (room < len) {
+        size_t cap = len - room > CONNECTION_WBUF_MIN ? len - room : CONNECTION_WBUF_MIN;
+        seg = malloc(sizeof(*seg) + cap);
+        if (!seg) {
+            syslog(LOG_ERR, "keystored::failed to grow send backlog for client %s:%d",
+                   conn->client_ip, conn->port);
+            return -1;
+        }
+        seg->iov = &seg->copied;
+        seg->iovcnt = 1;
+        seg->cap = cap;
+        seg->release = NULL;
+        seg->copied.iov_base = seg->data;
+        seg->copied.iov_len = 0;
+    }
+    size_t added = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        const char *src = iov[i].iov_base;
+        size_t n = iov[i].iov_len;
+        while (n > 0) {
+            connection_segment *dst = room > 0 ? tail : seg;
+            size_t take = room > 0 && room < n ? room : n;
+            memcpy((char *)dst->copied.iov_base + dst->copied.iov_len, src, take);
+            dst->copied.iov_len += take;
+            if (room > 0) {
+                room -= take;
+                added += take;
+            }
+            src += take;
+            n -= take;
+        }
+    }
+    if (added) __atomic_store_n(&conn->backlog, conn->backlog + added, __ATOMIC_RELEASE);
+    if (seg) backlog_link(conn, seg, len - added, 0);
+    return 0;
+}
+
+// Adds iovecs to the backlog: copied, or with `lend`, kept by reference
+// when they are large. They go at the end, or with `front` ahead of what
+// others added while the caller's response was half sent. Caller holds
+// wbuf_mutex.
+static int backlog_append(client_connection_t *conn, const struct iovec *iov, size_t iovcnt,
+                          int lend, int front){
+    // A shut down connection dropped its backlog for good
+    if (__atomic_load_n(&conn->closed, __ATOMIC_ACQUIRE)) return -1;
+    size_t len = 0;
+    size_t copy = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+        if (!lend || iov[i].iov_len < CONNECTION_LEND_MIN) copy += iov[i].iov_len;
+    }
+    if (len == 0) return 0;
+    if (copy == len && !front) return backlog_copy(conn, iov, iovcnt, len);
+
+    connection_segment *seg = malloc(sizeof(*seg) + iovcnt * sizeof(struct iovec) + copy);
+    if (!seg) {
+        syslog(LOG_ERR, "keystored::failed to grow send backlog for client %s:%d",
+               conn->client_ip, conn->port);
+        return -1;
+    }
+    seg->iov = (struct iovec *)seg->data;
+    seg->iovcnt = 0;
+    seg->cap = 0;
+    seg->release = NULL;
+    char *bytes = seg->data + iovcnt * sizeof(struct iovec);
+    for (size_t i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) continue;
+        struct iovec *dst = &seg->iov[seg->iovcnt++];
+        *dst = iov[i];
+        if (lend && iov[i].iov_len >= CONNECTION_LEND_MIN) continue;
+        memcpy(bytes, iov[i].iov_base, iov[i].iov_len);
+        dst->iov_base = bytes;
+        bytes += iov[i].iov_len;
+    }
+    backlog_link(conn, seg, len, front);
+    if (copy < len) conn->lent = seg;
+    return 0;
+}
+
+// Drops `sent` bytes from the front of the backlog and moves the segments
+// done with to `done`. Caller holds wbuf_mutex.
+static void backlog_consume(client_connection_t *conn, size_t sent, connection_segment **done){
+    __atomic_store_n(&conn->backlog, conn->backlog - sent, __ATOMIC_RELEASE);
+    while (conn->wbuf_head) {
+        connection_segment *seg = conn->wbuf_head;
+        while (seg->iovcnt > 0 && sent >= seg->iov->iov_len) {
+            sent -= seg->iov->iov_len;
+            seg->iov++;
+            seg->iovcnt--;
+        }
+        if (seg->iovcnt > 0) {
+            seg->iov->iov_base = (char *)seg->iov->iov_base + sent;
+            seg->iov->iov_len -= sent;
+            return;
+        }
+        conn->wbuf_head = seg->next;
+        if (!conn->wbuf_head) conn->wbuf_tail = NULL;
+        if (conn->lent == seg) conn->lent = NULL;
+        seg->next = *done;
+        *done = seg;
+    }
+}
+
+// Sends from the front of the backlog until the socket is full; the caller
+// holds send_mutex, so no response of its own is half sent.
+static int backlog_send(client_connection_t *conn){
+    connection_segment *done = NULL;
+    int rc = 0;
+    pthread_mutex_lock(&conn->wbuf_mutex);
+    while (conn->wbuf_head) {
+        struct iovec iov[CONNECTION_BACKLOG_IOV];
+        int count = 0;
+        for (connection_segment *seg = conn->wbuf_head; seg && count < CONNECTION_BACKLOG_IOV; seg = seg->next) {
+            for (size_t i = 0; i < seg->iovcnt && count < CONNECTION_BACKLOG_IOV; i++) iov[count++] = seg->iov[i];
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)count;
+        ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) rc = -1;
+            break;
+        }
+        backlog_consume(conn, (size_t)sent, &done);
+    }
+    pthread_mutex_unlock(&conn->wbuf_mutex);
+    // Lent buffers are given back outside the lock; the caller's own
+    // reference keeps the connection alive meanwhile
+    segments_free(done);
+    return rc;
+}
+
+// Caller holds send_mutex and has sent the backlog as far as it could.
+// What the socket does not take is kept in the backlog, behind anything
+// still there.
+static int send_locked(client_connection_t *conn, struct iovec *iov, int iovcnt){
+    if (__atomic_load_n(&conn->closed, __ATOMIC_ACQUIRE)) return -1;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    pthread_mutex_lock(&conn->wbuf_mutex);
+    ssize_t left = (ssize_t)iovcnt;
+    if (!conn->wbuf_head) left = send_msg(conn, &msg, (size_t)iovcnt);
+    int rc = left < 0 ? -1 : backlog_append(conn, msg.msg_iov, (size_t)left, conn->lending, 0);
+    pthread_mutex_unlock(&conn->wbuf_mutex);
+    return rc;
+}
+
+// Lets go of send_mutex. What a worker leaves in the backlog is sent by the
+// reactor, which it asks to; a reactor watches its connections itself.
+static void send_release(client_connection_t *conn){
+    pthread_mutex_unlock(&conn->send_mutex);
+    if (!t_nonblocking && connection_backlog(conn) > 0) connection_mailbox_post(conn);
+}
+
+int connection_send(client_connection_t *conn, struct iovec *iov, int iovcnt){
+    if (__atomic_load_n(&conn->closed, __ATOMIC_ACQUIRE)) return -1;
+    if (connection_send_begin(conn) != 0) return connection_send_later(conn, iov, iovcnt);
+    int rc = send_locked(conn, iov, iovcnt);
+    connection_send_end(conn);
+    return rc;
+}
+
+int connection_send_begin(client_connection_t *conn){
+    if (t_nonblocking) return connection_send_try_begin(conn);
+    pthread_mutex_lock(&conn->send_mutex);
+    // A failure shows in the sends that follow
+    backlog_send(conn);
+    return 0;
+}
+
+int connection_send_try_begin(client_connection_t *conn){
+    if (pthread_mutex_trylock(&conn->send_mutex) != 0) return -1;
+    backlog_send(conn);
+    return 0;
+}
+
+int connection_send_part(client_connection_t *conn, struct iovec *iov, int iovcnt){
+    return send_locked(conn, iov, iovcnt);
+}
+
+void connection_send_end(client_connection_t *conn){
+    send_release(conn);
+}
+
+void connection_send_lend(client_connection_t *conn){
+    conn->lending = 1;
+}
+
+int connection_send_end_lent(client_connection_t *conn, void (*release)(void *), void *arg){
+    pthread_mutex_lock(&conn->wbuf_mutex);
+    connection_segment *seg = conn->lent;
+    // The last segment lent is sent after all the others
+    if (seg) {
+        seg->release = release;
+        seg->arg = arg;
+    }
+    conn->lent = NULL;
+    conn->lending = 0;
+    pthread_mutex_unlock(&conn->wbuf_mutex);
+    send_release(conn);
+    return seg != NULL;
+}
+
+int connection_send_later(client_connection_t *conn, struct iovec *iov, int iovcnt){
+    connection_send_later_begin(conn);
+    int rc = connection_send_later_part(conn, iov, iovcnt);
+    connection_send_later_end(conn);
+    return rc;
+}
+
+// Holding wbuf_mutex keeps the send lock holder from sending half a response
+void connection_send_later_begin(client_connection_t *conn){
+    pthread_mutex_lock(&conn->wbuf_mutex);
+}
+
+int connection_send_later_part(client_connection_t *conn, struct iovec *iov, int iovcnt){
+    return backlog_append(conn, iov, (size_t)iovcnt, 0, 0);
+}
+
+void connection_send_later_end(client_connection_t *conn){
+    pthread_mutex_unlock(&conn->wbuf_mutex);
+    // The holder of the send lock sends the backlog or leaves it to the
+    // reactor, unless it let go before the append
+    if (pthread_mutex_trylock(&conn->send_mutex) == 0) {
+        backlog_send(conn);
+        pthread_mutex_unlock(&conn->send_mutex);
+    }
+}
+
+int connection_flush(client_connection_t *conn){
+    if (__atomic_load_n(&conn->closed, __ATOMIC_ACQUIRE)) return -1;
+    // A worker holding the lock hands the backlog back when it lets go
+    if (pthread_mutex_trylock(&conn->send_mutex) != 0) return 1;
+    int rc = backlog_send(conn);
+    pthread_mutex_unlock(&conn->send_mutex);
+    if (rc != 0) return -1;
+    return connection_backlog(conn) > 0;
+}
+
+void connection_use_uring(int enable){
+    g_use_uring = enable;
+}
+
+static void ring_release(void *ptr){
+    uring_free((uring *)ptr);
+    free(ptr);
+}
+
+static void ring_key_init(void){
+    pthread_key_create(&g_ring_key, ring_release);
+}
+
+// The calling thread's send ring, set up on first use; NULL falls back to
+// sendmsg()
+static uring * thread_ring(void){
+    if (!g_use_uring) return NULL;
+    pthread_once(&g_ring_once, ring_key_init);
+    uring *ring = pthread_getspecific(g_ring_key);
+    if (ring) return ring;
+    ring = malloc(sizeof(*ring));
+    if (!ring) return NULL;
+    if (uring_init(ring, CONNECTION_RING_ENTRIES, 0) != 0) {
+        syslog(LOG_WARNING, "keystored::failed to set up send ring: %m");
+        free(ring);
+        return NULL;
+    }
+    if (pthread_setspecific(g_ring_key, ring) != 0) {
+        ring_release(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+int connection_send_set_add(connection_send_set *set, client_connection_t *conn,
+                            struct iovec *iov, int iovcnt){
+    if (set->count == CONNECTION_SEND_SET) return -1;
+    connection_send_op *send = &set->sends[set->count];
+    memset(send, 0, sizeof(*send));
+    send->conn = conn;
+    send->msg.msg_iov = iov;
+    send->left = (size_t)iovcnt;
+    return set->count++;
+}
+
+void connection_send_set_run(connection_send_set *set){
+    uring *ring = thread_ring();
+    if (!ring) {
+        for (int i = 0; i < set->count; i++) {
+            connection_send_op *send = &set->sends[i];
+            send->failed = send_locked(send->conn, send->msg.msg_iov, (int)send->left) != 0;
+        }
+        return;
+    }
+    // Responses queue up behind a backlog the socket has not taken yet
+    int behind[CONNECTION_SEND_SET];
+    for (int i = 0; i < set->count; i++) {
+        connection_send_op *send = &set->sends[i];
+        send->full = connection_backlog(send->conn) > 0;
+        behind[i] = send->full;
+    }
+
+    // Every round submits what is left of each send and reaps all of them;
+    // a short send goes again with its remainder in the next round
+    for (;;) {
+        unsigned queued = 0;
+        for (int i = 0; i < set->count; i++) {
+            connection_send_op *send = &set->sends[i];
+            if (send->failed || send->full || send->left == 0) continue;
+            if (__atomic_load_n(&send->conn->closed, __ATOMIC_ACQUIRE)) {
+                send->failed = 1;
+                continue;
+            }
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            if (!sqe) {
+                send->failed = 1;
+                continue;
+            }
+            send->msg.msg_iovlen = send->left < CONNECTION_IOV_MAX ? send->left : CONNECTION_IOV_MAX;
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = send->conn->fd;
+            sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+            sqe->user_data = (uint64_t)i;
+            queued++;
+        }
+        if (queued == 0) break;
+
+        unsigned reaped = 0;
+        int rc = uring_submit_and_wait(ring, queued, -1);
+        while (reaped < queued) {
+            struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+            if (!cqe) {
+                // Interrupted by a signal; the sends are in flight regardless
+                if (rc < 0 && rc != -EINTR) break;
+                rc = uring_submit_and_wait(ring, queued - reaped, -1);
+                continue;
+            }
+            connection_send_op *send = &set->sends[cqe->user_data];
+            if (cqe->res == -EAGAIN) send->full = 1;
+            else if (cqe->res <= 0) send->failed = 1;
+            else send->left = msg_advance(&send->msg, send->left, (size_t)cqe->res);
+            uring_cqe_seen(ring);
+            reaped++;
+        }
+        if (reaped < queued) {
+            // The ring itself failed; nothing more can be told apart
+            syslog(LOG_ERR, "keystored::send ring failed: %s", strerror(-rc));
+            for (int i = 0; i < set->count; i++) set->sends[i].failed |= set->sends[i].left > 0;
+            return;
+        }
+    }
+
+    for (int i = 0; i < set->count; i++) {
+        connection_send_op *send = &set->sends[i];
+        if (!send->full || send->failed || send->left == 0) continue;
+        // A response partly on the wire goes ahead of any a reactor added
+        // meanwhile, or the two would interleave
+        pthread_mutex_lock(&send->conn->wbuf_mutex);
+        send->failed = backlog_append(send->conn, send->msg.msg_iov, send->left,
+                                      send->conn->lending, !behind[i]) != 0;
+        pthread_mutex_unlock(&send->conn->wbuf_mutex);
+        send->left = 0;
+    }
+}
@@ -0,0 +1,199 @@
+#define _DEFAULT_SOURCE /* syscall() */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+// Multishot accept/recv and provided buffer rings need Linux 6.0, the same
+// release that added linked file assignment; waiting with a timeout needs
+// the extended enter arguments
+#define URING_REQUIRED_FEATURES (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_LINKED_FILE)
+
+static int sys_setup(unsigned entries, struct io_uring_params *p){
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz){
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args){
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_unmap(uring *ring){
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+int uring_init(uring *ring, unsigned entries, unsigned cq_entries){
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (cq_entries) {
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+    }
+    ring->fd = sys_setup(entries, &p);
+    if (ring->fd < 0) return -1;
+    if ((p.features & URING_REQUIRED_FEATURES) != URING_REQUIRED_FEATURES) {
+        close(ring->fd);
+        ring->fd = -1;
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // Both rings share one mapping on every kernel with the features above
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = ring->sq_ring == MAP_FAILED ? MAP_FAILED
+               : mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int err = errno;
+        ring_unmap(ring);
+        close(ring->fd);
+        ring->fd = -1;
+        errno = err;
+        return -1;
+    }
+
+    char *sq = (char *)ring->sq_ring;
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(sq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+    // SQE i always sits in array slot i
+    for (unsigned i = 0; i < p.sq_entries; i++) ring->sq_array[i] = i;
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+}
+
+void uring_free(uring *ring){
+    if (!ring || ring->fd < 0) return;
+    ring_unmap(ring);
+    close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+int uring_supported(void){
+    uring ring;
+    if (uring_init(&ring, 4, 0) != 0) return 0;
+    uring_free(&ring);
+    return 1;
+}
+
+struct io_uring_sqe * uring_get_sqe(uring *ring){
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        if (uring_submit_and_wait(ring, 0, 0) < 0) return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head >= ring->sq_entries) return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(uring *ring, unsigned wait_nr, int timeout_ms){
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    int rc = sys_enter(ring->fd, to_submit, wait_nr, flags, flags ? &arg : NULL, flags ? sizeof(arg) : 0);
+    return rc < 0 ? -errno : rc;
+}
+
+struct io_uring_cqe * uring_peek_cqe(uring *ring){
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring *ring){
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_buf_ring_init(uring *ring, uring_buf_ring *bufs, uint16_t group, unsigned count, unsigned size){
+    memset(bufs, 0, sizeof(*bufs));
+    if (count == 0 || (count & (count - 1)) != 0 || count > 32768) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t ring_bytes = (size_t)count * sizeof(struct io_uring_buf);
+    void *mem = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return -1;
+    bufs->buffers = malloc((size_t)count * size);
+    if (!bufs->buffers) {
+        munmap(mem, ring_bytes);
+        return -1;
+    }
+    bufs->ring = (struct io_uring_buf_ring *)mem;
+    bufs->count = count;
+    bufs->size = size;
+    bufs->group = group;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)mem;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = errno;
+        free(bufs->buffers);
+        munmap(mem, ring_bytes);
+        memset(bufs, 0, sizeof(*bufs));
+        errno = err;
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) uring_buf_ring_recycle(bufs, (uint16_t)i);
+    return 0;
+}
+
+void uring_buf_ring_free(uring *ring, uring_buf_ring *bufs){
+    if (!bufs || !bufs->ring) return;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = bufs->group;
+    if (ring && ring->fd >= 0) sys_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(bufs->ring, (size_t)bufs->count * sizeof(struct io_uring_buf));
+    free(bufs->buffers);
+    memset(bufs, 0, sizeof(*bufs));
+}
+
+void uring_buf_ring_recycle(uring_buf_ring *bufs, uint16_t bid){
+    struct io_uring_buf *buf = &bufs->ring->bufs[bufs->tail & (bufs->count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf_ring_buffer(bufs, bid);
+    buf->len = bufs->size;
+    buf->bid = bid;
+    bufs->tail++;
+    __atomic_store_n(&bufs->ring->tail, bufs->tail, __ATOMIC_RELEASE);
+}
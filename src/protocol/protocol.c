@@ -0,0 +1,94 @@
+#include "protocol.h"
+
+static inline void put_u16(uint8_t *p, uint16_t v){
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v){
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint16_t get_u16(const uint8_t *p){
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get_u32(const uint8_t *p){
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+void kv_encode_request_header(uint8_t *buf, const kv_request_header *hdr){
+    buf[0] = KV_FRAME_MAGIC;
+    buf[1] = hdr->opcode;
+    put_u16(buf + 2, hdr->key_len);
+    put_u32(buf + 4, hdr->value_len);
+    put_u32(buf + 8, hdr->request_id);
+}
+
+int kv_decode_request_header(const uint8_t *buf, kv_request_header *hdr){
+    if (buf[0] != KV_FRAME_MAGIC) return -1;
+    hdr->opcode = buf[1];
+    hdr->key_len = get_u16(buf + 2);
+    hdr->value_len = get_u32(buf + 4);
+    hdr->request_id = get_u32(buf + 8);
+    return 0;
+}
+
+void kv_encode_response_header(uint8_t *buf, const kv_response_header *hdr){
+    buf[0] = KV_FRAME_MAGIC;
+    buf[1] = hdr->opcode;
+    buf[2] = hdr->status;
+    buf[3] = hdr->error;
+    put_u32(buf + 4, hdr->value_len);
+    put_u32(buf + 8, hdr->request_id);
+}
+
+int kv_decode_response_header(const uint8_t *buf, kv_response_header *hdr){
+    if (buf[0] != KV_FRAME_MAGIC) return -1;
+    hdr->opcode = buf[1];
+    hdr->status = buf[2];
+    hdr->error = buf[3];
+    hdr->value_len = get_u32(buf + 4);
+    hdr->request_id = get_u32(buf + 8);
+    return 0;
+}
+
+void kv_encode_batch_count(uint8_t *buf, uint32_t count){
+    put_u32(buf, count);
+}
+
+uint32_t kv_decode_batch_count(const uint8_t *buf){
+    return get_u32(buf);
+}
+
+void kv_encode_batch_entry(uint8_t *buf, uint16_t key_len, uint32_t value_len){
+    put_u16(buf, key_len);
+    put_u32(buf + 2, value_len);
+}
+
+int kv_decode_batch_entry(const uint8_t *buf, size_t len, size_t *off, kv_batch_entry *out){
+    if (len < *off || len - *off < KV_BATCH_REQ_ENTRY_SIZE) return -1;
+    const uint8_t *p = buf + *off;
+    out->key_len = get_u16(p);
+    out->value_len = get_u32(p + 2);
+    size_t body = (size_t)out->key_len + (size_t)out->value_len;
+    if (len - *off - KV_BATCH_REQ_ENTRY_SIZE < body) return -1;
+    out->key = (const char *)p + KV_BATCH_REQ_ENTRY_SIZE;
+    out->value = out->key + out->key_len;
+    *off += KV_BATCH_REQ_ENTRY_SIZE + body;
+    return 0;
+}
+
+void kv_encode_batch_result(uint8_t *buf, uint8_t error, uint32_t value_len){
+    buf[0] = error;
+    put_u32(buf + 1, value_len);
+}
+
+void kv_decode_batch_result(const uint8_t *buf, uint8_t *error, uint32_t *value_len){
+    *error = buf[0];
+    *value_len = get_u32(buf + 1);
+}
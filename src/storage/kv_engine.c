@@ -0,0 +1,1442 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "kv_engine.h"
+#include "wal.h"
+
+// ---------------- Linear hashing ----------------
+//   - The table has base_buckets << level buckets plus `split` buckets that
+//     were already split off; key -> bucket is hash % size, or hash % 2*size
+//     below the split pointer
+//   - Splitting bucket s moves the records that belong to s + size under the
+//     doubled table, then advances the split pointer; the pointer wraps to 0
+//     and the level goes up once every bucket of the level was split
+//   - Bucket heads live in directory segments; level, split pointer and the
+//     record count are kept in the superblock
+
+// 32-bit FNV-1a
+uint32_t kv_engine_hash(const char *key, size_t key_len){
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < key_len; i++) {
+        h ^= (uint8_t)key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+size_t kv_engine_max_record(const kv_engine_t *engine){
+    return engine->storage->super.block_size - sizeof(kv_record_header_t);
+}
+
+// Record behind a chain reference: a whole block or a slot of a page
+static inline kv_record_header_t * record_at(kv_engine_t *engine, uint32_t ref){
+    if (kv_ref_is_packed(ref)) return (kv_record_header_t *)kv_page_record(engine->storage, ref);
+    return (kv_record_header_t *)storage_block_ptr(engine->storage, ref);
+}
+
+static inline uint32_t stripe_of(uint32_t hash){
+    return hash % KV_LOCK_STRIPES;
+}
+
+static inline pthread_rwlock_t * hash_lock(kv_engine_t *engine, uint32_t hash){
+    return &engine->locks[stripe_of(hash)];
+}
+
+static inline uint64_t table_size(const kv_engine_t *engine, uint64_t lh_state){
+    return ((uint64_t)engine->base_buckets << (lh_state >> 32)) + (uint32_t)lh_state;
+}
+
+// Bucket of `hash`. Caller holds the key's stripe lock, which orders this
+// against a split of that very bucket.
+static inline uint32_t bucket_of(kv_engine_t *engine, uint32_t hash){
+    uint64_t lh = __atomic_load_n(&engine->lh_state, __ATOMIC_ACQUIRE);
+    uint64_t size = (uint64_t)engine->base_buckets << (lh >> 32);
+    uint64_t bucket = hash % size;
+    if (bucket < (uint32_t)lh) bucket = hash % (2 * size);
+    return (uint32_t)bucket;
+}
+
+static inline uint32_t * head_slot(kv_engine_t *engine, uint32_t bucket){
+    return &engine->segments[bucket / engine->segment_buckets][bucket % engine->segment_buckets];
+}
+
+// The bucket head (prev == 0) or the next pointer of `prev`
+static inline uint32_t * next_slot(kv_engine_t *engine, uint32_t bucket, uint32_t prev){
+    return (prev == 0) ? head_slot(engine, bucket) : &record_at(engine, prev)->next_block;
+}
+
+// Walks the chain of `bucket` looking for `key`. Returns the matching record
+// (0 if absent) and stores its predecessor (0 == bucket head).
+// Caller holds the bucket lock.
+static uint32_t chain_find(kv_engine_t *engine, uint32_t bucket, uint32_t hash,
+                           const char *key, size_t key_len, uint32_t *out_prev){
+    uint32_t prev = 0;
+    uint32_t cur = *head_slot(engine, bucket);
+    while (cur != 0) {
+        kv_record_header_t *rec = record_at(engine, cur);
+        if (!rec) break;
+        if (rec->hash == hash && rec->key_len == key_len &&
+            memcmp((const char *)(rec + 1), key, key_len) == 0) {
+            if (out_prev) *out_prev = prev;
+            return cur;
+        }
+        prev = cur;
+        cur = rec->next_block;
+    }
+    return 0;
+}
+
+// Points the bucket head (prev == 0) or `prev` at `ref` and logs the change.
+// Caller holds the bucket write lock.
+static void link_after(kv_engine_t *engine, uint32_t bucket, uint32_t prev, uint32_t ref){
+    uint32_t *slot = next_slot(engine, bucket, prev);
+    *slot = ref;
+    storage_log_write(engine->storage, slot, sizeof(uint32_t));
+}
+
+static void stripe_count_add(kv_engine_t *engine, uint32_t stripe, int64_t delta){
+    __atomic_add_fetch(&engine->counts[stripe].records, delta, __ATOMIC_RELAXED);
+}
+
+uint64_t kv_engine_record_count(kv_engine_t *engine){
+    int64_t total = 0;
+    for (uint32_t i = 0; i < KV_LOCK_STRIPES; i++) {
+        total += __atomic_load_n(&engine->counts[i].records, __ATOMIC_RELAXED);
+    }
+    return total < 0 ? 0 : (uint64_t)total;
+}
+
+// Keys hash evenly over the stripes, so one stripe past its share of the
+// split load stands for the whole table. Caller holds the stripe lock.
+static int split_due(kv_engine_t *engine, uint32_t stripe){
+    uint64_t size = table_size(engine, __atomic_load_n(&engine->lh_state, __ATOMIC_RELAXED));
+    int64_t share = (int64_t)(KV_SPLIT_LOAD * size / KV_LOCK_STRIPES);
+    return __atomic_load_n(&engine->counts[stripe].records, __ATOMIC_RELAXED) > share;
+}
+
+// Allocates and zeroes directory segment `index`. Caller holds split_mutex
+// (or has the engine to itself during open).
+static int segment_ensure(kv_engine_t *engine, uint32_t index){
+    if (engine->segments[index]) return 0;
+    storage_state_t *st = engine->storage;
+    uint32_t first = 0;
+    if (storage_block_alloc_run(st, KV_DIR_SEGMENT_BLOCKS, &first) != 0) return -1;
+    // Lookups read the segments through cached pointers
+    storage_cache_pin(st, first, KV_DIR_SEGMENT_BLOCKS);
+    uint32_t *heads = (uint32_t *)storage_block_ptr(st, first);
+    size_t bytes = (size_t)KV_DIR_SEGMENT_BLOCKS * st->super.block_size;
+    memset(heads, 0, bytes);
+    storage_log_write(st, heads, bytes);
+    engine->dir[index] = first;
+    storage_log_write(st, &engine->dir[index], sizeof(uint32_t));
+    engine->segments[index] = heads;
+    return 0;
+}
+
+// Writes level, split pointer and record count to the superblock
+static void persist_state(kv_engine_t *engine){
+    keystore_super_block_t *sb = (keystore_super_block_t *)engine->storage->mapped_ptr;
+    uint64_t lh = __atomic_load_n(&engine->lh_state, __ATOMIC_RELAXED);
+    sb->hash_records = kv_engine_record_count(engine);
+    sb->hash_level = (uint32_t)(lh >> 32);
+    sb->hash_split = (uint32_t)lh;
+    storage_log_write(engine->storage, &sb->hash_records,
+                      (size_t)((char *)(&sb->hash_split + 1) - (char *)&sb->hash_records));
+}
+
+// Moves the records of bucket `from` that hash to `to` under `modulus` to the
+// chain of `to`. A moved record is appended to the new chain before the old
+// chain skips it, so every record stays reachable from one of the two
+// chains after each logged write and an interrupted split can be redone.
+static void split_chain(kv_engine_t *engine, uint32_t from, uint32_t to, uint64_t modulus){
+    uint32_t keep_tail = 0, move_tail = 0;
+    uint32_t cur = *head_slot(engine, from);
+    while (cur != 0) {
+        uint32_t next = record_at(engine, cur)->next_block;
+        if (record_at(engine, cur)->hash % modulus == to) {
+            if (*next_slot(engine, to, move_tail) != cur) link_after(engine, to, move_tail, cur);
+            move_tail = cur;
+        } else {
+            if (*next_slot(engine, from, keep_tail) != cur) link_after(engine, from, keep_tail, cur);
+            keep_tail = cur;
+        }
+        cur = next;
+    }
+    if (*next_slot(engine, from, keep_tail) != 0) link_after(engine, from, keep_tail, 0);
+    if (*next_slot(engine, to, move_tail) != 0) link_after(engine, to, move_tail, 0);
+}
+
+// Moves the split pointer past the bucket just split and records it
+static void split_done(kv_engine_t *engine){
+    uint64_t lh = engine->lh_state;
+    uint32_t level = (uint32_t)(lh >> 32), split = (uint32_t)lh;
+    uint64_t size = (uint64_t)engine->base_buckets << level;
+    uint64_t next = (split + 1 == size) ? (uint64_t)(level + 1) << 32 : lh + 1;
+    __atomic_store_n(&engine->lh_state, next, __ATOMIC_RELEASE);
+    persist_state(engine);
+}
+
+// Splits the bucket under the split pointer. Caller holds split_mutex.
+static int split_bucket(kv_engine_t *engine){
+    uint64_t lh = engine->lh_state;
+    uint32_t level = (uint32_t)(lh >> 32), split = (uint32_t)lh;
+    uint64_t size = (uint64_t)engine->base_buckets << level;
+    uint64_t target = size + split;
+    if (target >= (uint64_t)engine->segment_count * engine->segment_buckets) return -1;
+    if (segment_ensure(engine, (uint32_t)(target / engine->segment_buckets)) != 0) return -1;
+
+    // `split` and `target` share a stripe; no other bucket changes address
+    pthread_rwlock_wrlock(&engine->locks[split % KV_LOCK_STRIPES]);
+    split_chain(engine, split, (uint32_t)target, 2 * size);
+    split_done(engine);
+    pthread_rwlock_unlock(&engine->locks[split % KV_LOCK_STRIPES]);
+    return 0;
+}
+
+// Splits buckets while the table is over its load, at most `budget` of
+// them. Only one thread splits at a time; others carry on.
+static void maybe_split(kv_engine_t *engine, uint32_t budget){
+    if (pthread_mutex_trylock(&engine->split_mutex) != 0) return;
+    for (uint32_t i = 0; i < budget; i++) {
+        uint64_t size = table_size(engine, engine->lh_state);
+        if (kv_engine_record_count(engine) <= KV_SPLIT_LOAD * size) break;
+        size_t mark = storage_op_mark();
+        int rc = split_bucket(engine);
+        storage_op_release(mark);
+        if (rc != 0) break;
+    }
+    pthread_mutex_unlock(&engine->split_mutex);
+}
+
+static int block_cmp(const void *a, const void *b){
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : (x > y);
+}
+
+// Finishes a split cut short by a crash: the chain of the split target is
+// folded back into the split bucket, then the split runs again. Both steps
+// keep every record reachable, so this is safe to interrupt as well.
+static int recover_split(kv_engine_t *engine){
+    uint64_t lh = engine->lh_state;
+    uint32_t split = (uint32_t)lh;
+    uint64_t size = (uint64_t)engine->base_buckets << (lh >> 32);
+    uint64_t target = size + split;
+    if (target >= (uint64_t)engine->segment_count * engine->segment_buckets ||
+        !engine->segments[target / engine->segment_buckets] ||
+        *head_slot(engine, (uint32_t)target) == 0) {
+        return 0;
+    }
+    syslog(LOG_INFO, "keystored::finishing interrupted split of bucket %u", split);
+
+    // Blocks on the split bucket's chain, sorted for lookups
+    size_t n = 0, cap = 64;
+    uint32_t *seen = malloc(cap * sizeof(uint32_t));
+    if (!seen) return -1;
+    uint32_t last = 0;
+    for (uint32_t cur = *head_slot(engine, split); cur != 0; cur = record_at(engine, cur)->next_block) {
+        if (n == cap) {
+            uint32_t *grown = realloc(seen, 2 * cap * sizeof(uint32_t));
+            if (!grown) {
+                free(seen);
+                return -1;
+            }
+            seen = grown;
+            cap *= 2;
+        }
+        seen[n++] = cur;
+        last = cur;
+    }
+    qsort(seen, n, sizeof(uint32_t), block_cmp);
+
+    // The target chain starts with records only it holds and may run into
+    // the split bucket's chain; cut it there and append the rest
+    uint32_t only_first = *head_slot(engine, (uint32_t)target), only_last = 0;
+    for (uint32_t cur = only_first; cur != 0; cur = record_at(engine, cur)->next_block) {
+        if (bsearch(&cur, seen, n, sizeof(uint32_t), block_cmp)) break;
+        only_last = cur;
+    }
+    free(seen);
+    if (only_last != 0) {
+        if (record_at(engine, only_last)->next_block != 0) link_after(engine, (uint32_t)target, only_last, 0);
+        link_after(engine, split, last, only_first);
+    }
+    link_after(engine, (uint32_t)target, 0, 0);
+    split_chain(engine, split, (uint32_t)target, 2 * size);
+    split_done(engine);
+    return 0;
+}
+
+// Creates the directory root and first segment, taking over the bucket
+// array of an older image if there is one
+static int dir_create(kv_engine_t *engine){
+    storage_state_t *st = engine->storage;
+    keystore_super_block_t *sb = (keystore_super_block_t *)st->mapped_ptr;
+    uint32_t old_block = sb->hash_buckets_block;
+    uint32_t base = old_block ? sb->hash_bucket_count : DEFAULT_HASH_BUCKETS;
+    if (base == 0 || base % KV_LOCK_STRIPES != 0 || base > engine->segment_buckets) {
+        syslog(LOG_ERR, "keystored::unsupported hash bucket count %u", base);
+        return -1;
+    }
+
+    uint32_t root = 0;
+    if (storage_block_alloc(st, &root) != 0) return -1;
+    engine->dir = (uint32_t *)storage_block_ptr(st, root);
+    memset(engine->dir, 0, st->super.block_size);
+    storage_log_write(st, engine->dir, st->super.block_size);
+    if (segment_ensure(engine, 0) != 0) return -1;
+
+    uint64_t records = 0;
+    if (old_block) {
+        const uint32_t *old_heads = (const uint32_t *)storage_block_ptr(st, old_block);
+        memcpy(engine->segments[0], old_heads, (size_t)base * sizeof(uint32_t));
+        storage_log_write(st, engine->segments[0], (size_t)base * sizeof(uint32_t));
+        // One-time count for the load factor
+        for (uint32_t b = 0; b < base; b++) {
+            size_t mark = storage_op_mark();
+            for (uint32_t cur = old_heads[b]; cur != 0; cur = record_at(engine, cur)->next_block) records++;
+            storage_op_release(mark);
+        }
+    }
+
+    sb->hash_bucket_count = base;
+    sb->hash_buckets_block = 0;
+    storage_log_write(st, &sb->hash_bucket_count, 2 * sizeof(uint32_t));
+    sb->hash_records = records;
+    sb->hash_dir_block = root;
+    sb->hash_level = 0;
+    sb->hash_split = 0;
+    storage_log_write(st, &sb->hash_records, (size_t)((char *)(&sb->hash_split + 1) - (char *)&sb->hash_records));
+    if (old_block) {
+        storage_block_free(st, old_block);
+        syslog(LOG_INFO, "keystored::converted %u hash buckets to a directory", base);
+    }
+    return 0;
+}
+
+// ---------------- Index snapshot ----------------
+//   - Per-stripe record counts and free-space maps only live in memory; the
+//     snapshot keeps them across restarts, tagged with the LSN they reflect
+//   - A copy taken while the engine runs is consistent if no record was
+//     logged while it was taken: every change to them is made and logged
+//     under the stripe's write lock
+//   - Without a usable snapshot the counts are recounted from the chains and
+//     the maps refilled in the background; map entries are checked against
+//     the page whenever they are picked anyway
+
+typedef struct kv_snapshot {
+    uint64_t lh_state;
+    int64_t records[KV_LOCK_STRIPES];
+    kv_page_map pages[KV_LOCK_STRIPES];
+} kv_snapshot;
+
+// Copies the snapshot state and returns the LSN it reflects, 0 if records
+// were logged meanwhile
+static uint64_t snapshot_take(kv_engine_t *engine, kv_snapshot *snap){
+    wal_t *wal = engine->storage->wal;
+    if (!wal) return 0;
+    uint64_t lsn = wal_last_lsn(wal);
+    for (uint32_t i = 0; i < KV_LOCK_STRIPES; i++) {
+        pthread_rwlock_rdlock(&engine->locks[i]);
+        snap->records[i] = engine->counts[i].records;
+        snap->pages[i] = engine->pages[i];
+        pthread_rwlock_unlock(&engine->locks[i]);
+    }
+    snap->lh_state = __atomic_load_n(&engine->lh_state, __ATOMIC_ACQUIRE);
+    return wal_last_lsn(wal) == lsn ? lsn : 0;
+}
+
+static void snapshot_save(kv_engine_t *engine){
+    kv_snapshot *snap = malloc(sizeof(*snap));
+    if (!snap) return;
+    uint64_t lsn = snapshot_take(engine, snap);
+    if (lsn != 0) storage_snapshot_save(engine->storage, lsn, snap, sizeof(*snap));
+    free(snap);
+}
+
+// Checkpoint hook: a busy engine simply skips this round
+static void snapshot_hook(void *arg){
+    snapshot_save((kv_engine_t *)arg);
+}
+
+static int snapshot_restore(kv_engine_t *engine){
+    kv_snapshot *snap = malloc(sizeof(*snap));
+    if (!snap) return -1;
+    int rc = -1;
+    if (storage_snapshot_load(engine->storage, snap, sizeof(*snap)) == 0 && snap->lh_state == engine->lh_state) {
+        for (uint32_t i = 0; i < KV_LOCK_STRIPES; i++) {
+            engine->counts[i].records = snap->records[i];
+            engine->pages[i] = snap->pages[i];
+        }
+        rc = 0;
+    }
+    free(snap);
+    return rc;
+}
+
+static uint32_t page_map_size(const kv_page_map *map){
+    uint32_t n = 0;
+    for (uint32_t c = 0; c < KV_PAGE_CLASSES; c++) n += map->count[c];
+    return n;
+}
+
+// Counts the records in the chains of stripe `s`. Updates and splits of
+// the stripe take its write lock, so its chains hold still meanwhile and
+// lookups carry on.
+static void stripe_recount(kv_engine_t *engine, uint32_t s){
+    pthread_rwlock_rdlock(&engine->locks[s]);
+    uint64_t size = table_size(engine, __atomic_load_n(&engine->lh_state, __ATOMIC_ACQUIRE));
+    int64_t records = 0;
+    storage_op_begin();
+    size_t mark = storage_op_mark();
+    for (uint64_t b = s; b < size; b += KV_LOCK_STRIPES) {
+        for (uint32_t cur = *head_slot(engine, (uint32_t)b); cur != 0; cur = record_at(engine, cur)->next_block) {
+            records++;
+        }
+        storage_op_release(mark);
+    }
+    storage_op_end();
+    __atomic_store_n(&engine->counts[s].records, records, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&engine->locks[s]);
+}
+
+// Recounts the records of its stripes, the superblock's count being as old
+// as the last split, then walks their buckets, one bucket per lock hold,
+// noting the pages of packed records until the stripe's map is full enough
+static void * rebuild_thread(void *arg){
+    kv_rebuild_worker *worker = (kv_rebuild_worker *)arg;
+    kv_engine_t *engine = worker->engine;
+    for (uint32_t s = worker->first_stripe; s < KV_LOCK_STRIPES; s += KV_REBUILD_THREADS) {
+        if (__atomic_load_n(&engine->rebuild_stop, __ATOMIC_RELAXED)) return NULL;
+        stripe_recount(engine, s);
+        kv_page_map *map = &engine->pages[s];
+        int done = 0;
+        // Buckets of a stripe are congruent to it modulo KV_LOCK_STRIPES
+        for (uint64_t b = s; !done; b += KV_LOCK_STRIPES) {
+            if (__atomic_load_n(&engine->rebuild_stop, __ATOMIC_RELAXED)) return NULL;
+            pthread_rwlock_wrlock(&engine->locks[s]);
+            storage_op_begin();
+            uint64_t size = table_size(engine, __atomic_load_n(&engine->lh_state, __ATOMIC_ACQUIRE));
+            done = b >= size || page_map_size(map) >= KV_PAGE_MAP_DEPTH;
+            uint32_t last = 0;
+            for (uint32_t cur = done ? 0 : *head_slot(engine, (uint32_t)b); cur != 0;
+                 cur = record_at(engine, cur)->next_block) {
+                if (!kv_ref_is_packed(cur) || kv_ref_page(cur) == last) continue;
+                last = kv_ref_page(cur);
+                kv_page_map_note(map, engine->storage, last);
+            }
+            storage_op_end();
+            pthread_rwlock_unlock(&engine->locks[s]);
+        }
+    }
+    return NULL;
+}
+
+static int engine_open(kv_engine_t *engine, storage_state_t *storage){
+    memset(engine, 0, sizeof(*engine));
+    engine->storage = storage;
+    engine->segment_count = storage->super.block_size / sizeof(uint32_t);
+    engine->segment_buckets = KV_DIR_SEGMENT_BLOCKS * storage->super.block_size / sizeof(uint32_t);
+    engine->segments = calloc(engine->segment_count, sizeof(uint32_t *));
+    if (!engine->segments) return KV_ERROR;
+
+    keystore_super_block_t *sb = (keystore_super_block_t *)storage->mapped_ptr;
+    if (sb->hash_dir_block == 0 && dir_create(engine) != 0) {
+        syslog(LOG_ERR, "keystored::failed to create hash directory");
+        free(engine->segments);
+        return KV_ERROR;
+    }
+    storage_cache_pin(storage, sb->hash_dir_block, 1);
+    engine->dir = (uint32_t *)storage_block_ptr(storage, sb->hash_dir_block);
+    for (uint32_t i = 0; engine->dir && i < engine->segment_count; i++) {
+        if (engine->dir[i] == 0) continue;
+        storage_cache_pin(storage, engine->dir[i], KV_DIR_SEGMENT_BLOCKS);
+        engine->segments[i] = (uint32_t *)storage_block_ptr(storage, engine->dir[i]);
+    }
+    engine->base_buckets = sb->hash_bucket_count;
+    engine->lh_state = ((uint64_t)sb->hash_level << 32) | sb->hash_split;
+    if (!engine->dir || !engine->segments[0] || engine->base_buckets == 0 ||
+        table_size(engine, engine->lh_state) > (uint64_t)engine->segment_count * engine->segment_buckets) {
+        syslog(LOG_ERR, "keystored::invalid hash directory %u", sb->hash_dir_block);
+        free(engine->segments);
+        return KV_ERROR;
+    }
+    storage->super.hash_bucket_count = sb->hash_bucket_count;
+    storage->super.hash_buckets_block = sb->hash_buckets_block;
+
+    // Page references hold 23 bits of page number and 16-bit offsets
+    if (storage->super.max_blocks <= KV_PAGE_MAX_PAGES && storage->super.block_size <= 32768) {
+        engine->pack_limit = storage->super.block_size / 4;
+        if (engine->pack_limit > KV_PAGE_MAX_RECORD) engine->pack_limit = KV_PAGE_MAX_RECORD;
+    }
+
+    // Spread the stored count over the stripes; only the sum matters. It is
+    // as old as the last split, so a rebuild recounts it.
+    engine->counts[0].records = (int64_t)(sb->hash_records % KV_LOCK_STRIPES);
+    for (uint32_t i = 0; i < KV_LOCK_STRIPES; i++) {
+        engine->counts[i].records += (int64_t)(sb->hash_records / KV_LOCK_STRIPES);
+    }
+    if (!storage->created) {
+        engine->rebuild_due = snapshot_restore(engine) != 0;
+        if (!engine->rebuild_due) syslog(LOG_INFO, "keystored::index snapshot restored");
+    }
+    if (recover_split(engine) != 0) {
+        free(engine->segments);
+        return KV_ERROR;
+    }
+    pthread_mutex_init(&engine->split_mutex, NULL);
+    for (uint32_t i = 0; i < KV_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&engine->locks[i], NULL);
+        pthread_mutex_init(&engine->pins[i].mutex, NULL);
+    }
+    storage_set_checkpoint_hook(storage, snapshot_hook, engine);
+    return KV_OK;
+}
+
+int kv_engine_open(kv_engine_t *engine, storage_state_t *storage){
+    if (!engine || !storage || !storage->mapped_ptr) return KV_ERROR;
+    storage_op_begin();
+    int rc = engine_open(engine, storage);
+    storage_op_end();
+    return rc;
+}
+
+int kv_engine_start(kv_engine_t *engine){
+    if (!engine || !engine->rebuild_due) return 0;
+    syslog(LOG_INFO, "keystored::no usable index snapshot, recounting records and rebuilding free-space maps");
+    for (uint32_t i = 0; i < KV_REBUILD_THREADS; i++) {
+        kv_rebuild_worker *worker = &engine->rebuilders[i];
+        worker->engine = engine;
+        worker->first_stripe = i;
+        // Only split timing and packing efficiency suffer meanwhile
+        worker->started = pthread_create(&worker->thread, NULL, rebuild_thread, worker) == 0;
+    }
+    return 0;
+}
+
+void kv_engine_close(kv_engine_t *engine){
+    if (!engine || !engine->storage) return;
+    storage_set_checkpoint_hook(engine->storage, NULL, NULL);
+    __atomic_store_n(&engine->rebuild_stop, 1, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < KV_REBUILD_THREADS; i++) {
+        if (engine->rebuilders[i].started) pthread_join(engine->rebuilders[i].thread, NULL);
+    }
+    persist_state(engine);
+    snapshot_save(engine);
+    pthread_mutex_destroy(&engine->split_mutex);
+    for (uint32_t i = 0; i < KV_LOCK_STRIPES; i++) {
+        pthread_rwlock_destroy(&engine->locks[i]);
+        pthread_mutex_destroy(&engine->pins[i].mutex);
+        kv_pin_entry *lists[2] = { engine->pins[i].active, engine->pins[i].spare };
+        for (int l = 0; l < 2; l++) {
+            while (lists[l]) {
+                kv_pin_entry *next = lists[l]->next;
+                free(lists[l]->deferred);
+                free(lists[l]);
+                lists[l] = next;
+            }
+        }
+    }
+    free(engine->segments);
+    memset(engine, 0, sizeof(*engine));
+}
+
+static inline size_t record_size(size_t key_len, size_t body_len){
+    return sizeof(kv_record_header_t) + key_len + body_len;
+}
+
+static inline int value_inline(const kv_engine_t *engine, size_t key_len, size_t value_len){
+    return key_len + value_len <= kv_engine_max_record(engine);
+}
+
+// Value bytes, or the extent table of a large value
+static inline const char * record_body(const kv_record_header_t *rec){
+    return (const char *)(rec + 1) + rec->key_len;
+}
+
+static inline uint32_t extent_count(const kv_record_header_t *rec){
+    uint32_t count;
+    memcpy(&count, record_body(rec), sizeof(count));
+    return count;
+}
+
+static inline kv_extent extent_at(const kv_record_header_t *rec, uint32_t i){
+    kv_extent ext;
+    memcpy(&ext, record_body(rec) + sizeof(kv_extent_table) + (size_t)i * sizeof(kv_extent), sizeof(ext));
+    return ext;
+}
+
+// Receives a value piece by piece, pointing into the image. `total` is the
+// whole value length; a non-zero return stops the walk.
+typedef int (*kv_value_sink)(void *ctx, size_t total, const char *data, size_t len);
+
+// Hands the value of `rec` to `sink` one contiguous piece at a time.
+// Caller holds the bucket lock and is inside an operation; the chunks of
+// each extent are only kept while it is handed over.
+static int record_walk_value(kv_engine_t *engine, const kv_record_header_t *rec,
+                             kv_value_sink sink, void *ctx){
+    size_t total = rec->value_len;
+    if (value_inline(engine, rec->key_len, total)) return sink(ctx, total, record_body(rec), total);
+    storage_state_t *st = engine->storage;
+    size_t block_size = st->super.block_size;
+    size_t left = total;
+    for (uint32_t i = 0, n = extent_count(rec); i < n && left > 0; i++) {
+        kv_extent ext = extent_at(rec, i);
+        size_t mark = storage_op_mark();
+        const char *data = (const char *)storage_block_ptr(st, ext.first_block);
+        size_t len = (size_t)ext.block_count * block_size;
+        if (len > left) len = left;
+        int rc = (data && storage_pin(st, data, len, 0) == 0) ? 0 : -1;
+        if (rc == 0) {
+            rc = sink(ctx, total, data, len);
+            storage_unpin(st, data, len, 0);
+        }
+        storage_op_release(mark);
+        if (rc != 0) return -1;
+        left -= len;
+    }
+    return left == 0 ? 0 : -1;
+}
+
+typedef struct value_copy {
+    char *buf;
+    size_t len;
+} value_copy;
+
+static int value_copy_sink(void *ctx, size_t total, const char *data, size_t len){
+    value_copy *copy = (value_copy *)ctx;
+    if (!copy->buf && !(copy->buf = malloc(total ? total : 1))) return -1;
+    memcpy(copy->buf + copy->len, data, len);
+    copy->len += len;
+    return 0;
+}
+
+// Copies the value of record `ref`. Caller holds the bucket lock.
+static int record_copy_value(kv_engine_t *engine, uint32_t ref, char **out_value, size_t *out_value_len){
+    value_copy copy = { NULL, 0 };
+    if (record_walk_value(engine, record_at(engine, ref), value_copy_sink, &copy) != 0) {
+        free(copy.buf);
+        return KV_ERROR;
+    }
+    *out_value = copy.buf;
+    *out_value_len = copy.len;
+    return KV_OK;
+}
+
+// Fills record `ref` with its header, key and `body` (the value, or the
+// extent table of a large one) and logs it. Packed records are filled under
+// their stripe lock, whole blocks may be filled before they are linked.
+static void record_fill(kv_engine_t *engine, uint32_t ref, uint32_t hash, const char *key, size_t key_len,
+                        size_t value_len, const void *body, size_t body_len){
+    kv_record_header_t *rec = record_at(engine, ref);
+    rec->hash = hash;
+    rec->key_len = (uint32_t)key_len;
+    rec->value_len = (uint32_t)value_len;
+    memcpy((char *)(rec + 1), key, key_len);
+    if (body_len) memcpy((char *)(rec + 1) + key_len, body, body_len);
+    storage_log_write(engine->storage, &rec->hash, sizeof(*rec) - sizeof(rec->next_block) + key_len + body_len);
+}
+
+// Places a record of `len` bytes in a page of `stripe` that has room,
+// starting a new page if none does. Returns the record reference, 0 when
+// out of space. Caller holds the stripe write lock.
+static uint32_t page_place(kv_engine_t *engine, uint32_t stripe, size_t len){
+    storage_state_t *st = engine->storage;
+    kv_page_map *map = &engine->pages[stripe];
+    uint32_t page = kv_page_map_pick(map, st, len);
+    if (page == 0) {
+        if (storage_block_alloc(st, &page) != 0) return 0;
+        kv_page_format(st, page, stripe);
+    }
+    uint32_t ref = kv_page_insert(st, page, len);
+    kv_page_map_note(map, st, page);
+    return ref;
+}
+
+// ---------------- Pins ----------------
+
+// Block a record lives in, the one a zero-copy read of it pins
+static inline uint32_t record_home(uint32_t ref){
+    return kv_ref_is_packed(ref) ? kv_ref_page(ref) : ref;
+}
+
+// Caller holds the pin stripe mutex
+static kv_pin_entry * pin_find(kv_pin_stripe *pins, uint32_t block){
+    for (kv_pin_entry *e = pins->active; e; e = e->next) {
+        if (e->block == block) return e;
+    }
+    return NULL;
+}
+
+static void free_run(kv_engine_t *engine, uint32_t first, uint32_t count){
+    if (count == 1) storage_block_free(engine->storage, first);
+    else storage_block_free_run(engine->storage, first, count);
+}
+
+// Pins `block` for a reader. Caller holds the stripe lock.
+static int pin_take(kv_engine_t *engine, uint32_t stripe, uint32_t block){
+    kv_pin_stripe *pins = &engine->pins[stripe];
+    pthread_mutex_lock(&pins->mutex);
+    kv_pin_entry *e = pin_find(pins, block);
+    if (!e) {
+        e = pins->spare;
+        if (e) pins->spare = e->next;
+        else if (!(e = malloc(sizeof(*e)))) {
+            pthread_mutex_unlock(&pins->mutex);
+            return -1;
+        }
+        memset(e, 0, sizeof(*e));
+        e->block = block;
+        e->next = pins->active;
+        pins->active = e;
+    }
+    e->count++;
+    pthread_mutex_unlock(&pins->mutex);
+    return 0;
+}
+
+static int pin_held(kv_engine_t *engine, uint32_t stripe, uint32_t block){
+    kv_pin_stripe *pins = &engine->pins[stripe];
+    pthread_mutex_lock(&pins->mutex);
+    int held = pin_find(pins, block) != NULL;
+    pthread_mutex_unlock(&pins->mutex);
+    return held;
+}
+
+// Frees a run of blocks now, or when the last pin on `block` is dropped if
+// it is pinned. Caller holds the stripe write lock.
+static void free_after_pin(kv_engine_t *engine, uint32_t stripe, uint32_t block,
+                           uint32_t first, uint32_t count){
+    kv_pin_stripe *pins = &engine->pins[stripe];
+    pthread_mutex_lock(&pins->mutex);
+    kv_pin_entry *e = pin_find(pins, block);
+    if (e) {
+        if (e->deferred_count == e->deferred_cap) {
+            uint32_t cap = e->deferred_cap ? e->deferred_cap * 2 : 4;
+            kv_extent *grown = realloc(e->deferred, cap * sizeof(kv_extent));
+            if (!grown) {
+                // A reader may still be sending from these blocks
+                pthread_mutex_unlock(&pins->mutex);
+                syslog(LOG_ERR, "keystored::leaking %u pinned blocks at %u", count, first);
+                return;
+            }
+            e->deferred = grown;
+            e->deferred_cap = cap;
+        }
+        e->deferred[e->deferred_count].first_block = first;
+        e->deferred[e->deferred_count].block_count = count;
+        e->deferred_count++;
+        pthread_mutex_unlock(&pins->mutex);
+        return;
+    }
+    pthread_mutex_unlock(&pins->mutex);
+    free_run(engine, first, count);
+}
+
+// Drops an unlinked record and the extents of its value. Returns the block
+// to free once the stripe lock is released: the record's own block, or its
+// page once it is empty (0 if nothing is to be freed). Space a reader has
+// pinned is freed when the reader is done instead. Caller holds the stripe
+// write lock.
+static uint32_t record_release(kv_engine_t *engine, uint32_t stripe, uint32_t ref){
+    uint32_t home = record_home(ref);
+    // No pin can be taken while the write lock is held; one dropped after
+    // this check just leaves the page uncompacted until its next delete
+    int pinned = pin_held(engine, stripe, home);
+    kv_record_header_t *rec = record_at(engine, ref);
+    if (rec && !value_inline(engine, rec->key_len, rec->value_len)) {
+        for (uint32_t i = 0, n = extent_count(rec); i < n; i++) {
+            kv_extent ext = extent_at(rec, i);
+            if (pinned) free_after_pin(engine, stripe, home, ext.first_block, ext.block_count);
+            else storage_block_free_run(engine->storage, ext.first_block, ext.block_count);
+        }
+    }
+    if (kv_ref_is_packed(ref)) {
+        if (kv_page_delete(engine->storage, ref, !pinned) > 0) {
+            kv_page_map_note(&engine->pages[stripe], engine->storage, home);
+            return 0;
+        }
+        kv_page_map_forget(&engine->pages[stripe], home);
+    }
+    if (!pinned) return home;
+    free_after_pin(engine, stripe, home, home, 1);
+    return 0;
+}
+
+// ---------------- Single-key operations ----------------
+
+// Links record `ref` into its bucket, replacing an existing record with the
+// same key. Returns the replaced record (0 if none). Caller holds the bucket
+// write lock.
+static uint32_t chain_upsert(kv_engine_t *engine, uint32_t bucket, uint32_t ref){
+    kv_record_header_t *rec = record_at(engine, ref);
+    uint32_t prev = 0;
+    uint32_t old = chain_find(engine, bucket, rec->hash, (const char *)(rec + 1), rec->key_len, &prev);
+    if (old != 0) {
+        // Replace in place in the chain
+        rec->next_block = record_at(engine, old)->next_block;
+    } else {
+        rec->next_block = *head_slot(engine, bucket);
+    }
+    storage_log_write(engine->storage, &rec->next_block, sizeof(uint32_t));
+    link_after(engine, bucket, prev, ref);
+    return old;
+}
+
+// Unlinks `key` from its bucket and returns its record (0 if absent).
+// Caller holds the bucket write lock.
+static uint32_t chain_unlink(kv_engine_t *engine, uint32_t bucket, uint32_t hash,
+                             const char *key, size_t key_len){
+    uint32_t prev = 0;
+    uint32_t ref = chain_find(engine, bucket, hash, key, key_len, &prev);
+    if (ref != 0) link_after(engine, bucket, prev, record_at(engine, ref)->next_block);
+    return ref;
+}
+
+int kv_engine_lookup(kv_engine_t *engine, const char *key, size_t key_len,
+                     char **out_value, size_t *out_value_len){
+    if (!engine || !key || !out_value || !out_value_len) return KV_ERROR;
+    if (key_len == 0) return KV_INVALID_KEY;
+
+    uint32_t hash = kv_engine_hash(key, key_len);
+    int rc = KV_NOT_FOUND;
+
+    storage_op_begin();
+    pthread_rwlock_rdlock(hash_lock(engine, hash));
+    uint32_t ref = chain_find(engine, bucket_of(engine, hash), hash, key, key_len, NULL);
+    if (ref != 0) rc = record_copy_value(engine, ref, out_value, out_value_len);
+    pthread_rwlock_unlock(hash_lock(engine, hash));
+    storage_op_end();
+    return rc;
+}
+
+// Builds the record for `key` around `body` and links it in place of the
+// key's current record. Caller is inside an operation.
+static int record_insert(kv_engine_t *engine, uint32_t hash, const char *key, size_t key_len,
+                         size_t value_len, const void *body, size_t body_len){
+    size_t len = record_size(key_len, body_len);
+    int packed = len <= engine->pack_limit;
+
+    // A record of its own block is built outside the bucket lock
+    uint32_t ref = 0;
+    if (!packed) {
+        if (storage_block_alloc(engine->storage, &ref) != 0) return KV_NO_SPACE;
+        record_fill(engine, ref, hash, key, key_len, value_len, body, body_len);
+    }
+
+    int due = 0;
+    uint32_t freed = 0;
+    pthread_rwlock_wrlock(hash_lock(engine, hash));
+    if (packed) {
+        ref = page_place(engine, stripe_of(hash), len);
+        if (ref == 0) {
+            pthread_rwlock_unlock(hash_lock(engine, hash));
+            return KV_NO_SPACE;
+        }
+        record_fill(engine, ref, hash, key, key_len, value_len, body, body_len);
+    }
+    uint32_t old = chain_upsert(engine, bucket_of(engine, hash), ref);
+    if (old != 0) {
+        freed = record_release(engine, stripe_of(hash), old);
+    } else {
+        stripe_count_add(engine, stripe_of(hash), 1);
+        due = split_due(engine, stripe_of(hash));
+    }
+    pthread_rwlock_unlock(hash_lock(engine, hash));
+
+    if (freed != 0) storage_block_free(engine->storage, freed);
+    if (due) maybe_split(engine, KV_SPLITS_PER_CHECK);
+    return KV_OK;
+}
+
+int kv_engine_insert(kv_engine_t *engine, const char *key, size_t key_len,
+                     const char *value, size_t value_len){
+    if (!engine || !key || (!value && value_len)) return KV_ERROR;
+    if (key_len == 0) return KV_INVALID_KEY;
+    if (value_inline(engine, key_len, value_len)) {
+        storage_op_begin();
+        int rc = record_insert(engine, kv_engine_hash(key, key_len), key, key_len, value_len, value, value_len);
+        storage_op_end();
+        return rc;
+    }
+    kv_put_stream stream;
+    if (kv_engine_put_begin(engine, key, key_len, value_len, &stream) == KV_OK) {
+        kv_engine_put_write(&stream, value, value_len);
+    }
+    return kv_engine_put_commit(&stream);
+}
+
+int kv_engine_remove(kv_engine_t *engine, const char *key, size_t key_len){
+    if (!engine || !key) return KV_ERROR;
+    if (key_len == 0) return KV_INVALID_KEY;
+
+    uint32_t hash = kv_engine_hash(key, key_len);
+
+    uint32_t freed = 0;
+    storage_op_begin();
+    pthread_rwlock_wrlock(hash_lock(engine, hash));
+    uint32_t ref = chain_unlink(engine, bucket_of(engine, hash), hash, key, key_len);
+    if (ref != 0) {
+        freed = record_release(engine, stripe_of(hash), ref);
+        stripe_count_add(engine, stripe_of(hash), -1);
+    }
+    pthread_rwlock_unlock(hash_lock(engine, hash));
+    storage_op_end();
+
+    if (ref == 0) return KV_NOT_FOUND;
+    if (freed != 0) storage_block_free(engine->storage, freed);
+    return KV_OK;
+}
+
+// ---------------- Streamed values ----------------
+
+// Points `out` at the value of `rec` in the image and keeps its chunks in
+// the buffer pool until kv_engine_unpin(). KV_NO_SPACE when the pool has no
+// room left for held chunks; what was held so far is still in `out`.
+// Caller holds the bucket lock and is inside an operation.
+static int record_pin_value(kv_engine_t *engine, const kv_record_header_t *rec, kv_pinned_value *out){
+    storage_state_t *st = engine->storage;
+    if (value_inline(engine, rec->key_len, rec->value_len)) {
+        out->pieces = &out->piece;
+        if (storage_pin(st, record_body(rec), out->len, 1) != 0) return KV_NO_SPACE;
+        out->piece.iov_base = (void *)record_body(rec);
+        out->piece.iov_len = out->len;
+        out->piece_count = 1;
+        return KV_OK;
+    }
+    uint32_t n = extent_count(rec);
+    size_t block_size = st->super.block_size;
+    size_t left = out->len;
+    out->pieces = malloc((n ? n : 1) * sizeof(struct iovec));
+    if (!out->pieces) return KV_ERROR;
+    for (uint32_t i = 0; i < n && left > 0; i++) {
+        kv_extent ext = extent_at(rec, i);
+        void *data = storage_block_ptr(st, ext.first_block);
+        if (!data) return KV_ERROR;
+        size_t len = (size_t)ext.block_count * block_size;
+        if (len > left) len = left;
+        if (storage_pin(st, data, len, 1) != 0) return KV_NO_SPACE;
+        out->pieces[out->piece_count].iov_base = data;
+        out->pieces[out->piece_count].iov_len = len;
+        out->piece_count++;
+        left -= len;
+    }
+    return left == 0 ? KV_OK : KV_ERROR;
+}
+
+int kv_engine_lookup_pinned(kv_engine_t *engine, const char *key, size_t key_len,
+                            kv_pinned_value *out){
+    if (!engine || !key || !out) return KV_ERROR;
+    memset(out, 0, sizeof(*out));
+    out->engine = engine;
+    if (key_len == 0) return KV_INVALID_KEY;
+
+    uint32_t hash = kv_engine_hash(key, key_len);
+    int rc = KV_NOT_FOUND;
+
+    storage_op_begin();
+    pthread_rwlock_rdlock(hash_lock(engine, hash));
+    uint32_t ref = chain_find(engine, bucket_of(engine, hash), hash, key, key_len, NULL);
+    if (ref != 0) {
+        const kv_record_header_t *rec = record_at(engine, ref);
+        out->len = rec->value_len;
+        rc = record_pin_value(engine, rec, out);
+        if (rc == KV_NO_SPACE) {
+            // Values being sent hold enough of the buffer pool already
+            kv_engine_unpin(out);
+            rc = record_copy_value(engine, ref, &out->copy, &out->len);
+            if (rc == KV_OK) {
+                out->piece.iov_base = out->copy;
+                out->piece.iov_len = out->len;
+                out->pieces = &out->piece;
+                out->piece_count = 1;
+            }
+        } else if (rc == KV_OK) {
+            if (pin_take(engine, stripe_of(hash), record_home(ref)) == 0) {
+                out->stripe = stripe_of(hash);
+                out->block = record_home(ref);
+            } else {
+                rc = KV_ERROR;
+            }
+        }
+    }
+    pthread_rwlock_unlock(hash_lock(engine, hash));
+    storage_op_end();
+    if (rc != KV_OK) kv_engine_unpin(out);
+    return rc;
+}
+
+void kv_engine_unpin(kv_pinned_value *value){
+    if (!value) return;
+    if (value->copy) {
+        free(value->copy);
+        value->copy = NULL;
+    } else {
+        for (uint32_t p = 0; p < value->piece_count; p++) {
+            storage_unpin(value->engine->storage, value->pieces[p].iov_base, value->pieces[p].iov_len, 1);
+        }
+    }
+    if (value->pieces != &value->piece) free(value->pieces);
+    value->pieces = NULL;
+    value->piece_count = 0;
+    if (value->block == 0) return;
+
+    kv_pin_stripe *pins = &value->engine->pins[value->stripe];
+    kv_extent *deferred = NULL;
+    uint32_t deferred_count = 0;
+    pthread_mutex_lock(&pins->mutex);
+    kv_pin_entry **link = &pins->active;
+    while (*link && (*link)->block != value->block) link = &(*link)->next;
+    kv_pin_entry *e = *link;
+    if (e && --e->count == 0) {
+        *link = e->next;
+        deferred = e->deferred;
+        deferred_count = e->deferred_count;
+        e->deferred = NULL;
+        e->next = pins->spare;
+        pins->spare = e;
+    }
+    pthread_mutex_unlock(&pins->mutex);
+
+    for (uint32_t i = 0; i < deferred_count; i++) {
+        free_run(value->engine, deferred[i].first_block, deferred[i].block_count);
+    }
+    free(deferred);
+    value->block = 0;
+}
+
+// Claims runs of up to KV_EXTENT_BLOCKS blocks for the value, settling for
+// shorter runs when no long one is free. The table has to fit in a block
+// record next to the key.
+static int extents_alloc(kv_engine_t *engine, kv_put_stream *stream){
+    storage_state_t *st = engine->storage;
+    size_t block_size = st->super.block_size;
+    size_t fixed = record_size(stream->key_len, sizeof(kv_extent_table));
+    if (fixed + sizeof(kv_extent) > block_size) return KV_TOO_LARGE;
+    uint64_t left = (stream->value_len + block_size - 1) / block_size;
+    if (left > st->super.max_blocks) return KV_TOO_LARGE;
+
+    stream->table_cap = (uint32_t)((block_size - fixed) / sizeof(kv_extent));
+    stream->table = calloc(1, sizeof(kv_extent_table) + (size_t)stream->table_cap * sizeof(kv_extent));
+    if (!stream->table) return KV_ERROR;
+    uint32_t run = KV_EXTENT_BLOCKS;
+    while (left > 0) {
+        if (run > left) run = (uint32_t)left;
+        if (stream->table->count == stream->table_cap) return KV_NO_SPACE;
+        uint32_t first = 0;
+        if (storage_block_alloc_run(st, run, &first) != 0) {
+            if (run == 1) return KV_NO_SPACE;
+            run /= 2;
+            continue;
+        }
+        kv_extent *ext = &stream->table->extents[stream->table->count++];
+        ext->first_block = first;
+        ext->block_count = run;
+        left -= run;
+    }
+    return KV_OK;
+}
+
+int kv_engine_put_begin(kv_engine_t *engine, const char *key, size_t key_len,
+                        size_t value_len, kv_put_stream *out){
+    memset(out, 0, sizeof(*out));
+    out->engine = engine;
+    out->key = key;
+    out->key_len = key_len;
+    out->value_len = value_len;
+    if (!engine || !key) {
+        out->status = KV_ERROR;
+    } else if (key_len == 0) {
+        out->status = KV_INVALID_KEY;
+    } else if (value_inline(engine, key_len, value_len)) {
+        out->hash = kv_engine_hash(key, key_len);
+        out->buffer = malloc(value_len ? value_len : 1);
+        out->status = out->buffer ? KV_OK : KV_ERROR;
+    } else {
+        out->hash = kv_engine_hash(key, key_len);
+        out->status = extents_alloc(engine, out);
+    }
+    return out->status;
+}
+
+// Where the next value bytes go and how many fit there: the rest of the
+// buffer, or of the extent up to the end of its chunk. NULL once the value
+// is complete or failed. Caller is inside an operation.
+static char * stream_next(kv_put_stream *stream, size_t *out_len){
+    if (stream->status != KV_OK || stream->written == stream->value_len) return NULL;
+    size_t left = stream->value_len - stream->written;
+    if (stream->buffer) {
+        *out_len = left;
+        return stream->buffer + stream->written;
+    }
+    // Extent holding the next byte
+    size_t block_size = stream->engine->storage->super.block_size;
+    size_t base = 0;
+    for (uint32_t i = 0; i < stream->table->count; i++) {
+        kv_extent *ext = &stream->table->extents[i];
+        size_t len = (size_t)ext->block_count * block_size;
+        if (stream->written < base + len) {
+            size_t off = stream->written - base;
+            uint32_t block = ext->first_block + (uint32_t)(off / block_size);
+            char *data = (char *)storage_block_ptr(stream->engine->storage, block);
+            if (!data) break;
+            size_t room = (STORAGE_CHUNK_BLOCKS - block % STORAGE_CHUNK_BLOCKS) * block_size - off % block_size;
+            if (room > len - off) room = len - off;
+            *out_len = room < left ? room : left;
+            return data + off % block_size;
+        }
+        base += len;
+    }
+    stream->status = KV_ERROR;
+    return NULL;
+}
+
+// Lets go of the window handed out by kv_engine_put_window()
+static void stream_unhold(kv_put_stream *stream){
+    if (!stream->window) return;
+    storage_unpin(stream->engine->storage, stream->window, stream->window_len, 1);
+    stream->window = NULL;
+    stream->window_len = 0;
+}
+
+char * kv_engine_put_window(kv_put_stream *stream, size_t *out_len){
+    stream_unhold(stream);
+    storage_op_begin();
+    size_t len = 0;
+    char *data = stream_next(stream, &len);
+    if (data && !stream->buffer) {
+        if (storage_pin(stream->engine->storage, data, len, 1) == 0) {
+            stream->window = data;
+            stream->window_len = len;
+        } else {
+            data = NULL;
+        }
+    }
+    storage_op_end();
+    if (data) *out_len = len;
+    return data;
+}
+
+void kv_engine_put_advance(kv_put_stream *stream, size_t len){
+    // Extents are private until the record is linked; they are logged
+    // when it is
+    if (stream->window) storage_note_write(stream->engine->storage, stream->window, len);
+    stream_unhold(stream);
+    stream->written += len;
+}
+
+// Logs the extents of a completely written value ahead of the record that
+// links them. From KV_SYNC_MIN_VALUE up they are synced in place and only
+// that is logged, so large values are not written twice; each extent is
+// contiguous in the image and takes one msync. Caller is inside an
+// operation.
+static int extents_log(kv_put_stream *stream){
+    storage_state_t *st = stream->engine->storage;
+    size_t block_size = st->super.block_size;
+    size_t left = stream->value_len;
+    for (uint32_t i = 0; i < stream->table->count && left > 0; i++) {
+        kv_extent *ext = &stream->table->extents[i];
+        size_t mark = storage_op_mark();
+        uint8_t *data = storage_block_ptr(st, ext->first_block);
+        size_t len = (size_t)ext->block_count * block_size;
+        if (len > left) len = left;
+        int rc = (data && storage_pin(st, data, len, 0) == 0) ? KV_OK : KV_ERROR;
+        if (rc == KV_OK) {
+            if (stream->value_len < KV_SYNC_MIN_VALUE) storage_log_write(st, data, len);
+            else if (storage_log_synced(st, data, len) != 0) rc = KV_ERROR;
+            storage_unpin(st, data, len, 0);
+        }
+        storage_op_release(mark);
+        if (rc != KV_OK) return rc;
+        left -= len;
+    }
+    return KV_OK;
+}
+
+int kv_engine_put_write(kv_put_stream *stream, const char *data, size_t len){
+    stream_unhold(stream);
+    storage_op_begin();
+    while (len > 0) {
+        size_t avail = 0, mark = storage_op_mark();
+        char *dst = stream_next(stream, &avail);
+        if (!dst) break;
+        if (avail > len) avail = len;
+        memcpy(dst, data, avail);
+        if (!stream->buffer) storage_note_write(stream->engine->storage, dst, avail);
+        storage_op_release(mark);
+        stream->written += avail;
+        data += avail;
+        len -= avail;
+    }
+    storage_op_end();
+    if (len > 0) return stream->status != KV_OK ? stream->status : KV_ERROR;
+    return stream->status;
+}
+
+int kv_engine_put_commit(kv_put_stream *stream){
+    stream_unhold(stream);
+    storage_op_begin();
+    int rc = stream->status;
+    if (rc == KV_OK && stream->written != stream->value_len) rc = KV_ERROR;
+    if (rc == KV_OK && stream->buffer) {
+        rc = record_insert(stream->engine, stream->hash, stream->key, stream->key_len,
+                           stream->value_len, stream->buffer, stream->value_len);
+    } else if (rc == KV_OK && (rc = extents_log(stream)) == KV_OK) {
+        size_t table_len = sizeof(kv_extent_table) + (size_t)stream->table->count * sizeof(kv_extent);
+        rc = record_insert(stream->engine, stream->hash, stream->key, stream->key_len,
+                           stream->value_len, stream->table, table_len);
+        // The extents belong to the record from here on
+        if (rc == KV_OK) stream->table->count = 0;
+    }
+    storage_op_end();
+    stream->status = rc;
+    kv_engine_put_abort(stream);
+    return rc;
+}
+
+void kv_engine_put_abort(kv_put_stream *stream){
+    stream_unhold(stream);
+    if (stream->table) {
+        for (uint32_t i = 0; i < stream->table->count; i++) {
+            storage_block_free_run(stream->engine->storage, stream->table->extents[i].first_block,
+                                   stream->table->extents[i].block_count);
+        }
+    }
+    free(stream->table);
+    free(stream->buffer);
+    stream->table = NULL;
+    stream->buffer = NULL;
+}
+
+// ---------------- Multi-key operations ----------------
+
+typedef struct batch_slot {
+    uint32_t stripe;
+    uint32_t index;         /* position in the caller's array */
+    uint32_t hash;
+    uint32_t ref;           /* new record of an insert, 0 if none */
+    kv_put_stream *stream;  /* extents of a large value */
+} batch_slot;
+
+static int batch_slot_cmp(const void *a, const void *b){
+    const batch_slot *x = (const batch_slot *)a, *y = (const batch_slot *)b;
+    if (x->stripe != y->stripe) return x->stripe < y->stripe ? -1 : 1;
+    // Keep request order for repeated keys
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+// Hashes the valid items and sorts them by lock stripe so every stripe is
+// taken once, in ascending order. Returns the slot count, or -1.
+static long batch_plan(kv_batch_item *items, size_t count, batch_slot **out_slots){
+    batch_slot *slots = malloc((count ? count : 1) * sizeof(batch_slot));
+    if (!slots) return -1;
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].result != KV_OK) continue;
+        uint32_t hash = kv_engine_hash(items[i].key, items[i].key_len);
+        slots[n].stripe = stripe_of(hash);
+        slots[n].index = (uint32_t)i;
+        slots[n].hash = hash;
+        slots[n].ref = 0;
+        slots[n].stream = NULL;
+        n++;
+    }
+    qsort(slots, n, sizeof(batch_slot), batch_slot_cmp);
+    *out_slots = slots;
+    return (long)n;
+}
+
+// Record body of an insert: the value, or the extent table of a large one
+static const void * slot_body(const batch_slot *slot, const kv_batch_item *it){
+    return slot->stream ? (const void *)slot->stream->table : (const void *)it->value;
+}
+
+static size_t slot_body_len(const batch_slot *slot, const kv_batch_item *it){
+    if (!slot->stream) return it->value_len;
+    return sizeof(kv_extent_table) + (size_t)slot->stream->table->count * sizeof(kv_extent);
+}
+
+static void batch_validate(kv_batch_item *items, size_t count){
+    for (size_t i = 0; i < count; i++) {
+        items[i].out_value = NULL;
+        items[i].out_value_len = 0;
+        items[i].result = (items[i].key && items[i].key_len) ? KV_OK : KV_INVALID_KEY;
+    }
+}
+
+int kv_engine_multi_lookup(kv_engine_t *engine, kv_batch_item *items, size_t count){
+    if (!engine || (!items && count)) return KV_ERROR;
+    batch_validate(items, count);
+    batch_slot *slots = NULL;
+    long n = batch_plan(items, count, &slots);
+    if (n < 0) return KV_ERROR;
+
+    storage_op_begin();
+    for (long s = 0; s < n; ) {
+        uint32_t stripe = slots[s].stripe;
+        pthread_rwlock_rdlock(&engine->locks[stripe]);
+        for (; s < n && slots[s].stripe == stripe; s++) {
+            kv_batch_item *it = &items[slots[s].index];
+            size_t mark = storage_op_mark();
+            uint32_t ref = chain_find(engine, bucket_of(engine, slots[s].hash), slots[s].hash,
+                                      it->key, it->key_len, NULL);
+            it->result = ref ? record_copy_value(engine, ref, &it->out_value, &it->out_value_len) : KV_NOT_FOUND;
+            storage_op_release(mark);
+        }
+        pthread_rwlock_unlock(&engine->locks[stripe]);
+    }
+    storage_op_end();
+    free(slots);
+    return KV_OK;
+}
+
+int kv_engine_multi_insert(kv_engine_t *engine, kv_batch_item *items, size_t count){
+    if (!engine || (!items && count)) return KV_ERROR;
+    batch_validate(items, count);
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].result != KV_OK) continue;
+        if (!items[i].value && items[i].value_len) items[i].result = KV_ERROR;
+    }
+    batch_slot *slots = NULL;
+    long n = batch_plan(items, count, &slots);
+    if (n < 0) return KV_ERROR;
+    uint32_t *blocks = malloc(2 * ((size_t)n ? (size_t)n : 1) * sizeof(uint32_t));
+    if (!blocks) {
+        free(slots);
+        return KV_ERROR;
+    }
+    uint32_t *frees = blocks + (n ? n : 1);
+    storage_op_begin();
+
+    // Large values are written to their extents before any lock is taken;
+    // their records then carry the extent table as body
+    kv_put_stream *streams = NULL;
+    for (long s = 0; s < n; s++) {
+        kv_batch_item *it = &items[slots[s].index];
+        if (value_inline(engine, it->key_len, it->value_len)) continue;
+        if (!streams && !(streams = calloc((size_t)n, sizeof(kv_put_stream)))) {
+            it->result = KV_ERROR;
+            continue;
+        }
+        kv_put_stream *stream = &streams[s];
+        if (kv_engine_put_begin(engine, it->key, it->key_len, it->value_len, stream) == KV_OK &&
+            kv_engine_put_write(stream, it->value, it->value_len) == KV_OK) {
+            stream->status = extents_log(stream);
+        }
+        if (stream->status != KV_OK) {
+            it->result = stream->status;
+            kv_engine_put_abort(stream);
+            continue;
+        }
+        slots[s].stream = stream;
+    }
+
+    // Records too large for a page take their blocks from the allocator all
+    // at once; keys beyond what is free get KV_NO_SPACE
+    uint32_t large = 0;
+    for (long s = 0; s < n; s++) {
+        kv_batch_item *it = &items[slots[s].index];
+        if (it->result == KV_OK && record_size(it->key_len, slot_body_len(&slots[s], it)) > engine->pack_limit) large++;
+    }
+    uint32_t got = storage_block_alloc_many(engine->storage, blocks, large);
+    for (long s = 0, b = 0; s < n; s++) {
+        kv_batch_item *it = &items[slots[s].index];
+        if (it->result != KV_OK || record_size(it->key_len, slot_body_len(&slots[s], it)) <= engine->pack_limit) continue;
+        if ((uint32_t)b >= got) {
+            it->result = KV_NO_SPACE;
+            continue;
+        }
+        slots[s].ref = blocks[b++];
+        size_t mark = storage_op_mark();
+        record_fill(engine, slots[s].ref, slots[s].hash, it->key, it->key_len, it->value_len,
+                    slot_body(&slots[s], it), slot_body_len(&slots[s], it));
+        storage_op_release(mark);
+    }
+
+    uint32_t freed = 0, added = 0;
+    int due = 0;
+    for (long s = 0; s < n; ) {
+        uint32_t stripe = slots[s].stripe;
+        pthread_rwlock_wrlock(&engine->locks[stripe]);
+        for (; s < n && slots[s].stripe == stripe; s++) {
+            kv_batch_item *it = &items[slots[s].index];
+            if (it->result != KV_OK) continue;
+            size_t mark = storage_op_mark();
+            if (slots[s].ref == 0) {
+                slots[s].ref = page_place(engine, stripe, record_size(it->key_len, slot_body_len(&slots[s], it)));
+                if (slots[s].ref == 0) {
+                    storage_op_release(mark);
+                    it->result = KV_NO_SPACE;
+                    continue;
+                }
+                record_fill(engine, slots[s].ref, slots[s].hash, it->key, it->key_len, it->value_len,
+                            slot_body(&slots[s], it), slot_body_len(&slots[s], it));
+            }
+            uint32_t old = chain_upsert(engine, bucket_of(engine, slots[s].hash), slots[s].ref);
+            if (old != 0) {
+                uint32_t blk = record_release(engine, stripe, old);
+                if (blk != 0) frees[freed++] = blk;
+            } else {
+                stripe_count_add(engine, stripe, 1);
+                added++;
+            }
+            storage_op_release(mark);
+        }
+        due |= split_due(engine, stripe);
+        pthread_rwlock_unlock(&engine->locks[stripe]);
+    }
+    storage_block_free_many(engine->storage, frees, freed);
+    // Extents of linked records now belong to them
+    for (long s = 0; s < n; s++) {
+        if (!slots[s].stream) continue;
+        if (items[slots[s].index].result == KV_OK) slots[s].stream->table->count = 0;
+        kv_engine_put_abort(slots[s].stream);
+    }
+    // A batch pays for the splits its new keys call for
+    if (due) maybe_split(engine, added > KV_SPLITS_PER_CHECK ? added : KV_SPLITS_PER_CHECK);
+    storage_op_end();
+    free(streams);
+    free(blocks);
+    free(slots);
+    return KV_OK;
+}
+
+int kv_engine_multi_remove(kv_engine_t *engine, kv_batch_item *items, size_t count){
+    if (!engine || (!items && count)) return KV_ERROR;
+    batch_validate(items, count);
+    batch_slot *slots = NULL;
+    long n = batch_plan(items, count, &slots);
+    if (n < 0) return KV_ERROR;
+    uint32_t *blocks = malloc(((size_t)n ? (size_t)n : 1) * sizeof(uint32_t));
+    if (!blocks) {
+        free(slots);
+        return KV_ERROR;
+    }
+
+    uint32_t freed = 0;
+    storage_op_begin();
+    for (long s = 0; s < n; ) {
+        uint32_t stripe = slots[s].stripe;
+        pthread_rwlock_wrlock(&engine->locks[stripe]);
+        for (; s < n && slots[s].stripe == stripe; s++) {
+            kv_batch_item *it = &items[slots[s].index];
+            size_t mark = storage_op_mark();
+            uint32_t ref = chain_unlink(engine, bucket_of(engine, slots[s].hash),
+                                        slots[s].hash, it->key, it->key_len);
+            if (ref == 0) {
+                it->result = KV_NOT_FOUND;
+            } else {
+                uint32_t blk = record_release(engine, stripe, ref);
+                if (blk != 0) blocks[freed++] = blk;
+                stripe_count_add(engine, stripe, -1);
+            }
+            storage_op_release(mark);
+        }
+        pthread_rwlock_unlock(&engine->locks[stripe]);
+    }
+    storage_op_end();
+    storage_block_free_many(engine->storage, blocks, freed);
+    free(blocks);
+    free(slots);
+    return KV_OK;
+}
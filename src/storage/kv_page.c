@@ -0,0 +1,147 @@
+#include <string.h>
+
+#include "kv_page.h"
+
+#define PAGE_ALIGN 4u
+
+static inline size_t page_align(size_t len){
+    return (len + PAGE_ALIGN - 1) & ~(size_t)(PAGE_ALIGN - 1);
+}
+
+static inline kv_page_header_t * page_at(storage_state_t *st, uint32_t page){
+    kv_page_header_t *hdr = (kv_page_header_t *)storage_block_ptr(st, page);
+    return (hdr && hdr->magic == KV_PAGE_MAGIC) ? hdr : NULL;
+}
+
+static inline kv_page_slot_t * page_slots(kv_page_header_t *hdr){
+    return (kv_page_slot_t *)(hdr + 1);
+}
+
+// Bytes a new record can take, counting the slot it needs if no free slot
+// is left for reuse
+static size_t page_room(const kv_page_header_t *hdr){
+    size_t dir_end = sizeof(*hdr) + (size_t)hdr->slot_count * sizeof(kv_page_slot_t);
+    size_t room = hdr->data_start > dir_end ? hdr->data_start - dir_end : 0;
+    if (hdr->live < hdr->slot_count) return room;
+    if (hdr->slot_count >= KV_PAGE_MAX_SLOTS || room < sizeof(kv_page_slot_t)) return 0;
+    return room - sizeof(kv_page_slot_t);
+}
+
+void kv_page_format(storage_state_t *st, uint32_t page, uint32_t stripe){
+    kv_page_header_t *hdr = (kv_page_header_t *)storage_block_ptr(st, page);
+    hdr->magic = KV_PAGE_MAGIC;
+    hdr->stripe = (uint16_t)stripe;
+    hdr->slot_count = 0;
+    hdr->data_start = (uint16_t)st->super.block_size;
+    hdr->live = 0;
+    storage_log_write(st, hdr, sizeof(*hdr));
+}
+
+void * kv_page_record(storage_state_t *st, uint32_t ref){
+    kv_page_header_t *hdr = page_at(st, kv_ref_page(ref));
+    uint32_t slot = kv_ref_slot(ref);
+    if (!hdr || slot >= hdr->slot_count || page_slots(hdr)[slot].offset == 0) return NULL;
+    return (char *)hdr + page_slots(hdr)[slot].offset;
+}
+
+uint32_t kv_page_insert(storage_state_t *st, uint32_t page, size_t len){
+    kv_page_header_t *hdr = page_at(st, page);
+    size_t need = page_align(len);
+    if (!hdr || need > page_room(hdr)) return 0;
+
+    kv_page_slot_t *slots = page_slots(hdr);
+    uint32_t slot = 0;
+    while (slot < hdr->slot_count && slots[slot].offset != 0) slot++;
+    if (slot == hdr->slot_count) hdr->slot_count++;
+    hdr->data_start = (uint16_t)(hdr->data_start - need);
+    slots[slot].offset = hdr->data_start;
+    slots[slot].length = (uint16_t)need;
+    hdr->live++;
+    // Header and directory in one record; the record body is logged by the
+    // caller once filled and only becomes reachable when linked
+    storage_log_write(st, hdr, sizeof(*hdr) + (size_t)hdr->slot_count * sizeof(kv_page_slot_t));
+    return kv_ref_pack(page, slot);
+}
+
+uint32_t kv_page_delete(storage_state_t *st, uint32_t ref, int compact){
+    kv_page_header_t *hdr = page_at(st, kv_ref_page(ref));
+    uint32_t slot = kv_ref_slot(ref);
+    if (!hdr || slot >= hdr->slot_count || page_slots(hdr)[slot].offset == 0) return hdr ? hdr->live : 0;
+
+    kv_page_slot_t *slots = page_slots(hdr);
+    slots[slot].offset = 0;
+    slots[slot].length = 0;
+    hdr->live--;
+    while (hdr->slot_count > 0 && slots[hdr->slot_count - 1].offset == 0) hdr->slot_count--;
+    size_t dirty_end = sizeof(*hdr) + (size_t)(slot + 1) * sizeof(kv_page_slot_t);
+
+    // Pack the live records against the end of the block, highest first so
+    // every move is upwards. Holes left by deletes on a pinned page are
+    // reclaimed here too.
+    if (compact) {
+        uint8_t order[KV_PAGE_MAX_SLOTS];
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < hdr->slot_count; i++) {
+            if (slots[i].offset == 0) continue;
+            uint32_t j = n++;
+            while (j > 0 && slots[order[j - 1]].offset < slots[i].offset) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = (uint8_t)i;
+        }
+        size_t pos = st->super.block_size;
+        for (uint32_t k = 0; k < n; k++) {
+            kv_page_slot_t *s = &slots[order[k]];
+            pos -= s->length;
+            if (s->offset == pos) continue;
+            memmove((char *)hdr + pos, (char *)hdr + s->offset, s->length);
+            s->offset = (uint16_t)pos;
+            if (pos + s->length > dirty_end) dirty_end = pos + s->length;
+        }
+        hdr->data_start = (uint16_t)pos;
+    }
+    // Directory and moved records change together, so they go out as one
+    // record: everything from the page start to the end of the last move
+    storage_log_write(st, hdr, dirty_end);
+    return hdr->live;
+}
+
+void kv_page_map_forget(kv_page_map *map, uint32_t page){
+    for (uint32_t c = 0; c < KV_PAGE_CLASSES; c++) {
+        for (uint32_t i = 0; i < map->count[c]; i++) {
+            if (map->pages[c][i] != page) continue;
+            memmove(&map->pages[c][i], &map->pages[c][i + 1], (size_t)(map->count[c] - i - 1) * sizeof(uint32_t));
+            map->count[c]--;
+            return;
+        }
+    }
+}
+
+void kv_page_map_note(kv_page_map *map, storage_state_t *st, uint32_t page){
+    kv_page_map_forget(map, page);
+    kv_page_header_t *hdr = page_at(st, page);
+    if (!hdr) return;
+    size_t room = page_room(hdr);
+    if (room < PAGE_ALIGN + sizeof(kv_page_slot_t)) return;
+    uint32_t c = (uint32_t)(room * KV_PAGE_CLASSES / st->super.block_size);
+    // Full class: the oldest entry makes way
+    if (map->count[c] == KV_PAGE_MAP_DEPTH) {
+        memmove(&map->pages[c][0], &map->pages[c][1], (KV_PAGE_MAP_DEPTH - 1) * sizeof(uint32_t));
+        map->count[c]--;
+    }
+    map->pages[c][map->count[c]++] = page;
+}
+
+uint32_t kv_page_map_pick(kv_page_map *map, storage_state_t *st, size_t len){
+    size_t need = page_align(len);
+    // Tightest class first; the lowest candidate class may hold pages just
+    // short of the room needed, so every pick checks the page itself
+    for (uint32_t c = (uint32_t)(need * KV_PAGE_CLASSES / st->super.block_size); c < KV_PAGE_CLASSES; c++) {
+        for (uint32_t i = map->count[c]; i-- > 0; ) {
+            kv_page_header_t *hdr = page_at(st, map->pages[c][i]);
+            if (hdr && page_room(hdr) >= need) return map->pages[c][i];
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "kv_shards.h"
+
+typedef struct shard_open_arg {
+    kv_shard *shard;
+    uint32_t count;
+    const wal_options *opts;
+    size_t pool_bytes;      /* this shard's buffer pool, 0 == mmap backend */
+} shard_open_arg;
+
+// Records the shard's place in the set on first use and refuses an image
+// that belongs elsewhere: its keys would be routed to other shards.
+static int shard_stamp(kv_shard *shard, uint32_t count){
+    storage_state_t *st = &shard->storage;
+    keystore_super_block_t *sb = (keystore_super_block_t *)st->mapped_ptr;
+    if (sb->shard_count == count && sb->shard_index == shard->index) return 0;
+    if (sb->shard_count != 0 || (!st->created && count > 1)) {
+        syslog(LOG_ERR, "keystored::image %s is shard %u of %u, not %u of %u", shard->image_path,
+               sb->shard_index, sb->shard_count ? sb->shard_count : 1, shard->index, count);
+        return -1;
+    }
+    sb->shard_index = shard->index;
+    sb->shard_count = count;
+    storage_log_write(st, &sb->shard_index, 2 * sizeof(uint32_t));
+    st->super.shard_index = sb->shard_index;
+    st->super.shard_count = sb->shard_count;
+    return 0;
+}
+
+static void * shard_open_thread(void *arg){
+    shard_open_arg *a = (shard_open_arg *)arg;
+    kv_shard *shard = a->shard;
+    shard->rc = -1;
+    if (storage_open_or_create(shard->image_path, DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS,
+                               DEFAULT_MAX_BLOCKS, a->pool_bytes, &shard->storage) != 0) {
+        syslog(LOG_ERR, "keystored::storage initialization failed for %s", shard->image_path);
+        return NULL;
+    }
+    // Replay the log before anything reads the image
+    if (wal_open(&shard->storage, shard->wal_path, a->opts) != 0) {
+        syslog(LOG_ERR, "keystored::failed to open write-ahead log %s", shard->wal_path);
+        storage_close(&shard->storage);
+        return NULL;
+    }
+    if (shard_stamp(shard, a->count) != 0 || kv_engine_open(&shard->engine, &shard->storage) != KV_OK) {
+        syslog(LOG_ERR, "keystored::failed to open storage engine for %s", shard->image_path);
+        storage_close(&shard->storage);
+        return NULL;
+    }
+    shard->rc = 0;
+    return NULL;
+}
+
+// The log of /a/b.img is /a/b.wal, of any other name <name>.wal
+static void shard_wal_path(const char *image, char *out, size_t size){
+    size_t len = strlen(image);
+    if (len > 4 && strcmp(image + len - 4, ".img") == 0) len -= 4;
+    snprintf(out, size, "%.*s.wal", (int)len, image);
+}
+
+int kv_shards_open(kv_shards *set, const char *const *image_paths, uint32_t count,
+                   const wal_options *opts, size_t pool_bytes){
+    if (!set || !image_paths || count == 0 || count > KV_MAX_SHARDS || !opts) return -1;
+    memset(set, 0, sizeof(*set));
+    set->shards = calloc(count, sizeof(kv_shard));
+    if (!set->shards) return -1;
+    set->count = count;
+
+    shard_open_arg args[KV_MAX_SHARDS];
+    pthread_t threads[KV_MAX_SHARDS];
+    int started[KV_MAX_SHARDS] = {0};
+    for (uint32_t i = 0; i < count; i++) {
+        kv_shard *shard = &set->shards[i];
+        shard->index = i;
+        shard->rc = -1;
+        if (strlen(image_paths[i]) + 1 > sizeof(shard->image_path)) {
+            syslog(LOG_ERR, "keystored::image path too long: %s", image_paths[i]);
+            continue;
+        }
+        snprintf(shard->image_path, sizeof(shard->image_path), "%s", image_paths[i]);
+        for (uint32_t k = 0; k < i; k++) {
+            if (strcmp(set->shards[k].image_path, shard->image_path) != 0) continue;
+            syslog(LOG_ERR, "keystored::image %s given twice", shard->image_path);
+            shard->image_path[0] = '\0';
+        }
+        if (!shard->image_path[0]) continue;
+        shard_wal_path(shard->image_path, shard->wal_path, sizeof(shard->wal_path));
+        args[i].shard = shard;
+        args[i].count = count;
+        args[i].opts = opts;
+        args[i].pool_bytes = pool_bytes / count;
+        // Recovery of one image is independent of the others
+        started[i] = pthread_create(&threads[i], NULL, shard_open_thread, &args[i]) == 0;
+        if (!started[i]) shard_open_thread(&args[i]);
+    }
+
+    int rc = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        if (set->shards[i].rc != 0) rc = -1;
+    }
+    if (rc != 0) kv_shards_close(set);
+    return rc;
+}
+
+int kv_shards_start(kv_shards *set, const storage_memory_options *memory){
+    storage_memory_options share = *memory;
+    share.cache_target = memory->cache_target / set->count;
+    for (uint32_t i = 0; i < set->count; i++) {
+        if (wal_start(set->shards[i].storage.wal) != 0) return -1;
+        if (kv_engine_start(&set->shards[i].engine) != 0) return -1;
+        if (storage_memory_start(&set->shards[i].storage, &share) != 0) return -1;
+    }
+    return 0;
+}
+
+void kv_shards_close(kv_shards *set){
+    if (!set || !set->shards) return;
+    for (uint32_t i = 0; i < set->count; i++) {
+        if (set->shards[i].rc != 0) continue;
+        kv_engine_close(&set->shards[i].engine);
+        storage_close(&set->shards[i].storage);
+    }
+    free(set->shards);
+    memset(set, 0, sizeof(*set));
+}
+
+// One gauge or counter family with a sample per shard
+typedef double (*shard_value)(kv_shard *shard);
+
+static double shard_blocks(kv_shard *shard){
+    return __atomic_load_n(&shard->storage.super.num_blocks, __ATOMIC_RELAXED);
+}
+
+static double shard_free_blocks(kv_shard *shard){
+    return __atomic_load_n(&shard->storage.super.free_block_count, __ATOMIC_RELAXED);
+}
+
+static double shard_records(kv_shard *shard){
+    return (double)kv_engine_record_count(&shard->engine);
+}
+
+static double shard_cache_resident(kv_shard *shard){
+    return (double)__atomic_load_n(&shard->storage.cache_resident, __ATOMIC_RELAXED);
+}
+
+static double shard_cache_evicted(kv_shard *shard){
+    return (double)__atomic_load_n(&shard->storage.cache_evicted, __ATOMIC_RELAXED);
+}
+
+static double shard_fsyncs(kv_shard *shard){
+    return (double)__atomic_load_n(&shard->storage.wal->fsync_count, __ATOMIC_RELAXED);
+}
+
+static double shard_fsync_seconds(kv_shard *shard){
+    return __atomic_load_n(&shard->storage.wal->fsync_ns, __ATOMIC_RELAXED) / 1e9;
+}
+
+static double shard_msyncs(kv_shard *shard){
+    return (double)__atomic_load_n(&shard->storage.wal->msync_count, __ATOMIC_RELAXED);
+}
+
+static double shard_msync_seconds(kv_shard *shard){
+    return __atomic_load_n(&shard->storage.wal->msync_ns, __ATOMIC_RELAXED) / 1e9;
+}
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    shard_value value;
+    int needs_wal;
+} shard_families[] = {
+    { "keystored_storage_blocks", "gauge", "Blocks in the image, superblock included", shard_blocks, 0 },
+    { "keystored_storage_free_blocks", "gauge", "Blocks not allocated", shard_free_blocks, 0 },
+    { "keystored_records", "gauge", "Keys stored", shard_records, 0 },
+    { "keystored_cache_resident_bytes", "gauge", "Resident image bytes at the last evictor sweep", shard_cache_resident, 0 },
+    { "keystored_cache_evicted_bytes_total", "counter", "Image bytes dropped by the evictor", shard_cache_evicted, 0 },
+    { "keystored_wal_fsyncs_total", "counter", "Log writes synced to disk", shard_fsyncs, 1 },
+    { "keystored_wal_fsync_seconds_total", "counter", "Time spent syncing the log", shard_fsync_seconds, 1 },
+    { "keystored_checkpoint_msyncs_total", "counter", "Checkpoint syncs of the image", shard_msyncs, 1 },
+    { "keystored_checkpoint_msync_seconds_total", "counter", "Time spent syncing the image at checkpoints", shard_msync_seconds, 1 },
+};
+
+void kv_shards_metrics(kv_shards *set, metrics_buffer *buf){
+    for (size_t f = 0; f < sizeof(shard_families) / sizeof(shard_families[0]); f++) {
+        metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", shard_families[f].name,
+                       shard_families[f].help, shard_families[f].name, shard_families[f].type);
+        for (uint32_t i = 0; i < set->count; i++) {
+            kv_shard *shard = &set->shards[i];
+            if (shard_families[f].needs_wal && !shard->storage.wal) continue;
+            metrics_printf(buf, "%s{shard=\"%u\"} %.15g\n", shard_families[f].name,
+                           shard->index, shard_families[f].value(shard));
+        }
+    }
+}
@@ -0,0 +1,1447 @@
+#define _GNU_SOURCE /* MAP_ANONYMOUS, MAP_NORESERVE, O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "storage.h"
+#include "wal.h"
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22   /* Linux 5.14 */
+#endif
+
+// ---------------- Block allocation ----------------
+//   - Block 0 is the superblock, followed by the allocation bitmap
+//   - Bit i of the bitmap (64-bit words) is set while block i is in use;
+//     updates are atomic per word and each changed word is logged
+//   - `claimed` mirrors the bitmap in memory and additionally marks blocks
+//     sitting in a thread cache, so refills never hand out the same block twice
+//   - The bitmap is sized for max_blocks; growing the image maps the next
+//     extent of the file inside the reserved range and publishes its blocks
+
+// num_blocks only grows, and only after the new extent is mapped
+static inline uint32_t block_count(const storage_state_t *state){
+    return __atomic_load_n(&state->super.num_blocks, __ATOMIC_ACQUIRE);
+}
+
+static int op_hold(storage_state_t *state, size_t chunk);
+static int chunk_acquire(storage_state_t *state, size_t c, int load);
+static void chunk_release(storage_state_t *state, size_t c);
+
+uint8_t * storage_block_ptr(storage_state_t *state, uint32_t block_index){
+    if (!state || !state->mapped_ptr) return NULL;
+    if (block_index >= block_count(state)) return NULL;
+    size_t offset = (size_t)block_index * (size_t)state->super.block_size;
+    if (offset + sizeof(uint32_t) > __atomic_load_n(&state->mapped_size, __ATOMIC_ACQUIRE)) return NULL;
+    if (state->pool_frames) {
+        size_t c = block_index / STORAGE_CHUNK_BLOCKS;
+        if (!(__atomic_load_n(&state->chunk_flags[c], __ATOMIC_RELAXED) & STORAGE_CHUNK_PINNED) &&
+            op_hold(state, c) != 0) {
+            return NULL;
+        }
+    }
+    if (__atomic_load_n(&state->cache_target, __ATOMIC_RELAXED) || state->pool_frames) {
+        // Second chance for the evictor; written only when it changes
+        uint8_t *flags = &state->chunk_flags[block_index / STORAGE_CHUNK_BLOCKS];
+        if (!(__atomic_load_n(flags, __ATOMIC_RELAXED) & STORAGE_CHUNK_REFERENCED)) {
+            __atomic_fetch_or(flags, STORAGE_CHUNK_REFERENCED, __ATOMIC_RELAXED);
+        }
+    }
+    return (uint8_t*)state->mapped_ptr + offset;
+}
+
+typedef struct storage_block_cache {
+    storage_state_t *owner;
+    uint32_t count;
+    uint32_t blocks[STORAGE_CACHE_BLOCKS];
+} storage_block_cache_t;
+
+static void cache_release(void *ptr);
+
+// Reserves `reserve` bytes of address space and maps the first `size` bytes
+// of the file at its start. Later extents are mapped right behind them.
+// For the buffer pool the whole range is anonymous memory instead, paged
+// in chunk by chunk as they are read.
+static void * map_image(int fd, size_t size, size_t reserve, int pool){
+    if (reserve < size) reserve = size;
+    // Reserved with slack and trimmed to start on a huge page boundary
+    uint8_t *raw = mmap(NULL, reserve + STORAGE_MAP_ALIGN, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) return MAP_FAILED;
+    uint8_t *base = (uint8_t *)(((uintptr_t)raw + STORAGE_MAP_ALIGN - 1) & ~(uintptr_t)(STORAGE_MAP_ALIGN - 1));
+    if (base > raw) munmap(raw, (size_t)(base - raw));
+    if (raw + STORAGE_MAP_ALIGN > base) munmap(base + reserve, (size_t)(raw + STORAGE_MAP_ALIGN - base));
+    void *map = pool ? mmap(base, reserve, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+                     : mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    if (map == MAP_FAILED) {
+        munmap(base, reserve);
+        return MAP_FAILED;
+    }
+    // A huge page would keep a whole 2 MiB resident for one chunk
+    if (pool) madvise(base, reserve, MADV_NOHUGEPAGE);
+    return base;
+}
+
+// The snapshot of /a/b.img is /a/b.snap, of any other name <name>.snap
+static void snapshot_path(const char *image, char *out, size_t size){
+    size_t len = strlen(image);
+    if (len > 4 && strcmp(image + len - 4, ".img") == 0) len -= 4;
+    snprintf(out, size, "%.*s.snap", (int)len, image);
+}
+
+// Reads from now on bypass the page cache, whose copy of every chunk in
+// the pool would take as much memory again
+static void pool_direct_io(storage_state_t *st){
+    int flags = fcntl(st->fd, F_GETFL);
+    if (st->super.block_size % 4096u != 0) {
+        syslog(LOG_WARNING, "keystored::%u-byte blocks are not aligned for O_DIRECT; the buffer pool uses the page cache",
+               st->super.block_size);
+    } else if (flags < 0 || fcntl(st->fd, F_SETFL, flags | O_DIRECT) != 0) {
+        syslog(LOG_WARNING, "keystored::no O_DIRECT for %s (%m); the buffer pool uses the page cache",
+               st->snapshot_path);
+    }
+}
+
+// Common setup once the image is mapped. `sb` is the superblock as read
+// from the file or about to be written to it.
+static int storage_attach(storage_state_t *st, const char *path, int fd, void *map, size_t size, size_t reserve,
+                          const keystore_super_block_t *sb, size_t pool_bytes){
+    st->fd = fd;
+    snapshot_path(path, st->snapshot_path, sizeof(st->snapshot_path));
+    st->mapped_ptr = map;
+    st->mapped_size = size;
+    st->reserved_size = reserve < size ? size : reserve;
+    st->super = *sb;
+    pthread_mutex_init(&st->alloc_mutex, NULL);
+    pthread_mutex_init(&st->grow_mutex, NULL);
+    pthread_mutex_init(&st->hook_mutex, NULL);
+    pthread_mutex_init(&st->evict_mutex, NULL);
+    pthread_cond_init(&st->evict_cond, NULL);
+    pthread_mutex_init(&st->pool_mutex, NULL);
+    pthread_cond_init(&st->pool_cond, NULL);
+    pthread_rwlock_init(&st->pool_write_lock, NULL);
+    size_t chunks = ((size_t)st->super.max_blocks + STORAGE_CHUNK_BLOCKS - 1) / STORAGE_CHUNK_BLOCKS;
+    st->dirty = calloc(chunks, sizeof(uint64_t));
+    st->chunk_flags = calloc(chunks, sizeof(uint8_t));
+    if (!st->dirty || !st->chunk_flags) {
+        syslog(LOG_ERR, "keystored::failed to allocate chunk state");
+        return -1;
+    }
+    if (pthread_key_create(&st->cache_key, cache_release) != 0) {
+        syslog(LOG_ERR, "keystored::failed to create block cache key");
+        return -1;
+    }
+    if (pool_bytes) {
+        st->chunk_users = malloc(chunks * sizeof(uint32_t));
+        st->chunk_held = calloc(chunks, sizeof(uint32_t));
+        if (!st->chunk_users || !st->chunk_held) {
+            syslog(LOG_ERR, "keystored::failed to allocate buffer pool state");
+            return -1;
+        }
+        memset(st->chunk_users, 0xFF, chunks * sizeof(uint32_t));  /* STORAGE_CHUNK_ABSENT */
+        st->pool_frames = pool_bytes / ((size_t)STORAGE_CHUNK_BLOCKS * st->super.block_size);
+        pool_direct_io(st);
+        syslog(LOG_INFO, "keystored::buffer pool of %zu MiB for %s", pool_bytes >> 20, path);
+    }
+    // The superblock, and the bitmap once there is one, are used by every
+    // allocation and by the log
+    uint32_t meta = st->super.bitmap_block + st->super.bitmap_blocks;
+    storage_cache_pin(st, 0, meta ? meta : 1);
+    return 0;
+}
+
+int storage_open_or_create(const char *path,
+                           uint32_t default_block_size,
+                           uint32_t default_num_blocks,
+                           uint32_t default_max_blocks,
+                           size_t pool_bytes,
+                           storage_state_t *out_state) {
+    if (!out_state) return -1;
+    memset(out_state, 0, sizeof(*out_state));
+    if (default_max_blocks < default_num_blocks) default_max_blocks = default_num_blocks;
+    if (pool_bytes && pool_bytes < STORAGE_POOL_MIN_BYTES) {
+        syslog(LOG_ERR, "keystored::buffer pool of %zu MiB for %s is below the minimum of %u MiB",
+               pool_bytes >> 20, path, STORAGE_POOL_MIN_BYTES >> 20);
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            syslog(LOG_ERR, "keystored::storage create failed: %m");
+            return -1;
+        }
+        // Compute total size and resize
+        uint64_t total_size = (uint64_t)default_block_size * (uint64_t)default_num_blocks;
+        if (ftruncate(fd, (off_t)total_size) != 0) {
+            syslog(LOG_ERR, "keystored::ftruncate failed: %m");
+            close(fd);
+            return -1;
+        }
+
+        // Map and write superblock
+        size_t reserve = (size_t)default_block_size * (size_t)default_max_blocks;
+        void *map = map_image(fd, (size_t)total_size, reserve, pool_bytes != 0);
+        if (map == MAP_FAILED) {
+            syslog(LOG_ERR, "keystored::mmap failed: %m");
+            close(fd);
+            return -1;
+        }
+        keystore_super_block_t sb;
+        memset(&sb, 0, sizeof(sb));
+        sb.magic = KEYSTORE_MAGIC;
+        sb.version = KEYSTORE_VERSION;
+        sb.total_size = total_size;
+        sb.block_size = default_block_size;
+        sb.num_blocks = default_num_blocks;
+        sb.max_blocks = default_max_blocks;
+
+        int rc = storage_attach(out_state, path, fd, map, (size_t)total_size, reserve, &sb, pool_bytes);
+        if (rc == 0) {
+            // Only now: the buffer pool read the superblock's chunk in when attaching
+            memcpy(map, &sb, sizeof(sb));
+            rc = storage_sync_range(out_state, map, sizeof(sb));
+        }
+        if (rc != 0 || bitmap_format(out_state) != 0 || storage_alloc_rescan(out_state) != 0) {
+            syslog(LOG_ERR, "keystored::failed to format storage image");
+            munmap(map, reserve);
+            close(fd);
+            return -1;
+        }
+        // Only the superblock and the first bitmap block were written
+        storage_sync_range(out_state, map, (size_t)default_block_size * 2);
+        // A snapshot left behind describes another image
+        unlink(out_state->snapshot_path);
+        out_state->created = 1;
+        return 0;
+    } else if (fd < 0) {
+        syslog(LOG_ERR, "keystored::storage open failed: %m");
+        return -1;
+    }
+
+    // Existing file: validate the superblock, then map
+    struct stat st;
+    keystore_super_block_t sb;
+    if (fstat(fd, &st) != 0 || pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)) {
+        syslog(LOG_ERR, "keystored::failed to read superblock: %m");
+        close(fd);
+        return -1;
+    }
+    if (sb.magic != KEYSTORE_MAGIC || sb.version != KEYSTORE_VERSION) {
+        // Version 1 images kept a free list; they have to be recreated
+        syslog(LOG_ERR, "keystored::invalid superblock (magic=%u version=%u)", sb.magic, sb.version);
+        close(fd);
+        return -1;
+    }
+    const uint64_t bitmap_bits = (uint64_t)sb.bitmap_blocks * sb.block_size * 8u;
+    // Images from before online growth can grow into their bitmap's slack
+    int upgrade = sb.max_blocks == 0;
+    if (upgrade) sb.max_blocks = bitmap_bits > UINT32_MAX ? UINT32_MAX : (uint32_t)bitmap_bits;
+    if (sb.bitmap_block == 0 || sb.bitmap_blocks == 0 || bitmap_bits < sb.max_blocks ||
+        sb.max_blocks < sb.num_blocks) {
+        syslog(LOG_ERR, "keystored::invalid allocation bitmap (block=%u blocks=%u)",
+               sb.bitmap_block, sb.bitmap_blocks);
+        close(fd);
+        return -1;
+    }
+    // The superblock page may reach the disk before the file size does.
+    // An image cut short by a crash is extended back to its blocks before
+    // anything is mapped, so replay sees every logged block in range.
+    const uint64_t image_size = (uint64_t)sb.block_size * sb.num_blocks;
+    if ((uint64_t)st.st_size < image_size) {
+        int err = posix_fallocate(fd, st.st_size, (off_t)(image_size - (uint64_t)st.st_size));
+        if (err != 0 || fsync(fd) != 0) {
+            syslog(LOG_ERR, "keystored::failed to restore storage image to %u blocks: %s",
+                   sb.num_blocks, strerror(err ? err : errno));
+            close(fd);
+            return -1;
+        }
+        syslog(LOG_WARNING, "keystored::storage image was %lld bytes short of its %u blocks; extended",
+               (long long)(image_size - (uint64_t)st.st_size), sb.num_blocks);
+        st.st_size = (off_t)image_size;
+    }
+    size_t reserve = (size_t)sb.block_size * (size_t)sb.max_blocks;
+    void *map = map_image(fd, (size_t)st.st_size, reserve, pool_bytes != 0);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "keystored::mmap failed: %m");
+        close(fd);
+        return -1;
+    }
+    if (storage_attach(out_state, path, fd, map, (size_t)st.st_size, reserve, &sb, pool_bytes) != 0) {
+        munmap(map, out_state->reserved_size);
+        close(fd);
+        return -1;
+    }
+    if (upgrade) {
+        keystore_super_block_t *live_sb = (keystore_super_block_t *)map;
+        live_sb->max_blocks = sb.max_blocks;
+        storage_note_write(out_state, &live_sb->max_blocks, sizeof(uint32_t));
+    }
+    if (storage_alloc_rescan(out_state) != 0) {
+        munmap(map, out_state->reserved_size);
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void cache_stop(storage_state_t *state);
+
+void storage_close(storage_state_t *state){
+    if (!state) return;
+    // The evictor may still ask the log for a checkpoint
+    cache_stop(state);
+    wal_close(state);
+    if (state->mapped_ptr && state->mapped_size) {
+        keystore_super_block_t *live_sb = (keystore_super_block_t *)state->mapped_ptr;
+        live_sb->free_block_count = state->super.free_block_count;
+        storage_note_write(state, &live_sb->free_block_count, sizeof(uint32_t));
+        storage_sync_image(state);
+        munmap(state->mapped_ptr, state->reserved_size);
+    }
+    if (state->fd > 0) close(state->fd);
+    // Blocks still cached by live threads are not allocated on disk
+    pthread_key_delete(state->cache_key);
+    pthread_mutex_destroy(&state->alloc_mutex);
+    pthread_mutex_destroy(&state->grow_mutex);
+    pthread_mutex_destroy(&state->hook_mutex);
+    pthread_mutex_destroy(&state->evict_mutex);
+    pthread_cond_destroy(&state->evict_cond);
+    pthread_mutex_destroy(&state->pool_mutex);
+    pthread_cond_destroy(&state->pool_cond);
+    pthread_rwlock_destroy(&state->pool_write_lock);
+    free(state->claimed);
+    free(state->dirty);
+    free(state->chunk_flags);
+    free(state->chunk_users);
+    free(state->chunk_held);
+    free(state->residency);
+    memset(state, 0, sizeof(*state));
+}
+
+void storage_print_superblock_ascii(const storage_state_t *state){
+    if (!state) return;
+    const keystore_super_block_t *sb = &state->super;
+    printf("+----------------------+------------------------------+\n");
+    printf("| %-20s | %-28s |\n", "Field", "Value");
+    printf("+----------------------+------------------------------+\n");
+    printf("| %-20s | 0x%08X                   |\n", "magic", sb->magic);
+    printf("| %-20s | %10u                    |\n", "version", sb->version);
+    printf("| %-20s | %10llu bytes          |\n", "total_size", (unsigned long long)sb->total_size);
+    printf("| %-20s | %10u bytes/block     |\n", "block_size", sb->block_size);
+    printf("| %-20s | %10u blocks          |\n", "num_blocks", sb->num_blocks);
+    printf("| %-20s | %10u blocks          |\n", "max_blocks", sb->max_blocks);
+    printf("| %-20s | %10u (block index)  |\n", "bitmap_block", sb->bitmap_block);
+    printf("| %-20s | %10u blocks          |\n", "bitmap_blocks", sb->bitmap_blocks);
+    printf("| %-20s | %10u blocks          |\n", "free_count", sb->free_block_count);
+    printf("| %-20s | %10u (block index)  |\n", "alloc_hwm", sb->alloc_hwm);
+    printf("| %-20s | %10u (block index)  |\n", "hash_dir_block", sb->hash_dir_block);
+    printf("| %-20s | %10u                    |\n", "hash_level", sb->hash_level);
+    printf("| %-20s | %10u (bucket)       |\n", "hash_split", sb->hash_split);
+    printf("| %-20s | %10u of %-10u      |\n", "shard_index", sb->shard_index, sb->shard_count);
+    printf("| %-20s | %10llu (lsn)          |\n", "checkpoint_lsn", (unsigned long long)sb->checkpoint_lsn);
+    printf("| %-20s | %10llu                    |\n", "wal_segment", (unsigned long long)sb->wal_segment);
+    printf("+----------------------+------------------------------+\n");
+}
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void){
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        crc32_table[i] = c;
+    }
+}
+
+// Standard reflected CRC-32; pass 0 to start and the previous result to continue
+uint32_t storage_crc32(uint32_t crc, const void *data, size_t len){
+    pthread_once(&crc32_once, crc32_init);
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    while (len--) crc = crc32_table[(crc ^ *p++) & 0xFFu] ^ (crc >> 8);
+    return ~crc;
+}
+
+void storage_note_write(storage_state_t *state, const void *ptr, size_t len){
+    if (!state || !state->dirty || len == 0) return;
+    size_t offset = (size_t)((const uint8_t *)ptr - (const uint8_t *)state->mapped_ptr);
+    uint32_t first = (uint32_t)(offset / state->super.block_size);
+    uint32_t last = (uint32_t)((offset + len - 1) / state->super.block_size);
+    for (uint32_t b = first; b <= last; b++) {
+        uint64_t mask = 1ULL << (b % 64);
+        if (!(__atomic_load_n(&state->dirty[b / 64], __ATOMIC_RELAXED) & mask)) {
+            __atomic_fetch_or(&state->dirty[b / 64], mask, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void storage_log_write(storage_state_t *state, const void *ptr, size_t len){
+    if (!state || len == 0) return;
+    // Marked before the record is appended: a checkpoint that rotates the
+    // log in between still finds the blocks dirty
+    storage_note_write(state, ptr, len);
+    if (state->wal) wal_append(state->wal, ptr, len);
+}
+
+int storage_log_synced(storage_state_t *state, const void *ptr, size_t len){
+    if (!state || !state->wal || len == 0) return 0;
+    if (storage_sync_range(state, ptr, len) != 0) {
+        syslog(LOG_ERR, "keystored::failed to sync value blocks: %m");
+        return -1;
+    }
+    // The blocks are clean now; the buffer pool need not write them again
+    size_t offset = (size_t)((const uint8_t *)ptr - (const uint8_t *)state->mapped_ptr);
+    for (size_t b = offset / state->super.block_size; b <= (offset + len - 1) / state->super.block_size; b++) {
+        __atomic_fetch_and(&state->dirty[b / 64], ~(1ULL << (b % 64)), __ATOMIC_RELAXED);
+    }
+    wal_append_synced(state->wal, ptr, len);
+    return 0;
+}
+
+// First block after the superblock and bitmap
+static inline uint32_t first_data_block(const storage_state_t *state){
+    return state->super.bitmap_block + state->super.bitmap_blocks;
+}
+
+static inline uint64_t * bitmap_base(storage_state_t *state){
+    return (uint64_t *)storage_block_ptr(state, state->super.bitmap_block);
+}
+
+// Sets or clears the on-disk bits of [first, first+count) and logs the
+// changed words. Returns -1 if any bit already had the requested value.
+static int bitmap_update(storage_state_t *state, uint32_t first, uint32_t count, int used){
+    uint64_t *words = bitmap_base(state);
+    int rc = 0;
+    for (uint32_t b = first; b < first + count; b++) {
+        uint64_t mask = 1ULL << (b % 64);
+        uint64_t old = used ? __atomic_fetch_or(&words[b / 64], mask, __ATOMIC_RELAXED)
+                            : __atomic_fetch_and(&words[b / 64], ~mask, __ATOMIC_RELAXED);
+        if (((old & mask) != 0) == (used != 0)) rc = -1;
+    }
+    size_t w0 = first / 64, w1 = (first + count - 1) / 64;
+    storage_log_write(state, &words[w0], (w1 - w0 + 1) * sizeof(uint64_t));
+    return rc;
+}
+
+// Lays out the bitmap after the superblock of a brand new image and marks
+// the metadata blocks as used. The file was just created sparse, so the
+// bitmap already reads as zero; only the metadata bits are written and the
+// high-water mark starts right behind them.
+int bitmap_format(storage_state_t *state){
+    if (!state || !state->mapped_ptr) return -1;
+    keystore_super_block_t *live_sb = (keystore_super_block_t*)state->mapped_ptr;
+    const uint64_t bits_per_block = (uint64_t)state->super.block_size * 8u;
+    const uint32_t bitmap_blocks = (uint32_t)((state->super.max_blocks + bits_per_block - 1) / bits_per_block);
+    if (1u + bitmap_blocks >= state->super.num_blocks) return -1;
+
+    live_sb->bitmap_block = 1;
+    live_sb->bitmap_blocks = bitmap_blocks;
+    state->super.bitmap_block = 1;
+    state->super.bitmap_blocks = bitmap_blocks;
+    // Read through the superblock's pointer from here on
+    storage_cache_pin(state, 0, first_data_block(state));
+    bitmap_update(state, 0, first_data_block(state), 1);
+    live_sb->alloc_hwm = first_data_block(state);
+    state->super.alloc_hwm = live_sb->alloc_hwm;
+    return storage_sync_range(state, live_sb, sizeof(*live_sb));
+}
+
+int storage_alloc_rescan(storage_state_t *state){
+    if (!state || !state->mapped_ptr) return -1;
+    const uint32_t num_blocks = state->super.num_blocks;
+    size_t words = ((size_t)num_blocks + 63) / 64;
+    size_t max_words = ((size_t)state->super.max_blocks + 63) / 64;
+    uint64_t *claimed = realloc(state->claimed, max_words * sizeof(uint64_t));
+    if (!claimed) return -1;
+    // Images from before the high-water mark have zero there: every block
+    // may be in use
+    keystore_super_block_t *live_sb = (keystore_super_block_t *)state->mapped_ptr;
+    if (live_sb->alloc_hwm == 0 || live_sb->alloc_hwm > num_blocks) live_sb->alloc_hwm = num_blocks;
+    state->super.alloc_hwm = live_sb->alloc_hwm;
+    // The bitmap above the mark is never read, so its pages stay unmapped
+    size_t hwm_words = ((size_t)state->super.alloc_hwm + 63) / 64;
+    memcpy(claimed, bitmap_base(state), hwm_words * sizeof(uint64_t));
+    memset(claimed + hwm_words, 0, (max_words - hwm_words) * sizeof(uint64_t));
+    // Bits past the last block never hold a block until the image grows
+    for (size_t w = num_blocks / 64; w < max_words; w++) {
+        claimed[w] |= (w == num_blocks / 64) ? ~0ULL << (num_blocks % 64) : ~0ULL;
+    }
+
+    uint32_t used = 0;
+    for (size_t i = 0; i < words; i++) used += (uint32_t)__builtin_popcountll(claimed[i]);
+    state->claimed = claimed;
+    state->bitmap_words = words;
+    state->alloc_cursor = 0;
+    state->super.free_block_count = (uint32_t)(words * 64 - used);
+    live_sb->free_block_count = state->super.free_block_count;
+    storage_note_write(state, &live_sb->alloc_hwm, sizeof(uint32_t));
+    storage_note_write(state, &live_sb->free_block_count, sizeof(uint32_t));
+    return 0;
+}
+
+// Moves the high-water mark up to `hwm` blocks. The change is logged before
+// any bitmap update for the blocks it admits, so replay never finds a used
+// block above the mark. Caller holds alloc_mutex.
+static void raise_hwm(storage_state_t *state, uint32_t hwm){
+    if (hwm > state->super.num_blocks) hwm = state->super.num_blocks;
+    if (hwm <= state->super.alloc_hwm) return;
+    keystore_super_block_t *live_sb = (keystore_super_block_t *)state->mapped_ptr;
+    live_sb->alloc_hwm = hwm;
+    state->super.alloc_hwm = hwm;
+    storage_log_write(state, &live_sb->alloc_hwm, sizeof(uint32_t));
+}
+
+// Claims up to `want` unclaimed blocks, scanning the words below the
+// high-water mark from the cursor and raising the mark when they are all
+// taken. Caller holds alloc_mutex.
+static uint32_t claim_blocks(storage_state_t *state, uint32_t *out, uint32_t want){
+    uint32_t got = 0, top = 0;
+    for (;;) {
+        const size_t words = ((size_t)state->super.alloc_hwm + 63) / 64;
+        for (size_t i = 0; i < words && got < want; i++) {
+            size_t w = (state->alloc_cursor + i) % words;
+            uint64_t free_bits = ~state->claimed[w];
+            while (free_bits && got < want) {
+                int bit = __builtin_ctzll(free_bits);
+                free_bits &= free_bits - 1;
+                state->claimed[w] |= 1ULL << bit;
+                out[got] = (uint32_t)(w * 64 + (size_t)bit);
+                if (out[got] >= top) top = out[got] + 1;
+                got++;
+            }
+            state->alloc_cursor = w;
+        }
+        if (got == want || state->super.alloc_hwm >= state->super.num_blocks) break;
+        raise_hwm(state, (uint32_t)(words * 64) + STORAGE_HWM_STEP);
+    }
+    // The last word below the mark may reach past it
+    raise_hwm(state, top);
+    return got;
+}
+
+static inline void unclaim_block(storage_state_t *state, uint32_t block_index){
+    state->claimed[block_index / 64] &= ~(1ULL << (block_index % 64));
+}
+
+// Reactors leave growing the image to the workers
+static __thread int t_no_grow;
+
+void storage_thread_nonblocking(void){
+    t_no_grow = 1;
+}
+
+// Extends the image by at least `min_extra` blocks unless another thread
+// already grew it past `seen_blocks`. Readers never wait: the new extent is
+// mapped inside the reserved range before its blocks become allocatable.
+// Returns 0 if the image grew (here or elsewhere), -1 at the growth limit.
+static int grow_image(storage_state_t *state, uint32_t seen_blocks, uint32_t min_extra){
+    if (t_no_grow) return -1;
+    pthread_mutex_lock(&state->grow_mutex);
+    const uint32_t old_blocks = state->super.num_blocks;
+    if (old_blocks != seen_blocks) {
+        pthread_mutex_unlock(&state->grow_mutex);
+        return 0;
+    }
+    uint32_t room = state->super.max_blocks - old_blocks;
+    uint32_t extra = old_blocks;
+    if (extra < STORAGE_GROW_MIN_BLOCKS) extra = STORAGE_GROW_MIN_BLOCKS;
+    if (extra > STORAGE_GROW_MAX_BLOCKS) extra = STORAGE_GROW_MAX_BLOCKS;
+    if (extra < min_extra) extra = min_extra;
+    if (extra > room) extra = room;
+    if (extra == 0 || extra < min_extra) {
+        pthread_mutex_unlock(&state->grow_mutex);
+        return -1;
+    }
+
+    const size_t block_size = state->super.block_size;
+    const size_t from = (size_t)old_blocks * block_size;
+    const size_t to = (size_t)(old_blocks + extra) * block_size;
+    int err = posix_fallocate(state->fd, (off_t)from, (off_t)(to - from));
+    if (err != 0) {
+        syslog(LOG_ERR, "keystored::failed to extend storage image: %s", strerror(err));
+        pthread_mutex_unlock(&state->grow_mutex);
+        return -1;
+    }
+    // The new size is logged and writes into it acknowledged: the file has
+    // to keep it through a crash, or replay would find records past its end
+    if (fsync(state->fd) != 0) {
+        syslog(LOG_ERR, "keystored::failed to sync storage extension: %m");
+        pthread_mutex_unlock(&state->grow_mutex);
+        return -1;
+    }
+    // The buffer pool reads the new chunks like any other
+    if (!state->pool_frames) {
+        if (mmap((uint8_t *)state->mapped_ptr + from, to - from, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, state->fd, (off_t)from) == MAP_FAILED) {
+            syslog(LOG_ERR, "keystored::failed to map storage extension: %m");
+            pthread_mutex_unlock(&state->grow_mutex);
+            return -1;
+        }
+        // A new mapping starts without the hints of the old ones
+        if (state->memory.huge_pages) madvise((uint8_t *)state->mapped_ptr + from, to - from, MADV_HUGEPAGE);
+        if (state->memory.random_access) madvise((uint8_t *)state->mapped_ptr + from, to - from, MADV_RANDOM);
+    }
+    if (to > state->mapped_size) __atomic_store_n(&state->mapped_size, to, __ATOMIC_RELEASE);
+
+    // The superblock change is logged before any record that uses the new
+    // blocks, so replay never sees a block past num_blocks
+    keystore_super_block_t *live_sb = (keystore_super_block_t *)state->mapped_ptr;
+    pthread_mutex_lock(&state->alloc_mutex);
+    for (uint32_t b = old_blocks; b < old_blocks + extra; b++) unclaim_block(state, b);
+    state->bitmap_words = ((size_t)old_blocks + extra + 63) / 64;
+    state->super.total_size = to;
+    __atomic_store_n(&state->super.num_blocks, old_blocks + extra, __ATOMIC_RELEASE);
+    live_sb->total_size = to;
+    live_sb->num_blocks = old_blocks + extra;
+    storage_log_write(state, &live_sb->total_size,
+                      offsetof(keystore_super_block_t, num_blocks) + sizeof(uint32_t) -
+                      offsetof(keystore_super_block_t, total_size));
+    pthread_mutex_unlock(&state->alloc_mutex);
+    __atomic_add_fetch(&state->super.free_block_count, extra, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&state->grow_mutex);
+
+    syslog(LOG_INFO, "keystored::storage image grown to %u blocks", old_blocks + extra);
+    return 0;
+}
+
+// Claims up to `want` blocks, growing the image when it runs out
+static uint32_t claim_or_grow(storage_state_t *state, uint32_t *out, uint32_t want){
+    uint32_t got = 0;
+    for (;;) {
+        pthread_mutex_lock(&state->alloc_mutex);
+        got += claim_blocks(state, out + got, want - got);
+        uint32_t seen = state->super.num_blocks;
+        pthread_mutex_unlock(&state->alloc_mutex);
+        if (got == want || grow_image(state, seen, 0) != 0) return got;
+    }
+}
+
+// Returns `count` cached blocks to the shared pool
+static void cache_spill(storage_block_cache_t *cache, uint32_t count){
+    storage_state_t *state = cache->owner;
+    pthread_mutex_lock(&state->alloc_mutex);
+    while (count-- > 0 && cache->count > 0) {
+        unclaim_block(state, cache->blocks[--cache->count]);
+    }
+    pthread_mutex_unlock(&state->alloc_mutex);
+}
+
+// Thread exit
+static void cache_release(void *ptr){
+    storage_block_cache_t *cache = (storage_block_cache_t *)ptr;
+    if (cache->count) cache_spill(cache, cache->count);
+    free(cache);
+}
+
+static storage_block_cache_t * thread_cache(storage_state_t *state){
+    storage_block_cache_t *cache = pthread_getspecific(state->cache_key);
+    if (cache) return cache;
+    cache = calloc(1, sizeof(*cache));
+    if (!cache) return NULL;
+    cache->owner = state;
+    if (pthread_setspecific(state->cache_key, cache) != 0) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+// Takes a block from the calling thread's cache, refilling it in a batch
+// when empty. Returns 0 on success and writes the block index.
+int storage_block_alloc(storage_state_t *state, uint32_t *out_block_index){
+    if (!state || !out_block_index) return -1;
+    storage_block_cache_t *cache = thread_cache(state);
+    if (!cache) return -1;
+
+    if (cache->count == 0) {
+        uint32_t batch[STORAGE_CACHE_BATCH];
+        uint32_t got = claim_or_grow(state, batch, STORAGE_CACHE_BATCH);
+        if (got == 0) return -1; // No free blocks and no room to grow
+        // Pop in ascending order so a thread fills neighbouring blocks
+        while (got > 0) cache->blocks[cache->count++] = batch[--got];
+    }
+
+    uint32_t block_index = cache->blocks[--cache->count];
+    bitmap_update(state, block_index, 1, 1);
+    __atomic_sub_fetch(&state->super.free_block_count, 1, __ATOMIC_RELAXED);
+    *out_block_index = block_index;
+    return 0;
+}
+
+// Marks a block free and keeps it in the thread cache for reuse; half the
+// cache is spilled back when it is full. Returns 0 on success.
+int storage_block_free(storage_state_t *state, uint32_t block_index){
+    if (!state) return -1;
+    if (block_index < first_data_block(state) || block_index >= block_count(state)) return -1;
+
+    if (bitmap_update(state, block_index, 1, 0) != 0) {
+        syslog(LOG_ERR, "keystored::double free of block %u", block_index);
+        return -1;
+    }
+    __atomic_add_fetch(&state->super.free_block_count, 1, __ATOMIC_RELAXED);
+
+    storage_block_cache_t *cache = thread_cache(state);
+    if (!cache) {
+        pthread_mutex_lock(&state->alloc_mutex);
+        unclaim_block(state, block_index);
+        pthread_mutex_unlock(&state->alloc_mutex);
+        return 0;
+    }
+    if (cache->count == STORAGE_CACHE_BLOCKS) cache_spill(cache, STORAGE_CACHE_BATCH);
+    cache->blocks[cache->count++] = block_index;
+    return 0;
+}
+
+uint32_t storage_block_alloc_many(storage_state_t *state, uint32_t *out_blocks, uint32_t count){
+    if (!state || !out_blocks) return 0;
+    storage_block_cache_t *cache = thread_cache(state);
+    if (!cache) return 0;
+
+    uint32_t got = 0;
+    while (got < count && cache->count > 0) out_blocks[got++] = cache->blocks[--cache->count];
+    if (got < count) got += claim_or_grow(state, out_blocks + got, count - got);
+    for (uint32_t i = 0; i < got; i++) bitmap_update(state, out_blocks[i], 1, 1);
+    __atomic_sub_fetch(&state->super.free_block_count, got, __ATOMIC_RELAXED);
+    return got;
+}
+
+void storage_block_free_many(storage_state_t *state, const uint32_t *blocks, uint32_t count){
+    // The thread cache absorbs these and spills in batches
+    for (uint32_t i = 0; i < count; i++) storage_block_free(state, blocks[i]);
+}
+
+// First-fit search for `count` contiguous unclaimed blocks
+int storage_block_alloc_run(storage_state_t *state, uint32_t count, uint32_t *out_first_block){
+    if (!state || !out_first_block || count == 0) return -1;
+    if (count == 1) return storage_block_alloc(state, out_first_block);
+
+retry:
+    pthread_mutex_lock(&state->alloc_mutex);
+    uint32_t start = 0, run = 0;
+    for (uint32_t b = first_data_block(state); b < state->super.num_blocks && run < count; b++) {
+        uint64_t word = state->claimed[b / 64];
+        if (word == ~0ULL) {
+            // Skip fully used words
+            run = 0;
+            b |= 63;
+            continue;
+        }
+        if (word & (1ULL << (b % 64))) {
+            run = 0;
+            continue;
+        }
+        if (run++ == 0) start = b;
+    }
+    if (run < count) {
+        uint32_t seen = state->super.num_blocks;
+        pthread_mutex_unlock(&state->alloc_mutex);
+        // A free run at the end of the image continues into the new extent
+        if (grow_image(state, seen, count - run) == 0) goto retry;
+        return -1;
+    }
+    for (uint32_t b = start; b < start + count; b++) state->claimed[b / 64] |= 1ULL << (b % 64);
+    raise_hwm(state, start + count);
+    pthread_mutex_unlock(&state->alloc_mutex);
+
+    bitmap_update(state, start, count, 1);
+    __atomic_sub_fetch(&state->super.free_block_count, count, __ATOMIC_RELAXED);
+    *out_first_block = start;
+    return 0;
+}
+
+int storage_block_free_run(storage_state_t *state, uint32_t first_block, uint32_t count){
+    if (!state || count == 0) return -1;
+    const uint32_t num_blocks = block_count(state);
+    if (first_block < first_data_block(state) || first_block >= num_blocks ||
+        count > num_blocks - first_block) return -1;
+
+    if (bitmap_update(state, first_block, count, 0) != 0) {
+        syslog(LOG_ERR, "keystored::double free in run %u+%u", first_block, count);
+    }
+    pthread_mutex_lock(&state->alloc_mutex);
+    for (uint32_t b = first_block; b < first_block + count; b++) unclaim_block(state, b);
+    pthread_mutex_unlock(&state->alloc_mutex);
+    __atomic_add_fetch(&state->super.free_block_count, count, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// ---------------- Memory target ----------------
+//   - Chunk c covers blocks [c*64, c*64+64) and dirty word c
+//   - The evictor measures the image's pages in memory with mincore(); over
+//     the target it moves the clock hand, clearing reference bits and
+//     dropping clean chunks whose bit was already clear
+//   - Dropping a chunk is only ever a hint: MADV_DONTNEED unmaps it and
+//     POSIX_FADV_DONTNEED releases its pages unless they are dirty, locked
+//     or mapped elsewhere. The next access faults them back in.
+//   - Dirty chunks wait for the checkpoint: writing them back early could
+//     put changes on disk before their log records
+//   - Nothing stops a fault, so the resident size is only brought back to
+//     the target on the next pass; it is not a cap
+
+static void timed_wait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, uint32_t ms){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+// Resident pages of [from, from+len) in the last mincore() vector
+static size_t resident_pages(const storage_state_t *state, size_t from, size_t len, size_t page){
+    size_t n = 0;
+    for (size_t p = from / page; p < (from + len) / page; p++) n += state->residency[p] & 1u;
+    return n;
+}
+
+static void cache_sweep(storage_state_t *state){
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t size = __atomic_load_n(&state->mapped_size, __ATOMIC_ACQUIRE);
+    const size_t pages = size / page;
+    if (pages > state->residency_len) {
+        unsigned char *vec = realloc(state->residency, pages);
+        if (!vec) return;
+        state->residency = vec;
+        state->residency_len = pages;
+    }
+    if (mincore(state->mapped_ptr, size, state->residency) != 0) {
+        syslog(LOG_WARNING, "keystored::mincore failed: %m");
+        return;
+    }
+    size_t resident = resident_pages(state, 0, size, page) * page;
+    __atomic_store_n(&state->cache_resident, resident, __ATOMIC_RELAXED);
+    if (resident <= state->cache_target) return;
+
+    const size_t target = state->cache_target / 100 * STORAGE_EVICT_LOW_PCT;
+    const size_t chunk_bytes = (size_t)STORAGE_CHUNK_BLOCKS * state->super.block_size;
+    const size_t chunks = size / chunk_bytes;
+    int dirty_left = 0;
+    // Two rounds: the first may only clear reference bits
+    for (size_t n = 0; n < 2 * chunks && resident > target; n++) {
+        size_t c = state->clock_hand++ % chunks;
+        uint8_t *flags = &state->chunk_flags[c];
+        uint8_t f = __atomic_load_n(flags, __ATOMIC_RELAXED);
+        if (f & STORAGE_CHUNK_PINNED) continue;
+        if (f & STORAGE_CHUNK_REFERENCED) {
+            __atomic_fetch_and(flags, (uint8_t)~STORAGE_CHUNK_REFERENCED, __ATOMIC_RELAXED);
+            continue;
+        }
+        size_t from = c * chunk_bytes;
+        size_t held = resident_pages(state, from, chunk_bytes, page) * page;
+        if (held == 0) continue;
+        if (__atomic_load_n(&state->dirty[c], __ATOMIC_RELAXED)) {
+            dirty_left = 1;
+            continue;
+        }
+        madvise((uint8_t *)state->mapped_ptr + from, chunk_bytes, MADV_DONTNEED);
+        posix_fadvise(state->fd, (off_t)from, (off_t)chunk_bytes, POSIX_FADV_DONTNEED);
+        resident -= held;
+        __atomic_add_fetch(&state->cache_evicted, held, __ATOMIC_RELAXED);
+    }
+    // The checkpoint makes the dirty chunks clean, and evictable next time
+    if (resident > target && dirty_left && state->wal) wal_request_checkpoint(state->wal);
+}
+
+static void pool_sweep(storage_state_t *state);
+
+static void * evictor_thread(void *arg){
+    storage_state_t *state = (storage_state_t *)arg;
+    pthread_mutex_lock(&state->evict_mutex);
+    while (state->evicting) {
+        timed_wait_ms(&state->evict_cond, &state->evict_mutex, STORAGE_EVICT_INTERVAL_MS);
+        if (!state->evicting) break;
+        pthread_mutex_unlock(&state->evict_mutex);
+        if (state->pool_frames) pool_sweep(state);
+        else cache_sweep(state);
+        pthread_mutex_lock(&state->evict_mutex);
+    }
+    pthread_mutex_unlock(&state->evict_mutex);
+    return NULL;
+}
+
+// Bytes of chunks [first, last] that are mapped
+static size_t chunk_span(const storage_state_t *state, size_t first, size_t last, size_t *out_from){
+    const size_t chunk_bytes = (size_t)STORAGE_CHUNK_BLOCKS * state->super.block_size;
+    const size_t size = __atomic_load_n(&state->mapped_size, __ATOMIC_ACQUIRE);
+    size_t from = first * chunk_bytes, to = (last + 1) * chunk_bytes;
+    if (to > size) to = size;
+    *out_from = from;
+    return to > from ? to - from : 0;
+}
+
+// Faults in and locks metadata as the memory options ask
+static void metadata_touch(storage_state_t *state, size_t from, size_t len){
+    uint8_t *ptr = (uint8_t *)state->mapped_ptr + from;
+    if (len == 0) return;
+    // Read faults only: write faults would mark every page dirty
+    if (state->memory.prefault && madvise(ptr, len, MADV_POPULATE_READ) != 0) {
+        madvise(ptr, len, MADV_WILLNEED);
+    }
+    if (state->memory.lock_metadata && mlock(ptr, len) != 0) {
+        syslog(LOG_WARNING, "keystored::failed to lock metadata: %m");
+        state->memory.lock_metadata = 0;
+    }
+}
+
+int storage_memory_start(storage_state_t *state, const storage_memory_options *opts){
+    if (!state || !state->mapped_ptr || !opts) return -1;
+    state->memory = *opts;
+    const size_t size = __atomic_load_n(&state->mapped_size, __ATOMIC_ACQUIRE);
+    const size_t data = (size_t)first_data_block(state) * state->super.block_size;
+    if (state->pool_frames && (opts->huge_pages || opts->random_access)) {
+        // The pool reads whole chunks and keeps them in small pages
+        syslog(LOG_INFO, "keystored::huge page and readahead hints do not apply to the buffer pool");
+    } else {
+        if (opts->huge_pages && madvise(state->mapped_ptr, size, MADV_HUGEPAGE) != 0) {
+            syslog(LOG_WARNING, "keystored::no transparent huge pages for the image: %m");
+        }
+        // Lookups jump between unrelated blocks; readahead only evicts
+        if (opts->random_access && size > data) {
+            madvise((uint8_t *)state->mapped_ptr + data, size - data, MADV_RANDOM);
+        }
+    }
+
+    // The superblock and bitmap are read and written all the time
+    storage_cache_pin(state, 0, first_data_block(state));
+    if (opts->prefault || opts->lock_metadata) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        const size_t chunks = (size + (size_t)STORAGE_CHUNK_BLOCKS * state->super.block_size - 1) /
+                              ((size_t)STORAGE_CHUNK_BLOCKS * state->super.block_size);
+        size_t touched = 0;
+        for (size_t c = 0; c < chunks; c++) {
+            if (!(state->chunk_flags[c] & STORAGE_CHUNK_PINNED)) continue;
+            size_t last = c;
+            while (last + 1 < chunks && (state->chunk_flags[last + 1] & STORAGE_CHUNK_PINNED)) last++;
+            size_t from = 0, len = chunk_span(state, c, last, &from);
+            metadata_touch(state, from, len);
+            touched += len;
+            c = last;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        syslog(LOG_INFO, "keystored::%s %zu KiB of metadata in %ld ms",
+               state->memory.lock_metadata ? "locked" : "prefaulted", touched >> 10,
+               (long)((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000));
+    }
+
+    // The buffer pool is capped already; its evictor keeps frames free
+    if (opts->cache_target == 0 && !state->pool_frames) return 0;
+    if (!state->pool_frames) __atomic_store_n(&state->cache_target, opts->cache_target, __ATOMIC_RELAXED);
+    state->evicting = 1;
+    if (pthread_create(&state->evictor, NULL, evictor_thread, state) != 0) {
+        state->evicting = 0;
+        __atomic_store_n(&state->cache_target, 0, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+static void cache_stop(storage_state_t *state){
+    if (!state->evicting) return;
+    pthread_mutex_lock(&state->evict_mutex);
+    state->evicting = 0;
+    pthread_cond_broadcast(&state->evict_cond);
+    pthread_mutex_unlock(&state->evict_mutex);
+    pthread_join(state->evictor, NULL);
+    size_t limit = state->pool_frames ? state->pool_frames * STORAGE_CHUNK_BLOCKS * state->super.block_size
+                                      : state->cache_target;
+    syslog(LOG_INFO, "keystored::%s %zu MiB, %zu MiB resident, %llu MiB evicted",
+           state->pool_frames ? "buffer pool" : "memory target", limit >> 20, state->cache_resident >> 20,
+           (unsigned long long)(state->cache_evicted >> 20));
+}
+
+void storage_cache_pin(storage_state_t *state, uint32_t first_block, uint32_t count){
+    if (!state || !state->chunk_flags || count == 0) return;
+    for (uint32_t c = first_block / STORAGE_CHUNK_BLOCKS; c <= (first_block + count - 1) / STORAGE_CHUNK_BLOCKS; c++) {
+        // The buffer pool keeps a pin on metadata for good
+        int hold = state->pool_frames &&
+                   !(__atomic_load_n(&state->chunk_flags[c], __ATOMIC_RELAXED) & STORAGE_CHUNK_PINNED);
+        if (hold && chunk_acquire(state, c, 1) != 0) continue;
+        uint8_t old = __atomic_fetch_or(&state->chunk_flags[c], STORAGE_CHUNK_PINNED, __ATOMIC_RELAXED);
+        if (hold && (old & STORAGE_CHUNK_PINNED)) {
+            chunk_release(state, c);
+        } else if (hold && __atomic_add_fetch(&state->pool_pinned, 1, __ATOMIC_RELAXED) == state->pool_frames / 2) {
+            syslog(LOG_WARNING, "keystored::metadata takes half of the buffer pool");
+        }
+        // Metadata pinned once the daemon runs is treated like the rest
+        if (!(old & STORAGE_CHUNK_PINNED) && (state->memory.prefault || state->memory.lock_metadata)) {
+            size_t from = 0, len = chunk_span(state, c, c, &from);
+            metadata_touch(state, from, len);
+        }
+    }
+}
+
+// ---------------- Buffer pool ----------------
+//   - The reserved range is anonymous memory. Chunk c is read from the
+//     file into its own place in the range, so block pointers are the same
+//     as with the mapping, and dropped with MADV_DONTNEED.
+//   - chunk_users[c] counts the pins on a resident chunk. Only the thread
+//     that moved it from ABSENT, or from 0, to BUSY reads or drops it.
+//   - At most pool_frames chunks are resident or being read. A thread that
+//     needs a frame moves the clock hand past metadata, chunks in use and
+//     chunks referenced since the last pass, and drops the first clean one
+//   - Changed chunks are written by the checkpoint. When no clean chunk is
+//     left, one is written back early, after a flush of the log: it is BUSY
+//     meanwhile, so every record describing it is already appended.
+//     Reactors leave that to the evictor, which keeps STORAGE_POOL_FREE_PCT
+//     of the frames free.
+//   - storage_block_ptr() pins for the calling thread's operation and
+//     storage_pin() until storage_unpin(); pins held between operations
+//     are limited to STORAGE_POOL_HELD_PCT of the frames
+
+// Chunks whose pins storage_block_ptr() checks before pinning again
+#define OP_RECENT 8u
+
+typedef struct op_pin {
+    storage_state_t *state;
+    size_t chunk;
+} op_pin;
+
+// Pins taken by the calling thread's operations
+static __thread struct {
+    uint32_t depth;
+    size_t count, cap;
+    op_pin *pins;
+} t_op;
+
+static inline size_t pool_reserve(const storage_state_t *state){
+    size_t frames = state->pool_frames / 100 * STORAGE_POOL_FREE_PCT;
+    return frames ? frames : 1;
+}
+
+// Whole pread() or pwrite() of the image file. Reads past its end leave
+// the chunk zero, as the file would read once grown.
+static int image_io(storage_state_t *state, int write, uint8_t *buf, size_t len, size_t from){
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write ? pwrite(state->fd, buf + done, len - done, (off_t)(from + done))
+                          : pread(state->fd, buf + done, len - done, (off_t)(from + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || (n == 0 && write)) return -1;
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static void evict_wake(storage_state_t *state){
+    pthread_mutex_lock(&state->evict_mutex);
+    pthread_cond_signal(&state->evict_cond);
+    pthread_mutex_unlock(&state->evict_mutex);
+}
+
+// Waits for a chunk to be read or dropped, or a pin to go. Caller holds pool_mutex.
+static void pool_wait(storage_state_t *state){
+    __atomic_add_fetch(&state->pool_waiters, 1, __ATOMIC_SEQ_CST);
+    timed_wait_ms(&state->pool_cond, &state->pool_mutex, STORAGE_POOL_WAIT_MS);
+    __atomic_sub_fetch(&state->pool_waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+static void chunk_release(storage_state_t *state, size_t c){
+    if (__atomic_sub_fetch(&state->chunk_users[c], 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&state->pool_waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&state->pool_mutex);
+        pthread_cond_broadcast(&state->pool_cond);
+        pthread_mutex_unlock(&state->pool_mutex);
+    }
+}
+
+// Gives the frame of a BUSY chunk back. Caller holds pool_mutex, which is
+// dropped meanwhile.
+static void chunk_drop(storage_state_t *state, size_t c){
+    const size_t chunk_bytes = (size_t)STORAGE_CHUNK_BLOCKS * state->super.block_size;
+    size_t from = c * chunk_bytes, len = chunk_bytes;
+    if (from + len > state->reserved_size) len = state->reserved_size - from;
+    pthread_mutex_unlock(&state->pool_mutex);
+    madvise((uint8_t *)state->mapped_ptr + from, len, MADV_DONTNEED);
+    pthread_mutex_lock(&state->pool_mutex);
+    __atomic_store_n(&state->chunk_users[c], STORAGE_CHUNK_ABSENT, __ATOMIC_RELEASE);
+    state->pool_used--;
+    __atomic_add_fetch(&state->cache_evicted, len, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&state->pool_cond);
+}
+
+// Writes a chunk to the image file. Caller has it pinned or BUSY.
+static int chunk_write(storage_state_t *state, size_t c){
+    size_t from = 0, len = chunk_span(state, c, c, &from);
+    if (len == 0) return 0;
+    if (image_io(state, 1, (uint8_t *)state->mapped_ptr + from, len, from) != 0) {
+        syslog(LOG_ERR, "keystored::failed to write chunk %zu back to the image: %m", c);
+        return -1;
+    }
+    return 0;
+}
+
+// Writes a BUSY chunk back ahead of the checkpoint, the log first
+static int chunk_write_back(storage_state_t *state, size_t c){
+    pthread_rwlock_rdlock(&state->pool_write_lock);
+    int rc = state->wal ? wal_flush(state->wal) : 0;
+    if (rc == 0) {
+        uint64_t bits = __atomic_exchange_n(&state->dirty[c], 0, __ATOMIC_ACQ_REL);
+        rc = chunk_write(state, c);
+        if (rc != 0) __atomic_fetch_or(&state->dirty[c], bits, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&state->pool_write_lock);
+    return rc;
+}
+
+// Frees one frame, writing a changed chunk back for it if no clean one is
+// left and `may_write` is set. Caller holds pool_mutex, which is dropped
+// meanwhile. Returns 1 once a frame was freed.
+static int pool_evict_one(storage_state_t *state, int may_write){
+    const size_t chunk_bytes = (size_t)STORAGE_CHUNK_BLOCKS * state->super.block_size;
+    const size_t chunks = (__atomic_load_n(&state->mapped_size, __ATOMIC_ACQUIRE) + chunk_bytes - 1) / chunk_bytes;
+    size_t changed = SIZE_MAX;
+    // Two rounds: the first may only clear reference bits
+    for (size_t n = 0; n < 2 * chunks; n++) {
+        size_t c = state->clock_hand++ % chunks;
+        uint8_t *flags = &state->chunk_flags[c];
+        uint8_t f = __atomic_load_n(flags, __ATOMIC_RELAXED);
+        if ((f & STORAGE_CHUNK_PINNED) || __atomic_load_n(&state->chunk_users[c], __ATOMIC_RELAXED) != 0) continue;
+        if (f & STORAGE_CHUNK_REFERENCED) {
+            __atomic_fetch_and(flags, (uint8_t)~STORAGE_CHUNK_REFERENCED, __ATOMIC_RELAXED);
+            continue;
+        }
+        uint32_t idle = 0;
+        if (!__atomic_compare_exchange_n(&state->chunk_users[c], &idle, STORAGE_CHUNK_BUSY, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        // Its last user is gone, and so are its writes
+        if (__atomic_load_n(&state->dirty[c], __ATOMIC_ACQUIRE) == 0) {
+            chunk_drop(state, c);
+            return 1;
+        }
+        __atomic_store_n(&state->chunk_users[c], 0, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&state->pool_cond);
+        if (changed == SIZE_MAX) changed = c;
+    }
+
+    uint32_t idle = 0;
+    if (changed == SIZE_MAX || !may_write ||
+        !__atomic_compare_exchange_n(&state->chunk_users[changed], &idle, STORAGE_CHUNK_BUSY, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    pthread_mutex_unlock(&state->pool_mutex);
+    int rc = chunk_write_back(state, changed);
+    pthread_mutex_lock(&state->pool_mutex);
+    if (rc != 0) {
+        __atomic_store_n(&state->chunk_users[changed], 0, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&state->pool_cond);
+        return 0;
+    }
+    chunk_drop(state, changed);
+    return 1;
+}
+
+// Takes a frame for a chunk about to be read, waiting as long as every
+// resident chunk is in use
+static void frame_reserve(storage_state_t *state){
+    // Reactors do not wait for the log; the evictor writes back for them
+    const int may_write = !t_no_grow;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    time_t warned = start.tv_sec;
+    pthread_mutex_lock(&state->pool_mutex);
+    while (state->pool_used >= state->pool_frames) {
+        if (pool_evict_one(state, may_write)) continue;
+        evict_wake(state);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > warned) {
+            warned = now.tv_sec;
+            syslog(LOG_WARNING, "keystored::all %zu chunks of the buffer pool in use for %ld s",
+                   state->pool_frames, (long)(now.tv_sec - start.tv_sec));
+        }
+        pool_wait(state);
+    }
+    state->pool_used++;
+    int low = state->pool_frames - state->pool_used < pool_reserve(state);
+    pthread_mutex_unlock(&state->pool_mutex);
+    if (low) evict_wake(state);
+}
+
+// Reads chunk c, which the caller moved from ABSENT to BUSY, into its
+// frame. It ends up resident with one pin, or absent if the read failed.
+static int chunk_load(storage_state_t *state, size_t c){
+    frame_reserve(state);
+    size_t from = 0, len = chunk_span(state, c, c, &from);
+    int rc = image_io(state, 0, (uint8_t *)state->mapped_ptr + from, len, from);
+    if (rc != 0) {
+        syslog(LOG_ERR, "keystored::failed to read chunk %zu of the image: %m", c);
+        madvise((uint8_t *)state->mapped_ptr + from, len, MADV_DONTNEED);
+    }
+    pthread_mutex_lock(&state->pool_mutex);
+    if (rc != 0) state->pool_used--;
+    __atomic_store_n(&state->chunk_users[c], rc == 0 ? 1u : STORAGE_CHUNK_ABSENT, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&state->pool_cond);
+    pthread_mutex_unlock(&state->pool_mutex);
+    return rc;
+}
+
+// Pins chunk c, reading it in unless `load` is clear. Returns -1 if it is
+// not resident and was not to be read, or could not be read.
+static int chunk_acquire(storage_state_t *state, size_t c, int load){
+    uint32_t *users = &state->chunk_users[c];
+    for (;;) {
+        uint32_t n = __atomic_load_n(users, __ATOMIC_ACQUIRE);
+        if (n < STORAGE_CHUNK_BUSY) {
+            if (__atomic_compare_exchange_n(users, &n, n + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+        } else if (n == STORAGE_CHUNK_ABSENT) {
+            if (!load) return -1;
+            if (__atomic_compare_exchange_n(users, &n, STORAGE_CHUNK_BUSY, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return chunk_load(state, c);
+            }
+        } else {
+            pthread_mutex_lock(&state->pool_mutex);
+            if (__atomic_load_n(users, __ATOMIC_ACQUIRE) == STORAGE_CHUNK_BUSY) pool_wait(state);
+            pthread_mutex_unlock(&state->pool_mutex);
+        }
+    }
+}
+
+static int op_hold(storage_state_t *state, size_t chunk){
+    for (size_t i = t_op.count; i > 0 && i + OP_RECENT > t_op.count; i--) {
+        if (t_op.pins[i - 1].chunk == chunk && t_op.pins[i - 1].state == state) return 0;
+    }
+    if (t_op.count == t_op.cap) {
+        size_t cap = t_op.cap ? t_op.cap * 2 : 16;
+        op_pin *pins = realloc(t_op.pins, cap * sizeof(op_pin));
+        if (!pins) return -1;
+        t_op.pins = pins;
+        t_op.cap = cap;
+    }
+    if (chunk_acquire(state, chunk, 1) != 0) return -1;
+    t_op.pins[t_op.count].state = state;
+    t_op.pins[t_op.count].chunk = chunk;
+    t_op.count++;
+    return 0;
+}
+
+void storage_op_begin(void){
+    t_op.depth++;
+}
+
+void storage_op_end(void){
+    if (t_op.depth > 0 && --t_op.depth > 0) return;
+    storage_op_release(0);
+}
+
+size_t storage_op_mark(void){
+    return t_op.count;
+}
+
+void storage_op_release(size_t mark){
+    while (t_op.count > mark) {
+        op_pin *pin = &t_op.pins[--t_op.count];
+        chunk_release(pin->state, pin->chunk);
+    }
+}
+
+// Drops the held pins of chunks [first, last] from the budget
+static void unhold(storage_state_t *state, size_t first, size_t last){
+    for (size_t c = first; c <= last; c++) {
+        if (__atomic_sub_fetch(&state->chunk_held[c], 1, __ATOMIC_RELAXED) == 0) {
+            __atomic_sub_fetch(&state->pool_held, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int storage_pin(storage_state_t *state, const void *ptr, size_t len, int held){
+    if (!state || !state->mapped_ptr) return -1;
+    if (len == 0) return 0;
+    size_t offset = (size_t)((const uint8_t *)ptr - (const uint8_t *)state->mapped_ptr);
+    if (offset + len > __atomic_load_n(&state->mapped_size, __ATOMIC_ACQUIRE)) return -1;
+    if (!state->pool_frames) return 0;
+    const size_t chunk_bytes = (size_t)STORAGE_CHUNK_BLOCKS * state->super.block_size;
+    const size_t first = offset / chunk_bytes, last = (offset + len - 1) / chunk_bytes;
+    if (held) {
+        // The budget counts chunks, however many sends hold each
+        size_t fresh = 0;
+        for (size_t c = first; c <= last; c++) fresh += __atomic_fetch_add(&state->chunk_held[c], 1, __ATOMIC_RELAXED) == 0;
+        if (fresh && __atomic_add_fetch(&state->pool_held, fresh, __ATOMIC_RELAXED) >
+                     state->pool_frames / 100 * STORAGE_POOL_HELD_PCT) {
+            unhold(state, first, last);
+            return -1;
+        }
+    }
+    for (size_t c = first; c <= last; c++) {
+        if (__atomic_load_n(&state->chunk_flags[c], __ATOMIC_RELAXED) & STORAGE_CHUNK_PINNED) continue;
+        if (chunk_acquire(state, c, 1) != 0) {
+            if (c > first) storage_unpin(state, ptr, (c - first) * chunk_bytes - offset % chunk_bytes, 0);
+            if (held) unhold(state, first, last);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void storage_unpin(storage_state_t *state, const void *ptr, size_t len, int held){
+    if (!state || !state->pool_frames || len == 0) return;
+    const size_t chunk_bytes = (size_t)STORAGE_CHUNK_BLOCKS * state->super.block_size;
+    size_t offset = (size_t)((const uint8_t *)ptr - (const uint8_t *)state->mapped_ptr);
+    const size_t first = offset / chunk_bytes, last = (offset + len - 1) / chunk_bytes;
+    for (size_t c = first; c <= last; c++) {
+        if (!(__atomic_load_n(&state->chunk_flags[c], __ATOMIC_RELAXED) & STORAGE_CHUNK_PINNED)) chunk_release(state, c);
+    }
+    if (held) unhold(state, first, last);
+}
+
+// Keeps a few frames free so that reads rarely wait for an eviction, and
+// does the early write-backs reactors leave to it
+static void pool_sweep(storage_state_t *state){
+    const size_t reserve = pool_reserve(state);
+    pthread_mutex_lock(&state->pool_mutex);
+    while (state->pool_used + reserve > state->pool_frames && pool_evict_one(state, 1)) {}
+    __atomic_store_n(&state->cache_resident, state->pool_used * STORAGE_CHUNK_BLOCKS * state->super.block_size,
+                     __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&state->pool_mutex);
+}
+
+int storage_sync_range(storage_state_t *state, const void *ptr, size_t len){
+    if (!state || len == 0) return 0;
+    if (!state->pool_frames) {
+        // msync() wants a page-aligned start
+        const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)ptr & ~(page - 1);
+        return msync((void *)start, (uintptr_t)ptr + len - start, MS_SYNC);
+    }
+    // Whole blocks, as O_DIRECT wants them; the caller has them pinned
+    const size_t block_size = state->super.block_size;
+    size_t offset = (size_t)((const uint8_t *)ptr - (const uint8_t *)state->mapped_ptr);
+    size_t from = offset / block_size * block_size;
+    size_t to = (offset + len + block_size - 1) / block_size * block_size;
+    if (image_io(state, 1, (uint8_t *)state->mapped_ptr + from, to - from, from) != 0) return -1;
+    return fdatasync(state->fd);
+}
+
+int storage_sync_image(storage_state_t *state){
+    if (!state || !state->dirty) return -1;
+    const size_t chunks = ((size_t)block_count(state) + STORAGE_CHUNK_BLOCKS - 1) / STORAGE_CHUNK_BLOCKS;
+    if (!state->pool_frames) {
+        // Blocks changed from here on are logged, and marked, again
+        for (size_t w = 0; w < chunks; w++) {
+            if (__atomic_load_n(&state->dirty[w], __ATOMIC_RELAXED)) __atomic_store_n(&state->dirty[w], 0, __ATOMIC_RELAXED);
+        }
+        return msync(state->mapped_ptr, __atomic_load_n(&state->mapped_size, __ATOMIC_ACQUIRE), MS_SYNC);
+    }
+    int rc = 0;
+    for (size_t c = 0; c < chunks; c++) {
+        if (!__atomic_load_n(&state->dirty[c], __ATOMIC_RELAXED)) continue;
+        // A chunk no longer resident was written back early
+        if (chunk_acquire(state, c, 0) != 0) continue;
+        uint64_t bits = __atomic_exchange_n(&state->dirty[c], 0, __ATOMIC_ACQ_REL);
+        if (bits && chunk_write(state, c) != 0) {
+            __atomic_fetch_or(&state->dirty[c], bits, __ATOMIC_RELAXED);
+            rc = -1;
+        }
+        chunk_release(state, c);
+    }
+    // Write-backs that took their chunk's bits before this pass got there
+    // finish before the sync
+    pthread_rwlock_wrlock(&state->pool_write_lock);
+    pthread_rwlock_unlock(&state->pool_write_lock);
+    if (fdatasync(state->fd) != 0) rc = -1;
+    return rc;
+}
+
+// ---------------- Index snapshot ----------------
+
+int storage_snapshot_save(storage_state_t *state, uint64_t lsn, const void *data, size_t len){
+    if (!state || !state->snapshot_path[0] || len > UINT32_MAX) return -1;
+    char *buf = malloc(sizeof(storage_snapshot_header_t) + len);
+    if (!buf) return -1;
+    storage_snapshot_header_t *hdr = (storage_snapshot_header_t *)buf;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = STORAGE_SNAPSHOT_MAGIC;
+    hdr->version = STORAGE_SNAPSHOT_VERSION;
+    hdr->lsn = lsn;
+    hdr->num_blocks = block_count(state);
+    hdr->len = (uint32_t)len;
+    hdr->crc = storage_crc32(0, data, len);
+    memcpy(buf + sizeof(*hdr), data, len);
+
+    // Written aside and renamed over the old one, so a crash leaves either
+    char tmp[STORAGE_PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", state->snapshot_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int rc = -1;
+    if (fd >= 0) {
+        size_t total = sizeof(*hdr) + len, done = 0;
+        while (done < total) {
+            ssize_t n = write(fd, buf + done, total - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += (size_t)n;
+        }
+        if (done == total && fsync(fd) == 0) rc = 0;
+        close(fd);
+    }
+    if (rc == 0 && rename(tmp, state->snapshot_path) != 0) rc = -1;
+    if (rc != 0) {
+        syslog(LOG_WARNING, "keystored::failed to write index snapshot %s: %m", state->snapshot_path);
+        unlink(tmp);
+    }
+    free(buf);
+    return rc;
+}
+
+int storage_snapshot_load(storage_state_t *state, void *data, size_t len){
+    if (!state || !state->snapshot_path[0] || state->created) return -1;
+    int fd = open(state->snapshot_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    char *buf = malloc(sizeof(storage_snapshot_header_t) + len);
+    if (!buf) {
+        close(fd);
+        return -1;
+    }
+    // One sequential read of the whole file
+    ssize_t n = pread(fd, buf, sizeof(storage_snapshot_header_t) + len, 0);
+    close(fd);
+
+    const storage_snapshot_header_t *hdr = (const storage_snapshot_header_t *)buf;
+    const keystore_super_block_t *sb = (const keystore_super_block_t *)state->mapped_ptr;
+    int rc = -1;
+    if (n != (ssize_t)(sizeof(*hdr) + len) || hdr->magic != STORAGE_SNAPSHOT_MAGIC ||
+        hdr->version != STORAGE_SNAPSHOT_VERSION || hdr->len != len) {
+        syslog(LOG_INFO, "keystored::ignoring unreadable index snapshot %s", state->snapshot_path);
+    } else if (hdr->lsn != sb->checkpoint_lsn || hdr->num_blocks != sb->num_blocks) {
+        syslog(LOG_INFO, "keystored::index snapshot %s is stale (lsn %llu, image at %llu)",
+               state->snapshot_path, (unsigned long long)hdr->lsn, (unsigned long long)sb->checkpoint_lsn);
+    } else if (storage_crc32(0, buf + sizeof(*hdr), len) != hdr->crc) {
+        syslog(LOG_WARNING, "keystored::index snapshot %s fails its checksum", state->snapshot_path);
+    } else {
+        memcpy(data, buf + sizeof(*hdr), len);
+        rc = 0;
+    }
+    free(buf);
+    return rc;
+}
+
+void storage_set_checkpoint_hook(storage_state_t *state, void (*hook)(void *arg), void *arg){
+    pthread_mutex_lock(&state->hook_mutex);
+    state->checkpoint_hook = hook;
+    state->checkpoint_arg = arg;
+    pthread_mutex_unlock(&state->hook_mutex);
+}
+
+void storage_run_checkpoint_hook(storage_state_t *state){
+    pthread_mutex_lock(&state->hook_mutex);
+    if (state->checkpoint_hook) state->checkpoint_hook(state->checkpoint_arg);
+    pthread_mutex_unlock(&state->hook_mutex);
+}
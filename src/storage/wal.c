@@ -0,0 +1,664 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "wal.h"
+#include "metrics.h"
+
+// LSN of the last record appended by this thread; jobs wait on it
+static __thread uint64_t t_last_lsn;
+
+uint64_t wal_thread_lsn(void){
+    return t_last_lsn;
+}
+
+// Reactors must not wait for the flusher
+static __thread int t_nonblocking;
+
+void wal_thread_nonblocking(void){
+    t_nonblocking = 1;
+}
+
+int wal_parse_durability(const char *name, enum durability_level *out){
+    if (strcasecmp(name, "sync") == 0) *out = DURABILITY_SYNC;
+    else if (strcasecmp(name, "group") == 0) *out = DURABILITY_GROUP;
+    else if (strcasecmp(name, "async") == 0) *out = DURABILITY_ASYNC;
+    else return -1;
+    return 0;
+}
+
+static void segment_path(const wal_t *w, uint64_t segment, char *out, size_t out_len){
+    snprintf(out, out_len, "%s.%llu", w->base_path, (unsigned long long)segment);
+}
+
+// Makes a newly created segment file survive a crash. Returns 0 on success.
+static int fsync_parent_dir(const char *path){
+    char dir[WAL_PATH_MAX + 24];
+    if ((size_t)snprintf(dir, sizeof(dir), "%s", path) >= sizeof(dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    char *slash = strrchr(dir, '/');
+    if (slash == dir) slash[1] = '\0';
+    else if (slash) *slash = '\0';
+    else snprintf(dir, sizeof(dir), ".");
+    int fd = open(dir, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+static int open_segment(const wal_t *w, uint64_t segment){
+    char path[WAL_PATH_MAX + 24];
+    segment_path(w, segment, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "keystored::failed to create WAL segment %s: %m", path);
+        return -1;
+    }
+    if (fsync_parent_dir(path) != 0) {
+        syslog(LOG_ERR, "keystored::failed to sync the directory of WAL segment %s: %m", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void unlink_segment(const wal_t *w, uint64_t segment){
+    char path[WAL_PATH_MAX + 24];
+    segment_path(w, segment, path, sizeof(path));
+    unlink(path);
+}
+
+static int write_all(int fd, const char *buf, size_t len){
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static uint32_t record_crc(const wal_record_header_t *hdr, const void *payload){
+    wal_record_header_t h = *hdr;
+    h.crc = 0;
+    uint32_t crc = storage_crc32(0, payload, hdr->len);
+    return storage_crc32(crc, &h, sizeof(h));
+}
+
+// Reads a whole segment file into memory. Returns NULL (with a size of 0
+// for an empty file) when there is nothing to read.
+static char * read_segment(const char *path, size_t *out_size, int *exists){
+    *out_size = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    *exists = fd >= 0;
+    if (fd < 0) return NULL;
+
+    struct stat fst;
+    char *data = NULL;
+    size_t size = 0;
+    if (fstat(fd, &fst) == 0 && fst.st_size > 0) {
+        size = (size_t)fst.st_size;
+        data = malloc(size);
+        size_t got = 0;
+        while (data && got < size) {
+            ssize_t n = read(fd, data + got, size - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += (size_t)n;
+        }
+        size = data ? got : 0;
+    }
+    close(fd);
+    *out_size = size;
+    return data;
+}
+
+// Checks the record at `off` of a segment; 0 and its header when intact
+static int record_check(const wal_t *w, const char *data, size_t size, size_t off,
+                        wal_record_header_t *hdr){
+    const storage_state_t *st = w->storage;
+    if (size - off < sizeof(*hdr)) return -1;
+    memcpy(hdr, data + off, sizeof(*hdr));
+    if (hdr->magic != WAL_RECORD_MAGIC || hdr->len > size - off - sizeof(*hdr) ||
+        hdr->offset > st->mapped_size || hdr->len > st->mapped_size - hdr->offset ||
+        record_crc(hdr, data + off + sizeof(*hdr)) != hdr->crc) {
+        return -1;
+    }
+    if ((hdr->flags & WAL_RECORD_SYNCED) && hdr->len != sizeof(uint64_t)) return -1;
+    return 0;
+}
+
+// Ranges synced in place after the checkpoint, sorted by offset
+typedef struct synced_range{
+    uint64_t offset;
+    uint64_t len;
+    uint64_t lsn;
+} synced_range;
+
+typedef struct synced_set{
+    synced_range *ranges;
+    size_t count, cap;
+    uint64_t max_len;           /* bounds how far back a lookup has to look */
+} synced_set;
+
+static int synced_range_cmp(const void *a, const void *b){
+    const synced_range *x = a, *y = b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// First pass of the replay: collects the WAL_RECORD_SYNCED ranges up to the
+// first torn record
+static void collect_synced(wal_t *w, uint64_t checkpoint, uint64_t segment, synced_set *set){
+    for (;; segment++) {
+        char path[WAL_PATH_MAX + 24];
+        segment_path(w, segment, path, sizeof(path));
+        size_t size = 0;
+        int exists = 0;
+        char *data = read_segment(path, &size, &exists);
+        if (!exists) break;
+        size_t off = 0;
+        wal_record_header_t hdr;
+        while (off < size && record_check(w, data, size, off, &hdr) == 0) {
+            if ((hdr.flags & WAL_RECORD_SYNCED) && hdr.lsn > checkpoint) {
+                uint64_t len;
+                memcpy(&len, data + off + sizeof(hdr), sizeof(len));
+                if (len > w->storage->mapped_size - hdr.offset) len = w->storage->mapped_size - hdr.offset;
+                if (set->count == set->cap) {
+                    size_t cap = set->cap ? set->cap * 2 : 64;
+                    synced_range *ranges = realloc(set->ranges, cap * sizeof(*ranges));
+                    if (!ranges) {
+                        syslog(LOG_ERR, "keystored::no memory for the synced ranges of the WAL");
+                        free(data);
+                        return;
+                    }
+                    set->ranges = ranges;
+                    set->cap = cap;
+                }
+                synced_range *r = &set->ranges[set->count++];
+                r->offset = hdr.offset;
+                r->len = len;
+                r->lsn = hdr.lsn;
+                if (len > set->max_len) set->max_len = len;
+            }
+            off += sizeof(hdr) + hdr.len;
+        }
+        free(data);
+        if (off < size) break;
+    }
+    if (set->count > 1) qsort(set->ranges, set->count, sizeof(synced_range), synced_range_cmp);
+}
+
+// Copies a record's payload into the image, except for the bytes a later
+// record says were synced in place: the disk already holds newer data there
+static void replay_apply(storage_state_t *st, const synced_set *set, uint64_t lsn,
+                         uint64_t offset, const char *payload, uint64_t len){
+    if (len == 0) return;
+    // Ranges starting before the end of this one, nearest first
+    size_t lo = 0, hi = set->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (set->ranges[mid].offset < offset + len) lo = mid + 1;
+        else hi = mid;
+    }
+    for (size_t i = lo; i-- > 0; ) {
+        const synced_range *r = &set->ranges[i];
+        if (r->offset + set->max_len <= offset) break;
+        if (r->lsn <= lsn || r->offset + r->len <= offset) continue;
+        uint64_t start = r->offset > offset ? r->offset : offset;
+        uint64_t end = r->offset + r->len < offset + len ? r->offset + r->len : offset + len;
+        replay_apply(st, set, lsn, offset, payload, start - offset);
+        replay_apply(st, set, lsn, end, payload + (end - offset), offset + len - end);
+        return;
+    }
+    char *dst = (char *)st->mapped_ptr + offset;
+    if (storage_pin(st, dst, len, 0) != 0) {
+        syslog(LOG_ERR, "keystored::failed to replay %llu bytes at %llu", (unsigned long long)len,
+               (unsigned long long)offset);
+        return;
+    }
+    memcpy(dst, payload, len);
+    // The buffer pool writes the chunk back at the end of the replay
+    storage_note_write(st, dst, len);
+    storage_unpin(st, dst, len, 0);
+}
+
+// Reapplies every record after the checkpoint. Returns the first segment
+// number that was not replayed and raises `max_lsn` to the last LSN seen.
+static uint64_t wal_replay(wal_t *w, uint64_t *max_lsn){
+    storage_state_t *st = w->storage;
+    keystore_super_block_t *sb = (keystore_super_block_t *)st->mapped_ptr;
+    const uint64_t checkpoint = sb->checkpoint_lsn;
+    uint64_t segment = sb->wal_segment;
+    size_t applied = 0;
+    synced_set synced;
+    memset(&synced, 0, sizeof(synced));
+    collect_synced(w, checkpoint, segment, &synced);
+
+    for (;; segment++) {
+        char path[WAL_PATH_MAX + 24];
+        segment_path(w, segment, path, sizeof(path));
+        size_t size = 0;
+        int exists = 0;
+        char *data = read_segment(path, &size, &exists);
+        if (!exists) break;
+
+        size_t off = 0;
+        int intact = 1;
+        while (off < size) {
+            wal_record_header_t hdr;
+            if (record_check(w, data, size, off, &hdr) != 0) {
+                intact = 0;
+                break;
+            }
+            // Records up to the checkpoint are already in the image
+            if (hdr.lsn > checkpoint && !(hdr.flags & WAL_RECORD_SYNCED)) {
+                replay_apply(st, &synced, hdr.lsn, hdr.offset, data + off + sizeof(hdr), hdr.len);
+                applied++;
+            }
+            if (hdr.lsn > *max_lsn) *max_lsn = hdr.lsn;
+            off += sizeof(hdr) + hdr.len;
+        }
+        free(data);
+        if (!intact) {
+            // Only the last segment can end in a torn write
+            syslog(LOG_WARNING, "keystored::WAL segment %s ends in a torn record at byte %zu", path, off);
+            segment++;
+            break;
+        }
+    }
+    free(synced.ranges);
+
+    if (applied > 0) {
+        storage_sync_image(st);
+        syslog(LOG_INFO, "keystored::replayed %zu WAL records up to LSN %llu",
+               applied, (unsigned long long)*max_lsn);
+    }
+    return segment;
+}
+
+// Wakes the threads whose LSN is now durable, or all of them once the log
+// failed. Caller holds mutex.
+static void notify_durable(wal_t *w){
+    if (w->notify_pending == 0) return;
+    for (int i = 0; i < w->notify_count; i++) {
+        if (!w->notify[i].lsn || (w->notify[i].lsn > w->durable_lsn && !w->failed)) continue;
+        uint64_t one = 1;
+        if (write(w->notify[i].fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            syslog(LOG_ERR, "keystored::failed to notify WAL commit: %m");
+        }
+        w->notify[i].lsn = 0;
+        w->notify_pending--;
+    }
+}
+
+// Writes and fsyncs the buffered records. Caller holds io_mutex.
+static int wal_write_buffer(wal_t *w){
+    pthread_mutex_lock(&w->mutex);
+    if (w->buf_len == 0) {
+        int failed = w->failed;
+        pthread_mutex_unlock(&w->mutex);
+        return failed ? -1 : 0;
+    }
+    // Swap buffers so appends continue while this batch is written
+    char *data = w->buf;
+    size_t len = w->buf_len, cap = w->buf_cap;
+    w->buf = w->spare;
+    w->buf_cap = w->spare_cap;
+    __atomic_store_n(&w->buf_len, 0, __ATOMIC_RELAXED);
+    w->spare = data;
+    w->spare_cap = cap;
+    uint64_t upto = w->next_lsn - 1;
+    pthread_mutex_unlock(&w->mutex);
+
+    int rc = write_all(w->fd, data, len);
+    if (rc == 0) {
+        uint64_t start = metrics_now();
+        rc = fdatasync(w->fd);
+        __atomic_add_fetch(&w->fsync_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->fsync_ns, metrics_now() - start, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&w->mutex);
+    if (rc == 0) {
+        w->durable_lsn = upto;
+        w->segment_bytes += len;
+        if (w->segment_bytes >= w->opts.checkpoint_bytes) pthread_cond_signal(&w->ckpt_cond);
+    } else {
+        syslog(LOG_ERR, "keystored::WAL write failed: %m");
+        w->failed = 1;
+    }
+    notify_durable(w);
+    pthread_cond_broadcast(&w->durable_cond);
+    pthread_mutex_unlock(&w->mutex);
+    return rc;
+}
+
+int wal_flush(wal_t *w){
+    pthread_mutex_lock(&w->io_mutex);
+    int rc = wal_write_buffer(w);
+    pthread_mutex_unlock(&w->io_mutex);
+    return rc;
+}
+
+static void timed_wait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, uint32_t ms){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+// Group commit: once a commit is waiting, sleep for the group window so
+// other workers can add their records, then write them all with one fsync.
+static void * wal_flusher_thread(void *arg){
+    wal_t *w = (wal_t *)arg;
+    const uint32_t idle_ms = (w->opts.level == DURABILITY_ASYNC) ? WAL_ASYNC_FLUSH_MS : 100;
+    pthread_mutex_lock(&w->mutex);
+    while (w->running) {
+        int waiting = w->waiters > 0 || w->notify_pending > 0;
+        int due = w->buf_len > 0 && (waiting || w->buf_len >= WAL_MAX_BUFFER);
+        if (!due) {
+            timed_wait_ms(&w->work_cond, &w->mutex, idle_ms);
+            // Async mode (and records nobody waits for) flush on the timer
+            due = w->buf_len > 0;
+            if (!due) continue;
+        }
+        int group = w->opts.level == DURABILITY_GROUP && waiting && w->opts.group_commit_us > 0;
+        pthread_mutex_unlock(&w->mutex);
+        if (group) {
+            struct timespec window = { 0, (long)w->opts.group_commit_us * 1000L };
+            nanosleep(&window, NULL);
+        }
+        wal_flush(w);
+        pthread_mutex_lock(&w->mutex);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+static void * wal_checkpointer_thread(void *arg){
+    wal_t *w = (wal_t *)arg;
+    pthread_mutex_lock(&w->mutex);
+    while (w->running) {
+        timed_wait_ms(&w->ckpt_cond, &w->mutex, w->opts.checkpoint_interval_ms);
+        if (!w->running) break;
+        if (w->segment_bytes == 0 && w->buf_len == 0) continue;
+        pthread_mutex_unlock(&w->mutex);
+        wal_checkpoint(w);
+        pthread_mutex_lock(&w->mutex);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+// Flushes the log, moves appends to a new segment, syncs the image and then
+// records the checkpoint so the old segment can be dropped. The storage
+// checkpoint hook runs last.
+int wal_checkpoint(wal_t *w){
+    storage_state_t *st = w->storage;
+    keystore_super_block_t *sb = (keystore_super_block_t *)st->mapped_ptr;
+
+    pthread_mutex_lock(&w->io_mutex);
+    if (wal_write_buffer(w) != 0) {
+        pthread_mutex_unlock(&w->io_mutex);
+        return -1;
+    }
+    int fd = open_segment(w, w->segment + 1);
+    if (fd < 0) {
+        pthread_mutex_unlock(&w->io_mutex);
+        return -1;
+    }
+    int old_fd = w->fd;
+    pthread_mutex_lock(&w->mutex);
+    // Every record up to here is durable in the old segment
+    uint64_t upto = w->durable_lsn;
+    w->fd = fd;
+    w->segment++;
+    w->segment_bytes = 0;
+    pthread_mutex_unlock(&w->mutex);
+    pthread_mutex_unlock(&w->io_mutex);
+    close(old_fd);
+
+    uint64_t start = metrics_now();
+    int rc = storage_sync_image(st);
+    if (rc == 0) {
+        sb->checkpoint_lsn = upto;
+        sb->wal_segment = w->segment;
+        storage_sync_range(st, sb, st->super.block_size);
+    }
+    __atomic_add_fetch(&w->msync_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&w->msync_ns, metrics_now() - start, __ATOMIC_RELAXED);
+    if (rc != 0) {
+        syslog(LOG_ERR, "keystored::checkpoint sync failed: %m");
+        return -1;
+    }
+    unlink_segment(w, w->segment - 1);
+    storage_run_checkpoint_hook(st);
+    return 0;
+}
+
+void wal_request_checkpoint(wal_t *w){
+    pthread_mutex_lock(&w->mutex);
+    pthread_cond_signal(&w->ckpt_cond);
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static uint64_t append_record(wal_t *w, const void *ptr, uint32_t flags, const void *payload_src, size_t len){
+    wal_record_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = WAL_RECORD_MAGIC;
+    hdr.len = (uint32_t)len;
+    hdr.offset = (uint64_t)((const char *)ptr - (const char *)w->storage->mapped_ptr);
+    hdr.flags = flags;
+
+    pthread_mutex_lock(&w->mutex);
+    // Back-pressure when the flusher falls behind
+    while (!t_nonblocking && w->buf_len >= WAL_MAX_BUFFER && w->running && !w->failed) {
+        pthread_cond_signal(&w->work_cond);
+        pthread_cond_wait(&w->durable_cond, &w->mutex);
+    }
+    hdr.lsn = w->next_lsn++;
+
+    size_t need = w->buf_len + sizeof(hdr) + len;
+    if (need > w->buf_cap) {
+        size_t cap = w->buf_cap ? w->buf_cap : 65536;
+        while (cap < need) cap *= 2;
+        char *buf = realloc(w->buf, cap);
+        if (!buf) {
+            // Nothing can be made durable past this point
+            syslog(LOG_ERR, "keystored::failed to grow WAL buffer");
+            w->failed = 1;
+            pthread_mutex_unlock(&w->mutex);
+            t_last_lsn = hdr.lsn;
+            return hdr.lsn;
+        }
+        w->buf = buf;
+        w->buf_cap = cap;
+    }
+    // The checksum covers the copy; words updated with atomics may change
+    // again while this runs
+    char *payload = w->buf + w->buf_len + sizeof(hdr);
+    memcpy(payload, payload_src, len);
+    hdr.crc = record_crc(&hdr, payload);
+    memcpy(w->buf + w->buf_len, &hdr, sizeof(hdr));
+    __atomic_store_n(&w->buf_len, need, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&w->mutex);
+
+    t_last_lsn = hdr.lsn;
+    return hdr.lsn;
+}
+
+uint64_t wal_append(wal_t *w, const void *ptr, size_t len){
+    return append_record(w, ptr, 0, ptr, len);
+}
+
+uint64_t wal_append_synced(wal_t *w, const void *ptr, size_t len){
+    uint64_t synced = len;
+    return append_record(w, ptr, WAL_RECORD_SYNCED, &synced, sizeof(synced));
+}
+
+uint64_t wal_last_lsn(wal_t *w){
+    pthread_mutex_lock(&w->mutex);
+    uint64_t lsn = w->next_lsn - 1;
+    pthread_mutex_unlock(&w->mutex);
+    return lsn;
+}
+
+int wal_wait_durable(wal_t *w, uint64_t lsn){
+    if (!w || lsn == 0 || w->opts.level == DURABILITY_ASYNC) return 0;
+    int rc = 0;
+    pthread_mutex_lock(&w->mutex);
+    while (w->durable_lsn < lsn && !w->failed) {
+        if (w->opts.level == DURABILITY_SYNC) {
+            // Flush right away instead of waiting for the group window
+            pthread_mutex_unlock(&w->mutex);
+            wal_flush(w);
+            pthread_mutex_lock(&w->mutex);
+            continue;
+        }
+        w->waiters++;
+        pthread_cond_signal(&w->work_cond);
+        pthread_cond_wait(&w->durable_cond, &w->mutex);
+        w->waiters--;
+    }
+    if (w->durable_lsn < lsn) rc = -1;
+    pthread_mutex_unlock(&w->mutex);
+    return rc;
+}
+
+int wal_durable_notify(wal_t *w, uint64_t lsn, int fd){
+    if (!w || lsn == 0 || w->opts.level == DURABILITY_ASYNC) return 1;
+    int rc = 0;
+    pthread_mutex_lock(&w->mutex);
+    if (w->durable_lsn >= lsn) rc = 1;
+    else if (w->failed) rc = -1;
+    else {
+        int i = 0;
+        while (i < w->notify_count && w->notify[i].fd != fd) i++;
+        if (i == w->notify_count) {
+            if (i == WAL_MAX_NOTIFY) {
+                // More reactors than the log was sized for; wait like a worker
+                pthread_mutex_unlock(&w->mutex);
+                return wal_wait_durable(w, lsn) == 0 ? 1 : -1;
+            }
+            w->notify[w->notify_count++].fd = fd;
+        }
+        if (!w->notify[i].lsn) w->notify_pending++;
+        if (w->notify[i].lsn < lsn) w->notify[i].lsn = lsn;
+        pthread_cond_signal(&w->work_cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return rc;
+}
+
+int wal_full(wal_t *w){
+    return w && __atomic_load_n(&w->buf_len, __ATOMIC_RELAXED) >= WAL_MAX_BUFFER;
+}
+
+int wal_open(storage_state_t *storage, const char *base_path, const wal_options *opts){
+    if (!storage || !storage->mapped_ptr || !base_path || !opts) return -1;
+    wal_t *w = calloc(1, sizeof(wal_t));
+    if (!w) return -1;
+    w->storage = storage;
+    w->opts = *opts;
+    w->fd = -1;
+    snprintf(w->base_path, sizeof(w->base_path), "%s", base_path);
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_mutex_init(&w->io_mutex, NULL);
+    pthread_cond_init(&w->work_cond, NULL);
+    pthread_cond_init(&w->durable_cond, NULL);
+    pthread_cond_init(&w->ckpt_cond, NULL);
+
+    keystore_super_block_t *sb = (keystore_super_block_t *)storage->mapped_ptr;
+    uint64_t first = sb->wal_segment;
+    uint64_t max_lsn = sb->checkpoint_lsn;
+    // Segments left next to a freshly created image describe other data
+    uint64_t segment = storage->created ? first : wal_replay(w, &max_lsn);
+    for (uint64_t s = first; s < segment; s++) unlink_segment(w, s);
+    for (uint64_t s = segment; ; s++) {
+        char path[WAL_PATH_MAX + 24];
+        segment_path(w, s, path, sizeof(path));
+        if (unlink(path) != 0) break;
+    }
+
+    // Start from a clean checkpoint
+    sb->checkpoint_lsn = max_lsn;
+    sb->wal_segment = segment;
+    storage_sync_range(storage, sb, storage->super.block_size);
+    storage->super = *sb;
+    // Replay may have changed the allocation bitmap
+    storage_alloc_rescan(storage);
+
+    w->segment = segment;
+    w->fd = open_segment(w, segment);
+    if (w->fd < 0) {
+        free(w);
+        return -1;
+    }
+    w->next_lsn = max_lsn + 1;
+    w->durable_lsn = max_lsn;
+    storage->wal = w;
+    return 0;
+}
+
+int wal_start(wal_t *w){
+    if (!w) return -1;
+    w->running = 1;
+    if (pthread_create(&w->flusher, NULL, wal_flusher_thread, w) != 0) {
+        w->running = 0;
+        return -1;
+    }
+    if (pthread_create(&w->checkpointer, NULL, wal_checkpointer_thread, w) != 0) {
+        w->running = 0;
+        pthread_cond_broadcast(&w->work_cond);
+        pthread_join(w->flusher, NULL);
+        return -1;
+    }
+    w->started = 1;
+    return 0;
+}
+
+void wal_close(storage_state_t *storage){
+    if (!storage || !storage->wal) return;
+    wal_t *w = storage->wal;
+    pthread_mutex_lock(&w->mutex);
+    w->running = 0;
+    pthread_cond_broadcast(&w->work_cond);
+    pthread_cond_broadcast(&w->ckpt_cond);
+    pthread_cond_broadcast(&w->durable_cond);
+    pthread_mutex_unlock(&w->mutex);
+    if (w->started) {
+        pthread_join(w->flusher, NULL);
+        pthread_join(w->checkpointer, NULL);
+    }
+
+    wal_checkpoint(w);
+    close(w->fd);
+    storage->wal = NULL;
+    pthread_mutex_destroy(&w->mutex);
+    pthread_mutex_destroy(&w->io_mutex);
+    pthread_cond_destroy(&w->work_cond);
+    pthread_cond_destroy(&w->durable_cond);
+    pthread_cond_destroy(&w->ckpt_cond);
+    free(w->buf);
+    free(w->spare);
+    free(w);
+}